@@ -1,17 +1,21 @@
 @echo off
 
 echo Compiling
-gcc -O2 -Wall -shared -c cotp.c otpuri.c
+gcc -O2 -Wall -shared -c cotp.c otpuri.c otphmac.c otpbatch.c otppool.c otpreplay.c otpcache.c otpmap.c otpcounter.c otpstore.c otpvault.c otpbase32.c otprandom.c otpenroll.c otpimport.c
 
 echo Building DLL
-gcc -O2 -Wall -shared -o libcotp.dll cotp.o otpuri.o -lcrypto
+gcc -O2 -Wall -shared -o libcotp.dll cotp.o otpuri.o otphmac.o otpbatch.o otppool.o otpreplay.o otpcache.o otpmap.o otpcounter.o otpstore.o otpvault.o otpbase32.o otprandom.o otpenroll.o otpimport.o -lcrypto -lpthread
 
 echo Building static library
-ar rcs -o libcotp.a cotp.o otpuri.o
+ar rcs -o libcotp.a cotp.o otpuri.o otphmac.o otpbatch.o otppool.o otpreplay.o otpcache.o otpmap.o otpcounter.o otpstore.o otpvault.o otpbase32.o otprandom.o otpenroll.o otpimport.o
 
 echo Building test C application
-gcc -O2 -Wall -L . -I . -o test_c.exe test/main.c libcotp.a -lcrypto
+gcc -O2 -Wall -L . -I . -o test_c.exe test/main.c libcotp.a -lcrypto -lpthread
 
 echo Building test C++ application
-g++ -O2 -Wall -L . -I . -o test_cpp.exe test/main.cpp libcotp.a -lcrypto
+g++ -O2 -Wall -L . -I . -o test_cpp.exe test/main.cpp libcotp.a -lcrypto -lpthread
 
+echo Building tools
+gcc -O2 -Wall -L . -I . -o tools/otpstore.exe tools/otpstore.c libcotp.a -lcrypto -lpthread
+gcc -O2 -Wall -L . -I . -o tools/otpenroll.exe tools/otpenroll.c libcotp.a -lcrypto -lpthread
+gcc -O2 -Wall -L . -I . -o tools/otpimport.exe tools/otpimport.c libcotp.a -lcrypto -lpthread
@@ -1,6 +1,7 @@
 #include "cotp.h"
+#include "otpbatch.h"
+#include "otpbase32.h"
 
-#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -52,6 +53,8 @@ OTPData* otp_new(OTPData* data, const char* base32_secret, COTP_ALGO algo, uint3
 	data->time = NULL;
 	
 	data->base32_secret = base32_secret;
+	data->key = NULL;
+	data->hmac = NULL;
 	
 	return data;
 }
@@ -118,46 +121,183 @@ void otp_free(OTPData* data)
 /*
 	Un-base32's a base32 string stored inside an OTPData.
 	
-	out_str is the null-terminated output string already allocated
+	out_str is the output already allocated, at least 5 bytes per
+	  started block of 8 base32 characters
 	
 	Returns
 			1 success
 		error, 0
 */
 COTPRESULT otp_byte_secret(OTPData* data, char* out_str) {
-	if (out_str == NULL || strlen(data->base32_secret) % 8 != 0) {
-		return OTP_ERROR;
-	}
-	
 	size_t base32_length = strlen(data->base32_secret);
-	size_t num_blocks = base32_length / 8;
-	size_t output_length = num_blocks * 5;
+	return otp_base32_decode(data->base32_secret, base32_length, (uint8_t*) out_str, (base32_length + 7) / 8 * 5, NULL);
+}
+
+/*
+	Initializes an OTPKey by decoding a base32 secret once.
 	
-	if (output_length == 0) {
-		return OTP_OK;
+	key is a non-initialized structure
+	base32_secret is a base32 compliant secret string
+	
+	The decoded secret must fit in OTP_KEY_MAX_LENGTH bytes.
+	
+	Returns
+			The same pointer passed through key
+		error, 0
+*/
+OTPKey* otp_key_new(OTPKey* key, const char* base32_secret)
+{
+	if (key == NULL || base32_secret == NULL)
+		return NULL;
+	
+	size_t length;
+	if (otp_base32_decode(base32_secret, strlen(base32_secret), key->bytes, OTP_KEY_MAX_LENGTH, &length) != OTP_OK)
+	{
+		otp_key_wipe(key);
+		return NULL;
 	}
+	key->length = (uint32_t) length;
+	key->scheduled = 0;
+	
+	return key;
+}
+
+/*
+	Decodes data->base32_secret into key and makes data use it
+	  for every following generation and comparison.
 	
-	int valid = 1;
+	When data->hmac is set, its key schedule is computed once
+	  here and reused for every code.
 	
-	for (size_t i = 0; i < num_blocks; i++) {
-		uint64_t block_value = 0;
-		
-		for (int j = 0; j < 8; j++) {
-			block_value <<= 5;
-			char c = data->base32_secret[i * 8 + j];
-			unsigned int value = (unsigned char) c < 256 ? OTP_DEFAULT_BASE32_OFFSETS[(unsigned char) c] : -1;
-			block_value |= value & 31;
-			valid &= (value >= 0);
+	key must outlive every use of data
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_prepare(OTPData* data, OTPKey* key)
+{
+	if (data == NULL || otp_key_new(key, data->base32_secret) == NULL)
+		return OTP_ERROR;
+	
+	if (data->hmac != NULL)
+	{
+		memset(&key->ctx, 0, sizeof(OTPAlgoCtx));
+		if (data->hmac->init((const char*) key->bytes, (int) key->length, &key->ctx) == 0)
+		{
+			otp_key_wipe(key);
+			return OTP_ERROR;
 		}
-		
-		out_str[i * 5 + 0] = block_value >> 32;
-		out_str[i * 5 + 1] = block_value >> 24;
-		out_str[i * 5 + 2] = block_value >> 16;
-		out_str[i * 5 + 3] = block_value >>  8;
-		out_str[i * 5 + 4] = block_value >>  0;
+		key->scheduled = 1;
 	}
+	
+	data->key = key;
+	
+	return OTP_OK;
+}
 
-	return valid ? OTP_OK : OTP_ERROR;
+/*
+	Releases a key prepared by otp_prepare(), wipes it and
+	  detaches it from data.
+*/
+void otp_unprepare(OTPData* data, OTPKey* key)
+{
+	if (key == NULL)
+		return;
+	
+	if (key->scheduled && data != NULL && data->hmac != NULL && data->hmac->free != NULL)
+		data->hmac->free(&key->ctx);
+	
+	otp_key_wipe(key);
+	
+	if (data != NULL && data->key == key)
+		data->key = NULL;
+}
+
+/*
+	Securely zeroes an OTPKey.
+*/
+void otp_key_wipe(OTPKey* key)
+{
+	if (key == NULL)
+		return;
+	
+	volatile uint8_t* p = (volatile uint8_t*) key;
+	for (size_t i=0; i<sizeof(OTPKey); i++)
+		p[i] = 0;
+}
+
+static const uint64_t POWERS[OTP_MAX_DIGITS + 1] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000ULL
+};
+
+/*
+	Computes the HMAC of an 8 byte input, through data->hmac
+	  when set, otherwise through data->algo.
+	
+	Returns
+			the length in bytes of the HMAC
+		error, 0
+*/
+static int otp_hmac(OTPData* data, const OTPKey* key, const char* input, char* output)
+{
+	if (data->hmac == NULL)
+		return (*(data->algo))((const char*) key->bytes, (int) key->length, input, output);
+	
+	if (key->scheduled)
+		return data->hmac->compute(&key->ctx, input, output);
+	
+	OTPAlgoCtx ctx;
+	memset(&ctx, 0, sizeof(OTPAlgoCtx));
+	
+	int hmac_len = 0;
+	if (data->hmac->init((const char*) key->bytes, (int) key->length, &ctx) != 0)
+	{
+		hmac_len = data->hmac->compute(&ctx, input, output);
+		if (data->hmac->free != NULL)
+			data->hmac->free(&ctx);
+	}
+	
+	volatile uint8_t* p = (volatile uint8_t*) &ctx;
+	for (size_t i=0; i<sizeof(OTPAlgoCtx); i++)
+		p[i] = 0;
+	
+	return hmac_len;
+}
+
+/*
+	Computes the truncated (not yet modulo'd) HOTP value of input
+	  using an already decoded key.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT otp_truncate(OTPData* data, const OTPKey* key, uint64_t input, uint32_t* out_code)
+{
+	char byte_string[8];
+	for (int i=7; i>=0; i--)
+	{
+		byte_string[i] = (char) (input & 0xFF);
+		input >>= 8;
+	}
+	
+	char hmac[64];
+	
+	int hmac_len = otp_hmac(data, key, byte_string, hmac);
+	if (hmac_len < 1 || hmac_len > 64)
+		return OTP_ERROR;
+	
+	size_t offset = (hmac[hmac_len - 1] & 0xF);
+	if (offset + 3 >= hmac_len)
+		return OTP_ERROR;
+	*out_code =
+		(((hmac[offset] & 0x7F) << 24)
+		| ((hmac[offset+1] & 0xFF) << 16)
+		| ((hmac[offset+2] & 0xFF) << 8)
+		| ((hmac[offset+3] & 0xFF)));
+	
+	return OTP_OK;
 }
 
 /*
@@ -206,19 +346,57 @@ COTPRESULT otp_random_base32(size_t len, char* out_str)
 	
 	len = len > 0 ? len : 16;
 	
-	unsigned char rand_buffer[len];
-	if (RAND_bytes(rand_buffer, len) != 1)
+	// 5 bits per character, not a whole byte
+	size_t bytes = (len * 5 + 7) / 8;
+	unsigned char rand_buffer[bytes + 1];
+	if (RAND_bytes(rand_buffer, bytes) != 1)
 		return OTP_ERROR;
+	rand_buffer[bytes] = 0;
 	
 	for (size_t i=0; i<len; i++)
 	{
-		out_str[i] = OTP_DEFAULT_BASE32_CHARS[rand_buffer[i] % 32];
+		size_t bit = i * 5;
+		unsigned int pair = ((unsigned int) rand_buffer[bit / 8] << 8) | rand_buffer[bit / 8 + 1];
+		out_str[i] = OTP_DEFAULT_BASE32_CHARS[(pair >> (11 - bit % 8)) & 31];
 	}
 	
+	memset(rand_buffer, 0, sizeof(rand_buffer));
+	
 	return OTP_OK;
 }
 
 
+/*
+	Compares two codes without branching on their value.
+	
+	Returns
+			1 if equal
+			0 otherwise
+*/
+static int otp_code_equal(uint32_t a, uint32_t b)
+{
+	return (int) (((uint64_t) (a ^ b) - 1) >> 63);
+}
+
+/*
+	Parses a key like otp_parse_code(), for the functions taking
+	  keys as strings.
+	
+	key is null-terminated and at least digits characters long
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_parse_key(const char* key, uint32_t digits, uint32_t* out_code)
+{
+	size_t length = 0;
+	while (length < digits && key[length] != '\0')
+		length++;
+	
+	return otp_parse_code(key, length, digits, out_code);
+}
+
 /*
 	Compares a key against a generated key for
 	  a single specific timeblock.
@@ -234,21 +412,32 @@ COTPRESULT otp_random_base32(size_t len, char* out_str)
 */
 COTPRESULT totp_compare(OTPData* data, const char* key, int64_t offset, uint64_t for_time)
 {
-	char time_str[data->digits+1];
-	memset(time_str, 0, data->digits+1);
-	
-	if (totp_at(data, for_time, offset, time_str) == 0)
+	uint32_t code;
+	if (key == NULL || otp_parse_key(key, data->digits, &code) != OTP_OK)
 		return OTP_ERROR;
 	
-	int invalid = 0;
-	for (size_t i=0; i<data->digits; i++)
-	{
-		invalid |=  key[i] ^ time_str[i];
-	}
-	if (invalid != 0)
+	return totp_compare_code(data, code, offset, for_time);
+}
+
+/*
+	Compares an already parsed code against a generated code for
+	  a single specific timeblock.
+	
+	code is the submitted code, see otp_parse_code()
+	offset is a timeblock adjustment for the generated compare code
+	for_time is the time the generated code will be created for
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT totp_compare_code(OTPData* data, uint32_t code, int64_t offset, uint64_t for_time)
+{
+	uint32_t generated;
+	if (otp_generate_code(data, totp_timecode(data, for_time) + offset, &generated) != OTP_OK)
 		return OTP_ERROR;
 	
-	return OTP_OK;
+	return otp_code_equal(code, generated) ? OTP_OK : OTP_ERROR;
 }
 
 /*
@@ -298,36 +487,287 @@ COTPRESULT totp_next(OTPData* data, char* out_str)
 }
 
 /*
-	Compares a key against a generated key for multiple
-	  timeblocks before and after a specific time.
+	Parses a submitted code into an integer, once, so it can be
+	  compared against generated codes without string work.
 	
-	key is an null-terminated input string, a previous OTP generation, must be data->digits+1 long
-	for_time is the time the generated key will be created for
-	valid_window is the number of timeblocks a OTP should be valid for
+	str is the submitted code, it doesn't need to be null-terminated
+	length is the amount of characters in str, must equal digits
+	digits is the amount of digits expected
+	out_code receives the code
 	
 	Returns
 			1 success
 		error, 0
 */
-COTPRESULT totp_verify(OTPData* data, const char* key, uint64_t for_time, int64_t valid_window)
+COTPRESULT otp_parse_code(const char* str, size_t length, uint32_t digits, uint32_t* out_code)
 {
-	if (key == NULL || valid_window < 0)
+	if (str == NULL || out_code == NULL || digits == 0 || digits > OTP_MAX_DIGITS || length != digits)
 		return OTP_ERROR;
 	
-	if (valid_window > 0)
+	uint64_t code = 0;
+	uint32_t invalid = 0;
+	for (size_t i=0; i<length; i++)
 	{
-		int wins = 0;
-		for (int64_t i=-valid_window; i<valid_window+1; i++)
+		uint32_t digit = (uint32_t) ((unsigned char) str[i] - '0');
+		invalid |= digit > 9;
+		code = code * 10 + digit;
+	}
+	
+	if (invalid || code > UINT32_MAX)
+		return OTP_ERROR;
+	
+	*out_code = (uint32_t) code;
+	return OTP_OK;
+}
+
+/*
+	Amount of timeblocks hashed per otp_generate_batch call
+	  while verifying a window.
+*/
+#define OTP_VERIFY_CHUNK 64
+
+/*
+	Best match found so far while searching timeblocks.
+*/
+typedef struct otp_match
+{
+	uint64_t matched;
+	int64_t offset;
+	uint64_t distance;
+} otp_match;
+
+/*
+	Generates the codes of count consecutive counters starting at counter,
+	  count is at most OTP_VERIFY_CHUNK.
+	
+	Prepared keys hash the counters together in SIMD lanes.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT otp_generate_range(OTPData* data, const OTPKey* key, uint64_t counter, size_t count, uint32_t* out_codes)
+{
+	if (data->hmac != NULL && key->scheduled)
+	{
+		const OTPKey* keys[OTP_VERIFY_CHUNK];
+		uint64_t counters[OTP_VERIFY_CHUNK];
+		for (size_t i=0; i<count; i++)
 		{
-			int cmp = totp_compare(data, key, i, for_time);
-			if (cmp == OTP_OK)
-				wins++;
+			keys[i] = key;
+			counters[i] = counter + i;
 		}
+		return otp_generate_batch(data->hmac, keys, counters, count, data->digits, out_codes);
+	}
+	
+	for (size_t i=0; i<count; i++)
+	{
+		if (otp_truncate(data, key, counter + i, &out_codes[i]) != OTP_OK)
+			return OTP_ERROR;
+		out_codes[i] %= POWERS[data->digits];
+	}
+	
+	return OTP_OK;
+}
+
+/*
+	Compares a code against the timeblocks timecode+first to timecode+last.
+	
+	Every timeblock is compared and the closest match to centre
+	  is kept without branching on the codes.
+	
+	Returns
+			1 if every timeblock was generated
+		error, 0
+*/
+static COTPRESULT totp_match_range(OTPData* data, const OTPKey* key, uint32_t code, uint64_t timecode, int64_t first, int64_t last, int64_t centre, otp_match* match)
+{
+	uint32_t codes[OTP_VERIFY_CHUNK];
+	
+	for (int64_t start=first; start<=last; start+=OTP_VERIFY_CHUNK)
+	{
+		uint64_t remaining = (uint64_t) (last - start) + 1;
+		size_t count = remaining < OTP_VERIFY_CHUNK ? (size_t) remaining : OTP_VERIFY_CHUNK;
 		
-		return (COTPRESULT) wins >= 1;
+		if (otp_generate_range(data, key, timecode + (uint64_t) start, count, codes) != OTP_OK)
+			return OTP_ERROR;
+		
+		for (size_t i=0; i<count; i++)
+		{
+			int64_t offset = start + (int64_t) i;
+			int64_t delta = offset - centre;
+			uint64_t distance = (uint64_t) ((delta ^ (delta >> 63)) - (delta >> 63));
+			
+			uint64_t equal = ((uint64_t) (codes[i] ^ code) - 1) >> 63;
+			uint64_t closer = (distance - match->distance) >> 63;
+			uint64_t mask = (uint64_t) 0 - (equal & closer);
+			
+			match->offset = (int64_t) (((uint64_t) match->offset & ~mask) | ((uint64_t) offset & mask));
+			match->distance = (match->distance & ~mask) | (distance & mask);
+			match->matched |= equal;
+		}
 	}
 	
-	return totp_compare(data, key, 0, for_time);
+	return OTP_OK;
+}
+
+/*
+	Compares code against the timeblocks first to last around for_time,
+	  and optionally the ranges before and after them.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT totp_search(OTPData* data, uint32_t code, uint64_t for_time, int64_t first, int64_t last, int64_t outer, int64_t centre, int64_t* out_offset)
+{
+	if (data->digits == 0 || data->digits > OTP_MAX_DIGITS)
+		return OTP_ERROR;
+	
+	OTPKey decoded;
+	const OTPKey* okey = data->key;
+	if (okey == NULL)
+	{
+		if (otp_key_new(&decoded, data->base32_secret) == NULL)
+			return OTP_ERROR;
+		okey = &decoded;
+	}
+	
+	uint64_t timecode = totp_timecode(data, for_time);
+	otp_match match = { 0, 0, INT64_MAX };
+	
+	COTPRESULT res = totp_match_range(data, okey, code, timecode, first, last, centre, &match);
+	if (res == OTP_OK && !match.matched && outer > 0)
+	{
+		res = totp_match_range(data, okey, code, timecode, -outer, first - 1, centre, &match)
+			&& totp_match_range(data, okey, code, timecode, last + 1, outer, centre, &match);
+	}
+	
+	if (okey == &decoded)
+		otp_key_wipe(&decoded);
+	
+	if (res != OTP_OK || !match.matched)
+		return OTP_ERROR;
+	
+	if (out_offset != NULL)
+		*out_offset = match.offset;
+	
+	return OTP_OK;
+}
+
+/*
+	Compares a key against a generated key for multiple
+	  timeblocks before and after a specific time.
+	
+	When data->key was prepared through data->hmac, the whole window
+	  is hashed in SIMD lanes by otp_generate_batch.
+	
+	key is an null-terminated input string, a previous OTP generation, must be data->digits+1 long
+	for_time is the time the generated key will be created for
+	valid_window is the number of timeblocks a OTP should be valid for,
+	  at most OTP_MAX_LOOK_AHEAD
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT totp_verify(OTPData* data, const char* key, uint64_t for_time, int64_t valid_window)
+{
+	return totp_verify_offset(data, key, for_time, valid_window, NULL);
+}
+
+/*
+	Same as totp_verify, also reporting which timeblock matched.
+	
+	out_offset receives the matched timeblock relative to for_time,
+	  the one closest to for_time if several matched
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT totp_verify_offset(OTPData* data, const char* key, uint64_t for_time, int64_t valid_window, int64_t* out_offset)
+{
+	uint32_t code;
+	if (key == NULL || otp_parse_key(key, data->digits, &code) != OTP_OK)
+		return OTP_ERROR;
+	
+	return totp_verify_code(data, code, for_time, valid_window, out_offset);
+}
+
+/*
+	Same as totp_verify_offset, with a code already parsed by otp_parse_code().
+	
+	out_offset is optional
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT totp_verify_code(OTPData* data, uint32_t code, uint64_t for_time, int64_t valid_window, int64_t* out_offset)
+{
+	if (valid_window < 0 || (uint64_t) valid_window > OTP_MAX_LOOK_AHEAD)
+		return OTP_ERROR;
+	
+	return totp_search(data, code, for_time, -valid_window, valid_window, 0, 0, out_offset);
+}
+
+/*
+	Initializes an OTPDrift structure for a user with no known skew.
+	
+	Returns
+			The same pointer passed through drift
+*/
+OTPDrift* totp_drift_new(OTPDrift* drift)
+{
+	drift->skew = 0;
+	drift->last_timecode = 0;
+	drift->matches = 0;
+	
+	return drift;
+}
+
+/*
+	Verifies a key around the user's estimated clock skew first.
+	
+	The narrow_window timeblocks around drift->skew are checked first,
+	  so most users cost 2*narrow_window+1 HMACs. Only when those miss
+	  is the rest of the valid_window checked. A match updates drift.
+	
+	narrow_window is the number of timeblocks checked around the skew
+	valid_window is the number of timeblocks a OTP should be valid for,
+	  both at most OTP_MAX_LOOK_AHEAD
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT totp_verify_drift(OTPData* data, OTPDrift* drift, const char* key, uint64_t for_time, int64_t narrow_window, int64_t valid_window)
+{
+	uint32_t code;
+	if (drift == NULL || key == NULL || narrow_window < 0 || valid_window < 0
+			|| (uint64_t) narrow_window > OTP_MAX_LOOK_AHEAD || (uint64_t) valid_window > OTP_MAX_LOOK_AHEAD
+			|| otp_parse_key(key, data->digits, &code) != OTP_OK)
+		return OTP_ERROR;
+	
+	int64_t centre = drift->skew;
+	if (centre < -valid_window)
+		centre = -valid_window;
+	if (centre > valid_window)
+		centre = valid_window;
+	
+	int64_t first = centre - narrow_window < -valid_window ? -valid_window : centre - narrow_window;
+	int64_t last = centre + narrow_window > valid_window ? valid_window : centre + narrow_window;
+	
+	int64_t offset = 0;
+	if (totp_search(data, code, for_time, first, last, valid_window, centre, &offset) != OTP_OK)
+		return OTP_ERROR;
+	
+	drift->skew = offset;
+	drift->last_timecode = totp_timecode(data, for_time) + (uint64_t) offset;
+	drift->matches++;
+	
+	return OTP_OK;
 }
 
 /*
@@ -371,8 +811,7 @@ uint64_t totp_timecode(OTPData* data, uint64_t for_time)
 	Compares a key against a generated key for a single counter.
 	
 	key is an null-terminated input string, a previous OTP generation, must be data->digits+1 long
-	offset is a timeblock adjustment for the generated compare key
-	for_time is the time the generated key will be created for
+	counter is the counter the generated compare key will be created for
 	
 	Returns
 			1 success
@@ -381,26 +820,159 @@ uint64_t totp_timecode(OTPData* data, uint64_t for_time)
 */
 int hotp_compare(OTPData* data, const char* key, uint64_t counter)
 {
-	if (key == NULL)
+	uint32_t code;
+	if (key == NULL || otp_parse_key(key, data->digits, &code) != OTP_OK)
 		return OTP_ERROR;
 	
-	char cnt_str[data->digits+1];
-	memset(cnt_str, 0, data->digits+1);
+	return hotp_compare_code(data, code, counter);
+}
+
+/*
+	Compares an already parsed code against a generated code for a single counter.
+	
+	code is the submitted code, see otp_parse_code()
+	counter is the counter the generated compare code will be created for
 	
-	if (hotp_at(data, counter, cnt_str) == 0)
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT hotp_compare_code(OTPData* data, uint32_t code, uint64_t counter)
+{
+	uint32_t generated;
+	if (otp_generate_code(data, counter, &generated) != OTP_OK)
+		return OTP_ERROR;
+	
+	return otp_code_equal(code, generated) ? OTP_OK : OTP_ERROR;
+}
+
+/*
+	Searches counter to counter+look_ahead for the first counter
+	  whose code is code, or whose code is code and the next
+	  counter's code is next when pair is set.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT hotp_search(OTPData* data, uint32_t code, uint32_t next, int pair, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter)
+{
+	if (data->digits == 0 || data->digits > OTP_MAX_DIGITS || look_ahead > OTP_MAX_LOOK_AHEAD)
 		return OTP_ERROR;
 	
-	int invalid = 0;
-	for (size_t i=0; i<data->digits; i++)
+	OTPKey decoded;
+	const OTPKey* okey = data->key;
+	if (okey == NULL)
+	{
+		if (otp_key_new(&decoded, data->base32_secret) == NULL)
+			return OTP_ERROR;
+		okey = &decoded;
+	}
+	
+	// Chunks of a pair search overlap by one counter for the next code
+	uint32_t codes[OTP_VERIFY_CHUNK];
+	size_t step = pair ? OTP_VERIFY_CHUNK - 1 : OTP_VERIFY_CHUNK;
+	uint64_t matched = 0;
+	uint64_t found = 0;
+	COTPRESULT res = OTP_OK;
+	
+	for (uint64_t start=0; start<=look_ahead && !matched; start+=step)
 	{
-		invalid |=  key[i] ^ cnt_str[i];
+		uint64_t remaining = look_ahead - start + 1;
+		size_t count = remaining < step ? (size_t) remaining : step;
+		
+		if (otp_generate_range(data, okey, counter + start, count + (size_t) pair, codes) != OTP_OK)
+		{
+			res = OTP_ERROR;
+			break;
+		}
+		
+		// Walk backwards so the first match in the chunk is the one kept
+		for (size_t i=count; i-- > 0;)
+		{
+			uint64_t equal = ((uint64_t) (codes[i] ^ code) - 1) >> 63;
+			if (pair)
+				equal &= ((uint64_t) (codes[i + 1] ^ next) - 1) >> 63;
+			
+			uint64_t mask = (uint64_t) 0 - equal;
+			found = (found & ~mask) | ((counter + start + i) & mask);
+			matched |= equal;
+		}
 	}
-	if (invalid != 0)
+	
+	if (okey == &decoded)
+		otp_key_wipe(&decoded);
+	
+	if (res != OTP_OK || !matched)
 		return OTP_ERROR;
 	
+	if (out_counter != NULL)
+		*out_counter = found;
+	
 	return OTP_OK;
 }
 
+/*
+	Compares key against the counters counter to counter+look_ahead,
+	  the RFC 4226 look-ahead window.
+	
+	key is an null-terminated input string, a previous OTP generation, must be data->digits+1 long
+	out_counter is optional, receives the first matching counter, the
+	  next expected counter is out_counter+1
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT hotp_verify(OTPData* data, const char* key, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter)
+{
+	uint32_t code;
+	if (key == NULL || otp_parse_key(key, data->digits, &code) != OTP_OK)
+		return OTP_ERROR;
+	
+	return hotp_verify_code(data, code, counter, look_ahead, out_counter);
+}
+
+/*
+	Same as hotp_verify, with a code already parsed by otp_parse_code().
+	
+	When data->key was prepared through data->hmac, the counters
+	  are hashed in SIMD lanes.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT hotp_verify_code(OTPData* data, uint32_t code, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter)
+{
+	return hotp_search(data, code, 0, 0, counter, look_ahead, out_counter);
+}
+
+/*
+	Resynchronizes a counter from two consecutive codes, RFC 4226 E.4.
+	
+	key and next_key are null-terminated input strings of consecutive generations
+	look_ahead is the amount of counters after counter to search,
+	  usually larger than the one used by hotp_verify
+	out_counter is optional, receives the counter of key, the next
+	  expected counter is out_counter+2
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT hotp_resync(OTPData* data, const char* key, const char* next_key, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter)
+{
+	uint32_t code;
+	uint32_t next;
+	if (key == NULL || next_key == NULL
+			|| otp_parse_key(key, data->digits, &code) != OTP_OK
+			|| otp_parse_key(next_key, data->digits, &next) != OTP_OK)
+		return OTP_ERROR;
+	
+	return hotp_search(data, code, next, 1, counter, look_ahead, out_counter);
+}
+
 /*
 	Generates a OTP key using the hotp algorithm.
 	
@@ -431,52 +1003,128 @@ int hotp_next(OTPData* data, char* out_str)
 }
 
 /*
-	Generates an OTP (One Time Password).
+	Generates an OTP (One Time Password) as an integer.
+	
+	Uses data->key when set, otherwise decodes data->base32_secret.
 	
 	input is a number used to generate the OTP
-	out_str is the null-terminated output string already allocated
+	out_code receives the code, below 10^data->digits
 	
 	Returns
 			1 if otp code was successfully generated
 		error, 0
 */
-COTPRESULT otp_generate(OTPData* data, uint64_t input, char* out_str)
+COTPRESULT otp_generate_code(OTPData* data, uint64_t input, uint32_t* out_code)
 {
-	if (out_str == NULL)
+	if (out_code == NULL || data->digits == 0 || data->digits > OTP_MAX_DIGITS)
 		return OTP_ERROR;
 	
-	char byte_string[8+1];
-	memset(byte_string, 0, 8+1);
+	uint32_t truncated = 0;
+	if (data->key != NULL)
+	{
+		if (otp_truncate(data, data->key, input, &truncated) != OTP_OK)
+			return OTP_ERROR;
+	}
+	else
+	{
+		OTPKey key;
+		COTPRESULT res = otp_key_new(&key, data->base32_secret) != NULL
+			? otp_truncate(data, &key, input, &truncated)
+			: OTP_ERROR;
+		otp_key_wipe(&key);
+		if (res != OTP_OK)
+			return OTP_ERROR;
+	}
 	
-	size_t bs_len = (strlen(data->base32_secret)/8)*5;
-	char byte_secret[bs_len + 1];
-	memset(byte_secret, 0, bs_len + 1);
+	*out_code = (uint32_t) (truncated % POWERS[data->digits]);
 	
-	char hmac[64+1];
-	memset(hmac, 0, 64+1);
+	return OTP_OK;
+}
+
+/*
+	Two characters per entry, "00" through "99".
+*/
+static const char OTP_DIGIT_PAIRS[201] =
+	"00010203040506070809" "10111213141516171819" "20212223242526272829" "30313233343536373839"
+	"40414243444546474849" "50515253545556575859" "60616263646566676869" "70717273747576777879"
+	"80818283848586878889" "90919293949596979899";
+
+/*
+	Writes exactly digits characters of code, zero padded.
 	
-	if (otp_num_to_bytestring(input, byte_string) != OTP_OK
-			|| otp_byte_secret(data, byte_secret) != OTP_OK)
-		return OTP_ERROR;
+	Inlined with a constant digits, so every width gets its own
+	  unrolled sequence of table lookups.
+*/
+static inline void otp_format_fixed(uint32_t code, const uint32_t digits, char* out_str)
+{
+	uint32_t pos = digits;
+	while (pos >= 2)
+	{
+		uint32_t pair = (code % 100) * 2;
+		code /= 100;
+		pos -= 2;
+		out_str[pos] = OTP_DIGIT_PAIRS[pair];
+		out_str[pos + 1] = OTP_DIGIT_PAIRS[pair + 1];
+	}
+	if (pos == 1)
+		out_str[0] = (char) ('0' + code % 10);
+	out_str[digits] = '\0';
+}
+
+/*
+	Formats a code as a zero padded, null-terminated string
+	  without going through stdio.
 	
-	int hmac_len = (*(data->algo))(byte_secret, bs_len, byte_string, hmac);
-	if (hmac_len < 1 || hmac_len > 64)
-		return OTP_ERROR;
+	digits is the amount of characters to write, at most OTP_MAX_DIGITS
+	out_str must hold at least digits+1 characters
 	
-	size_t offset = (hmac[hmac_len - 1] & 0xF);
-	if (offset + 3 >= hmac_len)
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_format_code(uint32_t code, uint32_t digits, char* out_str)
+{
+	if (out_str == NULL)
 		return OTP_ERROR;
-	uint64_t code =
-		(((hmac[offset] & 0x7F) << 24)
-		| ((hmac[offset+1] & 0xFF) << 16)
-		| ((hmac[offset+2] & 0xFF) << 8)
-		| ((hmac[offset+3] & 0xFF)));
-	
-	static const uint64_t POWERS[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
-	code %= POWERS[data->digits];
 	
-	sprintf(out_str, "%0*" PRIu64, data->digits, code);
+	switch (digits)
+	{
+		case 1: otp_format_fixed(code, 1, out_str); break;
+		case 2: otp_format_fixed(code, 2, out_str); break;
+		case 3: otp_format_fixed(code, 3, out_str); break;
+		case 4: otp_format_fixed(code, 4, out_str); break;
+		case 5: otp_format_fixed(code, 5, out_str); break;
+		case 6: otp_format_fixed(code, 6, out_str); break;
+		case 7: otp_format_fixed(code, 7, out_str); break;
+		case 8: otp_format_fixed(code, 8, out_str); break;
+		case 9: otp_format_fixed(code, 9, out_str); break;
+		case 10: otp_format_fixed(code, 10, out_str); break;
+		default: return OTP_ERROR;
+	}
 	
 	return OTP_OK;
 }
 
+/*
+	Generates an OTP (One Time Password).
+	
+	Uses data->key when set, otherwise decodes data->base32_secret.
+	
+	input is a number used to generate the OTP
+	out_str is the null-terminated output string already allocated
+	
+	Returns
+			1 if otp code was successfully generated
+		error, 0
+*/
+COTPRESULT otp_generate(OTPData* data, uint64_t input, char* out_str)
+{
+	if (out_str == NULL)
+		return OTP_ERROR;
+	
+	uint32_t code;
+	if (otp_generate_code(data, input, &code) != OTP_OK)
+		return OTP_ERROR;
+	
+	return otp_format_code(code, data->digits, out_str);
+}
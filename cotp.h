@@ -80,6 +80,106 @@ typedef int (*COTP_ALGO)(const char* key, int key_length, const char* input, cha
 typedef uint64_t (*COTP_TIME)(void);
 
 
+/*
+	Size in bytes of the storage an OTPAlgo can keep a prepared key in.
+*/
+#define OTP_ALGO_CTX_SIZE 128
+
+/*
+	Storage for a prepared key, such as the inner and outer
+	  HMAC states. Implementations needing more room can
+	  allocate and keep a pointer in ptr.
+*/
+typedef union OTPAlgoCtx
+{
+	uint8_t u8[OTP_ALGO_CTX_SIZE];
+	uint32_t u32[OTP_ALGO_CTX_SIZE / 4];
+	uint64_t u64[OTP_ALGO_CTX_SIZE / 8];
+	void* ptr;
+} OTPAlgoCtx;
+
+/*
+	Must prepare the HMAC key schedule for key into ctx.
+	
+	key is the decoded secret key.
+	ctx is zeroed storage owned by the OTPKey.
+	
+	Must return 0 if error, otherwise 1.
+*/
+typedef int (*COTP_ALGO_INIT)(const char* key, int key_length, OTPAlgoCtx* ctx);
+
+/*
+	Must compute HMAC of input with a key prepared by COTP_ALGO_INIT,
+	  output as char array through output.
+	
+	input is input number as string, 8 bytes long.
+	output is an output char buffer of the resulting HMAC operation.
+	
+	May be called concurrently with the same ctx.
+	
+	Must return 0 if error, or the length in bytes of the HMAC operation.
+*/
+typedef int (*COTP_ALGO_COMPUTE)(const OTPAlgoCtx* ctx, const char* input, char* output);
+
+/*
+	Must release anything COTP_ALGO_INIT acquired for ctx.
+*/
+typedef void (*COTP_ALGO_FREE)(OTPAlgoCtx* ctx);
+
+/*
+	HMAC implementation which caches the key schedule per key.
+	
+	Used instead of COTP_ALGO when set on OTPData.
+	free is optional.
+*/
+typedef struct OTPAlgo
+{
+	COTP_ALGO_INIT init;
+	COTP_ALGO_COMPUTE compute;
+	COTP_ALGO_FREE free;
+} OTPAlgo;
+
+
+/*
+	Maximum length in bytes of a decoded secret held by an OTPKey.
+	
+	Every code is generated from an OTPKey, a base32_secret in
+	  OTPData decoding to more than this is refused with an error.
+	  That is the HMAC block size of SHA-512, longer secrets add
+	  nothing as HMAC hashes them down first.
+*/
+#define OTP_KEY_MAX_LENGTH 128
+
+/*
+	Maximum amount of digits an OTP code may have.
+*/
+#define OTP_MAX_DIGITS 10
+
+/*
+	Largest look-ahead hotp_verify and hotp_resync search, and the
+	  largest valid_window the totp_verify functions accept. The
+	  COTP::Fixed classes share the limit.
+*/
+#define OTP_MAX_LOOK_AHEAD ((uint64_t) 1 << 31)
+
+/*
+	Holds a decoded (un-base32'd) secret so it doesn't have to be
+	  decoded again for every code generated.
+	
+	Create one with otp_key_new() or otp_prepare() and wipe it
+	  with otp_key_wipe() when you are done with it. Keys prepared
+	  through an OTPAlgo hold its key schedule in ctx and must be
+	  released with otp_unprepare().
+*/
+typedef struct OTPKey
+{
+	uint32_t length;
+	uint32_t scheduled; // Non-zero when ctx holds a key schedule
+	uint8_t bytes[OTP_KEY_MAX_LENGTH];
+	OTPAlgoCtx ctx;
+} OTPKey;
+
+
 /*
 	Holds data for use by the cotp module.
 	
@@ -96,10 +196,25 @@ typedef struct OTPData
 	COTP_ALGO algo;
 	COTP_TIME time;
 	
-	const char* base32_secret;
+	const char* base32_secret; // At most OTP_KEY_MAX_LENGTH bytes once decoded
+	const OTPKey* key; // Optional, used instead of base32_secret when set
+	const OTPAlgo* hmac; // Optional, used instead of algo when set
 } OTPData;
 
 
+/*
+	Per-user clock drift tracked by totp_verify_drift().
+	
+	Initialize with totp_drift_new() and persist it with the user.
+*/
+typedef struct OTPDrift
+{
+	int64_t skew; // Estimated clock skew in timeblocks
+	uint64_t last_timecode; // Last matched timeblock
+	uint64_t matches; // Amount of successful verifications
+} OTPDrift;
+
+
 /*
 	Struct initialization functions
 */
@@ -112,10 +227,22 @@ OTPData* hotp_new(OTPData* data, const char* base32_secret, COTP_ALGO algo, uint
 */
 void otp_free(OTPData* data);
 
+/*
+	Prepared key functions
+*/
+OTPKey* otp_key_new(OTPKey* key, const char* base32_secret);
+COTPRESULT otp_prepare(OTPData* data, OTPKey* key);
+void otp_unprepare(OTPData* data, OTPKey* key);
+void otp_key_wipe(OTPKey* key);
+
 /*
 	OTP functions
 */
 COTPRESULT otp_generate(OTPData* data, uint64_t input, char* out_str);
+COTPRESULT otp_generate_code(OTPData* data, uint64_t input, uint32_t* out_code);
+COTPRESULT otp_format_code(uint32_t code, uint32_t digits, char* out_str);
+COTPRESULT otp_parse_code(const char* str, size_t length, uint32_t digits, uint32_t* out_code);
+COTPRESULT otp_parse_key(const char* key, uint32_t digits, uint32_t* out_code);
 COTPRESULT otp_byte_secret(OTPData* data, char* out_str);
 COTPRESULT otp_num_to_bytestring(uint64_t integer, char* out_str);
 COTPRESULT otp_random_base32(size_t len, char* out_str);
@@ -125,9 +252,14 @@ COTPRESULT otp_random_base32(size_t len, char* out_str);
 	TOTP functions
 */
 COTPRESULT totp_compare(OTPData* data, const char* key, int64_t offset, uint64_t for_time);
+COTPRESULT totp_compare_code(OTPData* data, uint32_t code, int64_t offset, uint64_t for_time);
 COTPRESULT totp_at(OTPData* data, uint64_t for_time, int64_t offset, char* out_str);
 COTPRESULT totp_now(OTPData* data, char* out_str);
 COTPRESULT totp_verify(OTPData* data, const char* key, uint64_t for_time, int64_t valid_window);
+COTPRESULT totp_verify_offset(OTPData* data, const char* key, uint64_t for_time, int64_t valid_window, int64_t* out_offset);
+COTPRESULT totp_verify_code(OTPData* data, uint32_t code, uint64_t for_time, int64_t valid_window, int64_t* out_offset);
+OTPDrift* totp_drift_new(OTPDrift* drift);
+COTPRESULT totp_verify_drift(OTPData* data, OTPDrift* drift, const char* key, uint64_t for_time, int64_t narrow_window, int64_t valid_window);
 uint64_t totp_valid_until(OTPData* data, uint64_t for_time, int64_t valid_window);
 uint64_t totp_timecode(OTPData* data, uint64_t for_time);
 
@@ -136,6 +268,10 @@ uint64_t totp_timecode(OTPData* data, uint64_t for_time);
 	HOTP functions
 */
 COTPRESULT hotp_compare(OTPData* data, const char* key, uint64_t counter);
+COTPRESULT hotp_compare_code(OTPData* data, uint32_t code, uint64_t counter);
+COTPRESULT hotp_verify(OTPData* data, const char* key, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter);
+COTPRESULT hotp_verify_code(OTPData* data, uint32_t code, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter);
+COTPRESULT hotp_resync(OTPData* data, const char* key, const char* next_key, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter);
 COTPRESULT hotp_at(OTPData* data, uint64_t counter, char* out_str);
 COTPRESULT hotp_next(OTPData* data, char* out_str);
 
@@ -5,6 +5,7 @@
 
 #include "cotp.h"
 #include "otpuri.h"
+#include "otphmac.h"
 
 #include <cstdint>
 
@@ -32,6 +33,16 @@ namespace COTP
 				return otp_generate(data, input, output);
 			}
 			
+			COTPRESULT generate_code(uint64_t input, uint32_t* out_code)
+			{
+				return otp_generate_code(data, input, out_code);
+			}
+			
+			static COTPRESULT parse_code(const char* str, size_t length, uint32_t digits, uint32_t* out_code)
+			{
+				return otp_parse_code(str, length, digits, out_code);
+			}
+			
 			COTPRESULT byte_secret(char* out_str)
 			{
 				return otp_byte_secret(data, out_str);
@@ -47,11 +58,36 @@ namespace COTP
 				return otpuri_build_uri(data, issuer, name, digest, output);
 			}
 			
+			size_t uri_length(const char* issuer, const char* name, const char* digest)
+			{
+				return otpuri_length(data, issuer, name, digest);
+			}
+			
+			size_t write_uri(const char* issuer, const char* name, const char* digest, char* output, size_t capacity)
+			{
+				return otpuri_write(data, issuer, name, digest, output, capacity);
+			}
+			
+			COTPRESULT prepare(OTPKey* key)
+			{
+				return otp_prepare(data, key);
+			}
+			
+			void unprepare(OTPKey* key)
+			{
+				otp_unprepare(data, key);
+			}
+			
 			OTPData* data_struct()
 			{
 				return data;
 			}
 			
+			static COTPRESULT format_code(uint32_t code, uint32_t digits, char* out_str)
+			{
+				return otp_format_code(code, digits, out_str);
+			}
+			
 			static COTPRESULT num_to_bytestring(uint64_t integer, char* out_str)
 			{
 				return otp_num_to_bytestring(integer, out_str);
@@ -63,7 +99,7 @@ namespace COTP
 			}
 			
 	};
-
+	
 	class TOTP
 	{
 		protected:
@@ -95,6 +131,21 @@ namespace COTP
 				return totp_verify(data, key, for_time, valid_window);
 			}
 			
+			COTPRESULT verify_offset(const char* key, uint64_t for_time, int64_t valid_window, int64_t* out_offset)
+			{
+				return totp_verify_offset(data, key, for_time, valid_window, out_offset);
+			}
+			
+			COTPRESULT verify_code(uint32_t code, uint64_t for_time, int64_t valid_window, int64_t* out_offset)
+			{
+				return totp_verify_code(data, code, for_time, valid_window, out_offset);
+			}
+			
+			COTPRESULT verify_drift(OTPDrift* drift, const char* key, uint64_t for_time, int64_t narrow_window, int64_t valid_window)
+			{
+				return totp_verify_drift(data, drift, key, for_time, narrow_window, valid_window);
+			}
+			
 			uint64_t valid_until(uint64_t for_time, int64_t valid_window)
 			{
 				return totp_valid_until(data, for_time, valid_window);
@@ -115,6 +166,26 @@ namespace COTP
 				return otpuri_build_uri(data, issuer, name, digest, output);
 			}
 			
+			size_t uri_length(const char* issuer, const char* name, const char* digest)
+			{
+				return otpuri_length(data, issuer, name, digest);
+			}
+			
+			size_t write_uri(const char* issuer, const char* name, const char* digest, char* output, size_t capacity)
+			{
+				return otpuri_write(data, issuer, name, digest, output, capacity);
+			}
+			
+			COTPRESULT prepare(OTPKey* key)
+			{
+				return otp_prepare(data, key);
+			}
+			
+			void unprepare(OTPKey* key)
+			{
+				otp_unprepare(data, key);
+			}
+			
 			OTPData* data_struct()
 			{
 				return data;
@@ -126,7 +197,7 @@ namespace COTP
 			}
 			
 	};
-
+	
 	class HOTP
 	{
 		protected:
@@ -158,6 +229,21 @@ namespace COTP
 				return hotp_compare(data, key, counter);
 			}
 			
+			COTPRESULT compare_code(uint32_t code, uint64_t counter)
+			{
+				return hotp_compare_code(data, code, counter);
+			}
+			
+			COTPRESULT verify(const char* key, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter)
+			{
+				return hotp_verify(data, key, counter, look_ahead, out_counter);
+			}
+			
+			COTPRESULT resync(const char* key, const char* next_key, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter)
+			{
+				return hotp_resync(data, key, next_key, counter, look_ahead, out_counter);
+			}
+			
 			size_t uri_strlen(const char* issuer, const char* name, const char* digest)
 			{
 				return otpuri_strlen(data, issuer, name, digest);
@@ -168,6 +254,26 @@ namespace COTP
 				return otpuri_build_uri(data, issuer, name, digest, output);
 			}
 			
+			size_t uri_length(const char* issuer, const char* name, const char* digest)
+			{
+				return otpuri_length(data, issuer, name, digest);
+			}
+			
+			size_t write_uri(const char* issuer, const char* name, const char* digest, char* output, size_t capacity)
+			{
+				return otpuri_write(data, issuer, name, digest, output, capacity);
+			}
+			
+			COTPRESULT prepare(OTPKey* key)
+			{
+				return otp_prepare(data, key);
+			}
+			
+			void unprepare(OTPKey* key)
+			{
+				otp_unprepare(data, key);
+			}
+			
 			OTPData* data_struct()
 			{
 				return data;
@@ -182,6 +288,743 @@ namespace COTP
 	
 } // namespace COTP
 
+/*
+	Compile-time specialized OTPs, C++17 and later.
+	
+	The algorithm is a policy and digits and interval are template
+	  arguments, so the whole HMAC inlines into the caller without a
+	  function pointer or an allocation. Every generator owns its
+	  prepared key schedule, moves it and wipes it when destroyed.
+	
+	COTP::Fixed::TOTP<COTP::Fixed::Sha1, 6, 30> totp("JBSWY3DPEHPK3PXP");
+	if (totp.valid())
+		auto code = totp.now(); // std::array<char, 7>, null-terminated
+*/
+#if __cplusplus >= 201703L
+
+#include "otpsha.h"
+#include "otpbase32.h"
+
+#include <array>
+#include <ctime>
+#include <string_view>
+#if __cplusplus >= 202002L
+#	include <span>
+#endif
+
+namespace COTP::Fixed
+{
+	
+	/*
+		Algorithm policies over the engines of otpsha.h, the key
+		  schedule and the digest are words of Word.
+	*/
+	struct Sha1
+	{
+		using Word = uint32_t;
+		static constexpr size_t words = 5;
+		static constexpr const char* name = "SHA1";
+		
+		static void init(const uint8_t* key, size_t length, Word* inner, Word* outer) noexcept
+		{
+			otp_sha1_hmac_init(key, length, inner, outer);
+		}
+		
+		static void hmac(const Word* inner, const Word* outer, uint64_t counter, Word* digest) noexcept
+		{
+			otp_sha1_hmac_counter(inner, outer, counter, digest);
+		}
+	};
+	
+	struct Sha256
+	{
+		using Word = uint32_t;
+		static constexpr size_t words = 8;
+		static constexpr const char* name = "SHA256";
+		
+		static void init(const uint8_t* key, size_t length, Word* inner, Word* outer) noexcept
+		{
+			otp_sha256_hmac_init(key, length, inner, outer);
+		}
+		
+		static void hmac(const Word* inner, const Word* outer, uint64_t counter, Word* digest) noexcept
+		{
+			otp_sha256_hmac_counter(inner, outer, counter, digest);
+		}
+	};
+	
+	struct Sha512
+	{
+		using Word = uint64_t;
+		static constexpr size_t words = 8;
+		static constexpr const char* name = "SHA512";
+		
+		static void init(const uint8_t* key, size_t length, Word* inner, Word* outer) noexcept
+		{
+			otp_sha512_hmac_init(key, length, inner, outer);
+		}
+		
+		static void hmac(const Word* inner, const Word* outer, uint64_t counter, Word* digest) noexcept
+		{
+			otp_sha512_hmac_counter(inner, outer, counter, digest);
+		}
+	};
+	
+	namespace detail
+	{
+		
+		constexpr uint64_t power10(uint32_t digits)
+		{
+			uint64_t power = 1;
+			for (uint32_t i=0; i<digits; i++)
+				power *= 10;
+			return power;
+		}
+		
+		/*
+			Prepared key and code generation shared by TOTP and HOTP.
+		*/
+		template <class Algo, uint32_t Digits>
+		class Generator
+		{
+			static_assert(Digits >= 1 && Digits <= OTP_MAX_DIGITS, "Digits must be 1 to OTP_MAX_DIGITS");
+			
+			protected:
+				using Word = typename Algo::Word;
+				
+				Word inner[Algo::words] = {};
+				Word outer[Algo::words] = {};
+				bool ready = false;
+				
+				Generator() noexcept = default;
+				
+				explicit Generator(std::string_view base32_secret) noexcept
+				{
+					uint8_t key[OTP_KEY_MAX_LENGTH];
+					size_t length = 0;
+					if (otp_base32_decode(base32_secret.data(), base32_secret.size(), key, sizeof(key), &length) == OTP_OK)
+						prepare(key, length);
+					otp_sha_wipe(key, sizeof(key));
+				}
+				
+				Generator(const uint8_t* key, size_t length) noexcept
+				{
+					if (key != nullptr && length <= OTP_KEY_MAX_LENGTH)
+						prepare(key, length);
+				}
+				
+				Generator(Generator&& other) noexcept
+				{
+					take(other);
+				}
+				
+				Generator& operator=(Generator&& other) noexcept
+				{
+					if (this != &other)
+						take(other);
+					return *this;
+				}
+				
+				Generator(const Generator&) = delete;
+				Generator& operator=(const Generator&) = delete;
+				
+				~Generator()
+				{
+					wipe();
+				}
+				
+			private:
+				void prepare(const uint8_t* key, size_t length) noexcept
+				{
+					if (length == 0)
+						return;
+					Algo::init(key, length, inner, outer);
+					ready = true;
+				}
+				
+				void take(Generator& other) noexcept
+				{
+					memcpy(inner, other.inner, sizeof(inner));
+					memcpy(outer, other.outer, sizeof(outer));
+					ready = other.ready;
+					other.wipe();
+				}
+				
+				void wipe() noexcept
+				{
+					otp_sha_wipe(inner, sizeof(inner));
+					otp_sha_wipe(outer, sizeof(outer));
+					ready = false;
+				}
+				
+			public:
+				static constexpr uint32_t digits = Digits;
+				
+				/*
+					A formatted code, Digits characters and a null terminator.
+				*/
+				using Code = std::array<char, Digits + 1>;
+				
+				bool valid() const noexcept
+				{
+					return ready;
+				}
+				
+				explicit operator bool() const noexcept
+				{
+					return ready;
+				}
+				
+				/*
+					Computes the code of a counter, 0 when the key isn't valid.
+				*/
+				uint32_t generate_code(uint64_t counter) const noexcept
+				{
+					if (!ready)
+						return 0;
+					
+					Word digest[Algo::words];
+					Algo::hmac(inner, outer, counter, digest);
+					
+					// Dynamic truncation over the big-endian digest bytes
+					constexpr size_t bytes = sizeof(Word);
+					auto byte = [&digest](size_t i) {
+						return (uint32_t) (uint8_t) (digest[i / bytes] >> ((bytes - 1 - i % bytes) * 8));
+					};
+					size_t offset = (size_t) (digest[Algo::words - 1] & 0xF);
+					uint32_t code = ((byte(offset) & 0x7F) << 24) | (byte(offset + 1) << 16) | (byte(offset + 2) << 8) | byte(offset + 3);
+					
+					// 10 digits hold every 31-bit code already
+					if constexpr (Digits < 10)
+						code %= (uint32_t) power10(Digits);
+					return code;
+				}
+				
+				static Code format(uint32_t code) noexcept
+				{
+					Code out;
+					for (uint32_t i=Digits; i>0; i--)
+					{
+						out[i - 1] = (char) ('0' + code % 10);
+						code /= 10;
+					}
+					out[Digits] = '\0';
+					return out;
+				}
+				
+#if __cplusplus >= 202002L
+				static void format(uint32_t code, std::span<char, Digits> out) noexcept
+				{
+					for (uint32_t i=Digits; i>0; i--)
+					{
+						out[i - 1] = (char) ('0' + code % 10);
+						code /= 10;
+					}
+				}
+#endif
+				
+				static COTPRESULT parse(std::string_view str, uint32_t* out_code) noexcept
+				{
+					return otp_parse_code(str.data(), str.size(), Digits, out_code);
+				}
+				
+		};
+		
+	} // namespace detail
+	
+	template <class Algo, uint32_t Digits, uint32_t Interval>
+	class TOTP : public detail::Generator<Algo, Digits>
+	{
+		static_assert(Interval > 0, "Interval must be positive");
+		
+		using Base = detail::Generator<Algo, Digits>;
+		
+		public:
+			using typename Base::Code;
+			static constexpr uint32_t interval = Interval;
+			
+			TOTP() noexcept = default;
+			explicit TOTP(std::string_view base32_secret) noexcept : Base(base32_secret) {}
+			TOTP(const uint8_t* key, size_t length) noexcept : Base(key, length) {}
+			
+			static constexpr uint64_t timecode(uint64_t for_time) noexcept
+			{
+				return for_time / Interval;
+			}
+			
+			static constexpr uint64_t valid_until(uint64_t for_time, int64_t valid_window) noexcept
+			{
+				return for_time + (uint64_t) Interval * (uint64_t) valid_window;
+			}
+			
+			uint32_t code_at(uint64_t for_time, int64_t offset = 0) const noexcept
+			{
+				return this->generate_code(timecode(for_time) + (uint64_t) offset);
+			}
+			
+			Code at(uint64_t for_time, int64_t offset = 0) const noexcept
+			{
+				return Base::format(code_at(for_time, offset));
+			}
+			
+#if __cplusplus >= 202002L
+			void at(uint64_t for_time, int64_t offset, std::span<char, Digits> out) const noexcept
+			{
+				Base::format(code_at(for_time, offset), out);
+			}
+#endif
+			
+			Code now() const noexcept
+			{
+				return at((uint64_t) std::time(nullptr));
+			}
+			
+			/*
+				Checks code against every interval within valid_window of
+				  for_time, the matched offset closest to for_time goes to
+				  out_offset. Runs in the same time wherever code matches.
+				  valid_window is at most OTP_MAX_LOOK_AHEAD.
+			*/
+			COTPRESULT verify_code(uint32_t code, uint64_t for_time, int64_t valid_window, int64_t* out_offset = nullptr) const noexcept
+			{
+				if (!this->ready || valid_window < 0 || (uint64_t) valid_window > OTP_MAX_LOOK_AHEAD)
+					return OTP_ERROR;
+				
+				uint64_t base = timecode(for_time);
+				uint64_t matched = 0;
+				uint64_t distance = INT64_MAX;
+				int64_t found = 0;
+				for (int64_t offset=-valid_window; offset<=valid_window; offset++)
+				{
+					uint64_t away = (uint64_t) (offset < 0 ? -offset : offset);
+					uint64_t equal = ((uint64_t) (this->generate_code(base + (uint64_t) offset) ^ code) - 1) >> 63;
+					uint64_t closer = (away - distance) >> 63;
+					uint64_t mask = (uint64_t) 0 - (equal & closer);
+					
+					found = (int64_t) (((uint64_t) found & ~mask) | ((uint64_t) offset & mask));
+					distance = (distance & ~mask) | (away & mask);
+					matched |= equal;
+				}
+				
+				if (!matched)
+					return OTP_ERROR;
+				if (out_offset != nullptr)
+					*out_offset = found;
+				return OTP_OK;
+			}
+			
+			COTPRESULT verify(std::string_view key, uint64_t for_time, int64_t valid_window, int64_t* out_offset = nullptr) const noexcept
+			{
+				uint32_t code;
+				if (Base::parse(key, &code) != OTP_OK)
+					return OTP_ERROR;
+				return verify_code(code, for_time, valid_window, out_offset);
+			}
+			
+	};
+	
+	template <class Algo, uint32_t Digits>
+	class HOTP : public detail::Generator<Algo, Digits>
+	{
+		using Base = detail::Generator<Algo, Digits>;
+		
+		public:
+			using typename Base::Code;
+			
+			HOTP() noexcept = default;
+			explicit HOTP(std::string_view base32_secret) noexcept : Base(base32_secret) {}
+			HOTP(const uint8_t* key, size_t length) noexcept : Base(key, length) {}
+			
+			Code at(uint64_t counter) const noexcept
+			{
+				return Base::format(this->generate_code(counter));
+			}
+			
+#if __cplusplus >= 202002L
+			void at(uint64_t counter, std::span<char, Digits> out) const noexcept
+			{
+				Base::format(this->generate_code(counter), out);
+			}
+#endif
+			
+			COTPRESULT compare_code(uint32_t code, uint64_t counter) const noexcept
+			{
+				if (!this->ready)
+					return OTP_ERROR;
+				return ((((uint64_t) (this->generate_code(counter) ^ code) - 1) >> 63) != 0) ? OTP_OK : OTP_ERROR;
+			}
+			
+			COTPRESULT compare(std::string_view key, uint64_t counter) const noexcept
+			{
+				uint32_t code;
+				if (Base::parse(key, &code) != OTP_OK)
+					return OTP_ERROR;
+				return compare_code(code, counter);
+			}
+			
+			/*
+				Checks code against counter to counter + look_ahead, the
+				  first matching counter goes to out_counter. Runs in the
+				  same time wherever code matches. look_ahead is at most
+				  OTP_MAX_LOOK_AHEAD.
+			*/
+			COTPRESULT verify_code(uint32_t code, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter = nullptr) const noexcept
+			{
+				if (!this->ready || look_ahead > OTP_MAX_LOOK_AHEAD)
+					return OTP_ERROR;
+				
+				uint64_t matched = 0;
+				uint64_t found = 0;
+				for (uint64_t i=0; i<=look_ahead; i++)
+				{
+					uint64_t equal = ((uint64_t) (this->generate_code(counter + i) ^ code) - 1) >> 63;
+					uint64_t mask = (uint64_t) 0 - (equal & ~matched);
+					found = (found & ~mask) | ((counter + i) & mask);
+					matched |= equal;
+				}
+				
+				if (!matched)
+					return OTP_ERROR;
+				if (out_counter != nullptr)
+					*out_counter = found;
+				return OTP_OK;
+			}
+			
+			COTPRESULT verify(std::string_view key, uint64_t counter, uint64_t look_ahead, uint64_t* out_counter = nullptr) const noexcept
+			{
+				uint32_t code;
+				if (Base::parse(key, &code) != OTP_OK)
+					return OTP_ERROR;
+				return verify_code(code, counter, look_ahead, out_counter);
+			}
+			
+	};
+	
+} // namespace COTP::Fixed
+
+#endif // __cplusplus >= 201703L
+
+/*
+	Awaitable generation and verification, C++20 and later.
+	
+	An Executor owns a dispatcher thread, and an OTPPool when given
+	  more than one thread. Awaiting verify() or generate() queues the
+	  request and suspends the coroutine. The dispatcher takes every
+	  request queued since its last run as one batch, runs it through
+	  totp_verify_batch() or otp_generate_batch() so concurrent
+	  awaiters share SIMD lanes, then resumes them.
+	
+	Coroutines resume on the dispatcher thread unless the executor is
+	  given a resume function, e.g. one posting the handle back to an
+	  event loop. Requests are read from the dispatcher, OTPData and
+	  OTPKey must stay unchanged until their awaiter resumes.
+	
+	COTP::Async::Executor executor(4);
+	auto verified = co_await executor.verify(totp.data_struct(), "123456", now, 1);
+	if (verified.result == OTP_OK)
+		...
+*/
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include "otpbatch.h"
+#include "otppool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace COTP::Async
+{
+	
+	struct VerifyResult
+	{
+		COTPRESULT result;
+		int64_t offset; // Matched timeblock offset
+	};
+	
+	struct GenerateResult
+	{
+		COTPRESULT result;
+		uint32_t code;
+	};
+	
+	class Executor
+	{
+		public:
+			/*
+				Awaitable of one TOTP verification.
+			*/
+			class VerifyAwaiter
+			{
+				friend class Executor;
+				
+				Executor& executor;
+				OTPData* data;
+				uint32_t code;
+				uint64_t for_time;
+				int64_t valid_window;
+				bool parsed;
+				VerifyResult result = { OTP_ERROR, 0 };
+				std::coroutine_handle<> handle;
+				
+				public:
+					VerifyAwaiter(Executor& executor, OTPData* data, uint32_t code, bool parsed, uint64_t for_time, int64_t valid_window) noexcept
+						: executor(executor), data(data), code(code), for_time(for_time), valid_window(valid_window), parsed(parsed) {}
+					
+					// Requests that can't succeed complete without suspending
+					bool await_ready() const noexcept
+					{
+						return !parsed || data == nullptr || valid_window < 0;
+					}
+					
+					void await_suspend(std::coroutine_handle<> awaiting)
+					{
+						handle = awaiting;
+						executor.submit(this);
+					}
+					
+					VerifyResult await_resume() const noexcept
+					{
+						return result;
+					}
+			};
+			
+			/*
+				Awaitable of one code, key prepared by otp_prepare() for hmac.
+			*/
+			class GenerateAwaiter
+			{
+				friend class Executor;
+				
+				Executor& executor;
+				const OTPAlgo* hmac;
+				const OTPKey* key;
+				uint64_t counter;
+				uint32_t digits;
+				GenerateResult result = { OTP_ERROR, 0 };
+				std::coroutine_handle<> handle;
+				
+				public:
+					GenerateAwaiter(Executor& executor, const OTPAlgo* hmac, const OTPKey* key, uint64_t counter, uint32_t digits) noexcept
+						: executor(executor), hmac(hmac), key(key), counter(counter), digits(digits) {}
+					
+					bool await_ready() const noexcept
+					{
+						// A key without a schedule would fail the batch of every other caller
+						return hmac == nullptr || key == nullptr || !key->scheduled || digits == 0 || digits > OTP_MAX_DIGITS;
+					}
+					
+					void await_suspend(std::coroutine_handle<> awaiting)
+					{
+						handle = awaiting;
+						executor.submit(this);
+					}
+					
+					GenerateResult await_resume() const noexcept
+					{
+						return result;
+					}
+			};
+			
+			using Resume = std::function<void(std::coroutine_handle<>)>;
+			
+		private:
+			std::mutex mutex;
+			std::condition_variable wake;
+			std::vector<VerifyAwaiter*> pending_verify;
+			std::vector<GenerateAwaiter*> pending_generate;
+			bool stopping = false;
+			
+			OTPPool pool;
+			bool pooled = false;
+			Resume resume;
+			std::thread dispatcher;
+			
+			void submit(VerifyAwaiter* awaiter)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					pending_verify.push_back(awaiter);
+				}
+				wake.notify_one();
+			}
+			
+			void submit(GenerateAwaiter* awaiter)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					pending_generate.push_back(awaiter);
+				}
+				wake.notify_one();
+			}
+			
+			void run_verify(const std::vector<VerifyAwaiter*>& batch)
+			{
+				size_t count = batch.size();
+				std::vector<OTPData*> datas(count);
+				std::vector<uint32_t> codes(count);
+				std::vector<uint64_t> for_times(count);
+				std::vector<int64_t> windows(count);
+				std::vector<uint8_t> results(count);
+				std::vector<int64_t> offsets(count);
+				
+				for (size_t i=0; i<count; i++)
+				{
+					datas[i] = batch[i]->data;
+					codes[i] = batch[i]->code;
+					for_times[i] = batch[i]->for_time;
+					windows[i] = batch[i]->valid_window;
+				}
+				
+				COTPRESULT res = pooled
+					? otp_pool_verify_batch(&pool, datas.data(), codes.data(), for_times.data(), windows.data(), count, results.data(), offsets.data())
+					: totp_verify_batch(datas.data(), codes.data(), for_times.data(), windows.data(), count, results.data(), offsets.data());
+				
+				for (size_t i=0; i<count; i++)
+				{
+					bool verified = res == OTP_OK && results[i];
+					batch[i]->result = { verified ? OTP_OK : OTP_ERROR, verified ? offsets[i] : 0 };
+				}
+			}
+			
+			void run_generate(std::vector<GenerateAwaiter*>& batch)
+			{
+				// otp_generate_batch takes one hmac and digits per call
+				std::sort(batch.begin(), batch.end(), [](const GenerateAwaiter* a, const GenerateAwaiter* b) {
+					return a->hmac != b->hmac ? std::less<const OTPAlgo*>()(a->hmac, b->hmac) : a->digits < b->digits;
+				});
+				
+				std::vector<const OTPKey*> keys;
+				std::vector<uint64_t> counters;
+				std::vector<uint32_t> codes;
+				for (size_t first=0; first<batch.size(); )
+				{
+					size_t last = first + 1;
+					while (last < batch.size() && batch[last]->hmac == batch[first]->hmac && batch[last]->digits == batch[first]->digits)
+						last++;
+					
+					size_t count = last - first;
+					keys.resize(count);
+					counters.resize(count);
+					codes.resize(count);
+					for (size_t i=0; i<count; i++)
+					{
+						keys[i] = batch[first + i]->key;
+						counters[i] = batch[first + i]->counter;
+					}
+					
+					const OTPAlgo* hmac = batch[first]->hmac;
+					uint32_t digits = batch[first]->digits;
+					COTPRESULT res = pooled
+						? otp_pool_generate_batch(&pool, hmac, keys.data(), counters.data(), count, digits, codes.data())
+						: otp_generate_batch(hmac, keys.data(), counters.data(), count, digits, codes.data());
+					
+					for (size_t i=0; i<count; i++)
+						batch[first + i]->result = { res, res == OTP_OK ? codes[i] : 0 };
+					first = last;
+				}
+			}
+			
+			void run()
+			{
+				std::vector<VerifyAwaiter*> verifies;
+				std::vector<GenerateAwaiter*> generates;
+				
+				for (;;)
+				{
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						wake.wait(lock, [this] { return stopping || !pending_verify.empty() || !pending_generate.empty(); });
+						if (pending_verify.empty() && pending_generate.empty())
+							return;
+						verifies.swap(pending_verify);
+						generates.swap(pending_generate);
+					}
+					
+					if (!verifies.empty())
+						run_verify(verifies);
+					if (!generates.empty())
+						run_generate(generates);
+					
+					// Resumed coroutines may queue again, the lock isn't held
+					for (VerifyAwaiter* awaiter : verifies)
+						resume_handle(awaiter->handle);
+					for (GenerateAwaiter* awaiter : generates)
+						resume_handle(awaiter->handle);
+					verifies.clear();
+					generates.clear();
+				}
+			}
+			
+			void resume_handle(std::coroutine_handle<> handle)
+			{
+				if (resume)
+					resume(handle);
+				else
+					handle.resume();
+			}
+			
+		public:
+			/*
+				threads above 1 runs the batches on an OTPPool of that
+				  many workers, 0 uses one worker per online CPU.
+				resume is optional, receives every handle to resume
+				  instead of resuming it on the dispatcher thread.
+			*/
+			explicit Executor(uint32_t threads = 1, Resume resume = nullptr) : resume(std::move(resume))
+			{
+				if (threads != 1)
+					pooled = otp_pool_new(&pool, threads, nullptr) != nullptr;
+				dispatcher = std::thread([this] { run(); });
+			}
+			
+			Executor(const Executor&) = delete;
+			Executor& operator=(const Executor&) = delete;
+			
+			/*
+				Runs and resumes the requests still queued, then stops.
+			*/
+			~Executor()
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					stopping = true;
+				}
+				wake.notify_one();
+				dispatcher.join();
+				
+				if (pooled)
+					otp_pool_free(&pool);
+			}
+			
+			VerifyAwaiter verify(OTPData* data, uint32_t code, uint64_t for_time, int64_t valid_window) noexcept
+			{
+				return VerifyAwaiter(*this, data, code, true, for_time, valid_window);
+			}
+			
+			// The key is parsed on the calling thread, a malformed one never suspends
+			VerifyAwaiter verify(OTPData* data, std::string_view key, uint64_t for_time, int64_t valid_window) noexcept
+			{
+				uint32_t code = 0;
+				bool parsed = data != nullptr && otp_parse_code(key.data(), key.size(), data->digits, &code) == OTP_OK;
+				return VerifyAwaiter(*this, data, code, parsed, for_time, valid_window);
+			}
+			
+			GenerateAwaiter generate(const OTPAlgo* hmac, const OTPKey* key, uint64_t counter, uint32_t digits) noexcept
+			{
+				return GenerateAwaiter(*this, hmac, key, counter, digits);
+			}
+			
+	};
+	
+} // namespace COTP::Async
+
+#endif // __cplusplus >= 202002L
+
 #else
 #	error "cotp.hpp is a C++ header. __cplusplus not defined."
 #endif
@@ -0,0 +1,357 @@
+#include "otpbase32.h"
+#include "otpbatch.h"
+
+#include <string.h>
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define OTP_BASE32_X86 1
+	// 256-bit locals aren't reliably aligned on MinGW, see otpbatch.c
+#	if !defined(_WIN32)
+#		define OTP_BASE32_WIDE 1
+#	endif
+#endif
+
+/*
+	Characters mapped per call of the vector kernels.
+*/
+#define OTP_BASE32_CHUNK 256
+
+/*
+	Maps one character to its 5-bit value, sets bit 7 of the
+	  result when it isn't in the alphabet.
+*/
+static inline uint8_t otp_base32_value(uint8_t c)
+{
+	uint8_t upper = c & (uint8_t) ~0x20;
+	uint8_t letter = (uint8_t) (upper - 'A');
+	uint8_t digit = (uint8_t) (c - '2');
+	
+	if (letter < 26)
+		return letter;
+	if (digit < 6)
+		return (uint8_t) (digit + 26);
+	return 0x80;
+}
+
+static uint8_t otp_base32_map_scalar(const uint8_t* in, size_t length, uint8_t* values)
+{
+	uint8_t invalid = 0;
+	for (size_t i=0; i<length; i++)
+	{
+		values[i] = otp_base32_value(in[i]);
+		invalid |= values[i];
+	}
+	return invalid & 0x80;
+}
+
+/*
+	Reads 5 bytes as a big endian 40-bit value.
+*/
+static inline uint64_t otp_base32_load(const uint8_t* in)
+{
+	return ((uint64_t) in[0] << 32) | ((uint64_t) in[1] << 24) | ((uint64_t) in[2] << 16) | ((uint64_t) in[3] << 8) | in[4];
+}
+
+static void otp_base32_encode_scalar(const uint8_t* in, size_t blocks, char* out)
+{
+	for (size_t i=0; i<blocks; i++)
+	{
+		uint64_t x = otp_base32_load(in + i * 5);
+		for (int j=0; j<8; j++)
+			out[i * 8 + j] = OTP_DEFAULT_BASE32_CHARS[(x >> (35 - j * 5)) & 31];
+	}
+}
+
+/*
+	Vector kernels, length is a multiple of the vector size and
+	  blocks a multiple of the vector size over 8.
+	
+	The encoder spreads each block of 40 bits to one 5-bit value
+	  per byte of a 64-bit lane, the reverse of otp_base32_pack().
+*/
+#define OTP_BASE32_KERNEL(suffix, isa, bytes) \
+	typedef uint8_t otp_base32_vec_##suffix __attribute__((vector_size(bytes))); \
+	__attribute__((target(isa))) static uint8_t otp_base32_map_##suffix(const uint8_t* in, size_t length, uint8_t* values) \
+	{ \
+		otp_base32_vec_##suffix invalid = { 0 }; \
+		for (size_t i=0; i<length; i+=bytes) \
+		{ \
+			otp_base32_vec_##suffix c; \
+			memcpy(&c, in + i, bytes); \
+			otp_base32_vec_##suffix letter = (c & (uint8_t) ~0x20) - (uint8_t) 'A'; \
+			otp_base32_vec_##suffix digit = c - (uint8_t) '2'; \
+			otp_base32_vec_##suffix is_letter = (otp_base32_vec_##suffix) (letter < 26); \
+			otp_base32_vec_##suffix is_digit = (otp_base32_vec_##suffix) (digit < 6); \
+			otp_base32_vec_##suffix value = (letter & is_letter) | ((digit + 26) & is_digit & ~is_letter); \
+			invalid |= ~(is_letter | is_digit); \
+			memcpy(values + i, &value, bytes); \
+		} \
+		uint8_t any = 0; \
+		for (int j=0; j<bytes; j++) \
+			any |= invalid[j]; \
+		return any & 0x80; \
+	} \
+	typedef uint64_t otp_base32_lanes_##suffix __attribute__((vector_size(bytes))); \
+	__attribute__((target(isa))) static void otp_base32_encode_##suffix(const uint8_t* in, size_t blocks, char* out) \
+	{ \
+		otp_base32_vec_##suffix reverse; \
+		for (int j=0; j<bytes; j++) \
+			reverse[j] = (uint8_t) ((j & ~7) | (7 - (j & 7))); \
+		for (size_t i=0; i<blocks; i+=bytes/8) \
+		{ \
+			otp_base32_lanes_##suffix x; \
+			for (int j=0; j<bytes/8; j++) \
+				x[j] = otp_base32_load(in + (i + j) * 5); \
+			x = ((x & 0x000000FFFFF00000ULL) << 12) | (x & 0x00000000000FFFFFULL); \
+			x = ((x & 0x000FFC00000FFC00ULL) << 6) | (x & 0x000003FF000003FFULL); \
+			x = ((x & 0x03E003E003E003E0ULL) << 3) | (x & 0x001F001F001F001FULL); \
+			otp_base32_vec_##suffix value = __builtin_shuffle((otp_base32_vec_##suffix) x, reverse); \
+			otp_base32_vec_##suffix is_digit = (otp_base32_vec_##suffix) (value >= 26); \
+			value += (uint8_t) 'A' + (is_digit & (uint8_t) ('2' - 'A' - 26)); \
+			memcpy(out + i * 8, &value, bytes); \
+		} \
+	}
+
+#if defined(OTP_BASE32_X86)
+OTP_BASE32_KERNEL(sse4, "sse4.1", 16)
+#	if defined(OTP_BASE32_WIDE)
+OTP_BASE32_KERNEL(avx2, "avx2", 32)
+#	endif
+#endif
+
+#undef OTP_BASE32_KERNEL
+
+/*
+	Maps length characters to values, returns non-zero when
+	  any of them isn't in the alphabet.
+*/
+static uint8_t otp_base32_map(const uint8_t* in, size_t length, uint8_t* values, OTPSimd level)
+{
+	size_t done = 0;
+	uint8_t invalid = 0;
+	
+#if defined(OTP_BASE32_WIDE)
+	if (level >= OTP_SIMD_AVX2)
+	{
+		size_t wide = length & ~(size_t) 31;
+		invalid |= otp_base32_map_avx2(in, wide, values);
+		done = wide;
+	}
+#endif
+#if defined(OTP_BASE32_X86)
+	if (level >= OTP_SIMD_SSE4)
+	{
+		size_t wide = done + ((length - done) & ~(size_t) 15);
+		invalid |= otp_base32_map_sse4(in + done, wide - done, values + done);
+		done = wide;
+	}
+#endif
+	(void) level;
+	
+	return invalid | otp_base32_map_scalar(in + done, length - done, values + done);
+}
+
+/*
+	Encodes whole blocks of 5 bytes to 8 characters each.
+*/
+static void otp_base32_encode_blocks(const uint8_t* in, size_t blocks, char* out, OTPSimd level)
+{
+	size_t done = 0;
+	
+#if defined(OTP_BASE32_WIDE)
+	if (level >= OTP_SIMD_AVX2)
+	{
+		size_t wide = blocks & ~(size_t) 3;
+		otp_base32_encode_avx2(in, wide, out);
+		done = wide;
+	}
+#endif
+#if defined(OTP_BASE32_X86)
+	if (level >= OTP_SIMD_SSE4)
+	{
+		size_t wide = done + ((blocks - done) & ~(size_t) 1);
+		otp_base32_encode_sse4(in + done * 5, wide - done, out + done * 8);
+		done = wide;
+	}
+#endif
+	(void) level;
+	
+	otp_base32_encode_scalar(in + done * 5, blocks - done, out + done * 8);
+}
+
+/*
+	Packs 8 5-bit values into 5 bytes, no branches or loops.
+*/
+static inline void otp_base32_pack(const uint8_t* values, uint8_t* out, size_t out_bytes)
+{
+	uint64_t x = 0;
+	for (int i=0; i<8; i++)
+		x = (x << 8) | values[i];
+	
+	// Merge neighbours, 5+5 bits per 16, 10+10 per 32, 20+20 per 64
+	x = ((x & 0x1F001F001F001F00ULL) >> 3) | (x & 0x001F001F001F001FULL);
+	x = ((x & 0x03FF000003FF0000ULL) >> 6) | (x & 0x000003FF000003FFULL);
+	x = ((x & 0x000FFFFF00000000ULL) >> 12) | (x & 0x00000000000FFFFFULL);
+	
+	for (size_t i=0; i<out_bytes; i++)
+		out[i] = (uint8_t) (x >> (32 - i * 8));
+}
+
+/*
+	Strips the padding off in and checks its length.
+	
+	Returns
+			1 success, out_data_length is the amount of data characters
+		error, 0
+*/
+static COTPRESULT otp_base32_data_length(const char* in, size_t in_length, size_t* out_data_length)
+{
+	size_t length = in_length;
+	while (length > 0 && in[length - 1] == '=')
+		length--;
+	
+	size_t padding = in_length - length;
+	size_t partial = length % 8;
+	
+	// A partial block of 1, 3 or 6 characters can't come from whole bytes
+	if (partial == 1 || partial == 3 || partial == 6)
+		return OTP_ERROR;
+	if (padding > 0 && (in_length % 8 != 0 || padding >= 8))
+		return OTP_ERROR;
+	
+	*out_data_length = length;
+	return OTP_OK;
+}
+
+/*
+	Returns the amount of bytes in decodes to, 0 when in isn't
+	  a well formed length of base32.
+*/
+size_t otp_base32_decoded_length(const char* in, size_t in_length)
+{
+	size_t length;
+	if (in == NULL || otp_base32_data_length(in, in_length, &length) != OTP_OK)
+		return 0;
+	
+	return length * 5 / 8;
+}
+
+/*
+	Decodes base32 into caller allocated bytes.
+	
+	in is the base32 input, it doesn't need to be null-terminated
+	out_capacity is the size of out, otp_base32_decoded_length() is enough
+	out_length is optional, receives the amount of bytes written
+	
+	Characters outside the alphabet, including '=' anywhere but at
+	  the end, fail the whole input. Nothing is skipped.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_base32_decode(const char* in, size_t in_length, uint8_t* out, size_t out_capacity, size_t* out_length)
+{
+	size_t length;
+	if (in == NULL || (out == NULL && in_length > 0) || otp_base32_data_length(in, in_length, &length) != OTP_OK)
+		return OTP_ERROR;
+	
+	size_t decoded = length * 5 / 8;
+	if (decoded > out_capacity)
+		return OTP_ERROR;
+	
+	OTPSimd level = length >= 16 ? otp_simd_active() : OTP_SIMD_SCALAR;
+	uint8_t values[OTP_BASE32_CHUNK];
+	uint8_t invalid = 0;
+	size_t written = 0;
+	
+	for (size_t start=0; start<length; start+=OTP_BASE32_CHUNK)
+	{
+		size_t count = length - start < OTP_BASE32_CHUNK ? length - start : OTP_BASE32_CHUNK;
+		invalid |= otp_base32_map((const uint8_t*) in + start, count, values, level);
+		
+		// Chunks are multiples of 8, only the last one has a partial block
+		for (size_t i=0; i<count; i+=8)
+		{
+			if (count - i < 8)
+				memset(values + count, 0, 8 - (count - i));
+			
+			size_t bytes = decoded - written < 5 ? decoded - written : 5;
+			otp_base32_pack(values + i, out + written, bytes);
+			written += bytes;
+		}
+	}
+	
+	memset(values, 0, sizeof(values));
+	
+	if (invalid)
+	{
+		memset(out, 0, decoded);
+		return OTP_ERROR;
+	}
+	
+	if (out_length != NULL)
+		*out_length = decoded;
+	
+	return OTP_OK;
+}
+
+/*
+	Returns the amount of characters length bytes encode to,
+	  not counting the null terminator.
+	
+	pad is non-zero to count '=' padding up to a multiple of 8
+*/
+size_t otp_base32_encoded_length(size_t length, int pad)
+{
+	return pad ? (length + 4) / 5 * 8 : (length * 8 + 4) / 5;
+}
+
+/*
+	Encodes bytes to null-terminated base32 in a caller buffer.
+	
+	out_capacity is the size of out, at least
+	  otp_base32_encoded_length() + 1
+	pad is non-zero to pad the output with '=' to a multiple of 8
+	out_length is optional, receives the amount of characters
+	  written without the null terminator
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_base32_encode(const uint8_t* in, size_t in_length, char* out, size_t out_capacity, int pad, size_t* out_length)
+{
+	if ((in == NULL && in_length > 0) || out == NULL || in_length > SIZE_MAX / 8)
+		return OTP_ERROR;
+	
+	size_t encoded = otp_base32_encoded_length(in_length, pad);
+	if (encoded >= out_capacity)
+		return OTP_ERROR;
+	
+	size_t blocks = in_length / 5;
+	otp_base32_encode_blocks(in, blocks, out, blocks >= 2 ? otp_simd_active() : OTP_SIMD_SCALAR);
+	
+	size_t rest = in_length - blocks * 5;
+	size_t written = blocks * 8;
+	if (rest > 0)
+	{
+		uint8_t last[5] = { 0 };
+		char chars[8];
+		memcpy(last, in + blocks * 5, rest);
+		otp_base32_encode_scalar(last, 1, chars);
+		
+		size_t count = (rest * 8 + 4) / 5;
+		memcpy(out + written, chars, count);
+		written += count;
+	}
+	while (written < encoded)
+		out[written++] = '=';
+	out[written] = '\0';
+	
+	if (out_length != NULL)
+		*out_length = written;
+	
+	return OTP_OK;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "cotp.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Base32 functions, RFC 4648 alphabet, case insensitive.
+	
+	Decoder input may be padded with '=' to a multiple of 8 characters
+	  or not padded at all. Long inputs are mapped and validated, or
+	  encoded, 16 or 32 characters at a time with SSE4 or AVX2,
+	  following otp_simd_select().
+*/
+size_t otp_base32_decoded_length(const char* in, size_t in_length);
+COTPRESULT otp_base32_decode(const char* in, size_t in_length, uint8_t* out, size_t out_capacity, size_t* out_length);
+size_t otp_base32_encoded_length(size_t length, int pad);
+COTPRESULT otp_base32_encode(const uint8_t* in, size_t in_length, char* out, size_t out_capacity, int pad, size_t* out_length);
+
+#if defined(__cplusplus)
+}
+#endif
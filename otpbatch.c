@@ -0,0 +1,482 @@
+#include "otpbatch.h"
+#include "otphmac.h"
+#include "otpsha.h"
+
+#include <string.h>
+#include <stdatomic.h>
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define OTP_BATCH_X86 1
+// MinGW does not align the stack for spilled 32 and 64 byte vectors
+#	if !defined(_WIN32)
+#		define OTP_BATCH_WIDE 1
+#	endif
+#endif
+
+#if defined(OTP_BATCH_X86)
+
+#	define OTP_LANES 4
+#	define OTP_TARGET __attribute__((target("sse4.1")))
+#	define OTP_KERNEL(name) name##_sse4
+#	include "otpbatch_kernel.h"
+#	undef OTP_LANES
+#	undef OTP_TARGET
+#	undef OTP_KERNEL
+
+#	if defined(OTP_BATCH_WIDE)
+
+#		define OTP_LANES 8
+#		define OTP_TARGET __attribute__((target("avx2")))
+#		define OTP_KERNEL(name) name##_avx2
+#		include "otpbatch_kernel.h"
+#		undef OTP_LANES
+#		undef OTP_TARGET
+#		undef OTP_KERNEL
+
+#		define OTP_LANES 16
+#		define OTP_TARGET __attribute__((target("avx512f")))
+#		define OTP_KERNEL(name) name##_avx512
+#		include "otpbatch_kernel.h"
+#		undef OTP_LANES
+#		undef OTP_TARGET
+#		undef OTP_KERNEL
+
+#	endif
+
+#endif
+
+
+typedef void (*otp_lanes_kernel)(const OTPKey* const* keys, const uint64_t* counters, uint32_t digits, uint32_t* out_codes);
+
+typedef struct otp_batch_kernels
+{
+	size_t lanes;
+	otp_lanes_kernel sha1;
+	otp_lanes_kernel sha256;
+} otp_batch_kernels;
+
+static const otp_batch_kernels OTP_BATCH_KERNELS[] = {
+	{ 1, NULL, NULL }, // OTP_SIMD_AUTO, resolved before use
+	{ 1, NULL, NULL }, // OTP_SIMD_SCALAR
+#if defined(OTP_BATCH_X86)
+	{ 4, otp_sha1_kernel_sse4, otp_sha256_kernel_sse4 },
+#else
+	{ 1, NULL, NULL },
+#endif
+#if defined(OTP_BATCH_WIDE)
+	{ 8, otp_sha1_kernel_avx2, otp_sha256_kernel_avx2 },
+	{ 16, otp_sha1_kernel_avx512, otp_sha256_kernel_avx512 },
+#else
+	{ 1, NULL, NULL },
+	{ 1, NULL, NULL },
+#endif
+};
+
+static _Atomic int otp_simd_level = OTP_SIMD_AUTO;
+
+/*
+	Returns
+			the widest instruction set both built in and supported by the CPU
+*/
+static OTPSimd otp_simd_detect(void)
+{
+#if defined(OTP_BATCH_X86)
+	__builtin_cpu_init();
+#	if defined(OTP_BATCH_WIDE)
+	if (__builtin_cpu_supports("avx512f"))
+		return OTP_SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return OTP_SIMD_AVX2;
+#	endif
+	if (__builtin_cpu_supports("sse4.1"))
+		return OTP_SIMD_SSE4;
+#endif
+	return OTP_SIMD_SCALAR;
+}
+
+/*
+	Selects the instruction set used by the batch functions.
+	
+	OTP_SIMD_AUTO picks the widest one the CPU supports, any other
+	  level is lowered to the widest supported one at or below it.
+	
+	Returns
+			the level now in effect
+*/
+OTPSimd otp_simd_select(OTPSimd level)
+{
+	OTPSimd best = otp_simd_detect();
+	if (level == OTP_SIMD_AUTO || level > best)
+		level = best;
+	
+	atomic_store(&otp_simd_level, (int) level);
+	
+	return level;
+}
+
+/*
+	Returns the level in effect, detecting it on first use.
+*/
+static OTPSimd otp_simd_current(void)
+{
+	int level = atomic_load(&otp_simd_level);
+	if (level == OTP_SIMD_AUTO)
+		return otp_simd_select(OTP_SIMD_AUTO);
+	
+	return (OTPSimd) level;
+}
+
+/*
+	Returns
+			the instruction set level in effect
+*/
+OTPSimd otp_simd_active(void)
+{
+	return otp_simd_current();
+}
+
+/*
+	Returns
+			the amount of codes the batch kernels compute at once
+*/
+size_t otp_simd_lanes(void)
+{
+	return OTP_BATCH_KERNELS[otp_simd_current()].lanes;
+}
+
+/*
+	Dynamic truncation and modulo of a single HMAC.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT otp_batch_truncate(const uint8_t* hmac, int hmac_len, uint32_t digits, uint32_t* out_code)
+{
+	static const uint64_t POWERS[OTP_MAX_DIGITS + 1] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000ULL
+	};
+	
+	if (hmac_len < 1 || hmac_len > 64)
+		return OTP_ERROR;
+	
+	size_t offset = hmac[hmac_len - 1] & 0xF;
+	if (offset + 3 >= (size_t) hmac_len)
+		return OTP_ERROR;
+	
+	uint32_t code = (otp_load32be(hmac + offset) & 0x7FFFFFFF);
+	*out_code = (uint32_t) (code % POWERS[digits]);
+	
+	return OTP_OK;
+}
+
+/*
+	Computes a single code without SIMD, bit-identical to the kernels.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT otp_batch_scalar(const OTPAlgo* hmac, const OTPKey* key, uint64_t counter, uint32_t digits, uint32_t* out_code)
+{
+	uint8_t digest[64];
+	int digest_len;
+	
+	if (hmac == &OTP_HMAC_SHA1)
+	{
+		uint32_t words[5];
+		otp_sha1_hmac_counter(key->ctx.u32, key->ctx.u32 + 5, counter, words);
+		for (int i=0; i<5; i++)
+			otp_store32be(digest + i*4, words[i]);
+		digest_len = OTP_SHA1_BYTES;
+	}
+	else if (hmac == &OTP_HMAC_SHA256)
+	{
+		uint32_t words[8];
+		otp_sha256_hmac_counter(key->ctx.u32, key->ctx.u32 + 8, counter, words);
+		for (int i=0; i<8; i++)
+			otp_store32be(digest + i*4, words[i]);
+		digest_len = OTP_SHA256_BYTES;
+	}
+	else
+	{
+		uint8_t input[8];
+		otp_store64be(input, counter);
+		digest_len = hmac->compute(&key->ctx, (const char*) input, (char*) digest);
+	}
+	
+	return otp_batch_truncate(digest, digest_len, digits, out_code);
+}
+
+/*
+	Generates count OTP codes, code i for keys[i] and counters[i].
+	
+	Every key must be prepared by otp_prepare() with hmac as OTPData's
+	  hmac. OTP_HMAC_SHA1 and OTP_HMAC_SHA256 run in SIMD lanes, any
+	  other OTPAlgo is computed one code at a time.
+	
+	out_codes receives the codes as integers, already modulo'd to digits
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_generate_batch(const OTPAlgo* hmac, const OTPKey* const* keys, const uint64_t* counters, size_t count, uint32_t digits, uint32_t* out_codes)
+{
+	if (hmac == NULL || keys == NULL || counters == NULL || out_codes == NULL
+			|| digits == 0 || digits > OTP_MAX_DIGITS)
+		return OTP_ERROR;
+	
+	for (size_t i=0; i<count; i++)
+	{
+		if (keys[i] == NULL || !keys[i]->scheduled)
+			return OTP_ERROR;
+	}
+	
+	const otp_batch_kernels* kernels = &OTP_BATCH_KERNELS[otp_simd_current()];
+	otp_lanes_kernel kernel = NULL;
+	if (hmac == &OTP_HMAC_SHA1)
+		kernel = kernels->sha1;
+	else if (hmac == &OTP_HMAC_SHA256)
+		kernel = kernels->sha256;
+	
+	size_t i = 0;
+	if (kernel != NULL)
+	{
+		size_t lanes = kernels->lanes;
+		for (; i + lanes <= count; i += lanes)
+			kernel(keys + i, counters + i, digits, out_codes + i);
+		
+		// Pad the tail by repeating its last lane
+		if (i < count)
+		{
+			const OTPKey* tail_keys[16];
+			uint64_t tail_counters[16];
+			uint32_t tail_codes[16];
+			for (size_t j=0; j<lanes; j++)
+			{
+				size_t src = i + j < count ? i + j : count - 1;
+				tail_keys[j] = keys[src];
+				tail_counters[j] = counters[src];
+			}
+			kernel(tail_keys, tail_counters, digits, tail_codes);
+			memcpy(out_codes + i, tail_codes, (count - i) * sizeof(uint32_t));
+			i = count;
+		}
+	}
+	
+	for (; i<count; i++)
+	{
+		if (otp_batch_scalar(hmac, keys[i], counters[i], digits, &out_codes[i]) != OTP_OK)
+			return OTP_ERROR;
+	}
+	
+	return OTP_OK;
+}
+
+typedef uint8_t otp_byte_vec __attribute__((vector_size(16)));
+
+/*
+	Parses count submitted codes, code i starting at buffer + i*stride.
+	
+	The codes don't need to be null-terminated, so buffer can point
+	  straight into a network buffer. It must hold at least
+	  (count-1)*stride + digits bytes, codes far enough from its end
+	  get their digits validated 16 bytes at a time.
+	
+	out_codes receives the codes as integers, 0 for invalid ones
+	out_valid receives 1 for every valid code, 0 otherwise
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_parse_codes(const char* buffer, size_t stride, size_t count, uint32_t digits, uint32_t* out_codes, uint8_t* out_valid)
+{
+	if (buffer == NULL || out_codes == NULL || out_valid == NULL
+			|| digits == 0 || digits > OTP_MAX_DIGITS || (count > 1 && stride < digits))
+		return OTP_ERROR;
+	
+	if (count == 0)
+		return OTP_OK;
+	
+	size_t length = (count - 1) * stride + digits;
+	
+	otp_byte_vec lane_mask;
+	for (uint32_t j=0; j<16; j++)
+		lane_mask[j] = j < digits ? 0xFF : 0;
+	
+	for (size_t i=0; i<count; i++)
+	{
+		const char* str = buffer + i * stride;
+		
+		uint8_t values[16];
+		uint8_t invalid = 0;
+		if (i * stride + 16 <= length)
+		{
+			otp_byte_vec bytes;
+			memcpy(&bytes, str, 16);
+			otp_byte_vec value = bytes - (uint8_t) '0';
+			otp_byte_vec bad = (otp_byte_vec) (value > 9) & lane_mask;
+			
+			uint64_t halves[2];
+			memcpy(halves, &bad, 16);
+			invalid = (halves[0] | halves[1]) != 0;
+			memcpy(values, &value, 16);
+		}
+		else
+		{
+			for (uint32_t j=0; j<digits; j++)
+			{
+				values[j] = (uint8_t) ((unsigned char) str[j] - '0');
+				invalid |= values[j] > 9;
+			}
+		}
+		
+		uint64_t code = 0;
+		for (uint32_t j=0; j<digits; j++)
+			code = code * 10 + values[j];
+		
+		invalid |= code > UINT32_MAX;
+		out_valid[i] = !invalid;
+		out_codes[i] = invalid ? 0 : (uint32_t) code;
+	}
+	
+	return OTP_OK;
+}
+
+/*
+	Amount of candidate codes staged per otp_generate_batch call
+	  by totp_verify_batch.
+*/
+#define OTP_VERIFY_BATCH_CHUNK 256
+
+/*
+	Hashes the staged candidates and folds every match into
+	  the result of the request it belongs to. The match closest
+	  to the request's time is kept in out_offsets.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT otp_verify_staged(const OTPAlgo* hmac, uint32_t digits, const OTPKey* const* keys, const uint64_t* counters, const size_t* requests, const int64_t* offsets, size_t staged, const uint32_t* codes, uint8_t* out_results, int64_t* out_offsets)
+{
+	uint32_t generated[OTP_VERIFY_BATCH_CHUNK];
+	if (otp_generate_batch(hmac, keys, counters, staged, digits, generated) != OTP_OK)
+		return OTP_ERROR;
+	
+	for (size_t j=0; j<staged; j++)
+	{
+		size_t r = requests[j];
+		uint8_t equal = (uint8_t) (((uint64_t) (generated[j] ^ codes[r]) - 1) >> 63);
+		if (out_offsets != NULL)
+		{
+			uint64_t distance = (uint64_t) (offsets[j] < 0 ? -offsets[j] : offsets[j]);
+			uint64_t best = out_results[r] ? (uint64_t) (out_offsets[r] < 0 ? -out_offsets[r] : out_offsets[r]) : UINT64_MAX;
+			out_offsets[r] = (equal & (distance < best)) ? offsets[j] : out_offsets[r];
+		}
+		out_results[r] |= equal;
+	}
+	
+	return OTP_OK;
+}
+
+/*
+	Fails a batch verification, requests no group has picked up yet
+	  are left at 0 instead of the pending marker.
+*/
+static COTPRESULT otp_verify_fail(uint8_t* out_results, size_t count)
+{
+	for (size_t i=0; i<count; i++)
+	{
+		if (out_results[i] == 2)
+			out_results[i] = 0;
+	}
+	return OTP_ERROR;
+}
+
+/*
+	Verifies count TOTP requests laid out as parallel arrays, request i
+	  checks codes[i] against datas[i] at for_times[i] within windows[i].
+	
+	Requests are grouped by OTPData hmac and digits, every group streams
+	  its whole windows through otp_generate_batch so the candidates of
+	  different users share SIMD lanes. Requests whose key isn't prepared
+	  through an hmac are verified one at a time by totp_verify_code().
+	
+	codes are parsed codes, see otp_parse_code() and otp_parse_codes()
+	windows are at most OTP_MAX_LOOK_AHEAD, larger ones fail their request
+	out_results receives 1 for every verified request, 0 otherwise
+	out_offsets is optional, receives the matched timeblock offsets
+	
+	Returns
+			1 success
+		error, 0 every request not verified receives 0
+*/
+COTPRESULT totp_verify_batch(OTPData* const* datas, const uint32_t* codes, const uint64_t* for_times, const int64_t* windows, size_t count, uint8_t* out_results, int64_t* out_offsets)
+{
+	if (datas == NULL || codes == NULL || for_times == NULL || windows == NULL || out_results == NULL)
+		return OTP_ERROR;
+	
+	// 2 marks requests which no group has picked up yet
+	for (size_t i=0; i<count; i++)
+	{
+		OTPData* data = datas[i];
+		out_results[i] = 2;
+		if (data == NULL || windows[i] < 0 || (uint64_t) windows[i] > OTP_MAX_LOOK_AHEAD || data->interval <= 0
+				|| data->digits == 0 || data->digits > OTP_MAX_DIGITS)
+		{
+			out_results[i] = 0;
+		}
+		else if (data->hmac == NULL || data->key == NULL || !data->key->scheduled)
+		{
+			out_results[i] = totp_verify_code(data, codes[i], for_times[i], windows[i], out_offsets != NULL ? &out_offsets[i] : NULL) == OTP_OK;
+		}
+	}
+	
+	const OTPKey* keys[OTP_VERIFY_BATCH_CHUNK];
+	uint64_t counters[OTP_VERIFY_BATCH_CHUNK];
+	size_t requests[OTP_VERIFY_BATCH_CHUNK];
+	int64_t offsets[OTP_VERIFY_BATCH_CHUNK];
+	
+	for (size_t first=0; first<count; first++)
+	{
+		if (out_results[first] != 2)
+			continue;
+		
+		const OTPAlgo* hmac = datas[first]->hmac;
+		uint32_t digits = datas[first]->digits;
+		size_t staged = 0;
+		
+		for (size_t i=first; i<count; i++)
+		{
+			OTPData* data = datas[i];
+			if (out_results[i] != 2 || data->hmac != hmac || data->digits != digits)
+				continue;
+			
+			out_results[i] = 0;
+			uint64_t timecode = totp_timecode(data, for_times[i]);
+			for (int64_t offset=-windows[i]; offset<=windows[i]; offset++)
+			{
+				keys[staged] = data->key;
+				counters[staged] = timecode + (uint64_t) offset;
+				requests[staged] = i;
+				offsets[staged] = offset;
+				
+				if (++staged == OTP_VERIFY_BATCH_CHUNK)
+				{
+					if (otp_verify_staged(hmac, digits, keys, counters, requests, offsets, staged, codes, out_results, out_offsets) != OTP_OK)
+						return otp_verify_fail(out_results, count);
+					staged = 0;
+				}
+			}
+		}
+		
+		if (staged > 0 && otp_verify_staged(hmac, digits, keys, counters, requests, offsets, staged, codes, out_results, out_offsets) != OTP_OK)
+			return otp_verify_fail(out_results, count);
+	}
+	
+	return OTP_OK;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "cotp.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Instruction sets the batch functions can run their
+	  multi-buffer HMAC kernels with.
+	
+	SSE4 runs 4 lanes, AVX2 8 lanes and AVX512 16 lanes
+	  of HMAC-SHA1 or HMAC-SHA256 at once.
+*/
+typedef enum OTPSimd
+{
+	OTP_SIMD_AUTO, OTP_SIMD_SCALAR, OTP_SIMD_SSE4, OTP_SIMD_AVX2, OTP_SIMD_AVX512
+} OTPSimd;
+
+OTPSimd otp_simd_select(OTPSimd level);
+OTPSimd otp_simd_active(void);
+size_t otp_simd_lanes(void);
+
+/*
+	Batch functions
+*/
+COTPRESULT otp_generate_batch(const OTPAlgo* hmac, const OTPKey* const* keys, const uint64_t* counters, size_t count, uint32_t digits, uint32_t* out_codes);
+COTPRESULT otp_parse_codes(const char* buffer, size_t stride, size_t count, uint32_t digits, uint32_t* out_codes, uint8_t* out_valid);
+COTPRESULT totp_verify_batch(OTPData* const* datas, const uint32_t* codes, const uint64_t* for_times, const int64_t* windows, size_t count, uint8_t* out_results, int64_t* out_offsets);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,201 @@
+/*
+	Multi-buffer HMAC kernel template, included by otpbatch.c once
+	  per instruction set. No include guard on purpose.
+	
+	Expects
+		OTP_LANES			the amount of 32-bit lanes per vector
+		OTP_TARGET			the function attribute enabling the instruction set
+		OTP_KERNEL(name)	appends the instruction set suffix to name
+	
+	Every lane hashes its own key schedule with its own counter, the
+	  vector code is written with GCC vector extensions so the same
+	  source compiles to SSE4, AVX2 or AVX-512.
+*/
+
+#define OTP_V OTP_KERNEL(otp_vec)
+
+typedef uint32_t OTP_V __attribute__((vector_size(OTP_LANES * 4)));
+
+#define OTP_VROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define OTP_VROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+OTP_TARGET static inline void OTP_KERNEL(otp_sha1_lanes)(OTP_V state[5], OTP_V w[16])
+{
+	OTP_V a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+#define OTP_SHA1_VROUND(f, k, t) \
+	do { \
+		if ((t) >= 16) \
+			w[(t) & 15] = OTP_VROTL(w[((t) - 3) & 15] ^ w[((t) - 8) & 15] ^ w[((t) - 14) & 15] ^ w[(t) & 15], 1); \
+		OTP_V tmp = OTP_VROTL(a, 5) + (f) + e + (k) + w[(t) & 15]; \
+		e = d; d = c; c = OTP_VROTL(b, 30); b = a; a = tmp; \
+	} while (0)
+	
+	for (int t=0; t<20; t++)
+		OTP_SHA1_VROUND((b & c) | (~b & d), 0x5A827999, t);
+	for (int t=20; t<40; t++)
+		OTP_SHA1_VROUND(b ^ c ^ d, 0x6ED9EBA1, t);
+	for (int t=40; t<60; t++)
+		OTP_SHA1_VROUND((b & c) | (b & d) | (c & d), 0x8F1BBCDC, t);
+	for (int t=60; t<80; t++)
+		OTP_SHA1_VROUND(b ^ c ^ d, 0xCA62C1D6, t);
+
+#undef OTP_SHA1_VROUND
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+OTP_TARGET static inline void OTP_KERNEL(otp_sha256_lanes)(OTP_V state[8], OTP_V w[16])
+{
+	OTP_V a = state[0], b = state[1], c = state[2], d = state[3];
+	OTP_V e = state[4], f = state[5], g = state[6], h = state[7];
+	
+	for (int t=0; t<64; t++)
+	{
+		if (t >= 16)
+		{
+			OTP_V w15 = w[(t - 15) & 15];
+			OTP_V w2 = w[(t - 2) & 15];
+			OTP_V s0 = OTP_VROTR(w15, 7) ^ OTP_VROTR(w15, 18) ^ (w15 >> 3);
+			OTP_V s1 = OTP_VROTR(w2, 17) ^ OTP_VROTR(w2, 19) ^ (w2 >> 10);
+			w[t & 15] += s0 + w[(t - 7) & 15] + s1;
+		}
+		OTP_V S1 = OTP_VROTR(e, 6) ^ OTP_VROTR(e, 11) ^ OTP_VROTR(e, 25);
+		OTP_V ch = (e & f) ^ (~e & g);
+		OTP_V t1 = h + S1 + ch + OTP_SHA256_K[t] + w[t & 15];
+		OTP_V S0 = OTP_VROTR(a, 2) ^ OTP_VROTR(a, 13) ^ OTP_VROTR(a, 22);
+		OTP_V maj = (a & b) ^ (a & c) ^ (b & c);
+		OTP_V t2 = S0 + maj;
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/*
+	Dynamic truncation and modulo across lanes.
+	
+	digest holds the digest words, last is the index of the final word.
+*/
+OTP_TARGET static inline void OTP_KERNEL(otp_truncate_lanes)(const OTP_V* digest, int last, uint32_t digits, uint32_t* out_codes)
+{
+	OTP_V offset = digest[last] & 0xF;
+	OTP_V word = offset >> 2;
+	OTP_V shift = (offset & 3) * 8;
+	
+	// offset is at most 15, so the code spans words 0 to 4
+	OTP_V hi = { 0 };
+	OTP_V lo = { 0 };
+	for (uint32_t k=0; k<4; k++)
+	{
+		OTP_V sel = (OTP_V) (word == ((OTP_V) { 0 } + k));
+		hi |= digest[k] & sel;
+		lo |= digest[k + 1] & sel;
+	}
+	
+	OTP_V code = ((hi << shift) | ((lo >> 1) >> (31 - shift))) & 0x7FFFFFFF;
+	
+	// Constant divisors let the compiler use multiply-high sequences
+	switch (digits)
+	{
+		case 1: code %= 10u; break;
+		case 2: code %= 100u; break;
+		case 3: code %= 1000u; break;
+		case 4: code %= 10000u; break;
+		case 5: code %= 100000u; break;
+		case 6: code %= 1000000u; break;
+		case 7: code %= 10000000u; break;
+		case 8: code %= 100000000u; break;
+		case 9: code %= 1000000000u; break;
+		default: break; // 10 digits, the code is already below 10^10
+	}
+	
+	for (int j=0; j<OTP_LANES; j++)
+		out_codes[j] = code[j];
+}
+
+/*
+	Computes OTP_LANES HMAC-SHA1 codes, keys hold OTP_HMAC_SHA1 schedules.
+*/
+OTP_TARGET static void OTP_KERNEL(otp_sha1_kernel)(const OTPKey* const* keys, const uint64_t* counters, uint32_t digits, uint32_t* out_codes)
+{
+	OTP_V inner[5];
+	OTP_V outer[5];
+	OTP_V w[16];
+	
+	for (int j=0; j<OTP_LANES; j++)
+	{
+		const uint32_t* ctx = keys[j]->ctx.u32;
+		for (int i=0; i<5; i++)
+		{
+			inner[i][j] = ctx[i];
+			outer[i][j] = ctx[5 + i];
+		}
+		w[0][j] = (uint32_t) (counters[j] >> 32);
+		w[1][j] = (uint32_t) counters[j];
+	}
+	
+	w[2] = (OTP_V) { 0 } + 0x80000000;
+	for (int i=3; i<15; i++)
+		w[i] = (OTP_V) { 0 };
+	w[15] = (OTP_V) { 0 } + (64 + 8) * 8;
+	
+	OTP_KERNEL(otp_sha1_lanes)(inner, w);
+	
+	for (int i=0; i<5; i++)
+		w[i] = inner[i];
+	w[5] = (OTP_V) { 0 } + 0x80000000;
+	for (int i=6; i<15; i++)
+		w[i] = (OTP_V) { 0 };
+	w[15] = (OTP_V) { 0 } + (64 + OTP_SHA1_BYTES) * 8;
+	
+	OTP_KERNEL(otp_sha1_lanes)(outer, w);
+	
+	OTP_KERNEL(otp_truncate_lanes)(outer, 4, digits, out_codes);
+}
+
+/*
+	Computes OTP_LANES HMAC-SHA256 codes, keys hold OTP_HMAC_SHA256 schedules.
+*/
+OTP_TARGET static void OTP_KERNEL(otp_sha256_kernel)(const OTPKey* const* keys, const uint64_t* counters, uint32_t digits, uint32_t* out_codes)
+{
+	OTP_V inner[8];
+	OTP_V outer[8];
+	OTP_V w[16];
+	
+	for (int j=0; j<OTP_LANES; j++)
+	{
+		const uint32_t* ctx = keys[j]->ctx.u32;
+		for (int i=0; i<8; i++)
+		{
+			inner[i][j] = ctx[i];
+			outer[i][j] = ctx[8 + i];
+		}
+		w[0][j] = (uint32_t) (counters[j] >> 32);
+		w[1][j] = (uint32_t) counters[j];
+	}
+	
+	w[2] = (OTP_V) { 0 } + 0x80000000;
+	for (int i=3; i<15; i++)
+		w[i] = (OTP_V) { 0 };
+	w[15] = (OTP_V) { 0 } + (64 + 8) * 8;
+	
+	OTP_KERNEL(otp_sha256_lanes)(inner, w);
+	
+	for (int i=0; i<8; i++)
+		w[i] = inner[i];
+	w[8] = (OTP_V) { 0 } + 0x80000000;
+	for (int i=9; i<15; i++)
+		w[i] = (OTP_V) { 0 };
+	w[15] = (OTP_V) { 0 } + (64 + OTP_SHA256_BYTES) * 8;
+	
+	OTP_KERNEL(otp_sha256_lanes)(outer, w);
+	
+	OTP_KERNEL(otp_truncate_lanes)(outer, 7, digits, out_codes);
+}
+
+#undef OTP_VROTL
+#undef OTP_VROTR
+#undef OTP_V
@@ -0,0 +1,316 @@
+#include "otpcache.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+
+#define OTP_CODE_CACHE_MASK (OTP_CODE_CACHE_SLOTS - 1)
+
+/*
+	Initializes the code cache of one user, empty until the first
+	  otp_code_cache_advance() or totp_verify_cached().
+	
+	data must stay valid as long as the cache, prepare its key
+	  for the codes to be computed in SIMD lanes
+	window is the valid_window verification uses, at most
+	  OTP_CODE_CACHE_MAX_WINDOW
+	
+	Returns
+			A pointer to the passed cache
+		error, 0
+*/
+OTPCodeCache* otp_code_cache_new(OTPCodeCache* cache, OTPData* data, int64_t window)
+{
+	if (cache == NULL || data == NULL || window < 0 || window > OTP_CODE_CACHE_MAX_WINDOW)
+		return 0;
+	
+	cache->data = data;
+	cache->window = window;
+	cache->sequence = 0;
+	cache->count = 0;
+	cache->first = 0;
+	for (int i=0; i<OTP_CODE_CACHE_SLOTS; i++)
+		cache->codes[i] = 0;
+	
+	return cache;
+}
+
+/*
+	Returns the first timestep cache wants to hold for timecode.
+*/
+static uint64_t otp_code_cache_first(const OTPCodeCache* cache, uint64_t timecode)
+{
+	uint64_t behind = (uint64_t) cache->window + 1;
+	return timecode > behind ? timecode - behind : 0;
+}
+
+/*
+	Slides cache so it holds the window around for_time, plus one
+	  step on either side so verification keeps hitting the cache
+	  across the step boundary. Steps already held aren't computed
+	  again.
+	
+	Returns
+			1 success
+		error, 0 also when another thread is advancing the cache
+*/
+COTPRESULT otp_code_cache_advance(OTPCodeCache* cache, uint64_t for_time)
+{
+	if (cache == NULL || cache->data == NULL || cache->data->interval <= 0)
+		return OTP_ERROR;
+	
+	uint32_t sequence = __atomic_load_n(&cache->sequence, __ATOMIC_RELAXED);
+	if ((sequence & 1) || !__atomic_compare_exchange_n(&cache->sequence, &sequence, sequence + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return OTP_ERROR;
+	
+	// Orders the odd sequence before the code stores, a reader seeing a new code sees it too
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	uint64_t timecode = totp_timecode(cache->data, for_time);
+	uint64_t first = otp_code_cache_first(cache, timecode);
+	uint64_t end = timecode + (uint64_t) cache->window + 2;
+	
+	// Only the steps past the ones held are new, unless time went back
+	uint64_t held_end = cache->first + cache->count;
+	uint64_t from = first;
+	if (cache->count > 0 && first >= cache->first && first <= held_end)
+		from = held_end;
+	
+	COTPRESULT res = OTP_OK;
+	for (uint64_t step=from; step<end; step++)
+	{
+		uint32_t code;
+		if (otp_generate_code(cache->data, step, &code) != OTP_OK)
+		{
+			res = OTP_ERROR;
+			break;
+		}
+		__atomic_store_n(&cache->codes[step & OTP_CODE_CACHE_MASK], code, __ATOMIC_RELAXED);
+	}
+	
+	__atomic_store_n(&cache->first, first, __ATOMIC_RELAXED);
+	__atomic_store_n(&cache->count, res == OTP_OK ? (uint32_t) (end - first) : 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&cache->sequence, sequence + 2, __ATOMIC_RELEASE);
+	
+	return res;
+}
+
+/*
+	Compares code against the cached window, without branching on the codes.
+	
+	Returns
+			1 the window was held and read consistently
+			0 it wasn't, match is untouched
+*/
+static int otp_code_cache_match(OTPCodeCache* cache, uint32_t code, uint64_t timecode, uint64_t* out_matched, int64_t* out_offset)
+{
+	uint32_t sequence = __atomic_load_n(&cache->sequence, __ATOMIC_ACQUIRE);
+	if (sequence & 1)
+		return 0;
+	
+	uint64_t first = __atomic_load_n(&cache->first, __ATOMIC_RELAXED);
+	uint64_t count = __atomic_load_n(&cache->count, __ATOMIC_RELAXED);
+	int64_t window = cache->window;
+	
+	if (count == 0 || timecode < first + (uint64_t) window || timecode + (uint64_t) window >= first + count)
+		return 0;
+	
+	uint64_t matched = 0;
+	int64_t best_offset = 0;
+	uint64_t best_distance = INT64_MAX;
+	for (int64_t offset=-window; offset<=window; offset++)
+	{
+		uint32_t generated = __atomic_load_n(&cache->codes[(timecode + (uint64_t) offset) & OTP_CODE_CACHE_MASK], __ATOMIC_RELAXED);
+		uint64_t distance = (uint64_t) (offset < 0 ? -offset : offset);
+		
+		uint64_t equal = ((uint64_t) (generated ^ code) - 1) >> 63;
+		uint64_t closer = (distance - best_distance) >> 63;
+		uint64_t mask = (uint64_t) 0 - (equal & closer);
+		
+		best_offset = (int64_t) (((uint64_t) best_offset & ~mask) | ((uint64_t) offset & mask));
+		best_distance = (best_distance & ~mask) | (distance & mask);
+		matched |= equal;
+	}
+	
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&cache->sequence, __ATOMIC_RELAXED) != sequence)
+		return 0;
+	
+	*out_matched = matched;
+	*out_offset = best_offset;
+	return 1;
+}
+
+/*
+	Verifies code against the cached codes of a user, the
+	  window is the one the cache was created with.
+	
+	A cache that doesn't hold for_time's window is advanced first,
+	  when another thread is advancing it the codes are computed
+	  like totp_verify_code() does.
+	
+	out_offset is optional
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT totp_verify_cached(OTPCodeCache* cache, uint32_t code, uint64_t for_time, int64_t* out_offset)
+{
+	if (cache == NULL || cache->data == NULL || cache->data->interval <= 0)
+		return OTP_ERROR;
+	
+	uint64_t timecode = totp_timecode(cache->data, for_time);
+	uint64_t matched = 0;
+	int64_t offset = 0;
+	
+	if (!otp_code_cache_match(cache, code, timecode, &matched, &offset))
+	{
+		if (otp_code_cache_advance(cache, for_time) != OTP_OK
+				|| !otp_code_cache_match(cache, code, timecode, &matched, &offset))
+			return totp_verify_code(cache->data, code, for_time, cache->window, out_offset);
+	}
+	
+	if (!matched)
+		return OTP_ERROR;
+	
+	if (out_offset != NULL)
+		*out_offset = offset;
+	
+	return OTP_OK;
+}
+
+typedef struct otp_refresher_state
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int stopping;
+} otp_refresher_state;
+
+/*
+	Advances every cache for lead seconds from now, returns the
+	  time of the next step boundary minus lead.
+*/
+static uint64_t otp_refresher_pass(OTPRefresher* refresher, uint64_t now)
+{
+	uint64_t ahead = now + refresher->lead;
+	uint64_t next = UINT64_MAX;
+	
+	for (size_t i=0; i<refresher->count; i++)
+	{
+		OTPCodeCache* cache = &refresher->caches[i];
+		if (cache->data == NULL || cache->data->interval <= 0)
+			continue;
+		
+		otp_code_cache_advance(cache, ahead);
+		
+		uint64_t boundary = (totp_timecode(cache->data, ahead) + 1) * cache->data->interval;
+		if (boundary - refresher->lead < next)
+			next = boundary - refresher->lead;
+	}
+	
+	return next;
+}
+
+static void* otp_refresher_thread(void* arg)
+{
+	OTPRefresher* refresher = (OTPRefresher*) arg;
+	otp_refresher_state* state = (otp_refresher_state*) refresher->state;
+	
+	pthread_mutex_lock(&state->lock);
+	while (!state->stopping)
+	{
+		pthread_mutex_unlock(&state->lock);
+		uint64_t now = refresher->time();
+		uint64_t next = otp_refresher_pass(refresher, now);
+		pthread_mutex_lock(&state->lock);
+		
+		// Sleep until the next boundary comes within lead, a second at least
+		uint64_t delay = next > now ? next - now : 1;
+		struct timespec deadline;
+		deadline.tv_sec = time(NULL) + (time_t) (delay < 3600 ? delay : 3600);
+		deadline.tv_nsec = 0;
+		while (!state->stopping && pthread_cond_timedwait(&state->wake, &state->lock, &deadline) == 0)
+			;
+	}
+	pthread_mutex_unlock(&state->lock);
+	
+	return NULL;
+}
+
+/*
+	Advances caches once, then starts a thread advancing them lead
+	  seconds before each of their step boundaries, so verification
+	  at the boundary finds the new step already computed.
+	
+	caches must stay valid until otp_refresher_free()
+	time returns the current time, like OTPData's time
+	lead is at most the smallest interval of the caches
+	
+	Returns
+			A pointer to the passed refresher
+		error, 0
+*/
+OTPRefresher* otp_refresher_new(OTPRefresher* refresher, OTPCodeCache* caches, size_t count, COTP_TIME time, uint64_t lead)
+{
+	if (refresher == NULL || caches == NULL || time == NULL)
+		return 0;
+	
+	for (size_t i=0; i<count; i++)
+	{
+		if (caches[i].data != NULL && caches[i].data->interval < lead)
+			return 0;
+	}
+	
+	otp_refresher_state* state = (otp_refresher_state*) calloc(1, sizeof(otp_refresher_state));
+	if (state == NULL)
+		return 0;
+	
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->wake, NULL);
+	
+	refresher->caches = caches;
+	refresher->count = count;
+	refresher->time = time;
+	refresher->lead = lead;
+	refresher->state = state;
+	
+	// Warm every cache before returning
+	otp_refresher_pass(refresher, time());
+	
+	if (pthread_create(&state->thread, NULL, otp_refresher_thread, refresher) != 0)
+	{
+		pthread_cond_destroy(&state->wake);
+		pthread_mutex_destroy(&state->lock);
+		free(state);
+		refresher->state = NULL;
+		return 0;
+	}
+	
+	return refresher;
+}
+
+/*
+	Stops and joins the refresher thread.
+*/
+void otp_refresher_free(OTPRefresher* refresher)
+{
+	if (refresher == NULL || refresher->state == NULL)
+		return;
+	
+	otp_refresher_state* state = (otp_refresher_state*) refresher->state;
+	
+	pthread_mutex_lock(&state->lock);
+	state->stopping = 1;
+	pthread_cond_broadcast(&state->wake);
+	pthread_mutex_unlock(&state->lock);
+	
+	pthread_join(state->thread, NULL);
+	pthread_cond_destroy(&state->wake);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+	
+	refresher->state = NULL;
+}
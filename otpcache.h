@@ -0,0 +1,71 @@
+#pragma once
+
+#include "cotp.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Timesteps held per OTPCodeCache, a power of two.
+*/
+#define OTP_CODE_CACHE_SLOTS 32
+
+/*
+	Largest window an OTPCodeCache holds, it keeps one step
+	  before and after the window too.
+*/
+#define OTP_CODE_CACHE_MAX_WINDOW ((OTP_CODE_CACHE_SLOTS - 3) / 2)
+
+/*
+	The codes of one user around the current timestep.
+	
+	Holds timesteps first to first+count-1 in a ring indexed by
+	  timecode, sliding forward computes the new steps only.
+	  sequence is odd while a writer updates the codes, readers
+	  never block and compute the codes themselves instead.
+	
+	Initialize with otp_code_cache_new().
+*/
+typedef struct OTPCodeCache
+{
+	OTPData* data;
+	int64_t window;
+	uint32_t sequence;
+	uint32_t count;
+	uint64_t first;
+	uint32_t codes[OTP_CODE_CACHE_SLOTS];
+} OTPCodeCache;
+
+/*
+	Background thread advancing an array of OTPCodeCache
+	  lead seconds before their step boundaries.
+	
+	Initialize with otp_refresher_new() and stop it with
+	  otp_refresher_free().
+*/
+typedef struct OTPRefresher
+{
+	OTPCodeCache* caches;
+	size_t count;
+	COTP_TIME time;
+	uint64_t lead;
+	void* state;
+} OTPRefresher;
+
+/*
+	Code cache functions
+*/
+OTPCodeCache* otp_code_cache_new(OTPCodeCache* cache, OTPData* data, int64_t window);
+COTPRESULT otp_code_cache_advance(OTPCodeCache* cache, uint64_t for_time);
+COTPRESULT totp_verify_cached(OTPCodeCache* cache, uint32_t code, uint64_t for_time, int64_t* out_offset);
+
+/*
+	Refresher functions
+*/
+OTPRefresher* otp_refresher_new(OTPRefresher* refresher, OTPCodeCache* caches, size_t count, COTP_TIME time, uint64_t lead);
+void otp_refresher_free(OTPRefresher* refresher);
+
+#if defined(__cplusplus)
+}
+#endif
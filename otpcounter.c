@@ -0,0 +1,205 @@
+#include "otpcounter.h"
+
+#include <string.h>
+#include <stdatomic.h>
+
+
+#define OTP_COUNTER_MAGIC "COTPCNT1"
+#define OTP_COUNTER_VERSION 1
+#define OTP_COUNTER_HEADER 64
+
+/*
+	The header at the start of a counter file.
+*/
+typedef struct otp_counter_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t slot_size;
+	uint64_t slots;
+} otp_counter_header;
+
+static atomic_uint_least64_t* otp_counter_slot(OTPCounterStore* store, uint64_t key_id)
+{
+	return (atomic_uint_least64_t*) (store->map.base + OTP_COUNTER_HEADER) + key_id;
+}
+
+/*
+	Opens the counter file at path, creating it when missing.
+	
+	slots is the amount of key ids the file holds at least, a file
+	  declaring fewer slots is grown, 0 opens an existing file as it is
+	sync is when advances are written back to the disk
+	
+	A file shorter than its header declares is refused, growing it
+	  would hand out counters that were used already.
+	
+	Returns
+			A pointer to the passed store
+		error, 0
+*/
+OTPCounterStore* otp_counter_open(OTPCounterStore* store, const char* path, uint64_t slots, OTPSync sync)
+{
+	if (store == NULL || path == NULL || slots > (SIZE_MAX - OTP_COUNTER_HEADER) / sizeof(uint64_t))
+		return 0;
+	
+	// The header is read from the file as it is, nothing grows before it is checked
+	otp_counter_header header;
+	memset(&header, 0, sizeof(header));
+	size_t file_size = 0;
+	if (otp_map_open(&store->map, path, 0, OTP_MAP_WRITE))
+	{
+		file_size = store->map.size;
+		if (file_size >= OTP_COUNTER_HEADER)
+			memcpy(&header, store->map.base, sizeof(header));
+		otp_map_close(&store->map);
+	}
+	
+	static const char empty[8] = { 0 };
+	if (memcmp(header.magic, empty, 8) == 0)
+	{
+		// A new file, the magic goes last so a torn header reads as new again
+		if (slots == 0 || !otp_map_open(&store->map, path, OTP_COUNTER_HEADER + (size_t) slots * sizeof(uint64_t), OTP_MAP_WRITE))
+			return 0;
+		if (memcmp(store->map.base, empty, 8) != 0)
+		{
+			otp_map_close(&store->map);
+			return 0;
+		}
+		header.version = OTP_COUNTER_VERSION;
+		header.slot_size = sizeof(uint64_t);
+		header.slots = slots;
+		memcpy(store->map.base + 8, (const uint8_t*) &header + 8, sizeof(header) - 8);
+		otp_map_sync(&store->map, 0, OTP_COUNTER_HEADER, 1);
+		memcpy(store->map.base, OTP_COUNTER_MAGIC, 8);
+		otp_map_sync(&store->map, 0, OTP_COUNTER_HEADER, 1);
+	}
+	else if (memcmp(header.magic, OTP_COUNTER_MAGIC, 8) != 0 || header.version != OTP_COUNTER_VERSION
+			|| header.slot_size != sizeof(uint64_t) || header.slots > (SIZE_MAX - OTP_COUNTER_HEADER) / sizeof(uint64_t)
+			|| file_size < OTP_COUNTER_HEADER + (size_t) header.slots * sizeof(uint64_t))
+	{
+		return 0;
+	}
+	else
+	{
+		// Map exactly the slots the file ends up with, only more slots than declared grow it
+		uint64_t wanted = header.slots > slots ? header.slots : slots;
+		if (!otp_map_open(&store->map, path, OTP_COUNTER_HEADER + (size_t) wanted * sizeof(uint64_t), OTP_MAP_WRITE))
+			return 0;
+		
+		if (wanted != header.slots)
+		{
+			header.slots = wanted;
+			memcpy(store->map.base + 16, &header.slots, sizeof(uint64_t));
+			otp_map_sync(&store->map, 0, OTP_COUNTER_HEADER, 1);
+		}
+		slots = wanted;
+	}
+	
+	store->slots = slots;
+	store->sync = sync;
+	
+	return store;
+}
+
+/*
+	Unmaps the counter file, writing every counter back first.
+*/
+void otp_counter_close(OTPCounterStore* store)
+{
+	if (store == NULL || store->map.base == NULL)
+		return;
+	
+	otp_map_sync(&store->map, 0, store->map.size, 1);
+	otp_map_close(&store->map);
+	store->slots = 0;
+}
+
+/*
+	Reads the next counter expected from key_id.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_counter_get(OTPCounterStore* store, uint64_t key_id, uint64_t* out_counter)
+{
+	if (store == NULL || store->map.base == NULL || out_counter == NULL || key_id >= store->slots)
+		return OTP_ERROR;
+	
+	*out_counter = atomic_load(otp_counter_slot(store, key_id));
+	return OTP_OK;
+}
+
+/*
+	Marks counter of key_id as used, the stored counter becomes
+	  counter+1 unless it is past counter already.
+	
+	Returns
+			1 the counter moved forward
+			0 counter was used already
+		error, 0 also when writing the counter back fails, the
+			counter moved forward then and otp_counter_sync()
+			writes it again
+*/
+COTPRESULT otp_counter_advance(OTPCounterStore* store, uint64_t key_id, uint64_t counter)
+{
+	if (store == NULL || store->map.base == NULL || key_id >= store->slots || counter == UINT64_MAX)
+		return OTP_ERROR;
+	
+	atomic_uint_least64_t* slot = otp_counter_slot(store, key_id);
+	uint64_t current = atomic_load(slot);
+	do
+	{
+		if (current > counter)
+			return OTP_ERROR;
+	}
+	while (!atomic_compare_exchange_weak(slot, &current, counter + 1));
+	
+	if (store->sync != OTP_SYNC_NONE)
+	{
+		size_t offset = OTP_COUNTER_HEADER + (size_t) key_id * sizeof(uint64_t);
+		if (!otp_map_sync(&store->map, offset, sizeof(uint64_t), store->sync == OTP_SYNC_EACH))
+			return OTP_ERROR;
+	}
+	
+	return OTP_OK;
+}
+
+/*
+	Writes every counter back to the disk and waits for it.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_counter_sync(OTPCounterStore* store)
+{
+	if (store == NULL || store->map.base == NULL)
+		return OTP_ERROR;
+	
+	return otp_map_sync(&store->map, 0, store->map.size, 1) ? OTP_OK : OTP_ERROR;
+}
+
+/*
+	Verifies key within look_ahead counters of the counter stored
+	  for key_id, and moves the stored counter past the match.
+	
+	Two verifications racing for the same counter never both succeed.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT hotp_verify_stored(OTPData* data, OTPCounterStore* store, uint64_t key_id, const char* key, uint64_t look_ahead)
+{
+	uint64_t counter;
+	if (data == NULL || otp_counter_get(store, key_id, &counter) != OTP_OK)
+		return OTP_ERROR;
+	
+	uint64_t matched;
+	if (hotp_verify(data, key, counter, look_ahead, &matched) != OTP_OK)
+		return OTP_ERROR;
+	
+	return otp_counter_advance(store, key_id, matched);
+}
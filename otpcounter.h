@@ -0,0 +1,58 @@
+#pragma once
+
+#include "cotp.h"
+#include "otpmap.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	When otp_counter_advance writes a counter back to the file.
+	
+	A process crash never loses an advance, the mapping is shared
+	  with the OS. NONE and ASYNC can lose the latest advances when
+	  the machine itself goes down, EACH can't.
+*/
+typedef enum OTPSync
+{
+	OTP_SYNC_NONE,  // Left to the OS and otp_counter_sync()
+	OTP_SYNC_ASYNC, // Writeback scheduled after every advance
+	OTP_SYNC_EACH   // Every advance waits for the disk
+} OTPSync;
+
+/*
+	HOTP counters of many keys in a memory mapped file.
+	
+	The file is a 64 byte header followed by one 8 byte slot per
+	  key id, in native byte order. Slots are updated with
+	  compare-and-swap and only ever move forward, an aligned
+	  8 byte store is never torn, so a crash leaves every counter
+	  at a value it really had.
+	
+	Open with otp_counter_open().
+*/
+typedef struct OTPCounterStore
+{
+	OTPMap map;
+	uint64_t slots;
+	OTPSync sync;
+} OTPCounterStore;
+
+/*
+	Counter store functions
+*/
+OTPCounterStore* otp_counter_open(OTPCounterStore* store, const char* path, uint64_t slots, OTPSync sync);
+void otp_counter_close(OTPCounterStore* store);
+COTPRESULT otp_counter_get(OTPCounterStore* store, uint64_t key_id, uint64_t* out_counter);
+COTPRESULT otp_counter_advance(OTPCounterStore* store, uint64_t key_id, uint64_t counter);
+COTPRESULT otp_counter_sync(OTPCounterStore* store);
+
+/*
+	Verification against a stored counter
+*/
+COTPRESULT hotp_verify_stored(OTPData* data, OTPCounterStore* store, uint64_t key_id, const char* key, uint64_t look_ahead);
+
+#if defined(__cplusplus)
+}
+#endif
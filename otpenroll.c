@@ -0,0 +1,620 @@
+#include "otpenroll.h"
+#include "otprandom.h"
+#include "otpuri.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#	include <windows.h>
+#else
+#	include <unistd.h>
+#endif
+
+
+/*
+	Users per batch, batches are the unit the reader, the
+	  workers and the writer pass along.
+*/
+#define OTP_ENROLL_BATCH 4096
+
+/*
+	Bytes of user lines per batch and of the input read buffer,
+	  a longer line fails the enrollment.
+*/
+#define OTP_ENROLL_TEXT (1 << 18)
+#define OTP_ENROLL_READ (1 << 20)
+
+/*
+	Buffer size of the export file.
+*/
+#define OTP_ENROLL_WRITE (1 << 20)
+
+typedef enum otp_enroll_status
+{
+	OTP_ENROLL_FREE, OTP_ENROLL_READY, OTP_ENROLL_WORKING, OTP_ENROLL_DONE
+} otp_enroll_status;
+
+typedef struct otp_enroll_batch
+{
+	otp_enroll_status status;
+	uint64_t sequence;
+	uint64_t first; // Index of the first user in the keystore
+	size_t users;
+	
+	char* text;     // The user lines, each null-terminated
+	size_t text_length;
+	char* secrets;
+	
+	char* export;   // CSV lines of the users
+	size_t export_length;
+	size_t export_capacity;
+} otp_enroll_batch;
+
+typedef struct otp_enroll_state
+{
+	const OTPEnrollConfig* config;
+	OTPStoreWriter writer;
+	FILE* export;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	otp_enroll_batch* batches;
+	size_t slots;
+	uint64_t batches_read;
+	uint64_t batches_written;
+	int reading_done;
+	int failed;
+} otp_enroll_state;
+
+/*
+	Splits a file into lines with one large read at a time.
+*/
+typedef struct otp_enroll_reader
+{
+	FILE* file;
+	char* buffer;
+	size_t start;
+	size_t end;
+	int eof;
+} otp_enroll_reader;
+
+/*
+	Initializes config with TOTP, SHA1, 6 digits, 30 seconds and
+	  32 character secrets, key ids starting at 1.
+	
+	issuer is used for users listed without one
+	
+	Returns
+			A pointer to the passed config
+		error, 0
+*/
+OTPEnrollConfig* otp_enroll_config_new(OTPEnrollConfig* config, const char* issuer)
+{
+	if (config == NULL || issuer == NULL)
+		return 0;
+	
+	config->issuer = issuer;
+	config->algo = OTP_STORE_SHA1;
+	config->type = TOTP;
+	config->digits = 6;
+	config->interval = 30;
+	config->secret_length = 32;
+	config->first_id = 1;
+	config->threads = 0;
+	
+	return config;
+}
+
+/*
+	Finds the next user line, skipping empty lines and # comments.
+	
+	Returns
+			1 a line, null-terminated in place
+			0 end of file
+		error, -1 a line longer than the read buffer or a read error
+*/
+static int otp_enroll_next_line(otp_enroll_reader* reader, char** out_line, size_t* out_length)
+{
+	for (;;)
+	{
+		char* start = reader->buffer + reader->start;
+		char* newline = (char*) memchr(start, '\n', reader->end - reader->start);
+		
+		if (newline == NULL && !reader->eof)
+		{
+			// Move the partial line to the front and read behind it
+			size_t partial = reader->end - reader->start;
+			if (partial == OTP_ENROLL_READ - 1)
+				return -1;
+			memmove(reader->buffer, start, partial);
+			reader->start = 0;
+			reader->end = partial;
+			
+			size_t got = fread(reader->buffer + partial, 1, OTP_ENROLL_READ - 1 - partial, reader->file);
+			reader->end += got;
+			if (got == 0)
+			{
+				if (ferror(reader->file))
+					return -1;
+				reader->eof = 1;
+			}
+			continue;
+		}
+		
+		if (newline == NULL)
+		{
+			if (reader->start == reader->end)
+				return 0;
+			newline = reader->buffer + reader->end;
+		}
+		
+		size_t length = (size_t) (newline - start);
+		reader->start = newline - reader->buffer + (newline < reader->buffer + reader->end);
+		
+		if (length > 0 && start[length - 1] == '\r')
+			length--;
+		if (length == 0 || start[0] == '#')
+			continue;
+		
+		start[length] = '\0';
+		*out_line = start;
+		*out_length = length;
+		return 1;
+	}
+}
+
+/*
+	Returns the first batch with status, or NULL.
+*/
+static otp_enroll_batch* otp_enroll_find(otp_enroll_state* state, otp_enroll_status status, uint64_t sequence, int any)
+{
+	for (size_t i=0; i<state->slots; i++)
+	{
+		otp_enroll_batch* batch = &state->batches[i];
+		if (batch->status == status && (any || batch->sequence == sequence))
+			return batch;
+	}
+	return NULL;
+}
+
+static const char* otp_enroll_digest(OTPStoreAlgo algo)
+{
+	switch (algo)
+	{
+		case OTP_STORE_SHA256:
+			return "SHA256";
+		case OTP_STORE_SHA512:
+			return "SHA512";
+		default:
+			return "SHA1";
+	}
+}
+
+/*
+	Appends a CSV field in quotes, doubling the quotes inside.
+*/
+static char* otp_enroll_quote(char* out, const char* field)
+{
+	*out++ = '"';
+	for (; *field != '\0'; field++)
+	{
+		if (*field == '"')
+			*out++ = '"';
+		*out++ = *field;
+	}
+	*out++ = '"';
+	return out;
+}
+
+/*
+	Generates the secrets, records and export lines of a batch.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT otp_enroll_process(otp_enroll_state* state, otp_enroll_batch* batch)
+{
+	const OTPEnrollConfig* config = state->config;
+	size_t stride = config->secret_length + 1;
+	const char* digest = otp_enroll_digest(config->algo);
+	
+	if (otp_random_base32_batch(config->secret_length, batch->users, batch->secrets, stride) != OTP_OK)
+		return OTP_ERROR;
+	
+	COTPRESULT result = OTP_OK;
+	char* line = batch->text;
+	batch->export_length = 0;
+	
+	for (size_t i=0; i<batch->users && result == OTP_OK; i++)
+	{
+		size_t line_length = strlen(line);
+		char* next = line + line_length + 1;
+		
+		// `issuer:name` or a name of the configured issuer
+		const char* issuer = config->issuer;
+		const char* name = line;
+		char* colon = strchr(line, ':');
+		if (colon != NULL)
+		{
+			*colon = '\0';
+			issuer = line;
+			name = colon + 1;
+		}
+		
+		const char* secret = batch->secrets + i * stride;
+		uint64_t index = batch->first + i;
+		uint64_t key_id = config->first_id + index;
+		
+		OTPData data;
+		if (config->type == HOTP)
+			hotp_new(&data, secret, NULL, config->digits, 0);
+		else
+			totp_new(&data, secret, NULL, NULL, config->digits, config->interval);
+		
+		if (otp_store_record_new(&state->writer.records[index], key_id, secret, config->algo, config->type, config->digits, config->interval, 0) == NULL)
+		{
+			result = OTP_ERROR;
+			break;
+		}
+		state->writer.ids[index] = key_id;
+		
+		// key_id,"issuer","name",secret,"uri", the quoted fields at most double
+		size_t uri_capacity = otpuri_length(&data, issuer, name, digest) + 1;
+		size_t fields = 2 * strlen(issuer) + 2 + 2 * strlen(name) + 2;
+		size_t needed = batch->export_length + 24 + fields + stride + uri_capacity + 8;
+		if (needed > batch->export_capacity)
+		{
+			size_t capacity = batch->export_capacity * 2 > needed ? batch->export_capacity * 2 : needed;
+			char* grown = (char*) realloc(batch->export, capacity);
+			if (grown == NULL)
+			{
+				result = OTP_ERROR;
+				break;
+			}
+			batch->export = grown;
+			batch->export_capacity = capacity;
+		}
+		
+		char* out = batch->export + batch->export_length;
+		out += sprintf(out, "%" PRIu64 ",", key_id);
+		out = otp_enroll_quote(out, issuer);
+		*out++ = ',';
+		out = otp_enroll_quote(out, name);
+		*out++ = ',';
+		memcpy(out, secret, config->secret_length);
+		out += config->secret_length;
+		*out++ = ',';
+		*out++ = '"';
+		size_t uri_length = otpuri_write(&data, issuer, name, digest, out, uri_capacity);
+		if (uri_length == 0)
+		{
+			result = OTP_ERROR;
+			break;
+		}
+		out += uri_length;
+		*out++ = '"';
+		*out++ = '\n';
+		
+		batch->export_length = (size_t) (out - batch->export);
+		line = next;
+	}
+	
+	memset(batch->secrets, 0, batch->users * stride);
+	
+	return result;
+}
+
+static void* otp_enroll_worker(void* arg)
+{
+	otp_enroll_state* state = (otp_enroll_state*) arg;
+	
+	pthread_mutex_lock(&state->lock);
+	for (;;)
+	{
+		otp_enroll_batch* batch = otp_enroll_find(state, OTP_ENROLL_READY, 0, 1);
+		if (batch == NULL)
+		{
+			if (state->reading_done || state->failed)
+				break;
+			pthread_cond_wait(&state->changed, &state->lock);
+			continue;
+		}
+		
+		batch->status = OTP_ENROLL_WORKING;
+		pthread_mutex_unlock(&state->lock);
+		
+		COTPRESULT result = otp_enroll_process(state, batch);
+		
+		pthread_mutex_lock(&state->lock);
+		batch->status = OTP_ENROLL_DONE;
+		state->failed |= result != OTP_OK;
+		pthread_cond_broadcast(&state->changed);
+	}
+	pthread_mutex_unlock(&state->lock);
+	
+	return NULL;
+}
+
+/*
+	Writes the export lines of finished batches in input order.
+*/
+static void* otp_enroll_writer(void* arg)
+{
+	otp_enroll_state* state = (otp_enroll_state*) arg;
+	
+	pthread_mutex_lock(&state->lock);
+	for (;;)
+	{
+		otp_enroll_batch* batch = otp_enroll_find(state, OTP_ENROLL_DONE, state->batches_written, 0);
+		if (batch == NULL)
+		{
+			if (state->failed || (state->reading_done && state->batches_written == state->batches_read))
+				break;
+			pthread_cond_wait(&state->changed, &state->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&state->lock);
+		
+		int ok = fwrite(batch->export, 1, batch->export_length, state->export) == batch->export_length;
+		
+		pthread_mutex_lock(&state->lock);
+		batch->status = OTP_ENROLL_FREE;
+		state->batches_written++;
+		state->failed |= !ok;
+		pthread_cond_broadcast(&state->changed);
+	}
+	pthread_mutex_unlock(&state->lock);
+	
+	return NULL;
+}
+
+/*
+	Waits for a free batch and starts filling it.
+*/
+static otp_enroll_batch* otp_enroll_take(otp_enroll_state* state, uint64_t first)
+{
+	pthread_mutex_lock(&state->lock);
+	otp_enroll_batch* batch;
+	while ((batch = otp_enroll_find(state, OTP_ENROLL_FREE, 0, 1)) == NULL && !state->failed)
+		pthread_cond_wait(&state->changed, &state->lock);
+	pthread_mutex_unlock(&state->lock);
+	
+	if (batch != NULL)
+	{
+		batch->first = first;
+		batch->users = 0;
+		batch->text_length = 0;
+	}
+	return batch;
+}
+
+/*
+	Hands a filled batch to the workers.
+*/
+static void otp_enroll_submit(otp_enroll_state* state, otp_enroll_batch* batch)
+{
+	pthread_mutex_lock(&state->lock);
+	batch->sequence = state->batches_read++;
+	batch->status = OTP_ENROLL_READY;
+	pthread_cond_broadcast(&state->changed);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/*
+	Counts the user lines of a file.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT otp_enroll_count(otp_enroll_reader* reader, uint64_t* out_count)
+{
+	uint64_t count = 0;
+	char* line;
+	size_t length;
+	int next;
+	while ((next = otp_enroll_next_line(reader, &line, &length)) == 1)
+	{
+		if (length >= OTP_ENROLL_TEXT)
+			return OTP_ERROR;
+		count++;
+	}
+	
+	*out_count = count;
+	return next == 0 ? OTP_OK : OTP_ERROR;
+}
+
+/*
+	Returns the amount of online CPUs, at least 1.
+*/
+static uint32_t otp_enroll_cpus(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long cpus = (long) info.dwNumberOfProcessors;
+#else
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return cpus > 0 ? (uint32_t) cpus : 1;
+}
+
+/*
+	Enrolls every user of a list, generating their secrets into a
+	  keystore and their otpauth URIs into a CSV export.
+	
+	users_path is a text file of one `issuer:name` or `name` per line,
+	  empty lines and lines starting with # are skipped
+	keys_path receives the keystore, user n has key id first_id + n
+	export_path receives `key_id,issuer,name,secret,uri` lines in
+	  the order of the users, the file is readable by its owner only
+	out_count is optional, receives the amount of users enrolled
+	
+	The list is read twice, once to size the keystore. Worker threads
+	  generate the secrets, records and URIs of batches of users while
+	  a writer thread appends finished batches to the export in order.
+	  Memory stays bounded by a fixed amount of batches in flight.
+	
+	Returns
+			1 success
+		error, 0 a keystore already at keys_path is left as it was,
+			the partial export is removed
+*/
+COTPRESULT otp_enroll(const OTPEnrollConfig* config, const char* users_path, const char* keys_path, const char* export_path, uint64_t* out_count)
+{
+	if (config == NULL || config->issuer == NULL || users_path == NULL || keys_path == NULL || export_path == NULL
+			|| config->secret_length == 0 || config->secret_length > OTP_KEY_MAX_LENGTH * 8 / 5)
+		return OTP_ERROR;
+	
+	otp_enroll_reader reader;
+	memset(&reader, 0, sizeof(reader));
+	reader.file = fopen(users_path, "rb");
+	reader.buffer = (char*) malloc(OTP_ENROLL_READ);
+	
+	uint64_t count = 0;
+	int ok = reader.file != NULL && reader.buffer != NULL && otp_enroll_count(&reader, &count) == OTP_OK;
+	if (ok)
+	{
+		rewind(reader.file);
+		reader.start = reader.end = 0;
+		reader.eof = 0;
+	}
+	
+	otp_enroll_state state;
+	memset(&state, 0, sizeof(state));
+	state.config = config;
+	
+	uint32_t threads = config->threads != 0 ? config->threads : otp_enroll_cpus();
+	state.slots = 2 * (size_t) threads + 2;
+	state.batches = ok ? (otp_enroll_batch*) calloc(state.slots, sizeof(otp_enroll_batch)) : NULL;
+	ok = ok && state.batches != NULL;
+	for (size_t i=0; ok && i<state.slots; i++)
+	{
+		otp_enroll_batch* batch = &state.batches[i];
+		batch->text = (char*) malloc(OTP_ENROLL_TEXT);
+		batch->secrets = (char*) malloc(OTP_ENROLL_BATCH * (config->secret_length + 1));
+		ok = batch->text != NULL && batch->secrets != NULL;
+	}
+	
+	int store_open = ok && otp_store_writer_open(&state.writer, keys_path, count) != NULL;
+	ok = store_open;
+	
+	state.export = ok ? otp_file_create(export_path, 0) : NULL;
+	ok = state.export != NULL;
+	if (ok)
+	{
+		setvbuf(state.export, NULL, _IOFBF, OTP_ENROLL_WRITE);
+		ok = fputs("key_id,issuer,name,secret,uri\n", state.export) >= 0;
+	}
+	
+	pthread_t* workers = ok ? (pthread_t*) calloc(threads, sizeof(pthread_t)) : NULL;
+	pthread_t writer;
+	uint32_t started = 0;
+	int writer_started = 0;
+	ok = ok && workers != NULL;
+	
+	if (ok)
+	{
+		pthread_mutex_init(&state.lock, NULL);
+		pthread_cond_init(&state.changed, NULL);
+		
+		writer_started = pthread_create(&writer, NULL, otp_enroll_writer, &state) == 0;
+		for (; writer_started && started<threads; started++)
+		{
+			if (pthread_create(&workers[started], NULL, otp_enroll_worker, &state) != 0)
+				break;
+		}
+		ok = writer_started && started > 0;
+	}
+	
+	// Read the users into batches, the workers pick them up as they fill
+	uint64_t read = 0;
+	otp_enroll_batch* batch = NULL;
+	char* line;
+	size_t length;
+	int next = 0;
+	while (ok && (next = otp_enroll_next_line(&reader, &line, &length)) == 1)
+	{
+		if (batch != NULL && (batch->users == OTP_ENROLL_BATCH || batch->text_length + length + 1 > OTP_ENROLL_TEXT))
+		{
+			otp_enroll_submit(&state, batch);
+			batch = NULL;
+		}
+		if (batch == NULL && (batch = otp_enroll_take(&state, read)) == NULL)
+			break;
+		
+		// The list changed since it was counted
+		if (read == count)
+		{
+			ok = 0;
+			break;
+		}
+		
+		memcpy(batch->text + batch->text_length, line, length + 1);
+		batch->text_length += length + 1;
+		batch->users++;
+		read++;
+	}
+	ok = ok && next == 0 && read == count;
+	if (batch != NULL && batch->users > 0)
+		otp_enroll_submit(&state, batch);
+	
+	if (writer_started)
+	{
+		pthread_mutex_lock(&state.lock);
+		state.reading_done = 1;
+		state.failed |= !ok;
+		pthread_cond_broadcast(&state.changed);
+		pthread_mutex_unlock(&state.lock);
+		
+		for (uint32_t i=0; i<started; i++)
+			pthread_join(workers[i], NULL);
+		pthread_join(writer, NULL);
+		ok = ok && !state.failed;
+		
+		pthread_cond_destroy(&state.changed);
+		pthread_mutex_destroy(&state.lock);
+	}
+	
+	if (state.export != NULL)
+	{
+		ok = ok && otp_file_sync(state.export);
+		ok = (fclose(state.export) == 0) && ok;
+	}
+	
+	if (store_open)
+	{
+		if (ok)
+			ok = otp_store_writer_close(&state.writer);
+		else
+			otp_store_writer_abort(&state.writer);
+	}
+	
+	// A partial export holds secrets of a keystore that was never written
+	if (!ok && state.export != NULL)
+		remove(export_path);
+	
+	for (size_t i=0; state.batches != NULL && i<state.slots; i++)
+	{
+		free(state.batches[i].text);
+		free(state.batches[i].secrets);
+		if (state.batches[i].export != NULL)
+			memset(state.batches[i].export, 0, state.batches[i].export_capacity);
+		free(state.batches[i].export);
+	}
+	free(state.batches);
+	free(workers);
+	free(reader.buffer);
+	if (reader.file != NULL)
+		fclose(reader.file);
+	
+	if (ok && out_count != NULL)
+		*out_count = count;
+	
+	return ok ? OTP_OK : OTP_ERROR;
+}
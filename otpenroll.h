@@ -0,0 +1,33 @@
+#pragma once
+
+#include "cotp.h"
+#include "otpstore.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Settings of a bulk enrollment, initialize with otp_enroll_config_new().
+*/
+typedef struct OTPEnrollConfig
+{
+	const char* issuer;     // Issuer of users listed without one
+	OTPStoreAlgo algo;
+	OTPType type;           // TOTP or HOTP
+	uint32_t digits;
+	uint32_t interval;      // TOTP exclusive
+	uint32_t secret_length; // Base32 characters per secret
+	uint64_t first_id;      // Key id of the first user, the others follow in order
+	uint32_t threads;       // Worker threads, 0 for one per online CPU
+} OTPEnrollConfig;
+
+/*
+	Enrollment functions
+*/
+OTPEnrollConfig* otp_enroll_config_new(OTPEnrollConfig* config, const char* issuer);
+COTPRESULT otp_enroll(const OTPEnrollConfig* config, const char* users_path, const char* keys_path, const char* export_path, uint64_t* out_count);
+
+#if defined(__cplusplus)
+}
+#endif
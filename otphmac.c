@@ -0,0 +1,190 @@
+#include "otphmac.h"
+#include "otpsha.h"
+
+#include <string.h>
+
+
+/*
+	Prepares the HMAC-SHA1 key schedule.
+	
+	ctx holds the inner state in u32[0..4] and the outer state in u32[5..9]
+	
+	Returns
+			1 success
+		error, 0
+*/
+static int otp_hmac_sha1_init(const char* key, int key_length, OTPAlgoCtx* ctx)
+{
+	if (key_length < 0 || (key == NULL && key_length > 0))
+		return 0;
+	
+	otp_sha1_hmac_init((const uint8_t*) key, (size_t) key_length, ctx->u32, ctx->u32 + 5);
+	
+	return 1;
+}
+
+/*
+	Computes HMAC-SHA1 of the 8 byte input with a prepared key.
+	
+	Returns
+			20, the length of the HMAC
+*/
+static int otp_hmac_sha1_compute(const OTPAlgoCtx* ctx, const char* input, char* output)
+{
+	uint32_t digest[5];
+	otp_sha1_hmac_counter(ctx->u32, ctx->u32 + 5, otp_load64be((const uint8_t*) input), digest);
+	
+	for (int i=0; i<5; i++)
+		otp_store32be((uint8_t*) output + i*4, digest[i]);
+	
+	return OTP_SHA1_BYTES;
+}
+
+/*
+	Prepares the HMAC-SHA256 key schedule.
+	
+	ctx holds the inner state in u32[0..7] and the outer state in u32[8..15]
+	
+	Returns
+			1 success
+		error, 0
+*/
+static int otp_hmac_sha256_init(const char* key, int key_length, OTPAlgoCtx* ctx)
+{
+	if (key_length < 0 || (key == NULL && key_length > 0))
+		return 0;
+	
+	otp_sha256_hmac_init((const uint8_t*) key, (size_t) key_length, ctx->u32, ctx->u32 + 8);
+	
+	return 1;
+}
+
+/*
+	Computes HMAC-SHA256 of the 8 byte input with a prepared key.
+	
+	Returns
+			32, the length of the HMAC
+*/
+static int otp_hmac_sha256_compute(const OTPAlgoCtx* ctx, const char* input, char* output)
+{
+	uint32_t digest[8];
+	otp_sha256_hmac_counter(ctx->u32, ctx->u32 + 8, otp_load64be((const uint8_t*) input), digest);
+	
+	for (int i=0; i<8; i++)
+		otp_store32be((uint8_t*) output + i*4, digest[i]);
+	
+	return OTP_SHA256_BYTES;
+}
+
+/*
+	Prepares the HMAC-SHA512 key schedule.
+	
+	ctx holds the inner state in u64[0..7] and the outer state in u64[8..15]
+	
+	Returns
+			1 success
+		error, 0
+*/
+static int otp_hmac_sha512_init(const char* key, int key_length, OTPAlgoCtx* ctx)
+{
+	if (key_length < 0 || (key == NULL && key_length > 0))
+		return 0;
+	
+	otp_sha512_hmac_init((const uint8_t*) key, (size_t) key_length, ctx->u64, ctx->u64 + 8);
+	
+	return 1;
+}
+
+/*
+	Computes HMAC-SHA512 of the 8 byte input with a prepared key.
+	
+	Returns
+			64, the length of the HMAC
+*/
+static int otp_hmac_sha512_compute(const OTPAlgoCtx* ctx, const char* input, char* output)
+{
+	uint64_t digest[8];
+	otp_sha512_hmac_counter(ctx->u64, ctx->u64 + 8, otp_load64be((const uint8_t*) input), digest);
+	
+	for (int i=0; i<8; i++)
+		otp_store64be((uint8_t*) output + i*8, digest[i]);
+	
+	return OTP_SHA512_BYTES;
+}
+
+
+const OTPAlgo OTP_HMAC_SHA1 = {
+	otp_hmac_sha1_init,
+	otp_hmac_sha1_compute,
+	NULL
+};
+
+const OTPAlgo OTP_HMAC_SHA256 = {
+	otp_hmac_sha256_init,
+	otp_hmac_sha256_compute,
+	NULL
+};
+
+const OTPAlgo OTP_HMAC_SHA512 = {
+	otp_hmac_sha512_init,
+	otp_hmac_sha512_compute,
+	NULL
+};
+
+
+/*
+	Computes HMAC-SHA1 of the 8 byte input, preparing the key every call.
+	
+	Returns
+			20, the length of the HMAC
+		error, 0
+*/
+int otp_algo_sha1(const char* key, int key_length, const char* input, char* output)
+{
+	OTPAlgoCtx ctx;
+	if (otp_hmac_sha1_init(key, key_length, &ctx) == 0)
+		return 0;
+	
+	int len = otp_hmac_sha1_compute(&ctx, input, output);
+	otp_sha_wipe(&ctx, sizeof(ctx));
+	
+	return len;
+}
+
+/*
+	Computes HMAC-SHA256 of the 8 byte input, preparing the key every call.
+	
+	Returns
+			32, the length of the HMAC
+		error, 0
+*/
+int otp_algo_sha256(const char* key, int key_length, const char* input, char* output)
+{
+	OTPAlgoCtx ctx;
+	if (otp_hmac_sha256_init(key, key_length, &ctx) == 0)
+		return 0;
+	
+	int len = otp_hmac_sha256_compute(&ctx, input, output);
+	otp_sha_wipe(&ctx, sizeof(ctx));
+	
+	return len;
+}
+
+/*
+	Computes HMAC-SHA512 of the 8 byte input, preparing the key every call.
+	
+	Returns
+			64, the length of the HMAC
+		error, 0
+*/
+int otp_algo_sha512(const char* key, int key_length, const char* input, char* output)
+{
+	OTPAlgoCtx ctx;
+	if (otp_hmac_sha512_init(key, key_length, &ctx) == 0)
+		return 0;
+	
+	int len = otp_hmac_sha512_compute(&ctx, input, output);
+	otp_sha_wipe(&ctx, sizeof(ctx));
+	
+	return len;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "cotp.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Built-in HMAC engines, specialized for the 8 byte counter
+	  every OTP hashes. No OpenSSL required.
+	
+	Set one as OTPData's hmac, then otp_prepare() caches
+	  the key schedule inside the OTPKey.
+*/
+extern const OTPAlgo OTP_HMAC_SHA1;
+extern const OTPAlgo OTP_HMAC_SHA256;
+extern const OTPAlgo OTP_HMAC_SHA512;
+
+/*
+	The same engines as one-shot COTP_ALGO functions
+*/
+int otp_algo_sha1(const char* key, int key_length, const char* input, char* output);
+int otp_algo_sha256(const char* key, int key_length, const char* input, char* output);
+int otp_algo_sha512(const char* key, int key_length, const char* input, char* output);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,762 @@
+#include "otpimport.h"
+#include "otpuri.h"
+#include "otphmac.h"
+#include "otpbase32.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#	include <windows.h>
+#else
+#	include <unistd.h>
+#endif
+
+
+/*
+	Bytes of input per chunk, chunks end on a line boundary.
+*/
+#define OTP_IMPORT_CHUNK (1 << 20)
+
+/*
+	One key found in the input, decoded but not yet scheduled.
+*/
+typedef struct otp_import_entry
+{
+	uint8_t key[OTP_KEY_MAX_LENGTH];
+	size_t key_length;
+	OTPStoreAlgo algo;
+	OTPType type;
+	uint32_t digits;
+	uint32_t interval;
+	uint64_t counter;
+	OTPUriSlice issuer; // Decoded bytes, empty without one
+	OTPUriSlice name;
+} otp_import_entry;
+
+/*
+	A range of whole lines of the input and what it yields.
+*/
+typedef struct otp_import_chunk
+{
+	const char* begin;
+	const char* end;
+	
+	uint64_t lines;        // Lines holding a URI
+	uint64_t records;      // Keys the lines yield
+	uint64_t first_line;   // Line number of begin
+	uint64_t first_record; // Index of the first key in the keystore
+	
+	char* report;
+	size_t report_length;
+	size_t report_capacity;
+	uint64_t failed;
+	
+	char* index; // `key_id,issuer,name` lines of the keys
+	size_t index_length;
+	size_t index_capacity;
+} otp_import_chunk;
+
+typedef struct otp_import_state
+{
+	otp_import_chunk* chunks;
+	size_t chunk_count;
+	size_t next_chunk;
+	int writing; // Second pass, write the records, the report and the index
+	int failed;
+	int indexing;
+	
+	OTPStoreWriter writer;
+	uint64_t first_id;
+} otp_import_state;
+
+/*
+	Scratch memory of one worker, grown to the longest line.
+*/
+typedef struct otp_import_scratch
+{
+	uint8_t* bytes;
+	size_t capacity;
+} otp_import_scratch;
+
+/*
+	Where a worker is within its chunk.
+*/
+typedef struct otp_import_cursor
+{
+	otp_import_state* state;
+	otp_import_chunk* chunk;
+	uint64_t line;
+	uint64_t record;
+} otp_import_cursor;
+
+/*
+	Appends a line to the error report of the chunk.
+*/
+static void otp_import_report(otp_import_cursor* cursor, int entry, const char* reason)
+{
+	otp_import_chunk* chunk = cursor->chunk;
+	chunk->failed++;
+	if (!cursor->state->writing)
+		return;
+	
+	if (chunk->report_capacity - chunk->report_length < 128)
+	{
+		size_t capacity = chunk->report_capacity * 2 + 4096;
+		char* grown = (char*) realloc(chunk->report, capacity);
+		if (grown == NULL)
+		{
+			__atomic_store_n(&cursor->state->failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		chunk->report = grown;
+		chunk->report_capacity = capacity;
+	}
+	
+	char* out = chunk->report + chunk->report_length;
+	size_t room = chunk->report_capacity - chunk->report_length;
+	int written = entry < 0
+		? snprintf(out, room, "line %" PRIu64 ": %s\n", cursor->line, reason)
+		: snprintf(out, room, "line %" PRIu64 " entry %d: %s\n", cursor->line, entry, reason);
+	if (written > 0 && (size_t) written < room)
+		chunk->report_length += (size_t) written;
+}
+
+/*
+	Appends a CSV field in quotes, doubling the quotes inside.
+*/
+static char* otp_import_quote(char* out, const OTPUriSlice* field)
+{
+	*out++ = '"';
+	for (size_t i=0; i<field->length; i++)
+	{
+		if (field->data[i] == '"')
+			*out++ = '"';
+		*out++ = field->data[i];
+	}
+	*out++ = '"';
+	return out;
+}
+
+/*
+	Appends the index line of a key to its chunk.
+*/
+static void otp_import_index(otp_import_cursor* cursor, uint64_t key_id, const otp_import_entry* entry)
+{
+	otp_import_chunk* chunk = cursor->chunk;
+	size_t needed = 24 + 2 * (entry->issuer.length + entry->name.length) + 8;
+	if (chunk->index_capacity - chunk->index_length < needed)
+	{
+		size_t capacity = chunk->index_capacity * 2 + needed + 4096;
+		char* grown = (char*) realloc(chunk->index, capacity);
+		if (grown == NULL)
+		{
+			__atomic_store_n(&cursor->state->failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		chunk->index = grown;
+		chunk->index_capacity = capacity;
+	}
+	
+	char* out = chunk->index + chunk->index_length;
+	out += sprintf(out, "%" PRIu64 ",", key_id);
+	out = otp_import_quote(out, &entry->issuer);
+	*out++ = ',';
+	out = otp_import_quote(out, &entry->name);
+	*out++ = '\n';
+	chunk->index_length = (size_t) (out - chunk->index);
+}
+
+/*
+	Counts a key in the first pass, writes it in the second.
+*/
+static void otp_import_emit(otp_import_cursor* cursor, const otp_import_entry* entry)
+{
+	otp_import_state* state = cursor->state;
+	if (state->writing)
+	{
+		uint64_t index = cursor->chunk->first_record + cursor->record;
+		uint64_t key_id = state->first_id + index;
+		
+		if (otp_store_record_from_key(&state->writer.records[index], key_id, entry->key, entry->key_length,
+				entry->algo, entry->type, entry->digits, entry->interval, entry->counter) == NULL)
+			__atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+		state->writer.ids[index] = key_id;
+		
+		if (state->indexing)
+			otp_import_index(cursor, key_id, entry);
+	}
+	else
+	{
+		cursor->chunk->records++;
+	}
+	cursor->record++;
+}
+
+static int otp_import_grow(otp_import_scratch* scratch, size_t size)
+{
+	if (size <= scratch->capacity)
+		return 1;
+	
+	uint8_t* grown = (uint8_t*) realloc(scratch->bytes, size);
+	if (grown == NULL)
+		return 0;
+	scratch->bytes = grown;
+	scratch->capacity = size;
+	return 1;
+}
+
+/*
+	Decodes standard or url-safe base64 in place, padding optional.
+	
+	Returns
+			the decoded length
+		error, SIZE_MAX
+*/
+static size_t otp_import_base64(uint8_t* data, size_t length)
+{
+	while (length > 0 && data[length - 1] == '=')
+		length--;
+	if (length % 4 == 1)
+		return SIZE_MAX;
+	
+	size_t out = 0;
+	uint32_t bits = 0;
+	int count = 0;
+	for (size_t i=0; i<length; i++)
+	{
+		uint8_t c = data[i];
+		int value;
+		if (c >= 'A' && c <= 'Z')
+			value = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			value = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			value = c - '0' + 52;
+		else if (c == '+' || c == '-')
+			value = 62;
+		else if (c == '/' || c == '_')
+			value = 63;
+		else
+			return SIZE_MAX;
+		
+		bits = (bits << 6) | (uint32_t) value;
+		count += 6;
+		if (count >= 8)
+		{
+			count -= 8;
+			data[out++] = (uint8_t) (bits >> count);
+		}
+	}
+	return out;
+}
+
+/*
+	Reads a protobuf varint.
+*/
+static int otp_import_varint(const uint8_t** p, const uint8_t* end, uint64_t* out_value)
+{
+	uint64_t value = 0;
+	for (int shift=0; shift<64 && *p < end; shift+=7)
+	{
+		uint8_t byte = *(*p)++;
+		value |= (uint64_t) (byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			*out_value = value;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	Reads the key of a protobuf field and, for length delimited
+	  fields, the bounds of its bytes. Other wire types are skipped
+	  unless they're varints, which land in out_value.
+*/
+static int otp_import_field(const uint8_t** p, const uint8_t* end, uint64_t* out_field, uint64_t* out_value, const uint8_t** out_bytes)
+{
+	uint64_t key;
+	if (!otp_import_varint(p, end, &key))
+		return 0;
+	
+	*out_field = key >> 3;
+	*out_bytes = NULL;
+	switch (key & 7)
+	{
+		case 0:
+			return otp_import_varint(p, end, out_value);
+		case 1:
+			if (end - *p < 8)
+				return 0;
+			*p += 8;
+			return 1;
+		case 2:
+			if (!otp_import_varint(p, end, out_value) || *out_value > (uint64_t) (end - *p))
+				return 0;
+			*out_bytes = *p;
+			*p += *out_value;
+			return 1;
+		case 5:
+			if (end - *p < 4)
+				return 0;
+			*p += 4;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+	Parses one OtpParameters message of a migration payload.
+	
+	Returns
+			the reason it's unusable
+		NULL, entry is filled
+*/
+static const char* otp_import_parameters(const uint8_t* p, const uint8_t* end, otp_import_entry* entry)
+{
+	uint64_t algorithm = 0;
+	uint64_t digits = 0;
+	uint64_t type = 0;
+	entry->key_length = 0;
+	entry->counter = 0;
+	entry->issuer = (OTPUriSlice) { NULL, 0 };
+	entry->name = (OTPUriSlice) { NULL, 0 };
+	
+	while (p < end)
+	{
+		uint64_t field;
+		uint64_t value = 0;
+		const uint8_t* bytes;
+		if (!otp_import_field(&p, end, &field, &value, &bytes))
+			return "malformed entry";
+		
+		switch (field)
+		{
+			case 1:
+				if (bytes == NULL || value == 0 || value > OTP_KEY_MAX_LENGTH)
+					return "invalid secret";
+				memcpy(entry->key, bytes, (size_t) value);
+				entry->key_length = (size_t) value;
+				break;
+			case 2:
+			case 3:
+				if (bytes == NULL)
+					return "malformed entry";
+				if (field == 2)
+					entry->name = (OTPUriSlice) { (const char*) bytes, (size_t) value };
+				else
+					entry->issuer = (OTPUriSlice) { (const char*) bytes, (size_t) value };
+				break;
+			case 4: algorithm = value; break;
+			case 5: digits = value; break;
+			case 6: type = value; break;
+			case 7: entry->counter = value; break;
+			default: break;
+		}
+	}
+	
+	if (entry->key_length == 0)
+		return "invalid secret";
+	
+	switch (algorithm)
+	{
+		case 0: case 1: entry->algo = OTP_STORE_SHA1; break;
+		case 2: entry->algo = OTP_STORE_SHA256; break;
+		case 3: entry->algo = OTP_STORE_SHA512; break;
+		default: return "unsupported algorithm";
+	}
+	switch (digits)
+	{
+		case 0: case 1: entry->digits = 6; break;
+		case 2: entry->digits = 8; break;
+		default: return "unsupported digits";
+	}
+	switch (type)
+	{
+		case 0: case 2: entry->type = TOTP; entry->interval = 30; entry->counter = 0; break;
+		case 1: entry->type = HOTP; entry->interval = 0; break;
+		default: return "unsupported type";
+	}
+	return NULL;
+}
+
+/*
+	Imports an otpauth-migration://offline?data=... line, a base64
+	  protobuf MigrationPayload of one or more keys.
+*/
+static void otp_import_migration(otp_import_cursor* cursor, const char* line, size_t length, otp_import_scratch* scratch)
+{
+	static const char PREFIX[] = "otpauth-migration://offline?data=";
+	size_t prefix = sizeof(PREFIX) - 1;
+	if (length <= prefix || memcmp(line, PREFIX, prefix) != 0)
+	{
+		otp_import_report(cursor, -1, "invalid migration uri");
+		return;
+	}
+	
+	// The data is usually the last parameter, anything after it is ignored
+	const char* data = line + prefix;
+	const char* data_end = (const char*) memchr(data, '&', length - prefix);
+	OTPUriSlice slice = { data, data_end != NULL ? (size_t) (data_end - data) : length - prefix };
+	
+	size_t decoded;
+	if (!otp_import_grow(scratch, slice.length + 1))
+	{
+		__atomic_store_n(&cursor->state->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (otpuri_decode(&slice, (char*) scratch->bytes, scratch->capacity, &decoded) != OTP_OK
+			|| (decoded = otp_import_base64(scratch->bytes, decoded)) == SIZE_MAX)
+	{
+		otp_import_report(cursor, -1, "invalid migration data");
+		return;
+	}
+	
+	// Check the framing first so a broken payload yields no keys at all
+	const uint8_t* end = scratch->bytes + decoded;
+	for (const uint8_t* p=scratch->bytes; p<end; )
+	{
+		uint64_t field;
+		uint64_t value;
+		const uint8_t* bytes;
+		if (!otp_import_field(&p, end, &field, &value, &bytes))
+		{
+			otp_import_report(cursor, -1, "invalid migration payload");
+			return;
+		}
+	}
+	
+	int index = 0;
+	for (const uint8_t* p=scratch->bytes; p<end; )
+	{
+		uint64_t field;
+		uint64_t value;
+		const uint8_t* bytes;
+		otp_import_field(&p, end, &field, &value, &bytes);
+		if (field != 1 || bytes == NULL)
+			continue;
+		
+		otp_import_entry entry;
+		const char* reason = otp_import_parameters(bytes, bytes + value, &entry);
+		if (reason != NULL)
+			otp_import_report(cursor, index, reason);
+		else
+			otp_import_emit(cursor, &entry);
+		memset(entry.key, 0, sizeof(entry.key));
+		index++;
+	}
+	
+	memset(scratch->bytes, 0, decoded);
+}
+
+/*
+	Imports an otpauth:// line.
+*/
+static void otp_import_uri(otp_import_cursor* cursor, const char* line, size_t length, otp_import_scratch* scratch)
+{
+	OTPUri uri;
+	if (otpuri_parse(&uri, line, length) != OTP_OK)
+	{
+		otp_import_report(cursor, -1, "invalid uri");
+		return;
+	}
+	
+	otp_import_entry entry;
+	const char* base32 = uri.secret.data;
+	size_t base32_length = uri.secret.length;
+	if (memchr(base32, '%', base32_length) != NULL)
+	{
+		if (!otp_import_grow(scratch, base32_length + 1))
+		{
+			__atomic_store_n(&cursor->state->failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		otpuri_decode(&uri.secret, (char*) scratch->bytes, scratch->capacity, &base32_length);
+		base32 = (const char*) scratch->bytes;
+	}
+	
+	if (otp_base32_decode(base32, base32_length, entry.key, sizeof(entry.key), &entry.key_length) != OTP_OK)
+	{
+		otp_import_report(cursor, -1, "invalid secret");
+		return;
+	}
+	
+	entry.algo = uri.hmac == &OTP_HMAC_SHA512 ? OTP_STORE_SHA512 : uri.hmac == &OTP_HMAC_SHA256 ? OTP_STORE_SHA256 : OTP_STORE_SHA1;
+	entry.type = uri.type;
+	entry.digits = uri.digits;
+	entry.interval = uri.interval;
+	entry.counter = uri.counter;
+	entry.issuer = (OTPUriSlice) { NULL, 0 };
+	entry.name = (OTPUriSlice) { NULL, 0 };
+	
+	// The secret is decoded already, the scratch holds the labels next
+	if (cursor->state->writing && cursor->state->indexing)
+	{
+		if (!otp_import_grow(scratch, uri.issuer.length + uri.name.length + 2))
+		{
+			__atomic_store_n(&cursor->state->failed, 1, __ATOMIC_RELAXED);
+			memset(entry.key, 0, sizeof(entry.key));
+			return;
+		}
+		char* labels = (char*) scratch->bytes;
+		otpuri_decode(&uri.issuer, labels, uri.issuer.length + 1, &entry.issuer.length);
+		otpuri_decode(&uri.name, labels + entry.issuer.length + 1, uri.name.length + 1, &entry.name.length);
+		entry.issuer.data = labels;
+		entry.name.data = labels + entry.issuer.length + 1;
+	}
+	
+	otp_import_emit(cursor, &entry);
+	memset(entry.key, 0, sizeof(entry.key));
+}
+
+/*
+	Runs one pass over the lines of a chunk.
+*/
+static void otp_import_chunk_run(otp_import_state* state, otp_import_chunk* chunk, otp_import_scratch* scratch)
+{
+	otp_import_cursor cursor = { state, chunk, chunk->first_line, 0 };
+	chunk->failed = 0;
+	
+	for (const char* p=chunk->begin; p<chunk->end; cursor.line++)
+	{
+		const char* newline = (const char*) memchr(p, '\n', (size_t) (chunk->end - p));
+		const char* line_end = newline != NULL ? newline : chunk->end;
+		const char* line = p;
+		size_t length = (size_t) (line_end - line);
+		p = line_end + (newline != NULL);
+		
+		if (length > 0 && line[length - 1] == '\r')
+			length--;
+		if (length == 0 || line[0] == '#')
+			continue;
+		
+		if (!state->writing)
+			chunk->lines++;
+		
+		if (length > 18 && memcmp(line, "otpauth-migration:", 18) == 0)
+			otp_import_migration(&cursor, line, length, scratch);
+		else
+			otp_import_uri(&cursor, line, length, scratch);
+	}
+}
+
+static void* otp_import_worker(void* arg)
+{
+	otp_import_state* state = (otp_import_state*) arg;
+	otp_import_scratch scratch = { NULL, 0 };
+	
+	for (;;)
+	{
+		size_t index = __atomic_fetch_add(&state->next_chunk, 1, __ATOMIC_RELAXED);
+		if (index >= state->chunk_count || __atomic_load_n(&state->failed, __ATOMIC_RELAXED))
+			break;
+		otp_import_chunk_run(state, &state->chunks[index], &scratch);
+	}
+	
+	if (scratch.bytes != NULL)
+		memset(scratch.bytes, 0, scratch.capacity);
+	free(scratch.bytes);
+	
+	return NULL;
+}
+
+/*
+	Runs a pass over every chunk on threads workers.
+*/
+static void otp_import_pass(otp_import_state* state, uint32_t threads)
+{
+	state->next_chunk = 0;
+	
+	pthread_t* workers = (pthread_t*) calloc(threads, sizeof(pthread_t));
+	uint32_t started = 0;
+	for (; workers != NULL && started<threads; started++)
+	{
+		if (pthread_create(&workers[started], NULL, otp_import_worker, state) != 0)
+			break;
+	}
+	
+	// Without threads the caller does the work
+	if (started == 0)
+		otp_import_worker(state);
+	for (uint32_t i=0; i<started; i++)
+		pthread_join(workers[i], NULL);
+	
+	free(workers);
+}
+
+/*
+	Returns the amount of online CPUs, at least 1.
+*/
+static uint32_t otp_import_cpus(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long cpus = (long) info.dwNumberOfProcessors;
+#else
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return cpus > 0 ? (uint32_t) cpus : 1;
+}
+
+/*
+	Tells an empty input apart from one that can't be read, empty
+	  files can't be mapped.
+*/
+static int otp_import_empty(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+		return 0;
+	
+	int empty = fgetc(file) == EOF && !ferror(file);
+	fclose(file);
+	return empty;
+}
+
+/*
+	Imports a file of otpauth:// URIs and otpauth-migration:// exports
+	  into a keystore.
+	
+	input_path holds one URI per line, empty lines and lines starting
+	  with # are skipped, an empty file gives an empty keystore
+	keys_path receives the keystore, the n-th key found gets key id
+	  first_id + n
+	report_path is optional, receives one line per skipped line or
+	  migration entry with its line number and the reason
+	index_path is optional, receives `key_id,issuer,name` lines in
+	  the order of the keys
+	threads is the amount of worker threads, 0 for one per online CPU
+	out_result is optional, receives the counts of the import
+	
+	The input is mapped and split into chunks of whole lines. Worker
+	  threads parse the chunks twice: once to count the keys so every
+	  chunk knows where its records go, then to decode and schedule
+	  them straight into the mapped keystore.
+	
+	Returns
+			1 success, lines that couldn't be imported are only reported
+		error, 0 a keystore already at keys_path is left as it was,
+			the partial index is removed
+*/
+COTPRESULT otp_import(const char* input_path, const char* keys_path, const char* report_path, const char* index_path, uint64_t first_id, uint32_t threads, OTPImportResult* out_result)
+{
+	if (input_path == NULL || keys_path == NULL)
+		return OTP_ERROR;
+	
+	// An empty input imports nothing into an empty keystore
+	OTPMap input;
+	if (!otp_map_open(&input, input_path, 0, 0) && !otp_import_empty(input_path))
+		return OTP_ERROR;
+	
+	otp_import_state state;
+	memset(&state, 0, sizeof(state));
+	state.first_id = first_id;
+	state.indexing = index_path != NULL;
+	
+	// Split at the first line break after every OTP_IMPORT_CHUNK bytes
+	const char* base = (const char*) input.base;
+	const char* end = base + input.size;
+	size_t max_chunks = input.size / OTP_IMPORT_CHUNK + 1;
+	state.chunks = (otp_import_chunk*) calloc(max_chunks, sizeof(otp_import_chunk));
+	for (const char* p=base; state.chunks != NULL && p<end; )
+	{
+		const char* split = (size_t) (end - p) > OTP_IMPORT_CHUNK ? p + OTP_IMPORT_CHUNK : end;
+		const char* newline = (const char*) memchr(split - 1, '\n', (size_t) (end - split + 1));
+		split = newline != NULL ? newline + 1 : end;
+		
+		state.chunks[state.chunk_count].begin = p;
+		state.chunks[state.chunk_count].end = split;
+		state.chunk_count++;
+		p = split;
+	}
+	
+	if (threads == 0)
+		threads = otp_import_cpus();
+	if (threads > state.chunk_count)
+		threads = state.chunk_count > 0 ? (uint32_t) state.chunk_count : 1;
+	
+	int ok = state.chunks != NULL;
+	if (ok)
+		otp_import_pass(&state, threads);
+	ok = ok && !state.failed;
+	
+	// Line numbers are only known for whole lines, count them per chunk
+	OTPImportResult result = { 0, 0, 0 };
+	uint64_t line = 1;
+	for (size_t i=0; ok && i<state.chunk_count; i++)
+	{
+		otp_import_chunk* chunk = &state.chunks[i];
+		chunk->first_line = line;
+		chunk->first_record = result.imported;
+		
+		for (const char* p=chunk->begin; (p = (const char*) memchr(p, '\n', (size_t) (chunk->end - p))) != NULL; p++)
+			line++;
+		
+		result.lines += chunk->lines;
+		result.imported += chunk->records;
+		result.failed += chunk->failed;
+	}
+	
+	int store_open = ok && otp_store_writer_open(&state.writer, keys_path, result.imported) != NULL;
+	ok = store_open;
+	if (ok)
+	{
+		state.writing = 1;
+		otp_import_pass(&state, threads);
+		ok = !state.failed;
+	}
+	
+	if (ok && report_path != NULL)
+	{
+		FILE* report = fopen(report_path, "wb");
+		ok = report != NULL;
+		for (size_t i=0; ok && i<state.chunk_count; i++)
+			ok = fwrite(state.chunks[i].report, 1, state.chunks[i].report_length, report) == state.chunks[i].report_length;
+		if (report != NULL)
+			ok = (fclose(report) == 0) && ok;
+	}
+	
+	int indexed = 0;
+	if (ok && index_path != NULL)
+	{
+		FILE* index = fopen(index_path, "wb");
+		indexed = index != NULL;
+		ok = indexed && fputs("key_id,issuer,name\n", index) >= 0;
+		for (size_t i=0; ok && i<state.chunk_count; i++)
+			ok = fwrite(state.chunks[i].index, 1, state.chunks[i].index_length, index) == state.chunks[i].index_length;
+		if (index != NULL)
+			ok = (fclose(index) == 0) && ok;
+	}
+	
+	if (store_open)
+	{
+		if (ok)
+			ok = otp_store_writer_close(&state.writer);
+		else
+			otp_store_writer_abort(&state.writer);
+	}
+	
+	// The index only describes a keystore that was written
+	if (!ok && indexed)
+		remove(index_path);
+	
+	for (size_t i=0; state.chunks != NULL && i<state.chunk_count; i++)
+	{
+		free(state.chunks[i].report);
+		free(state.chunks[i].index);
+	}
+	free(state.chunks);
+	otp_map_close(&input);
+	
+	if (ok && out_result != NULL)
+		*out_result = result;
+	
+	return ok ? OTP_OK : OTP_ERROR;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "cotp.h"
+#include "otpstore.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Counts of an import, see otp_import().
+*/
+typedef struct OTPImportResult
+{
+	uint64_t lines;    // Lines holding a URI
+	uint64_t imported; // Keys written to the keystore
+	uint64_t failed;   // Lines and migration entries reported and skipped
+} OTPImportResult;
+
+/*
+	Import functions
+*/
+COTPRESULT otp_import(const char* input_path, const char* keys_path, const char* report_path, const char* index_path, uint64_t first_id, uint32_t threads, OTPImportResult* out_result);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,345 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#	define _GNU_SOURCE
+#elif !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#	define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "otpmap.h"
+
+#if defined(_WIN32)
+#	include <windows.h>
+#	include <io.h>
+#	include <fcntl.h>
+#	include <sys/stat.h>
+#else
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+	Maps the file at path.
+	
+	size is the size to map, 0 maps the whole existing file. With
+	  OTP_MAP_WRITE a missing file is created and a shorter one grown
+	  to size, the new bytes read as zero.
+	flags are OTP_MAP_* flags or'd together
+	
+	Returns
+			1 success
+		error, 0
+*/
+int otp_map_open(OTPMap* map, const char* path, size_t size, int flags)
+{
+	if (map == NULL || path == NULL)
+		return 0;
+	
+	int writable = (flags & OTP_MAP_WRITE) != 0;
+	
+	map->base = NULL;
+	map->size = 0;
+	map->file = -1;
+	map->mapping = 0;
+	map->writable = writable;
+	
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, writable ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return 0;
+	
+	LARGE_INTEGER length;
+	if (!GetFileSizeEx(file, &length))
+	{
+		CloseHandle(file);
+		return 0;
+	}
+	
+	if (size == 0)
+		size = (size_t) length.QuadPart;
+	if (size == 0 || (!writable && (uint64_t) length.QuadPart < size))
+	{
+		CloseHandle(file);
+		return 0;
+	}
+	
+	// Mapping a file larger than it is grows it
+	uint64_t mapped = (uint64_t) length.QuadPart > size ? (uint64_t) length.QuadPart : size;
+	HANDLE mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD) (mapped >> 32), (DWORD) mapped, NULL);
+	if (mapping == NULL)
+	{
+		CloseHandle(file);
+		return 0;
+	}
+	
+	void* base = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+	if (base == NULL)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return 0;
+	}
+	
+	map->file = (intptr_t) file;
+	map->mapping = (intptr_t) mapping;
+#else
+	int fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+	if (fd < 0)
+		return 0;
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return 0;
+	}
+	
+	if (size == 0)
+		size = (size_t) st.st_size;
+	if (size == 0 || ((uint64_t) st.st_size < size && (!writable || ftruncate(fd, (off_t) size) != 0)))
+	{
+		close(fd);
+		return 0;
+	}
+	
+	int mflags = MAP_SHARED;
+#	if defined(MAP_POPULATE)
+	if (flags & OTP_MAP_POPULATE)
+		mflags |= MAP_POPULATE;
+#	endif
+	
+	void* base = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, mflags, fd, 0);
+	if (base == MAP_FAILED)
+	{
+		close(fd);
+		return 0;
+	}
+	
+#	if defined(MADV_HUGEPAGE)
+	if (flags & OTP_MAP_HUGE)
+		madvise(base, size, MADV_HUGEPAGE);
+#	endif
+	
+	map->file = fd;
+#endif
+	
+	map->base = (uint8_t*) base;
+	map->size = size;
+	
+	return 1;
+}
+
+/*
+	Writes the pages holding offset to offset+length back to the file,
+	  waiting for the disk when wait is set.
+	
+	Returns
+			1 success
+		error, 0
+*/
+int otp_map_sync(OTPMap* map, size_t offset, size_t length, int wait)
+{
+	if (map == NULL || map->base == NULL || offset > map->size)
+		return 0;
+	
+	if (length > map->size - offset)
+		length = map->size - offset;
+	
+#if defined(_WIN32)
+	if (!FlushViewOfFile(map->base + offset, length))
+		return 0;
+	return !wait || FlushFileBuffers((HANDLE) map->file);
+#else
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t start = offset - offset % page;
+	return msync(map->base + start, length + (offset - start), wait ? MS_SYNC : MS_ASYNC) == 0;
+#endif
+}
+
+/*
+	Unmaps and closes the file, without syncing it.
+*/
+void otp_map_close(OTPMap* map)
+{
+	if (map == NULL || map->base == NULL)
+		return;
+	
+#if defined(_WIN32)
+	UnmapViewOfFile(map->base);
+	CloseHandle((HANDLE) map->mapping);
+	CloseHandle((HANDLE) map->file);
+#else
+	munmap(map->base, map->size);
+	close((int) map->file);
+#endif
+	
+	map->base = NULL;
+	map->size = 0;
+	map->file = -1;
+	map->mapping = 0;
+}
+
+/*
+	Creates the file at path for writing, readable and writable by
+	  its owner only.
+	
+	exclusive fails when the file exists, otherwise it's truncated
+	
+	Returns
+			The file, opened "wb"
+		error, 0
+*/
+FILE* otp_file_create(const char* path, int exclusive)
+{
+	if (path == NULL)
+		return NULL;
+	
+#if defined(_WIN32)
+	int fd = _open(path, _O_WRONLY | _O_CREAT | _O_BINARY | (exclusive ? _O_EXCL : _O_TRUNC), _S_IREAD | _S_IWRITE);
+	if (fd < 0)
+		return NULL;
+	
+	FILE* file = _fdopen(fd, "wb");
+	if (file == NULL)
+		_close(fd);
+#else
+	int fd = open(path, O_WRONLY | O_CREAT | (exclusive ? O_EXCL : O_TRUNC), 0600);
+	if (fd < 0)
+		return NULL;
+	
+	// An existing file keeps its mode, take it back to the owner
+	if (!exclusive && fchmod(fd, 0600) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	
+	FILE* file = fdopen(fd, "wb");
+	if (file == NULL)
+		close(fd);
+#endif
+	
+	return file;
+}
+
+/*
+	Flushes file and waits for the disk.
+	
+	Returns
+			1 success
+		error, 0
+*/
+int otp_file_sync(FILE* file)
+{
+	if (file == NULL || fflush(file) != 0)
+		return 0;
+	
+#if defined(_WIN32)
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+/*
+	Renames from over to, replacing to in one step.
+	
+	Returns
+			1 success
+		error, 0
+*/
+int otp_file_replace(const char* from, const char* to)
+{
+	if (from == NULL || to == NULL)
+		return 0;
+	
+#if defined(_WIN32)
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(from, to) == 0;
+#endif
+}
+
+/*
+	Returns path with .tmp appended, where a file is written before
+	  otp_file_replace() moves it over path. Free it with free().
+	
+	Returns
+			The temporary path
+		error, 0
+*/
+char* otp_file_temp_path(const char* path)
+{
+	if (path == NULL)
+		return 0;
+	
+	size_t length = strlen(path);
+	char* temp = (char*) malloc(length + 5);
+	if (temp != NULL)
+	{
+		memcpy(temp, path, length);
+		memcpy(temp + length, ".tmp", 5);
+	}
+	return temp;
+}
+
+/*
+	Allocates zeroed memory kept out of swap, and out of core dumps
+	  where supported, for decrypted secrets. Locking is best effort,
+	  the memory is still returned when the lock limit is reached.
+	
+	size is rounded up to whole pages by the OS
+	
+	Returns
+			The memory
+		error, 0
+*/
+void* otp_locked_alloc(size_t size)
+{
+	if (size == 0)
+		return NULL;
+	
+#if defined(_WIN32)
+	void* memory = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (memory == NULL)
+		return NULL;
+	VirtualLock(memory, size);
+#else
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return NULL;
+#	if defined(MADV_DONTDUMP)
+	madvise(memory, size, MADV_DONTDUMP);
+#	endif
+	mlock(memory, size);
+#endif
+	
+	return memory;
+}
+
+/*
+	Wipes, unlocks and frees memory from otp_locked_alloc().
+*/
+void otp_locked_free(void* memory, size_t size)
+{
+	if (memory == NULL)
+		return;
+	
+	volatile uint8_t* bytes = (volatile uint8_t*) memory;
+	for (size_t i=0; i<size; i++)
+		bytes[i] = 0;
+	
+#if defined(_WIN32)
+	VirtualUnlock(memory, size);
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munlock(memory, size);
+	munmap(memory, size);
+#endif
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	otp_map_open flags, huge pages and populating are hints
+	  ignored where the OS doesn't support them.
+*/
+#define OTP_MAP_WRITE    1 // Map read-write, create and grow the file
+#define OTP_MAP_POPULATE 2 // Read the whole file in up front
+#define OTP_MAP_HUGE     4 // Back the mapping with huge pages
+
+/*
+	A file mapped into memory, shared with every process mapping it.
+	
+	Used by the counter store and the keystore, open with otp_map_open().
+*/
+typedef struct OTPMap
+{
+	uint8_t* base;
+	size_t size;
+	intptr_t file;
+	intptr_t mapping;
+	int writable;
+} OTPMap;
+
+/*
+	Map functions
+*/
+int otp_map_open(OTPMap* map, const char* path, size_t size, int flags);
+int otp_map_sync(OTPMap* map, size_t offset, size_t length, int wait);
+void otp_map_close(OTPMap* map);
+
+/*
+	Owner-only file functions, for files holding secrets
+*/
+FILE* otp_file_create(const char* path, int exclusive);
+int otp_file_sync(FILE* file);
+int otp_file_replace(const char* from, const char* to);
+char* otp_file_temp_path(const char* path);
+
+/*
+	Locked memory functions
+*/
+void* otp_locked_alloc(size_t size);
+void otp_locked_free(void* memory, size_t size);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,440 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#	define _GNU_SOURCE
+#endif
+
+#include "otppool.h"
+#include "otpbatch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#	include <windows.h>
+#else
+#	include <unistd.h>
+#endif
+
+
+/*
+	Amount of codes per chunk of otp_pool_generate_batch, a
+	  multiple of every SIMD lane count.
+*/
+#define OTP_POOL_GENERATE_CHUNK 2048
+
+/*
+	Amount of requests per chunk of otp_pool_verify_batch.
+*/
+#define OTP_POOL_VERIFY_CHUNK 64
+
+typedef struct otp_pool_job otp_pool_job;
+
+typedef void (*otp_pool_run)(const otp_pool_job* job, size_t begin, size_t end);
+
+/*
+	A batch call split into chunks of items.
+*/
+struct otp_pool_job
+{
+	otp_pool_run run;
+	size_t count;
+	size_t chunk;
+	atomic_int failed;
+	
+	const OTPAlgo* hmac;
+	const OTPKey* const* keys;
+	const uint64_t* counters;
+	uint32_t digits;
+	uint32_t* out_codes;
+	
+	OTPData* const* datas;
+	const uint32_t* codes;
+	const uint64_t* for_times;
+	const int64_t* windows;
+	uint8_t* out_results;
+	int64_t* out_offsets;
+};
+
+/*
+	A worker thread and the chunks it still owns, begin is
+	  taken by the owner and end is stolen by the others.
+	
+	Aligned so two workers never share a cache line.
+*/
+typedef struct otp_worker
+{
+	_Alignas(64) pthread_mutex_t lock;
+	size_t begin;
+	size_t end;
+	pthread_t thread;
+	struct otp_pool_state* state;
+	uint32_t index;
+	int cpu;
+} otp_worker;
+
+typedef struct otp_pool_state
+{
+	pthread_mutex_t submit;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	
+	const otp_pool_job* job;
+	uint64_t generation;
+	uint32_t active;
+	int stopping;
+	atomic_size_t remaining;
+	
+	uint32_t threads;
+	otp_worker* workers;
+	void* memory;
+} otp_pool_state;
+
+/*
+	Takes the next chunk from worker's own deque.
+	
+	Returns
+			1 a chunk was taken
+			0 the deque is empty
+*/
+static int otp_pool_pop(otp_worker* worker, size_t* out_chunk)
+{
+	int taken = 0;
+	pthread_mutex_lock(&worker->lock);
+	if (worker->begin < worker->end)
+	{
+		*out_chunk = worker->begin++;
+		taken = 1;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return taken;
+}
+
+/*
+	Moves the later half of the first non-empty deque after
+	  worker's into worker's own deque.
+	
+	Returns
+			1 chunks were stolen
+			0 every deque is empty
+*/
+static int otp_pool_steal(otp_pool_state* state, otp_worker* worker)
+{
+	for (uint32_t i=1; i<state->threads; i++)
+	{
+		otp_worker* victim = &state->workers[(worker->index + i) % state->threads];
+		
+		pthread_mutex_lock(&victim->lock);
+		size_t available = victim->end - victim->begin;
+		size_t stolen = (available + 1) / 2;
+		size_t end = victim->end;
+		victim->end -= stolen;
+		pthread_mutex_unlock(&victim->lock);
+		
+		if (stolen > 0)
+		{
+			pthread_mutex_lock(&worker->lock);
+			worker->begin = end - stolen;
+			worker->end = end;
+			pthread_mutex_unlock(&worker->lock);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	Runs chunks of job until no deque has any left.
+*/
+static void otp_pool_work(otp_pool_state* state, otp_worker* worker, const otp_pool_job* job)
+{
+	size_t chunk;
+	while (otp_pool_pop(worker, &chunk) || (otp_pool_steal(state, worker) && otp_pool_pop(worker, &chunk)))
+	{
+		size_t begin = chunk * job->chunk;
+		size_t end = begin + job->chunk < job->count ? begin + job->chunk : job->count;
+		job->run(job, begin, end);
+		
+		if (atomic_fetch_sub(&state->remaining, 1) == 1)
+		{
+			pthread_mutex_lock(&state->lock);
+			pthread_cond_broadcast(&state->done);
+			pthread_mutex_unlock(&state->lock);
+		}
+	}
+}
+
+static void* otp_pool_thread(void* arg)
+{
+	otp_worker* worker = (otp_worker*) arg;
+	otp_pool_state* state = worker->state;
+	
+#if defined(__linux__)
+	if (worker->cpu >= 0 && worker->cpu < CPU_SETSIZE)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(worker->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+	}
+#endif
+	
+	uint64_t seen = 0;
+	pthread_mutex_lock(&state->lock);
+	for (;;)
+	{
+		while (!state->stopping && state->generation == seen)
+			pthread_cond_wait(&state->wake, &state->lock);
+		if (state->stopping)
+			break;
+		
+		seen = state->generation;
+		const otp_pool_job* job = state->job;
+		if (job == NULL)
+			continue;
+		
+		state->active++;
+		pthread_mutex_unlock(&state->lock);
+		
+		otp_pool_work(state, worker, job);
+		
+		pthread_mutex_lock(&state->lock);
+		if (--state->active == 0)
+			pthread_cond_broadcast(&state->done);
+	}
+	pthread_mutex_unlock(&state->lock);
+	
+	return NULL;
+}
+
+/*
+	Returns the amount of online CPUs, at least 1.
+*/
+static uint32_t otp_pool_cpus(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long cpus = (long) info.dwNumberOfProcessors;
+#else
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return cpus > 0 ? (uint32_t) cpus : 1;
+}
+
+/*
+	Initializes a pool and starts its worker threads.
+	
+	pool is the pool to initialize
+	threads is the amount of worker threads, 0 for one per online CPU
+	cpus is optional, pins worker i to CPU cpus[i] where supported,
+	  negative entries aren't pinned, it holds threads entries so
+	  threads can't be 0 with it
+	
+	Returns
+			A pointer to the passed pool
+		error, 0
+*/
+OTPPool* otp_pool_new(OTPPool* pool, uint32_t threads, const int* cpus)
+{
+	if (pool == NULL || (cpus != NULL && threads == 0))
+		return 0;
+	
+	if (threads == 0)
+		threads = otp_pool_cpus();
+	
+	otp_pool_state* state = (otp_pool_state*) calloc(1, sizeof(otp_pool_state));
+	if (state == NULL)
+		return 0;
+	
+	// calloc doesn't promise cache line alignment, round the workers up to it
+	state->memory = calloc(1, threads * sizeof(otp_worker) + 64);
+	if (state->memory == NULL)
+	{
+		free(state);
+		return 0;
+	}
+	state->workers = (otp_worker*) (((uintptr_t) state->memory + 63) & ~(uintptr_t) 63);
+	
+	pthread_mutex_init(&state->submit, NULL);
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->wake, NULL);
+	pthread_cond_init(&state->done, NULL);
+	atomic_init(&state->remaining, 0);
+	
+	pool->state = state;
+	pool->threads = 0;
+	
+	for (uint32_t i=0; i<threads; i++)
+	{
+		otp_worker* worker = &state->workers[i];
+		pthread_mutex_init(&worker->lock, NULL);
+		worker->state = state;
+		worker->index = i;
+		worker->cpu = cpus != NULL ? cpus[i] : -1;
+		
+		if (pthread_create(&worker->thread, NULL, otp_pool_thread, worker) != 0)
+		{
+			pthread_mutex_destroy(&worker->lock);
+			otp_pool_free(pool);
+			return 0;
+		}
+		
+		state->threads = i + 1;
+		pool->threads = i + 1;
+	}
+	
+	return pool;
+}
+
+/*
+	Stops and joins the worker threads of a pool.
+*/
+void otp_pool_free(OTPPool* pool)
+{
+	if (pool == NULL || pool->state == NULL)
+		return;
+	
+	otp_pool_state* state = (otp_pool_state*) pool->state;
+	
+	pthread_mutex_lock(&state->lock);
+	state->stopping = 1;
+	pthread_cond_broadcast(&state->wake);
+	pthread_mutex_unlock(&state->lock);
+	
+	for (uint32_t i=0; i<state->threads; i++)
+	{
+		pthread_join(state->workers[i].thread, NULL);
+		pthread_mutex_destroy(&state->workers[i].lock);
+	}
+	
+	pthread_cond_destroy(&state->done);
+	pthread_cond_destroy(&state->wake);
+	pthread_mutex_destroy(&state->lock);
+	pthread_mutex_destroy(&state->submit);
+	free(state->memory);
+	free(state);
+	
+	pool->state = NULL;
+	pool->threads = 0;
+}
+
+/*
+	Deals the chunks of job evenly across the worker deques and
+	  waits until every chunk ran and every worker let go of job.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT otp_pool_submit(OTPPool* pool, otp_pool_job* job)
+{
+	size_t chunks = (job->count + job->chunk - 1) / job->chunk;
+	
+	// Not worth waking anyone for
+	if (chunks <= 1)
+	{
+		job->run(job, 0, job->count);
+		return atomic_load(&job->failed) ? OTP_ERROR : OTP_OK;
+	}
+	
+	otp_pool_state* state = (otp_pool_state*) pool->state;
+	pthread_mutex_lock(&state->submit);
+	
+	for (uint32_t i=0; i<state->threads; i++)
+	{
+		otp_worker* worker = &state->workers[i];
+		pthread_mutex_lock(&worker->lock);
+		worker->begin = chunks * i / state->threads;
+		worker->end = chunks * (i + 1) / state->threads;
+		pthread_mutex_unlock(&worker->lock);
+	}
+	
+	pthread_mutex_lock(&state->lock);
+	atomic_store(&state->remaining, chunks);
+	state->job = job;
+	state->generation++;
+	pthread_cond_broadcast(&state->wake);
+	
+	while (atomic_load(&state->remaining) > 0 || state->active > 0)
+		pthread_cond_wait(&state->done, &state->lock);
+	
+	state->job = NULL;
+	pthread_mutex_unlock(&state->lock);
+	
+	pthread_mutex_unlock(&state->submit);
+	
+	return atomic_load(&job->failed) ? OTP_ERROR : OTP_OK;
+}
+
+static void otp_pool_generate_run(const otp_pool_job* job, size_t begin, size_t end)
+{
+	otp_pool_job* mjob = (otp_pool_job*) job;
+	if (otp_generate_batch(job->hmac, job->keys + begin, job->counters + begin, end - begin, job->digits, job->out_codes + begin) != OTP_OK)
+		atomic_store(&mjob->failed, 1);
+}
+
+static void otp_pool_verify_run(const otp_pool_job* job, size_t begin, size_t end)
+{
+	otp_pool_job* mjob = (otp_pool_job*) job;
+	int64_t* out_offsets = job->out_offsets != NULL ? job->out_offsets + begin : NULL;
+	if (totp_verify_batch(job->datas + begin, job->codes + begin, job->for_times + begin, job->windows + begin, end - begin, job->out_results + begin, out_offsets) != OTP_OK)
+		atomic_store(&mjob->failed, 1);
+}
+
+/*
+	Same as otp_generate_batch, split across the pool's workers.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_pool_generate_batch(OTPPool* pool, const OTPAlgo* hmac, const OTPKey* const* keys, const uint64_t* counters, size_t count, uint32_t digits, uint32_t* out_codes)
+{
+	if (pool == NULL || pool->state == NULL || keys == NULL || counters == NULL || out_codes == NULL)
+		return OTP_ERROR;
+	
+	otp_pool_job job;
+	memset(&job, 0, sizeof(otp_pool_job));
+	job.run = otp_pool_generate_run;
+	job.count = count;
+	job.chunk = OTP_POOL_GENERATE_CHUNK;
+	atomic_init(&job.failed, 0);
+	job.hmac = hmac;
+	job.keys = keys;
+	job.counters = counters;
+	job.digits = digits;
+	job.out_codes = out_codes;
+	
+	return otp_pool_submit(pool, &job);
+}
+
+/*
+	Same as totp_verify_batch, split across the pool's workers.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_pool_verify_batch(OTPPool* pool, OTPData* const* datas, const uint32_t* codes, const uint64_t* for_times, const int64_t* windows, size_t count, uint8_t* out_results, int64_t* out_offsets)
+{
+	if (pool == NULL || pool->state == NULL || datas == NULL || codes == NULL
+			|| for_times == NULL || windows == NULL || out_results == NULL)
+		return OTP_ERROR;
+	
+	otp_pool_job job;
+	memset(&job, 0, sizeof(otp_pool_job));
+	job.run = otp_pool_verify_run;
+	job.count = count;
+	job.chunk = OTP_POOL_VERIFY_CHUNK;
+	atomic_init(&job.failed, 0);
+	job.datas = datas;
+	job.codes = codes;
+	job.for_times = for_times;
+	job.windows = windows;
+	job.out_results = out_results;
+	job.out_offsets = out_offsets;
+	
+	return otp_pool_submit(pool, &job);
+}
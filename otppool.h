@@ -0,0 +1,39 @@
+#pragma once
+
+#include "cotp.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	A pool of worker threads that splits batch calls into chunks.
+	
+	Every worker owns a deque of chunks and steals half of another
+	  worker's chunks once its own run out. Results are the same as
+	  the single threaded batch functions.
+	
+	Initialize with otp_pool_new() and release with otp_pool_free().
+	  Calls on the same pool are serialized.
+*/
+typedef struct OTPPool
+{
+	uint32_t threads;
+	void* state;
+} OTPPool;
+
+/*
+	Pool functions
+*/
+OTPPool* otp_pool_new(OTPPool* pool, uint32_t threads, const int* cpus);
+void otp_pool_free(OTPPool* pool);
+
+/*
+	Parallel batch functions
+*/
+COTPRESULT otp_pool_generate_batch(OTPPool* pool, const OTPAlgo* hmac, const OTPKey* const* keys, const uint64_t* counters, size_t count, uint32_t digits, uint32_t* out_codes);
+COTPRESULT otp_pool_verify_batch(OTPPool* pool, OTPData* const* datas, const uint32_t* codes, const uint64_t* for_times, const int64_t* windows, size_t count, uint8_t* out_results, int64_t* out_offsets);
+
+#if defined(__cplusplus)
+}
+#endif
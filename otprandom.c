@@ -0,0 +1,240 @@
+#include "otprandom.h"
+#include "otpbase32.h"
+
+#include <string.h>
+
+#include <openssl/rand.h>
+
+#if !defined(_WIN32)
+#	include <pthread.h>
+#endif
+
+
+/*
+	ChaCha20 blocks produced per refill, the first 32 bytes
+	  become the next key.
+*/
+#define OTP_RANDOM_BLOCKS 16
+#define OTP_RANDOM_BUFFER (OTP_RANDOM_BLOCKS * 64)
+
+/*
+	Base32 characters encoded per step of otp_random_base32_batch(),
+	  a multiple of 8 so only a secret's last step has a partial block.
+*/
+#define OTP_RANDOM_STEP 320
+
+typedef struct otp_random_state
+{
+	uint32_t key[8];
+	uint8_t buffer[OTP_RANDOM_BUFFER];
+	size_t available;
+	size_t since_seed;
+	uint32_t forks;
+	int seeded;
+} otp_random_state;
+
+static _Thread_local otp_random_state otp_random_local;
+
+static uint32_t otp_random_forks;
+
+#if !defined(_WIN32)
+static pthread_once_t otp_random_once = PTHREAD_ONCE_INIT;
+
+static void otp_random_forked(void)
+{
+	__atomic_add_fetch(&otp_random_forks, 1, __ATOMIC_RELAXED);
+}
+
+static void otp_random_register(void)
+{
+	pthread_atfork(NULL, NULL, otp_random_forked);
+}
+#endif
+
+#define OTP_QUARTER_ROUND(a, b, c, d) \
+	do { \
+		a += b; d ^= a; d = (d << 16) | (d >> 16); \
+		c += d; b ^= c; b = (b << 12) | (b >> 20); \
+		a += b; d ^= a; d = (d << 8) | (d >> 24); \
+		c += d; b ^= c; b = (b << 7) | (b >> 25); \
+	} while (0)
+
+/*
+	Writes one 64 byte ChaCha20 block of key at counter, zero nonce.
+*/
+static void otp_chacha20_block(const uint32_t key[8], uint32_t counter, uint8_t* out)
+{
+	uint32_t input[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		counter, 0, 0, 0
+	};
+	uint32_t x[16];
+	memcpy(x, input, sizeof(x));
+	
+	for (int i=0; i<10; i++)
+	{
+		OTP_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+		OTP_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+		OTP_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+		OTP_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+		OTP_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+		OTP_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+		OTP_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+		OTP_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+	}
+	
+	for (int i=0; i<16; i++)
+	{
+		uint32_t v = x[i] + input[i];
+		out[i * 4 + 0] = (uint8_t) v;
+		out[i * 4 + 1] = (uint8_t) (v >> 8);
+		out[i * 4 + 2] = (uint8_t) (v >> 16);
+		out[i * 4 + 3] = (uint8_t) (v >> 24);
+	}
+	
+	memset(x, 0, sizeof(x));
+	memset(input, 0, sizeof(input));
+}
+
+#undef OTP_QUARTER_ROUND
+
+/*
+	Refills the buffer of state, seeding it first when needed.
+	
+	Returns
+			1 success
+		error, 0
+*/
+static COTPRESULT otp_random_refill(otp_random_state* state)
+{
+	uint32_t forks = __atomic_load_n(&otp_random_forks, __ATOMIC_RELAXED);
+	
+	if (!state->seeded || state->since_seed >= OTP_RANDOM_RESEED || state->forks != forks)
+	{
+		uint32_t seed[8];
+		if (RAND_bytes((unsigned char*) seed, sizeof(seed)) != 1)
+			return OTP_ERROR;
+		
+		// Mixed into the old key, a weak seed never makes things worse
+		for (int i=0; i<8; i++)
+			state->key[i] ^= seed[i];
+		memset(seed, 0, sizeof(seed));
+		
+		state->since_seed = 0;
+		state->forks = forks;
+		state->seeded = 1;
+	}
+	
+	for (uint32_t i=0; i<OTP_RANDOM_BLOCKS; i++)
+		otp_chacha20_block(state->key, i, state->buffer + i * 64);
+	
+	// Fast key erasure, the key is replaced before any output is used
+	memcpy(state->key, state->buffer, sizeof(state->key));
+	memset(state->buffer, 0, sizeof(state->key));
+	
+	state->available = OTP_RANDOM_BUFFER - sizeof(state->key);
+	state->since_seed += OTP_RANDOM_BUFFER;
+	
+	return OTP_OK;
+}
+
+/*
+	Fills out with random bytes from the generator of the
+	  calling thread.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_random_bytes(uint8_t* out, size_t length)
+{
+	if (out == NULL && length > 0)
+		return OTP_ERROR;
+	
+#if !defined(_WIN32)
+	pthread_once(&otp_random_once, otp_random_register);
+#endif
+	
+	// A forked child drops what the parent had buffered and reseeds
+	otp_random_state* state = &otp_random_local;
+	if (state->forks != __atomic_load_n(&otp_random_forks, __ATOMIC_RELAXED))
+	{
+		memset(state->buffer, 0, sizeof(state->buffer));
+		state->available = 0;
+	}
+	
+	while (length > 0)
+	{
+		if (state->available == 0 && otp_random_refill(state) != OTP_OK)
+			return OTP_ERROR;
+		
+		size_t count = length < state->available ? length : state->available;
+		uint8_t* from = state->buffer + OTP_RANDOM_BUFFER - state->available;
+		memcpy(out, from, count);
+		memset(from, 0, count);
+		
+		state->available -= count;
+		out += count;
+		length -= count;
+	}
+	
+	return OTP_OK;
+}
+
+/*
+	Generates count random base32 secrets of len characters each.
+	
+	Every character carries 5 random bits, the bytes drawn from
+	  the generator are split into characters without rejection,
+	  only the unused bits of a secret's last byte are dropped.
+	
+	out_strs receives the null-terminated secrets, the first
+	  character of secret i is at out_strs + i * stride
+	stride is at least len + 1
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_random_base32_batch(size_t len, size_t count, char* out_strs, size_t stride)
+{
+	if (out_strs == NULL || len == 0 || stride <= len)
+		return OTP_ERROR;
+	
+	uint8_t bytes[OTP_RANDOM_STEP / 8 * 5];
+	char chars[OTP_RANDOM_STEP + 1];
+	COTPRESULT result = OTP_OK;
+	
+	for (size_t i=0; i<count && result == OTP_OK; i++)
+	{
+		char* out = out_strs + i * stride;
+		for (size_t done=0; done<len; done+=OTP_RANDOM_STEP)
+		{
+			size_t step = len - done < OTP_RANDOM_STEP ? len - done : OTP_RANDOM_STEP;
+			size_t length = (step * 5 + 7) / 8;
+			
+			if (otp_random_bytes(bytes, length) != OTP_OK || otp_base32_encode(bytes, length, chars, sizeof(chars), 0, NULL) != OTP_OK)
+			{
+				result = OTP_ERROR;
+				break;
+			}
+			memcpy(out + done, chars, step);
+		}
+		out[len] = '\0';
+	}
+	
+	memset(bytes, 0, sizeof(bytes));
+	memset(chars, 0, sizeof(chars));
+	
+	return result;
+}
+
+/*
+	Wipes the generator of the calling thread, call it before
+	  the thread exits. The next use seeds a fresh one.
+*/
+void otp_random_wipe(void)
+{
+	memset(&otp_random_local, 0, sizeof(otp_random_local));
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "cotp.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Buffered random functions.
+	
+	Every thread draws from its own ChaCha20 generator, seeded
+	  from RAND_bytes() on first use and reseeded every
+	  OTP_RANDOM_RESEED bytes and after fork(). Each refill replaces
+	  the generator key with its own output, so state captured later
+	  can't reproduce earlier output.
+*/
+#define OTP_RANDOM_RESEED (1 << 24)
+
+COTPRESULT otp_random_bytes(uint8_t* out, size_t length);
+COTPRESULT otp_random_base32_batch(size_t len, size_t count, char* out_strs, size_t stride);
+void otp_random_wipe(void);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,182 @@
+#include "otpreplay.h"
+
+#include <string.h>
+#include <stdatomic.h>
+
+
+/*
+	An entry packs a 40-bit key id fingerprint above a 24-bit
+	  timestep tag, 0 is an empty slot.
+*/
+#define OTP_REPLAY_TAG_BITS 24
+#define OTP_REPLAY_TAG_MASK ((UINT64_C(1) << OTP_REPLAY_TAG_BITS) - 1)
+
+/*
+	Largest horizon the 24-bit tag can tell apart in both directions.
+*/
+#define OTP_REPLAY_MAX_HORIZON (OTP_REPLAY_TAG_MASK >> 2)
+
+static uint64_t otp_replay_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= UINT64_C(0xBF58476D1CE4E5B9);
+	x ^= x >> 27;
+	x *= UINT64_C(0x94D049BB133111EB);
+	x ^= x >> 31;
+	return x;
+}
+
+/*
+	Returns the distance between two timestep tags, modulo 2^24.
+*/
+static uint64_t otp_replay_distance(uint64_t a, uint64_t b)
+{
+	uint64_t forward = (a - b) & OTP_REPLAY_TAG_MASK;
+	uint64_t backward = (b - a) & OTP_REPLAY_TAG_MASK;
+	return forward < backward ? forward : backward;
+}
+
+/*
+	Returns the amount of bytes a replay cache of shards times
+	  buckets needs, 0 when either isn't a power of two.
+*/
+size_t otp_replay_size(uint32_t shards, uint32_t buckets)
+{
+	if (shards == 0 || buckets == 0 || (shards & (shards - 1)) != 0 || (buckets & (buckets - 1)) != 0)
+		return 0;
+	
+	return (size_t) shards * buckets * OTP_REPLAY_BUCKET_SLOTS * sizeof(uint64_t);
+}
+
+/*
+	Initializes a replay cache over caller allocated memory.
+	
+	memory should be 64-byte aligned, at least 8-byte aligned,
+	  and hold otp_replay_size(shards, buckets) bytes
+	horizon must cover every timestep still accepted, twice the
+	  valid_window passed to totp_verify_once() at least
+	
+	Returns
+			A pointer to the passed cache
+		error, 0
+*/
+OTPReplay* otp_replay_new(OTPReplay* cache, void* memory, size_t memory_size, uint32_t shards, uint32_t buckets, uint64_t horizon)
+{
+	size_t size = otp_replay_size(shards, buckets);
+	if (cache == NULL || memory == NULL || size == 0 || memory_size < size
+			|| ((uintptr_t) memory & 7) != 0 || horizon > OTP_REPLAY_MAX_HORIZON)
+		return 0;
+	
+	memset(memory, 0, size);
+	
+	cache->shards = shards;
+	cache->buckets = buckets;
+	cache->horizon = horizon;
+	cache->slots = memory;
+	
+	return cache;
+}
+
+/*
+	Marks (key_id, timestep) as used unless it already was.
+	
+	Concurrent callers inserting the same pair never both succeed.
+	  If they race into different slots each one checks the bucket
+	  again after its compare-and-swap, and backs out when it sees
+	  the other's entry.
+	
+	Returns
+			1 the pair was inserted
+			0 the pair was already used, or its bucket is full of
+			  entries within the horizon
+		error, 0
+*/
+COTPRESULT otp_replay_insert(OTPReplay* cache, uint64_t key_id, uint64_t timestep)
+{
+	if (cache == NULL || cache->slots == NULL)
+		return OTP_ERROR;
+	
+	uint64_t fingerprint = otp_replay_mix(key_id) | 1;
+	uint64_t tag = timestep & OTP_REPLAY_TAG_MASK;
+	uint64_t entry = (fingerprint << OTP_REPLAY_TAG_BITS) | tag;
+	
+	uint64_t hash = otp_replay_mix(key_id ^ otp_replay_mix(timestep));
+	uint64_t shard = (hash >> 32) & (cache->shards - 1);
+	uint64_t bucket = hash & (cache->buckets - 1);
+	atomic_uint_least64_t* slots = (atomic_uint_least64_t*) cache->slots
+		+ (shard * cache->buckets + bucket) * OTP_REPLAY_BUCKET_SLOTS;
+	
+	for (;;)
+	{
+		int free_slot = -1;
+		uint64_t free_value = 0;
+		for (int i=0; i<OTP_REPLAY_BUCKET_SLOTS; i++)
+		{
+			uint64_t value = atomic_load(&slots[i]);
+			if (value == entry)
+				return OTP_ERROR;
+			
+			if (free_slot < 0 && (value == 0 || otp_replay_distance(value & OTP_REPLAY_TAG_MASK, tag) > cache->horizon))
+			{
+				free_slot = i;
+				free_value = value;
+			}
+		}
+		
+		if (free_slot < 0)
+			return OTP_ERROR;
+		
+		if (!atomic_compare_exchange_strong(&slots[free_slot], &free_value, entry))
+			continue;
+		
+		for (int i=0; i<OTP_REPLAY_BUCKET_SLOTS; i++)
+		{
+			if (i != free_slot && atomic_load(&slots[i]) == entry)
+			{
+				uint64_t expected = entry;
+				atomic_compare_exchange_strong(&slots[free_slot], &expected, 0);
+				return OTP_ERROR;
+			}
+		}
+		
+		return OTP_OK;
+	}
+}
+
+/*
+	Same as totp_verify_code_once, parsing key first.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT totp_verify_once(OTPData* data, OTPReplay* cache, uint64_t key_id, const char* key, uint64_t for_time, int64_t valid_window)
+{
+	uint32_t code;
+	if (data == NULL || key == NULL || otp_parse_key(key, data->digits, &code) != OTP_OK)
+		return OTP_ERROR;
+	
+	return totp_verify_code_once(data, cache, key_id, code, for_time, valid_window);
+}
+
+/*
+	Verifies code like totp_verify_code and marks the matched
+	  timestep of key_id as used in cache, in one step.
+	
+	key_id identifies the secret of data, e.g. a user id
+	
+	Returns
+			1 the code matched and wasn't used before
+		error, 0
+*/
+COTPRESULT totp_verify_code_once(OTPData* data, OTPReplay* cache, uint64_t key_id, uint32_t code, uint64_t for_time, int64_t valid_window)
+{
+	if (data == NULL || cache == NULL)
+		return OTP_ERROR;
+	
+	int64_t offset;
+	if (totp_verify_code(data, code, for_time, valid_window, &offset) != OTP_OK)
+		return OTP_ERROR;
+	
+	return otp_replay_insert(cache, key_id, totp_timecode(data, for_time) + (uint64_t) offset);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "cotp.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Slots per replay cache bucket, one cache line of entries.
+*/
+#define OTP_REPLAY_BUCKET_SLOTS 8
+
+/*
+	Remembers which (key id, timestep) pairs were already used so a
+	  code can't be accepted twice.
+	
+	The cache is split into shards of buckets, every bucket is one
+	  cache line of 64-bit entries updated with compare-and-swap, no
+	  locks are taken. An entry expires once a pair more than horizon
+	  timesteps away wants its slot.
+	
+	The memory is allocated by the caller, see otp_replay_size().
+	  Initialize with otp_replay_new().
+*/
+typedef struct OTPReplay
+{
+	uint32_t shards;  // Power of two
+	uint32_t buckets; // Buckets per shard, power of two
+	uint64_t horizon; // Timesteps an entry is kept at least
+	void* slots;
+} OTPReplay;
+
+/*
+	Replay cache functions
+*/
+size_t otp_replay_size(uint32_t shards, uint32_t buckets);
+OTPReplay* otp_replay_new(OTPReplay* cache, void* memory, size_t memory_size, uint32_t shards, uint32_t buckets, uint64_t horizon);
+COTPRESULT otp_replay_insert(OTPReplay* cache, uint64_t key_id, uint64_t timestep);
+
+/*
+	Verification with replay protection
+*/
+COTPRESULT totp_verify_once(OTPData* data, OTPReplay* cache, uint64_t key_id, const char* key, uint64_t for_time, int64_t valid_window);
+COTPRESULT totp_verify_code_once(OTPData* data, OTPReplay* cache, uint64_t key_id, uint32_t code, uint64_t for_time, int64_t valid_window);
+
+#if defined(__cplusplus)
+}
+#endif
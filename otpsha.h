@@ -0,0 +1,466 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+	SHA-1, SHA-256 and SHA-512 used by the built-in HMAC engines.
+	
+	Internal header. Everything is static inline so the engines
+	  can be specialized for the 8 byte OTP counter message, where
+	  the padding and length words are compile-time constants.
+	
+	Also included by cotp.hpp, where COTP::Fixed inlines it into
+	  each TOTP and HOTP specialization.
+*/
+
+#define OTP_ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define OTP_ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define OTP_ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define OTP_SHA1_BYTES		20
+#define OTP_SHA256_BYTES	32
+#define OTP_SHA512_BYTES	64
+
+static const uint32_t OTP_SHA1_IV[5] = {
+	0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static const uint32_t OTP_SHA256_IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint32_t OTP_SHA256_K[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static const uint64_t OTP_SHA512_IV[8] = {
+	0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+	0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+static const uint64_t OTP_SHA512_K[80] = {
+	0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL, 0xE9B5DBA58189DBBCULL,
+	0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL, 0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL,
+	0xD807AA98A3030242ULL, 0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+	0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL, 0xC19BF174CF692694ULL,
+	0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL, 0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL,
+	0x2DE92C6F592B0275ULL, 0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+	0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL, 0xBF597FC7BEEF0EE4ULL,
+	0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL, 0x06CA6351E003826FULL, 0x142929670A0E6E70ULL,
+	0x27B70A8546D22FFCULL, 0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+	0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL, 0x92722C851482353BULL,
+	0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL, 0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL,
+	0xD192E819D6EF5218ULL, 0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+	0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL, 0x34B0BCB5E19B48A8ULL,
+	0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL, 0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL,
+	0x748F82EE5DEFB2FCULL, 0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+	0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL, 0xC67178F2E372532BULL,
+	0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL, 0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL,
+	0x06F067AA72176FBAULL, 0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+	0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL, 0x431D67C49C100D4CULL,
+	0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL, 0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+};
+
+
+static inline uint32_t otp_load32be(const uint8_t* p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline uint64_t otp_load64be(const uint8_t* p)
+{
+	return ((uint64_t) otp_load32be(p) << 32) | otp_load32be(p + 4);
+}
+
+static inline void otp_store32be(uint8_t* p, uint32_t v)
+{
+	p[0] = (uint8_t) (v >> 24);
+	p[1] = (uint8_t) (v >> 16);
+	p[2] = (uint8_t) (v >> 8);
+	p[3] = (uint8_t) v;
+}
+
+static inline void otp_store64be(uint8_t* p, uint64_t v)
+{
+	otp_store32be(p, (uint32_t) (v >> 32));
+	otp_store32be(p + 4, (uint32_t) v);
+}
+
+static inline void otp_sha_wipe(void* p, size_t length)
+{
+	volatile uint8_t* v = (volatile uint8_t*) p;
+	for (size_t i=0; i<length; i++)
+		v[i] = 0;
+}
+
+
+/*
+	Compression functions, block is the message block as big-endian words.
+*/
+
+static inline void otp_sha1_compress(uint32_t state[5], const uint32_t block[16])
+{
+	uint32_t w[80];
+	for (int t=0; t<16; t++)
+		w[t] = block[t];
+	for (int t=16; t<80; t++)
+		w[t] = OTP_ROTL32(w[t-3] ^ w[t-8] ^ w[t-14] ^ w[t-16], 1);
+	
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+#define OTP_SHA1_ROUND(f, k, t) \
+	do { \
+		uint32_t tmp = OTP_ROTL32(a, 5) + (f) + e + (k) + w[t]; \
+		e = d; d = c; c = OTP_ROTL32(b, 30); b = a; a = tmp; \
+	} while (0)
+	
+	for (int t=0; t<20; t++)
+		OTP_SHA1_ROUND((b & c) | (~b & d), 0x5A827999, t);
+	for (int t=20; t<40; t++)
+		OTP_SHA1_ROUND(b ^ c ^ d, 0x6ED9EBA1, t);
+	for (int t=40; t<60; t++)
+		OTP_SHA1_ROUND((b & c) | (b & d) | (c & d), 0x8F1BBCDC, t);
+	for (int t=60; t<80; t++)
+		OTP_SHA1_ROUND(b ^ c ^ d, 0xCA62C1D6, t);
+
+#undef OTP_SHA1_ROUND
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+static inline void otp_sha256_compress(uint32_t state[8], const uint32_t block[16])
+{
+	uint32_t w[64];
+	for (int t=0; t<16; t++)
+		w[t] = block[t];
+	for (int t=16; t<64; t++)
+	{
+		uint32_t s0 = OTP_ROTR32(w[t-15], 7) ^ OTP_ROTR32(w[t-15], 18) ^ (w[t-15] >> 3);
+		uint32_t s1 = OTP_ROTR32(w[t-2], 17) ^ OTP_ROTR32(w[t-2], 19) ^ (w[t-2] >> 10);
+		w[t] = w[t-16] + s0 + w[t-7] + s1;
+	}
+	
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	
+	for (int t=0; t<64; t++)
+	{
+		uint32_t S1 = OTP_ROTR32(e, 6) ^ OTP_ROTR32(e, 11) ^ OTP_ROTR32(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + S1 + ch + OTP_SHA256_K[t] + w[t];
+		uint32_t S0 = OTP_ROTR32(a, 2) ^ OTP_ROTR32(a, 13) ^ OTP_ROTR32(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = S0 + maj;
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static inline void otp_sha512_compress(uint64_t state[8], const uint64_t block[16])
+{
+	uint64_t w[80];
+	for (int t=0; t<16; t++)
+		w[t] = block[t];
+	for (int t=16; t<80; t++)
+	{
+		uint64_t s0 = OTP_ROTR64(w[t-15], 1) ^ OTP_ROTR64(w[t-15], 8) ^ (w[t-15] >> 7);
+		uint64_t s1 = OTP_ROTR64(w[t-2], 19) ^ OTP_ROTR64(w[t-2], 61) ^ (w[t-2] >> 6);
+		w[t] = w[t-16] + s0 + w[t-7] + s1;
+	}
+	
+	uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+	
+	for (int t=0; t<80; t++)
+	{
+		uint64_t S1 = OTP_ROTR64(e, 14) ^ OTP_ROTR64(e, 18) ^ OTP_ROTR64(e, 41);
+		uint64_t ch = (e & f) ^ (~e & g);
+		uint64_t t1 = h + S1 + ch + OTP_SHA512_K[t] + w[t];
+		uint64_t S0 = OTP_ROTR64(a, 28) ^ OTP_ROTR64(a, 34) ^ OTP_ROTR64(a, 39);
+		uint64_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint64_t t2 = S0 + maj;
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+
+/*
+	Byte oriented block helpers, used only while preparing keys.
+*/
+
+static inline void otp_sha1_block(uint32_t state[5], const uint8_t* p)
+{
+	uint32_t w[16];
+	for (int i=0; i<16; i++)
+		w[i] = otp_load32be(p + i*4);
+	otp_sha1_compress(state, w);
+}
+
+static inline void otp_sha256_block(uint32_t state[8], const uint8_t* p)
+{
+	uint32_t w[16];
+	for (int i=0; i<16; i++)
+		w[i] = otp_load32be(p + i*4);
+	otp_sha256_compress(state, w);
+}
+
+static inline void otp_sha512_block(uint64_t state[8], const uint8_t* p)
+{
+	uint64_t w[16];
+	for (int i=0; i<16; i++)
+		w[i] = otp_load64be(p + i*8);
+	otp_sha512_compress(state, w);
+}
+
+/*
+	Full digests of arbitrary messages, used to shorten HMAC keys
+	  longer than the block size.
+*/
+
+static inline void otp_sha1_digest(const uint8_t* msg, size_t length, uint8_t out[OTP_SHA1_BYTES])
+{
+	uint32_t state[5];
+	memcpy(state, OTP_SHA1_IV, sizeof(state));
+	
+	size_t i = 0;
+	for (; length - i >= 64; i += 64)
+		otp_sha1_block(state, msg + i);
+	
+	uint8_t last[128];
+	memset(last, 0, sizeof(last));
+	size_t rem = length - i;
+	memcpy(last, msg + i, rem);
+	last[rem] = 0x80;
+	size_t blocks = rem + 9 > 64 ? 2 : 1;
+	otp_store64be(last + blocks*64 - 8, (uint64_t) length * 8);
+	for (size_t b=0; b<blocks; b++)
+		otp_sha1_block(state, last + b*64);
+	
+	for (int j=0; j<5; j++)
+		otp_store32be(out + j*4, state[j]);
+	otp_sha_wipe(last, sizeof(last));
+}
+
+static inline void otp_sha256_digest(const uint8_t* msg, size_t length, uint8_t out[OTP_SHA256_BYTES])
+{
+	uint32_t state[8];
+	memcpy(state, OTP_SHA256_IV, sizeof(state));
+	
+	size_t i = 0;
+	for (; length - i >= 64; i += 64)
+		otp_sha256_block(state, msg + i);
+	
+	uint8_t last[128];
+	memset(last, 0, sizeof(last));
+	size_t rem = length - i;
+	memcpy(last, msg + i, rem);
+	last[rem] = 0x80;
+	size_t blocks = rem + 9 > 64 ? 2 : 1;
+	otp_store64be(last + blocks*64 - 8, (uint64_t) length * 8);
+	for (size_t b=0; b<blocks; b++)
+		otp_sha256_block(state, last + b*64);
+	
+	for (int j=0; j<8; j++)
+		otp_store32be(out + j*4, state[j]);
+	otp_sha_wipe(last, sizeof(last));
+}
+
+static inline void otp_sha512_digest(const uint8_t* msg, size_t length, uint8_t out[OTP_SHA512_BYTES])
+{
+	uint64_t state[8];
+	memcpy(state, OTP_SHA512_IV, sizeof(state));
+	
+	size_t i = 0;
+	for (; length - i >= 128; i += 128)
+		otp_sha512_block(state, msg + i);
+	
+	uint8_t last[256];
+	memset(last, 0, sizeof(last));
+	size_t rem = length - i;
+	memcpy(last, msg + i, rem);
+	last[rem] = 0x80;
+	size_t blocks = rem + 17 > 128 ? 2 : 1;
+	otp_store64be(last + blocks*128 - 8, (uint64_t) length * 8);
+	for (size_t b=0; b<blocks; b++)
+		otp_sha512_block(state, last + b*128);
+	
+	for (int j=0; j<8; j++)
+		otp_store64be(out + j*8, state[j]);
+	otp_sha_wipe(last, sizeof(last));
+}
+
+
+/*
+	HMAC key schedules, the states after hashing the
+	  ipad and opad blocks.
+*/
+
+static inline void otp_sha1_hmac_init(const uint8_t* key, size_t key_length, uint32_t inner[5], uint32_t outer[5])
+{
+	uint8_t k[64];
+	memset(k, 0, sizeof(k));
+	if (key_length > 64)
+		otp_sha1_digest(key, key_length, k);
+	else
+		memcpy(k, key, key_length);
+	
+	uint8_t pad[64];
+	for (int i=0; i<64; i++)
+		pad[i] = k[i] ^ 0x36;
+	memcpy(inner, OTP_SHA1_IV, sizeof(OTP_SHA1_IV));
+	otp_sha1_block(inner, pad);
+	
+	for (int i=0; i<64; i++)
+		pad[i] = k[i] ^ 0x5C;
+	memcpy(outer, OTP_SHA1_IV, sizeof(OTP_SHA1_IV));
+	otp_sha1_block(outer, pad);
+	
+	otp_sha_wipe(k, sizeof(k));
+	otp_sha_wipe(pad, sizeof(pad));
+}
+
+static inline void otp_sha256_hmac_init(const uint8_t* key, size_t key_length, uint32_t inner[8], uint32_t outer[8])
+{
+	uint8_t k[64];
+	memset(k, 0, sizeof(k));
+	if (key_length > 64)
+		otp_sha256_digest(key, key_length, k);
+	else
+		memcpy(k, key, key_length);
+	
+	uint8_t pad[64];
+	for (int i=0; i<64; i++)
+		pad[i] = k[i] ^ 0x36;
+	memcpy(inner, OTP_SHA256_IV, sizeof(OTP_SHA256_IV));
+	otp_sha256_block(inner, pad);
+	
+	for (int i=0; i<64; i++)
+		pad[i] = k[i] ^ 0x5C;
+	memcpy(outer, OTP_SHA256_IV, sizeof(OTP_SHA256_IV));
+	otp_sha256_block(outer, pad);
+	
+	otp_sha_wipe(k, sizeof(k));
+	otp_sha_wipe(pad, sizeof(pad));
+}
+
+static inline void otp_sha512_hmac_init(const uint8_t* key, size_t key_length, uint64_t inner[8], uint64_t outer[8])
+{
+	uint8_t k[128];
+	memset(k, 0, sizeof(k));
+	if (key_length > 128)
+		otp_sha512_digest(key, key_length, k);
+	else
+		memcpy(k, key, key_length);
+	
+	uint8_t pad[128];
+	for (int i=0; i<128; i++)
+		pad[i] = k[i] ^ 0x36;
+	memcpy(inner, OTP_SHA512_IV, sizeof(OTP_SHA512_IV));
+	otp_sha512_block(inner, pad);
+	
+	for (int i=0; i<128; i++)
+		pad[i] = k[i] ^ 0x5C;
+	memcpy(outer, OTP_SHA512_IV, sizeof(OTP_SHA512_IV));
+	otp_sha512_block(outer, pad);
+	
+	otp_sha_wipe(k, sizeof(k));
+	otp_sha_wipe(pad, sizeof(pad));
+}
+
+
+/*
+	HMAC of the 8 byte counter with a prepared key schedule.
+	
+	The message always fits one block after the ipad block, so
+	  only the counter words vary. Likewise the inner digest
+	  always fits one block after the opad block.
+*/
+
+static inline void otp_sha1_hmac_counter(const uint32_t inner[5], const uint32_t outer[5], uint64_t counter, uint32_t digest[5])
+{
+	uint32_t w[16] = {
+		(uint32_t) (counter >> 32), (uint32_t) counter, 0x80000000, 0,
+		0, 0, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, (64 + 8) * 8
+	};
+	
+	uint32_t s[5];
+	memcpy(s, inner, sizeof(s));
+	otp_sha1_compress(s, w);
+	
+	uint32_t o[16] = {
+		s[0], s[1], s[2], s[3],
+		s[4], 0x80000000, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, (64 + OTP_SHA1_BYTES) * 8
+	};
+	
+	memcpy(digest, outer, sizeof(s));
+	otp_sha1_compress(digest, o);
+}
+
+static inline void otp_sha256_hmac_counter(const uint32_t inner[8], const uint32_t outer[8], uint64_t counter, uint32_t digest[8])
+{
+	uint32_t w[16] = {
+		(uint32_t) (counter >> 32), (uint32_t) counter, 0x80000000, 0,
+		0, 0, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, (64 + 8) * 8
+	};
+	
+	uint32_t s[8];
+	memcpy(s, inner, sizeof(s));
+	otp_sha256_compress(s, w);
+	
+	uint32_t o[16] = {
+		s[0], s[1], s[2], s[3],
+		s[4], s[5], s[6], s[7],
+		0x80000000, 0, 0, 0,
+		0, 0, 0, (64 + OTP_SHA256_BYTES) * 8
+	};
+	
+	memcpy(digest, outer, sizeof(s));
+	otp_sha256_compress(digest, o);
+}
+
+static inline void otp_sha512_hmac_counter(const uint64_t inner[8], const uint64_t outer[8], uint64_t counter, uint64_t digest[8])
+{
+	uint64_t w[16] = {
+		counter, 0x8000000000000000ULL, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, 0,
+		0, 0, 0, (128 + 8) * 8
+	};
+	
+	uint64_t s[8];
+	memcpy(s, inner, sizeof(s));
+	otp_sha512_compress(s, w);
+	
+	uint64_t o[16] = {
+		s[0], s[1], s[2], s[3],
+		s[4], s[5], s[6], s[7],
+		0x8000000000000000ULL, 0, 0, 0,
+		0, 0, 0, (128 + OTP_SHA512_BYTES) * 8
+	};
+	
+	memcpy(digest, outer, sizeof(s));
+	otp_sha512_compress(digest, o);
+}
@@ -0,0 +1,452 @@
+#include "otpstore.h"
+#include "otphmac.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define OTP_STORE_MAGIC "COTPKEY1"
+#define OTP_STORE_VERSION 1
+#define OTP_STORE_ENDIAN 0x01020304u
+#define OTP_STORE_HEADER 64
+
+_Static_assert(sizeof(OTPStoreRecord) == 320, "OTPStoreRecord must be five cache lines");
+
+/*
+	The header at the start of a keystore file.
+*/
+typedef struct otp_store_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint32_t record_size;
+	uint32_t reserved;
+	uint64_t count;
+	uint64_t ids_offset;
+	uint64_t records_offset;
+	uint8_t padding[16];
+} otp_store_header;
+
+static uint64_t otp_store_records_offset(uint64_t count)
+{
+	return (OTP_STORE_HEADER + count * sizeof(uint64_t) + 63) & ~(uint64_t) 63;
+}
+
+static const OTPAlgo* otp_store_hmac(uint8_t algo)
+{
+	switch (algo)
+	{
+		case OTP_STORE_SHA1: return &OTP_HMAC_SHA1;
+		case OTP_STORE_SHA256: return &OTP_HMAC_SHA256;
+		case OTP_STORE_SHA512: return &OTP_HMAC_SHA512;
+		default: return NULL;
+	}
+}
+
+static COTP_ALGO otp_store_algo(uint8_t algo)
+{
+	switch (algo)
+	{
+		case OTP_STORE_SHA1: return otp_algo_sha1;
+		case OTP_STORE_SHA256: return otp_algo_sha256;
+		case OTP_STORE_SHA512: return otp_algo_sha512;
+		default: return NULL;
+	}
+}
+
+/*
+	Maps the keystore at path read-only, nothing is parsed or copied.
+	
+	flags are OTP_MAP_POPULATE and OTP_MAP_HUGE hints
+	
+	Returns
+			A pointer to the passed store
+		error, 0
+*/
+OTPStore* otp_store_open(OTPStore* store, const char* path, int flags)
+{
+	if (store == NULL || path == NULL)
+		return 0;
+	
+	if (!otp_map_open(&store->map, path, 0, flags & ~OTP_MAP_WRITE))
+		return 0;
+	
+	otp_store_header header;
+	if (store->map.size < OTP_STORE_HEADER)
+	{
+		otp_map_close(&store->map);
+		return 0;
+	}
+	memcpy(&header, store->map.base, sizeof(header));
+	
+	uint64_t max_count = (store->map.size - OTP_STORE_HEADER) / (sizeof(uint64_t) + sizeof(OTPStoreRecord));
+	if (memcmp(header.magic, OTP_STORE_MAGIC, 8) != 0 || header.version != OTP_STORE_VERSION
+			|| header.endian != OTP_STORE_ENDIAN || header.record_size != sizeof(OTPStoreRecord)
+			|| header.count > max_count || header.ids_offset != OTP_STORE_HEADER
+			|| header.records_offset != otp_store_records_offset(header.count)
+			|| header.records_offset + header.count * sizeof(OTPStoreRecord) > store->map.size)
+	{
+		otp_map_close(&store->map);
+		return 0;
+	}
+	
+	store->count = header.count;
+	store->ids = (const uint64_t*) (store->map.base + header.ids_offset);
+	store->records = (const OTPStoreRecord*) (store->map.base + header.records_offset);
+	
+	return store;
+}
+
+/*
+	Unmaps a keystore, every OTPData made from it becomes invalid.
+*/
+void otp_store_close(OTPStore* store)
+{
+	if (store == NULL)
+		return;
+	
+	otp_map_close(&store->map);
+	store->count = 0;
+	store->ids = NULL;
+	store->records = NULL;
+}
+
+/*
+	Looks up the record of key_id, a binary search over the ids.
+	
+	Returns
+			A pointer into the mapped keystore
+		not found, 0
+*/
+const OTPStoreRecord* otp_store_find(const OTPStore* store, uint64_t key_id)
+{
+	if (store == NULL || store->ids == NULL)
+		return NULL;
+	
+	uint64_t low = 0;
+	uint64_t high = store->count;
+	while (low < high)
+	{
+		uint64_t middle = low + (high - low) / 2;
+		if (store->ids[middle] < key_id)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	
+	if (low == store->count || store->ids[low] != key_id)
+		return NULL;
+	
+	return &store->records[low];
+}
+
+/*
+	Initializes data to generate and verify with record's key,
+	  which stays in the mapped keystore.
+	
+	data is a non-initialized OTPData
+	time is used for TOTP records, may be NULL otherwise
+	
+	Returns
+			A pointer to the passed data
+		error, 0
+*/
+OTPData* otp_store_data(OTPData* data, const OTPStoreRecord* record, COTP_TIME time)
+{
+	if (data == NULL || record == NULL || !record->key.scheduled)
+		return 0;
+	
+	const OTPAlgo* hmac = otp_store_hmac(record->algo);
+	COTP_ALGO algo = otp_store_algo(record->algo);
+	if (hmac == NULL)
+		return 0;
+	
+	OTPData* res;
+	switch (record->type)
+	{
+		case TOTP: res = totp_new(data, "", algo, time, record->digits, record->interval); break;
+		case HOTP: res = hotp_new(data, "", algo, record->digits, record->counter); break;
+		case OTP: res = otp_new(data, "", algo, record->digits); break;
+		default: return 0;
+	}
+	if (res == NULL)
+		return 0;
+	
+	data->key = &record->key;
+	data->hmac = hmac;
+	
+	return data;
+}
+
+/*
+	Checks the parameters of a record and clears it.
+*/
+static const OTPAlgo* otp_store_record_check(OTPStoreRecord* record, OTPStoreAlgo algo, OTPType type, uint32_t digits, uint32_t interval)
+{
+	const OTPAlgo* hmac = otp_store_hmac((uint8_t) algo);
+	if (record == NULL || hmac == NULL || digits == 0 || digits > OTP_MAX_DIGITS
+			|| (type != OTP && type != TOTP && type != HOTP) || (type == TOTP && interval == 0))
+		return NULL;
+	
+	memset(record, 0, sizeof(OTPStoreRecord));
+	return hmac;
+}
+
+/*
+	Schedules the key of a checked record and fills in the rest.
+*/
+static OTPStoreRecord* otp_store_record_finish(OTPStoreRecord* record, const OTPAlgo* hmac, uint64_t key_id, OTPStoreAlgo algo, OTPType type, uint32_t digits, uint32_t interval, uint64_t counter)
+{
+	if (!hmac->init((const char*) record->key.bytes, (int) record->key.length, &record->key.ctx))
+	{
+		otp_key_wipe(&record->key);
+		return 0;
+	}
+	record->key.scheduled = 1;
+	
+	record->key_id = key_id;
+	record->counter = counter;
+	record->interval = interval;
+	record->algo = (uint8_t) algo;
+	record->digits = (uint8_t) digits;
+	record->type = (uint8_t) type;
+	
+	return record;
+}
+
+/*
+	Initializes a keystore record, decoding and scheduling the secret.
+	
+	Returns
+			A pointer to the passed record
+		error, 0
+*/
+OTPStoreRecord* otp_store_record_new(OTPStoreRecord* record, uint64_t key_id, const char* base32_secret, OTPStoreAlgo algo, OTPType type, uint32_t digits, uint32_t interval, uint64_t counter)
+{
+	const OTPAlgo* hmac = otp_store_record_check(record, algo, type, digits, interval);
+	if (hmac == NULL || otp_key_new(&record->key, base32_secret) == NULL)
+		return 0;
+	
+	return otp_store_record_finish(record, hmac, key_id, algo, type, digits, interval, counter);
+}
+
+/*
+	Initializes a keystore record from a secret already decoded,
+	  scheduling it.
+	
+	key_length is at most OTP_KEY_MAX_LENGTH
+	
+	Returns
+			A pointer to the passed record
+		error, 0
+*/
+OTPStoreRecord* otp_store_record_from_key(OTPStoreRecord* record, uint64_t key_id, const uint8_t* key, size_t key_length, OTPStoreAlgo algo, OTPType type, uint32_t digits, uint32_t interval, uint64_t counter)
+{
+	if (key == NULL || key_length > OTP_KEY_MAX_LENGTH)
+		return 0;
+	
+	const OTPAlgo* hmac = otp_store_record_check(record, algo, type, digits, interval);
+	if (hmac == NULL)
+		return 0;
+	
+	memcpy(record->key.bytes, key, key_length);
+	record->key.length = (uint32_t) key_length;
+	
+	return otp_store_record_finish(record, hmac, key_id, algo, type, digits, interval, counter);
+}
+
+static int otp_store_compare(const void* a, const void* b)
+{
+	uint64_t x = ((const OTPStoreRecord*) a)->key_id;
+	uint64_t y = ((const OTPStoreRecord*) b)->key_id;
+	return (x > y) - (x < y);
+}
+
+/*
+	Fills the header of a keystore of count records.
+*/
+static void otp_store_header_new(otp_store_header* header, uint64_t count)
+{
+	memset(header, 0, sizeof(otp_store_header));
+	memcpy(header->magic, OTP_STORE_MAGIC, 8);
+	header->version = OTP_STORE_VERSION;
+	header->endian = OTP_STORE_ENDIAN;
+	header->record_size = sizeof(OTPStoreRecord);
+	header->count = count;
+	header->ids_offset = OTP_STORE_HEADER;
+	header->records_offset = otp_store_records_offset(count);
+}
+
+/*
+	Writes count records as a keystore at path, replacing it.
+	
+	records are sorted by key id in place, key ids must be unique
+	
+	The keystore is written to path.tmp, readable by its owner only,
+	  and renamed over path once synced. A keystore already at path is
+	  left as it was on error.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_store_write(const char* path, OTPStoreRecord* records, size_t count)
+{
+	if (path == NULL || (records == NULL && count > 0))
+		return OTP_ERROR;
+	
+	qsort(records, count, sizeof(OTPStoreRecord), otp_store_compare);
+	for (size_t i=1; i<count; i++)
+	{
+		if (records[i].key_id == records[i - 1].key_id)
+			return OTP_ERROR;
+	}
+	
+	otp_store_header header;
+	otp_store_header_new(&header, count);
+	
+	char* temp = otp_file_temp_path(path);
+	if (temp == NULL)
+		return OTP_ERROR;
+	
+	remove(temp);
+	FILE* file = otp_file_create(temp, 1);
+	if (file == NULL)
+	{
+		free(temp);
+		return OTP_ERROR;
+	}
+	
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	for (size_t i=0; ok && i<count; i++)
+		ok = fwrite(&records[i].key_id, sizeof(uint64_t), 1, file) == 1;
+	
+	static const uint8_t zeros[64] = { 0 };
+	size_t padding = (size_t) (header.records_offset - OTP_STORE_HEADER - count * sizeof(uint64_t));
+	if (ok && padding > 0)
+		ok = fwrite(zeros, padding, 1, file) == 1;
+	if (ok && count > 0)
+		ok = fwrite(records, sizeof(OTPStoreRecord), count, file) == count;
+	
+	ok = ok && otp_file_sync(file);
+	ok = (fclose(file) == 0) && ok;
+	ok = ok && otp_file_replace(temp, path);
+	if (!ok)
+		remove(temp);
+	free(temp);
+	return ok ? OTP_OK : OTP_ERROR;
+}
+
+/*
+	Closes the map of writer, removes its temporary file unless it
+	  was renamed and frees its paths.
+*/
+static void otp_store_writer_release(OTPStoreWriter* writer, int renamed)
+{
+	otp_map_close(&writer->map);
+	if (!renamed && writer->temp_path != NULL)
+		remove(writer->temp_path);
+	
+	free(writer->path);
+	free(writer->temp_path);
+	writer->path = NULL;
+	writer->temp_path = NULL;
+	writer->ids = NULL;
+	writer->records = NULL;
+}
+
+/*
+	Creates a keystore file of count records to fill in place.
+	
+	The records are written to path.tmp, owner-only, which replaces
+	  path in otp_store_writer_close(). Any keystore at path stays
+	  until then.
+	
+	Returns
+			A pointer to the passed writer
+		error, 0
+*/
+OTPStoreWriter* otp_store_writer_open(OTPStoreWriter* writer, const char* path, uint64_t count)
+{
+	if (writer == NULL || path == NULL || count > (SIZE_MAX - OTP_STORE_HEADER) / (sizeof(uint64_t) + sizeof(OTPStoreRecord)))
+		return 0;
+	
+	memset(writer, 0, sizeof(OTPStoreWriter));
+	size_t length = strlen(path);
+	writer->path = (char*) malloc(length + 1);
+	writer->temp_path = otp_file_temp_path(path);
+	if (writer->path == NULL || writer->temp_path == NULL)
+	{
+		otp_store_writer_release(writer, 1);
+		return 0;
+	}
+	memcpy(writer->path, path, length + 1);
+	
+	// A larger leftover file wouldn't shrink under the map
+	remove(writer->temp_path);
+	
+	uint64_t records_offset = otp_store_records_offset(count);
+	size_t size = (size_t) (records_offset + count * sizeof(OTPStoreRecord));
+	if (!otp_map_open(&writer->map, writer->temp_path, size, OTP_MAP_WRITE))
+	{
+		otp_store_writer_release(writer, 0);
+		return 0;
+	}
+	
+	writer->count = count;
+	writer->ids = (uint64_t*) (writer->map.base + OTP_STORE_HEADER);
+	writer->records = (OTPStoreRecord*) (writer->map.base + records_offset);
+	
+	return writer;
+}
+
+/*
+	Checks the ids, writes the header, flushes the keystore and
+	  renames it over the keystore at path.
+	
+	Returns
+			1 success
+		error, 0 the ids aren't strictly ascending or don't match
+			their records, or the file couldn't be written. The
+			keystore at path is left as it was
+*/
+COTPRESULT otp_store_writer_close(OTPStoreWriter* writer)
+{
+	if (writer == NULL || writer->map.base == NULL)
+		return OTP_ERROR;
+	
+	int ok = 1;
+	for (uint64_t i=0; i<writer->count; i++)
+	{
+		ok &= writer->records[i].key_id == writer->ids[i];
+		ok &= i == 0 || writer->ids[i] > writer->ids[i - 1];
+	}
+	
+	if (ok)
+	{
+		otp_store_header header;
+		otp_store_header_new(&header, writer->count);
+		memcpy(writer->map.base, &header, sizeof(header));
+		ok = otp_map_sync(&writer->map, 0, writer->map.size, 1);
+	}
+	
+	// Windows can't rename a mapped file
+	otp_map_close(&writer->map);
+	ok = ok && otp_file_replace(writer->temp_path, writer->path);
+	otp_store_writer_release(writer, ok);
+	
+	return ok ? OTP_OK : OTP_ERROR;
+}
+
+/*
+	Drops an unfinished keystore, the keystore at path is left as it was.
+*/
+void otp_store_writer_abort(OTPStoreWriter* writer)
+{
+	if (writer == NULL)
+		return;
+	
+	otp_store_writer_release(writer, 0);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "cotp.h"
+#include "otpmap.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Algorithms a keystore record can be scheduled for,
+	  the built-in engines of otphmac.h.
+*/
+typedef enum OTPStoreAlgo
+{
+	OTP_STORE_SHA1 = 1, OTP_STORE_SHA256, OTP_STORE_SHA512
+} OTPStoreAlgo;
+
+/*
+	One secret of a keystore, 320 bytes, five cache lines.
+	
+	key is decoded and scheduled for algo already, OTPData
+	  points straight at it, see otp_store_data().
+*/
+typedef struct OTPStoreRecord
+{
+	OTPKey key;
+	uint64_t key_id;
+	uint64_t counter;  // HOTP counter when written
+	uint32_t interval; // TOTP interval
+	uint8_t algo;      // OTPStoreAlgo
+	uint8_t digits;
+	uint8_t type;      // OTPType
+	uint8_t reserved[33];
+} OTPStoreRecord;
+
+/*
+	A keystore file opened read-only with mmap.
+	
+	The file is a 64 byte header, the sorted key ids, then the
+	  records in the same order starting on a cache line. Integers
+	  are in native byte order.
+	
+	Open with otp_store_open(), write with otp_store_write().
+*/
+typedef struct OTPStore
+{
+	OTPMap map;
+	uint64_t count;
+	const uint64_t* ids;
+	const OTPStoreRecord* records;
+} OTPStore;
+
+/*
+	A keystore file written in place through a writable map.
+	
+	ids and records have room for count entries. Fill them from
+	  any thread in any order, ids strictly ascending and matching
+	  their records, then finish the file with otp_store_writer_close()
+	  or drop it with otp_store_writer_abort().
+	
+	The file is written next to path and only replaces it once
+	  complete, a keystore already at path survives a failed write.
+*/
+typedef struct OTPStoreWriter
+{
+	OTPMap map;
+	uint64_t count;
+	uint64_t* ids;
+	OTPStoreRecord* records;
+	char* path;      // Keystore to replace
+	char* temp_path; // path.tmp, written through the map
+} OTPStoreWriter;
+
+/*
+	Keystore functions
+*/
+OTPStore* otp_store_open(OTPStore* store, const char* path, int flags);
+void otp_store_close(OTPStore* store);
+const OTPStoreRecord* otp_store_find(const OTPStore* store, uint64_t key_id);
+OTPData* otp_store_data(OTPData* data, const OTPStoreRecord* record, COTP_TIME time);
+
+/*
+	Keystore writing functions
+*/
+OTPStoreRecord* otp_store_record_new(OTPStoreRecord* record, uint64_t key_id, const char* base32_secret, OTPStoreAlgo algo, OTPType type, uint32_t digits, uint32_t interval, uint64_t counter);
+OTPStoreRecord* otp_store_record_from_key(OTPStoreRecord* record, uint64_t key_id, const uint8_t* key, size_t key_length, OTPStoreAlgo algo, OTPType type, uint32_t digits, uint32_t interval, uint64_t counter);
+COTPRESULT otp_store_write(const char* path, OTPStoreRecord* records, size_t count);
+OTPStoreWriter* otp_store_writer_open(OTPStoreWriter* writer, const char* path, uint64_t count);
+COTPRESULT otp_store_writer_close(OTPStoreWriter* writer);
+void otp_store_writer_abort(OTPStoreWriter* writer);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -1,21 +1,252 @@
-
 #include "otpuri.h"
+#include "otphmac.h"
+#include "otpbase32.h"
+#include "otpbatch.h"
 
-#include <stdio.h>
 #include <string.h>
-#include <inttypes.h>
 
 
+static const char OTPURI_HEX[16] = "0123456789ABCDEF";
+
+/*
+	1 for the bytes that must be percent-encoded in an otpauth URI:
+	  controls, bytes from 0x7F up and " <>#%@{}|\^~[]` ?&
+*/
+static const uint8_t OTPURI_ESCAPED[256] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 0, 1, 1, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 1,
+	1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0,
+	1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define OTPURI_X86 1
+	// 256-bit locals aren't reliably aligned on MinGW, see otpbatch.c
+#	if !defined(_WIN32)
+#		define OTPURI_WIDE 1
+#	endif
+#endif
+
+#if defined(OTPURI_X86)
+/*
+	OTPURI_ESCAPED split by nibble for the vector kernels, a byte
+	  is escaped when its two entries share a bit. Bit 0 marks the
+	  high nibbles escaped whatever the low one, the others stand
+	  for high nibbles 2 to 7. Repeated for both 128-bit lanes.
+*/
+static const uint8_t OTPURI_ESCAPED_LOW[32] = {
+	0x2B, 0x01, 0x03, 0x03, 0x01, 0x03, 0x03, 0x01, 0x01, 0x01, 0x01, 0x51, 0x55, 0x51, 0x55, 0x45,
+	0x2B, 0x01, 0x03, 0x03, 0x01, 0x03, 0x03, 0x01, 0x01, 0x01, 0x01, 0x51, 0x55, 0x51, 0x55, 0x45,
+};
+static const uint8_t OTPURI_ESCAPED_HIGH[32] = {
+	0x01, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+};
+#endif
+
+/*
+	Vector kernels, length is a multiple of the vector size.
+	
+	otpuri_safe_ returns the offset of the first vector holding a
+	  byte to escape, or length. otpuri_count_ returns the amount of
+	  bytes to escape. shuffle is the byte shuffle within 128-bit
+	  lanes, __builtin_shuffle would permute across them.
+*/
+#define OTPURI_KERNEL(suffix, isa, bytes, shuffle) \
+	typedef uint8_t otpuri_vec_##suffix __attribute__((vector_size(bytes))); \
+	typedef char otpuri_chars_##suffix __attribute__((vector_size(bytes))); \
+	typedef uint64_t otpuri_lanes_##suffix __attribute__((vector_size(bytes))); \
+	__attribute__((target(isa))) static inline otpuri_vec_##suffix otpuri_classify_##suffix(const char* in, otpuri_vec_##suffix low_table, otpuri_vec_##suffix high_table) \
+	{ \
+		otpuri_vec_##suffix c; \
+		memcpy(&c, in, bytes); \
+		otpuri_vec_##suffix low = (otpuri_vec_##suffix) shuffle((otpuri_chars_##suffix) low_table, (otpuri_chars_##suffix) (c & 15)); \
+		otpuri_vec_##suffix high = (otpuri_vec_##suffix) shuffle((otpuri_chars_##suffix) high_table, (otpuri_chars_##suffix) (c >> 4)); \
+		return (otpuri_vec_##suffix) ((low & high) != 0); \
+	} \
+	__attribute__((target(isa))) static size_t otpuri_safe_##suffix(const char* in, size_t length) \
+	{ \
+		otpuri_vec_##suffix low_table; \
+		otpuri_vec_##suffix high_table; \
+		memcpy(&low_table, OTPURI_ESCAPED_LOW, bytes); \
+		memcpy(&high_table, OTPURI_ESCAPED_HIGH, bytes); \
+		for (size_t i=0; i<length; i+=bytes) \
+		{ \
+			otpuri_lanes_##suffix escaped = (otpuri_lanes_##suffix) otpuri_classify_##suffix(in + i, low_table, high_table); \
+			uint64_t any = 0; \
+			for (int j=0; j<bytes/8; j++) \
+				any |= escaped[j]; \
+			if (any != 0) \
+				return i; \
+		} \
+		return length; \
+	} \
+	__attribute__((target(isa))) static size_t otpuri_count_##suffix(const char* in, size_t length) \
+	{ \
+		otpuri_vec_##suffix low_table; \
+		otpuri_vec_##suffix high_table; \
+		memcpy(&low_table, OTPURI_ESCAPED_LOW, bytes); \
+		memcpy(&high_table, OTPURI_ESCAPED_HIGH, bytes); \
+		size_t count = 0; \
+		for (size_t i=0; i<length; ) \
+		{ \
+			/* Bytes of the sum count up to 255 vectors */ \
+			otpuri_vec_##suffix sum = { 0 }; \
+			size_t end = length - i > 255 * bytes ? i + 255 * bytes : length; \
+			for (; i<end; i+=bytes) \
+				sum -= otpuri_classify_##suffix(in + i, low_table, high_table); \
+			for (int j=0; j<bytes; j++) \
+				count += sum[j]; \
+		} \
+		return count; \
+	}
+
+#if defined(OTPURI_X86)
+OTPURI_KERNEL(sse4, "sse4.1", 16, __builtin_ia32_pshufb128)
+#	if defined(OTPURI_WIDE)
+OTPURI_KERNEL(avx2, "avx2", 32, __builtin_ia32_pshufb256)
+#	endif
+#endif
+
+#undef OTPURI_KERNEL
+
+/*
+	Returns the amount of leading bytes of in that are copied as is.
+*/
+static size_t otpuri_safe(const char* in, size_t length, OTPSimd level)
+{
+	size_t done = 0;
+	
+#if defined(OTPURI_WIDE)
+	if (level >= OTP_SIMD_AVX2)
+		done = otpuri_safe_avx2(in, length & ~(size_t) 31);
+	else
+#endif
+#if defined(OTPURI_X86)
+	if (level >= OTP_SIMD_SSE4)
+		done = otpuri_safe_sse4(in, length & ~(size_t) 15);
+#endif
+	(void) level;
+	
+	while (done < length && !OTPURI_ESCAPED[(unsigned char) in[done]])
+		done++;
+	return done;
+}
+
+/*
+	Returns the amount of characters otpuri_encode_url() writes
+	  for length bytes of data, not counting the null terminator.
+*/
+size_t otpuri_encoded_length(const char* data, size_t length)
+{
+	if (data == NULL)
+		return 0;
+	
+	size_t done = 0;
+	size_t escaped = 0;
+	
+#if defined(OTPURI_X86)
+	OTPSimd level = length >= 16 ? otp_simd_active() : OTP_SIMD_SCALAR;
+#	if defined(OTPURI_WIDE)
+	if (level >= OTP_SIMD_AVX2)
+	{
+		done = length & ~(size_t) 31;
+		escaped = otpuri_count_avx2(data, done);
+	}
+	else
+#	endif
+	if (level >= OTP_SIMD_SSE4)
+	{
+		done = length & ~(size_t) 15;
+		escaped = otpuri_count_sse4(data, done);
+	}
+#endif
+	
+	for (size_t i=done; i<length; i++)
+		escaped += OTPURI_ESCAPED[(unsigned char) data[i]];
+	return length + escaped * 2;
+}
+
+/*
+	Percent-encodes data at out, returns the end of the output.
+	
+	Runs of bytes that need no escape are found a vector at a time
+	  and copied whole.
+*/
+static char* otpuri_encode(char* out, const char* data, size_t length)
+{
+	OTPSimd level = length >= 16 ? otp_simd_active() : OTP_SIMD_SCALAR;
+	
+	for (size_t i=0; i<length; )
+	{
+		size_t run = otpuri_safe(data + i, length - i, level);
+		memcpy(out, data + i, run);
+		out += run;
+		i += run;
+		
+		if (i < length)
+		{
+			unsigned char c = (unsigned char) data[i++];
+			out[0] = '%';
+			out[1] = OTPURI_HEX[c >> 4];
+			out[2] = OTPURI_HEX[c & 0xF];
+			out += 3;
+		}
+	}
+	return out;
+}
+
+/*
+	Writes value in decimal at out, returns the end of the output.
+*/
+static char* otpuri_decimal(char* out, uint64_t value)
+{
+	char digits[20];
+	size_t count = 0;
+	do {
+		digits[count++] = (char) ('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+	
+	while (count > 0)
+		*out++ = digits[--count];
+	return out;
+}
+
+static size_t otpuri_decimal_length(uint64_t value)
+{
+	size_t length = 1;
+	while (value >= 10)
+	{
+		value /= 10;
+		length++;
+	}
+	return length;
+}
+
 /*
 	Encodes all given data into url-safe data. Null-terminates
-	  returned string. Caller must free the returned pointer.
-	  Will treat embedded \0's as valid characters.
+	  the output. Will treat embedded \0's as valid characters.
 	
 	length is the length in bytes of input string data
 	data is the optionally null-terminated string to encode
+	output holds at least otpuri_encoded_length() + 1 bytes,
+	  length * 3 + 1 is always enough
 	
 	Returns
-			Pointer to malloc'd url-safe data string
+			1 success
 		error, 0
 */
 COTPRESULT otpuri_encode_url(const char* data, size_t length, char* output)
@@ -23,138 +254,562 @@ COTPRESULT otpuri_encode_url(const char* data, size_t length, char* output)
 	if (data == NULL || output == NULL)
 		return OTP_ERROR;
 	
-	static const char to_test[] = "\"<>#%@{}|\\^~[]` ?&";
+	*otpuri_encode(output, data, length) = '\0';
 	
-	size_t output_i = 0;
-	for (size_t i=0; i<length; i++)
+	return OTP_OK;
+}
+
+static const char* otpuri_type(const OTPData* data)
+{
+	switch (data->method)
 	{
-		output[output_i] = data[i];
-		if (data[i] < 0x20 || data[i] >= 0x7F)
-		{
-			output_i += snprintf(output + output_i, 3+1, "%%%.2X", data[i]);
-			output_i--;
-		}
-		else
-		{
-			for (size_t j=0; j<18; j++)
-			{
-				if (to_test[j] == data[i])
-				{
-					output_i += snprintf(output + output_i, 3+1, "%%%.2X", data[i]);
-					output_i--;
-					break;
-				}
-			}
-		}
-		output_i++;
+		case TOTP:
+			return "totp";
+		case HOTP:
+			return "hotp";
+		default:
+			return "otp";
 	}
+}
+
+/*
+	Returns the exact length of the otpuri built from the given
+	  parameters, not including the null-termination.
 	
-	return OTP_OK;
+	Returns
+			Length in bytes of the otpuri
+		error, 0
+*/
+size_t otpuri_length(OTPData* data, const char* issuer, const char* name, const char* digest)
+{
+	if (data == NULL || data->base32_secret == NULL || issuer == NULL || name == NULL || digest == NULL)
+		return 0;
+	
+	size_t length = strlen("otpauth://") + strlen(otpuri_type(data)) + 1
+			+ otpuri_encoded_length(issuer, strlen(issuer)) * 2 + 1
+			+ otpuri_encoded_length(name, strlen(name))
+			+ strlen("?secret=") + otpuri_encoded_length(data->base32_secret, strlen(data->base32_secret))
+			+ strlen("&issuer=")
+			+ strlen("&algorithm=") + otpuri_encoded_length(digest, strlen(digest))
+			+ strlen("&digits=") + otpuri_decimal_length(data->digits);
+	
+	switch (data->method)
+	{
+		case TOTP:
+			length += strlen("&period=") + otpuri_decimal_length(data->interval);
+			break;
+		case HOTP:
+			length += strlen("&counter=") + otpuri_decimal_length(data->count);
+			break;
+		default:
+			break;
+	}
+	
+	return length;
 }
 
 /*
 	Returns the maximum expected length of an array needed to fill a buffer
 	  with an otpuri not including the null-termination.
 	
+	The strings are counted exactly, the numbers at their widest so the
+	  bound holds when the digits, interval or counter change later.
+	
 	Returns
 			Length in bytes of an array to match an otpuri generation
+		error, 0
 */
 size_t otpuri_strlen(OTPData* data, const char* issuer, const char* name, const char* digest)
 {
-	return strlen(issuer) * 2 * 3
-			+ strlen(name) * 3
-			+ strlen(data->base32_secret) * 3
-			+ strlen(digest) * 3
-			+ 100;
+	size_t length = otpuri_length(data, issuer, name, digest);
+	if (length == 0)
+		return 0;
+	
+	length += 10 - otpuri_decimal_length(data->digits);
+	if (data->method == TOTP)
+		length += 10 - otpuri_decimal_length(data->interval);
+	else if (data->method == HOTP)
+		length += 20 - otpuri_decimal_length(data->count);
+	
+	return length;
 }
 
 /*
-	Builds a valid, url-safe URI which is used for applications such as QR codes.
+	Appends a literal at out, returns the end of the output.
+*/
+static char* otpuri_append(char* out, const char* literal, size_t length)
+{
+	memcpy(out, literal, length);
+	return out + length;
+}
+
+#define OTPURI_APPEND(out, literal) otpuri_append(out, literal, sizeof(literal) - 1)
+
+/*
+	Builds a valid, url-safe otpauth URI into a buffer of known size,
+	  in one pass with every part encoded once.
 	
 	issuer is the null-terminated string of the company name
 	name is the null-terminated string of the username
 	digest is the null-terminated string of the HMAC encryption algorithm
-	output is the zero'd destination the function writes the URI to
+	output receives the null-terminated URI
+	capacity is the size of output, at least otpuri_length() + 1
 	
 	Returns
-			1 on success
-		error, 0
-		
+			The length of the URI written, without the null-termination
+		error, 0 nothing is written
 */
-COTPRESULT otpuri_build_uri(OTPData* data, const char* issuer, const char* name, const char* digest, char* output)
+size_t otpuri_write(OTPData* data, const char* issuer, const char* name, const char* digest, char* output, size_t capacity)
 {
-	if (issuer == NULL || name == NULL || digest == NULL || output == NULL)
-		return OTP_ERROR;
+	size_t length = otpuri_length(data, issuer, name, digest);
+	if (length == 0 || output == NULL || length >= capacity)
+		return 0;
+	
+	char* out = OTPURI_APPEND(output, "otpauth://");
+	const char* type = otpuri_type(data);
+	out = otpuri_append(out, type, strlen(type));
+	*out++ = '/';
+	
+	char* encoded_issuer = out;
+	out = otpuri_encode(out, issuer, strlen(issuer));
+	size_t encoded_issuer_length = (size_t) (out - encoded_issuer);
+	*out++ = ':';
+	out = otpuri_encode(out, name, strlen(name));
+	
+	out = OTPURI_APPEND(out, "?secret=");
+	out = otpuri_encode(out, data->base32_secret, strlen(data->base32_secret));
+	
+	out = OTPURI_APPEND(out, "&issuer=");
+	out = otpuri_append(out, encoded_issuer, encoded_issuer_length);
+	
+	out = OTPURI_APPEND(out, "&algorithm=");
+	out = otpuri_encode(out, digest, strlen(digest));
+	
+	out = OTPURI_APPEND(out, "&digits=");
+	out = otpuri_decimal(out, data->digits);
 	
-	strcat(output, "otpuri://");
-	switch(data->method)
+	switch (data->method)
 	{
 		case TOTP:
-			strcat(output, "totp");
+			out = OTPURI_APPEND(out, "&period=");
+			out = otpuri_decimal(out, data->interval);
 			break;
 		case HOTP:
-			strcat(output, "hotp");
+			out = OTPURI_APPEND(out, "&counter=");
+			out = otpuri_decimal(out, data->count);
 			break;
 		default:
-			strcat(output, "otp");
 			break;
 	}
 	
-	strcat(output, "/");
+	*out = '\0';
+	
+	return (size_t) (out - output);
+}
+
+/*
+	Builds a valid, url-safe URI which is used for applications such as QR codes.
+	
+	issuer is the null-terminated string of the company name
+	name is the null-terminated string of the username
+	digest is the null-terminated string of the HMAC encryption algorithm
+	output is the destination the function writes the URI to, at
+	  least otpuri_strlen() + 1 bytes, see otpuri_write()
+	
+	Returns
+			1 on success
+		error, 0
+		
+*/
+COTPRESULT otpuri_build_uri(OTPData* data, const char* issuer, const char* name, const char* digest, char* output)
+{
+	size_t length = otpuri_length(data, issuer, name, digest);
+	if (length == 0)
+		return OTP_ERROR;
+	
+	return otpuri_write(data, issuer, name, digest, output, length + 1) != 0 ? OTP_OK : OTP_ERROR;
+}
+
+/*
+	Returns the value of a hex digit, -1 for any other character.
+*/
+static int otpuri_hex(unsigned char c)
+{
+	if ((unsigned char) (c - '0') < 10)
+		return c - '0';
+	if ((unsigned char) ((c | 0x20) - 'a') < 6)
+		return (c | 0x20) - 'a' + 10;
+	return -1;
+}
+
+/*
+	Checks that input holds no control characters, no fragment and
+	  only complete percent escapes.
+*/
+static int otpuri_valid(const char* input, size_t length)
+{
+	for (size_t i=0; i<length; i++)
+	{
+		unsigned char c = (unsigned char) input[i];
+		if (c < 0x20 || c == 0x7F || c == '#')
+			return 0;
+		if (c == '%')
+		{
+			if (length - i < 3 || otpuri_hex((unsigned char) input[i + 1]) < 0 || otpuri_hex((unsigned char) input[i + 2]) < 0)
+				return 0;
+			i += 2;
+		}
+	}
+	return 1;
+}
+
+/*
+	Compares length bytes of input to a lower case literal,
+	  ignoring the case of input.
+*/
+static int otpuri_match(const char* input, size_t length, const char* literal)
+{
+	size_t literal_length = strlen(literal);
+	if (length < literal_length)
+		return 0;
+	
+	for (size_t i=0; i<literal_length; i++)
+	{
+		char c = input[i];
+		if (c >= 'A' && c <= 'Z')
+			c |= 0x20;
+		if (c != literal[i])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+	Parses a decimal number of at most max, no signs or spaces.
+*/
+static int otpuri_number(const char* input, size_t length, uint64_t max, uint64_t* out_value)
+{
+	if (length == 0 || length > 20)
+		return 0;
 	
-	char cissuer[strlen(issuer)*3 + 1];
-	memset(cissuer, 0, strlen(issuer)*3 + 1);
-	otpuri_encode_url(issuer, strlen(issuer), cissuer);
-	strcat(output, cissuer);
+	uint64_t value = 0;
+	for (size_t i=0; i<length; i++)
+	{
+		unsigned int digit = (unsigned char) input[i] - '0';
+		if (digit > 9 || value > (max - digit) / 10)
+			return 0;
+		value = value * 10 + digit;
+	}
 	
-	strcat(output, ":");
+	*out_value = value;
+	return 1;
+}
+
+/*
+	Reads the next byte of a percent-encoded slice at *i.
+*/
+static unsigned char otpuri_next(const OTPUriSlice* slice, size_t* i)
+{
+	unsigned char c = (unsigned char) slice->data[*i];
+	if (c == '%')
+	{
+		c = (unsigned char) (otpuri_hex((unsigned char) slice->data[*i + 1]) << 4 | otpuri_hex((unsigned char) slice->data[*i + 2]));
+		*i += 3;
+	}
+	else
+	{
+		*i += 1;
+	}
+	return c;
+}
+
+/*
+	Compares two validated slices by their decoded bytes.
+*/
+static int otpuri_equal(const OTPUriSlice* a, const OTPUriSlice* b)
+{
+	size_t i = 0;
+	size_t j = 0;
+	while (i < a->length && j < b->length)
+	{
+		if (otpuri_next(a, &i) != otpuri_next(b, &j))
+			return 0;
+	}
+	return i == a->length && j == b->length;
+}
+
+/*
+	Parses an otpauth://TYPE/LABEL?PARAMETERS URI in one forward scan,
+	  without copying or allocating.
 	
-	char cname[strlen(name)*3 + 1];
-	memset(cname, 0, strlen(name)*3 + 1);
-	otpuri_encode_url(name, strlen(name), cname);
-	strcat(output, cname);
+	uri receives slices into input, input must outlive them
+	input doesn't need to be null-terminated
 	
-	strcat(output, "?secret=");
-	char csecret[strlen(data->base32_secret)*3 + 1];
-	memset(csecret, 0, strlen(data->base32_secret)*3 + 1);
-	otpuri_encode_url(data->base32_secret, strlen(data->base32_secret), csecret);
-	strcat(output, csecret);
+	TYPE is totp or hotp, LABEL is `issuer:name` or `name` with the
+	  colon optionally encoded as %3A. secret is required, counter is
+	  required for hotp. algorithm defaults to SHA1, digits to 6 and
+	  period to 30. Unknown parameters are skipped, repeated ones,
+	  broken percent escapes and control characters are errors. An
+	  issuer parameter has to match the issuer of the label.
 	
-	strcat(output, "&issuer=");
-	strcat(output, cissuer);
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otpuri_parse(OTPUri* uri, const char* input, size_t length)
+{
+	if (uri == NULL || input == NULL)
+		return OTP_ERROR;
+	
+	memset(uri, 0, sizeof(OTPUri));
+	uri->hmac = &OTP_HMAC_SHA1;
+	uri->algo = otp_algo_sha1;
+	uri->digits = 6;
+	uri->interval = 30;
+	
+	const char* end = input + length;
+	if (!otpuri_match(input, length, "otpauth://") || !otpuri_valid(input, length))
+		return OTP_ERROR;
 	
-	strcat(output, "&algorithm=");
-	char cdigest[strlen(digest)*3 + 1];
-	memset(cdigest, 0, strlen(digest)*3 + 1);
-	otpuri_encode_url(digest, strlen(digest), cdigest);
-	strcat(output, cdigest);
+	const char* p = input + 10;
+	if (otpuri_match(p, (size_t) (end - p), "totp/"))
+		uri->type = TOTP;
+	else if (otpuri_match(p, (size_t) (end - p), "hotp/"))
+		uri->type = HOTP;
+	else
+		return OTP_ERROR;
+	p += 5;
 	
-	strcat(output, "&digits=");
-	char cdigits[21];
-	memset(cdigits, 0, 21);
-	snprintf(cdigits, 21, "%" PRIu32, data->digits);
-	strcat(output, cdigits);
+	// Label, up to the query
+	const char* label = p;
+	const char* colon = NULL;
+	size_t colon_length = 0;
+	for (; p < end && *p != '?'; p++)
+	{
+		if (colon != NULL)
+			continue;
+		if (*p == ':')
+		{
+			colon = p;
+			colon_length = 1;
+		}
+		else if (*p == '%' && p[1] == '3' && (p[2] | 0x20) == 'a')
+		{
+			colon = p;
+			colon_length = 3;
+		}
+	}
 	
-	switch(data->method)
+	if (colon != NULL)
 	{
-		case TOTP:
-			strcat(output, "&period=");
-			char cperiod[21];
-			memset(cperiod, 0, 21);
-			snprintf(cperiod, 21, "%" PRIu32, data->interval);
-			strcat(output, cperiod);
-			break;
-		case HOTP:
-			strcat(output, "&counter=");
-			char ccounter[21];
-			memset(ccounter, 0, 21);
-			snprintf(ccounter, 21, "%" PRIu64, data->count);
-			strcat(output, ccounter);
-			break;
-		default:
-			break;
+		uri->issuer.data = label;
+		uri->issuer.length = (size_t) (colon - label);
+		
+		const char* name = colon + colon_length;
+		while (name < p && (*name == ' ' || (p - name >= 3 && name[0] == '%' && name[1] == '2' && name[2] == '0')))
+			name += *name == ' ' ? 1 : 3;
+		uri->name.data = name;
+		uri->name.length = (size_t) (p - name);
+		
+		if (uri->issuer.length == 0)
+			return OTP_ERROR;
+	}
+	else
+	{
+		uri->name.data = label;
+		uri->name.length = (size_t) (p - label);
 	}
+	if (uri->name.length == 0)
+		return OTP_ERROR;
+	
+	// Parameters
+	enum { SECRET = 1, ISSUER = 2, ALGORITHM = 4, DIGITS = 8, PERIOD = 16, COUNTER = 32 };
+	unsigned int seen = 0;
+	OTPUriSlice issuer = { NULL, 0 };
+	
+	if (p < end)
+		p++;
+	while (p < end)
+	{
+		const char* name = p;
+		const char* param_end = (const char*) memchr(p, '&', (size_t) (end - p));
+		if (param_end == NULL)
+			param_end = end;
+		const char* equals = (const char*) memchr(p, '=', (size_t) (param_end - p));
+		if (equals == NULL || equals == name)
+			return OTP_ERROR;
+		
+		size_t name_length = (size_t) (equals - name);
+		const char* value = equals + 1;
+		size_t value_length = (size_t) (param_end - value);
+		p = param_end + (param_end < end);
+		
+		unsigned int param = 0;
+		uint64_t number = 0;
+		if (name_length == 6 && otpuri_match(name, 6, "secret"))
+		{
+			param = SECRET;
+			uri->secret.data = value;
+			uri->secret.length = value_length;
+			if (value_length == 0)
+				return OTP_ERROR;
+		}
+		else if (name_length == 6 && otpuri_match(name, 6, "issuer"))
+		{
+			param = ISSUER;
+			issuer.data = value;
+			issuer.length = value_length;
+		}
+		else if (name_length == 9 && otpuri_match(name, 9, "algorithm"))
+		{
+			param = ALGORITHM;
+			if (value_length == 4 && otpuri_match(value, 4, "sha1"))
+			{
+				uri->hmac = &OTP_HMAC_SHA1;
+				uri->algo = otp_algo_sha1;
+			}
+			else if (value_length == 6 && otpuri_match(value, 6, "sha256"))
+			{
+				uri->hmac = &OTP_HMAC_SHA256;
+				uri->algo = otp_algo_sha256;
+			}
+			else if (value_length == 6 && otpuri_match(value, 6, "sha512"))
+			{
+				uri->hmac = &OTP_HMAC_SHA512;
+				uri->algo = otp_algo_sha512;
+			}
+			else
+			{
+				return OTP_ERROR;
+			}
+		}
+		else if (name_length == 6 && otpuri_match(name, 6, "digits"))
+		{
+			param = DIGITS;
+			if (!otpuri_number(value, value_length, OTP_MAX_DIGITS, &number) || number == 0)
+				return OTP_ERROR;
+			uri->digits = (uint32_t) number;
+		}
+		else if (name_length == 6 && otpuri_match(name, 6, "period"))
+		{
+			param = PERIOD;
+			if (!otpuri_number(value, value_length, UINT32_MAX, &number) || number == 0)
+				return OTP_ERROR;
+			uri->interval = (uint32_t) number;
+		}
+		else if (name_length == 7 && otpuri_match(name, 7, "counter"))
+		{
+			param = COUNTER;
+			if (!otpuri_number(value, value_length, UINT64_MAX, &number))
+				return OTP_ERROR;
+			uri->counter = number;
+		}
+		
+		if (seen & param)
+			return OTP_ERROR;
+		seen |= param;
+	}
+	
+	if (!(seen & SECRET) || (uri->type == HOTP && !(seen & COUNTER)))
+		return OTP_ERROR;
+	
+	// Padding and length only, the characters are checked when decoding
+	if (memchr(uri->secret.data, '%', uri->secret.length) == NULL && otp_base32_decoded_length(uri->secret.data, uri->secret.length) == 0)
+		return OTP_ERROR;
+	
+	if (uri->issuer.length == 0)
+		uri->issuer = issuer;
+	else if ((seen & ISSUER) && !otpuri_equal(&uri->issuer, &issuer))
+		return OTP_ERROR;
+	
+	if (uri->type == HOTP)
+		uri->interval = 0;
+	else
+		uri->counter = 0;
 	
 	return OTP_OK;
 }
 
+/*
+	Percent-decodes a slice of a parsed URI.
+	
+	output receives the null-terminated bytes, capacity is its size,
+	  slice->length + 1 is always enough
+	out_length is optional, receives the amount of bytes decoded
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otpuri_decode(const OTPUriSlice* slice, char* output, size_t capacity, size_t* out_length)
+{
+	if (slice == NULL || output == NULL || (slice->data == NULL && slice->length > 0) || !otpuri_valid(slice->data, slice->length))
+		return OTP_ERROR;
+	
+	size_t written = 0;
+	for (size_t i=0; i<slice->length; written++)
+	{
+		if (written + 1 >= capacity)
+			return OTP_ERROR;
+		output[written] = (char) otpuri_next(slice, &i);
+	}
+	if (written >= capacity)
+		return OTP_ERROR;
+	output[written] = '\0';
+	
+	if (out_length != NULL)
+		*out_length = written;
+	
+	return OTP_OK;
+}
+
+/*
+	Fills data from a parsed URI, decoding its secret straight into
+	  key and scheduling it for the built-in engine of uri->hmac.
+	
+	key must outlive every use of data, wipe it with otp_key_wipe()
+	
+	Returns
+			A pointer to the passed data
+		error, 0 the secret isn't valid base32
+*/
+OTPData* otpuri_data(OTPData* data, const OTPUri* uri, OTPKey* key, COTP_TIME time)
+{
+	if (data == NULL || uri == NULL || key == NULL || uri->hmac == NULL || uri->secret.data == NULL)
+		return 0;
+	
+	const char* base32 = uri->secret.data;
+	size_t base32_length = uri->secret.length;
+	char decoded[OTP_KEY_MAX_LENGTH * 8 / 5 + 8 + 1];
+	if (memchr(base32, '%', base32_length) != NULL)
+	{
+		if (otpuri_decode(&uri->secret, decoded, sizeof(decoded), &base32_length) != OTP_OK)
+			return 0;
+		base32 = decoded;
+	}
+	
+	memset(key, 0, sizeof(OTPKey));
+	size_t key_length;
+	COTPRESULT decoded_ok = otp_base32_decode(base32, base32_length, key->bytes, OTP_KEY_MAX_LENGTH, &key_length);
+	memset(decoded, 0, sizeof(decoded));
+	if (decoded_ok != OTP_OK)
+		return 0;
+	
+	key->length = (uint32_t) key_length;
+	if (!uri->hmac->init((const char*) key->bytes, (int) key->length, &key->ctx))
+	{
+		otp_key_wipe(key);
+		return 0;
+	}
+	key->scheduled = 1;
+	
+	if (uri->type == HOTP)
+		hotp_new(data, "", uri->algo, uri->digits, uri->counter);
+	else
+		totp_new(data, "", uri->algo, time, uri->digits, uri->interval);
+	
+	data->key = key;
+	data->hmac = uri->hmac;
+	
+	return data;
+}
@@ -6,9 +6,46 @@
 extern "C" {
 #endif
 
+/*
+	A borrowed piece of a parsed URI, not null-terminated and
+	  still percent-encoded, see otpuri_decode().
+*/
+typedef struct OTPUriSlice
+{
+	const char* data;
+	size_t length;
+} OTPUriSlice;
+
+/*
+	An otpauth:// URI parsed by otpuri_parse(), its slices point
+	  into the parsed input.
+*/
+typedef struct OTPUri
+{
+	OTPType type;
+	OTPUriSlice issuer;  // Empty without one
+	OTPUriSlice name;
+	OTPUriSlice secret;
+	const OTPAlgo* hmac; // Built-in engine of the algorithm
+	COTP_ALGO algo;      // The same as a one-shot function
+	uint32_t digits;
+	uint32_t interval;   // TOTP exclusive
+	uint64_t counter;    // HOTP exclusive
+} OTPUri;
+
 size_t otpuri_strlen(OTPData* data, const char* issuer, const char* name, const char* digest);
+size_t otpuri_length(OTPData* data, const char* issuer, const char* name, const char* digest);
+size_t otpuri_encoded_length(const char* data, size_t length);
 COTPRESULT otpuri_encode_url(const char* data, size_t length, char* output);
 COTPRESULT otpuri_build_uri(OTPData* data, const char* issuer, const char* name, const char* digest, char* output);
+size_t otpuri_write(OTPData* data, const char* issuer, const char* name, const char* digest, char* output, size_t capacity);
+
+/*
+	URI parsing functions
+*/
+COTPRESULT otpuri_parse(OTPUri* uri, const char* input, size_t length);
+COTPRESULT otpuri_decode(const OTPUriSlice* slice, char* output, size_t capacity, size_t* out_length);
+OTPData* otpuri_data(OTPData* data, const OTPUri* uri, OTPKey* key, COTP_TIME time);
 
 #if defined(__cplusplus)
 }
@@ -0,0 +1,432 @@
+#include "otpvault.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+
+#define OTP_VAULT_MAGIC "COTPVLT1"
+#define OTP_VAULT_VERSION 1
+#define OTP_VAULT_ENDIAN 0x01020304u
+#define OTP_VAULT_HEADER 64
+#define OTP_VAULT_PAGE_SIZE 4096
+#define OTP_VAULT_NONCE 12
+#define OTP_VAULT_TAG 16
+#define OTP_VAULT_PLAIN (OTP_VAULT_PAGE_RECORDS * sizeof(OTPStoreRecord))
+
+_Static_assert(OTP_VAULT_NONCE + OTP_VAULT_TAG + OTP_VAULT_PAGE_RECORDS * 320 <= OTP_VAULT_PAGE_SIZE, "vault page too small");
+
+/*
+	The header at the start of a vault file, authenticated
+	  with every page.
+*/
+typedef struct otp_vault_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint32_t record_size;
+	uint32_t page_records;
+	uint64_t count;
+	uint64_t ids_offset;
+	uint64_t pages_offset;
+	uint8_t padding[16];
+} otp_vault_header;
+
+/*
+	Marks a page whose tag didn't match.
+*/
+#define OTP_VAULT_FAILED ((void*) 1)
+
+typedef struct otp_vault_state
+{
+	_Atomic(void*)* pages; // Decrypted pages, NULL until first access
+	pthread_t prewarm;
+	atomic_int prewarming;
+	atomic_int stopping;
+} otp_vault_state;
+
+static uint64_t otp_vault_pages_offset(uint64_t count)
+{
+	uint64_t end = OTP_VAULT_HEADER + count * sizeof(uint64_t);
+	return (end + OTP_VAULT_PAGE_SIZE - 1) / OTP_VAULT_PAGE_SIZE * OTP_VAULT_PAGE_SIZE;
+}
+
+/*
+	Encrypts or decrypts one page with AES-256-GCM, the header
+	  and the page's index are the additional data.
+	
+	Returns
+			1 success
+		error or authentication failure, 0
+		out of memory, -1
+*/
+static int otp_vault_crypt(const uint8_t* key, const uint8_t* header, uint64_t page, const uint8_t* nonce, uint8_t* tag, const uint8_t* in, uint8_t* out, int encrypt)
+{
+	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL)
+		return -1;
+	
+	uint8_t index[8];
+	for (int i=0; i<8; i++)
+		index[i] = (uint8_t) (page >> (56 - i * 8));
+	
+	int length = 0;
+	int ok = EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL, encrypt) == 1
+		&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, OTP_VAULT_NONCE, NULL) == 1
+		&& EVP_CipherInit_ex(ctx, NULL, NULL, key, nonce, encrypt) == 1
+		&& EVP_CipherUpdate(ctx, NULL, &length, header, OTP_VAULT_HEADER) == 1
+		&& EVP_CipherUpdate(ctx, NULL, &length, index, sizeof(index)) == 1
+		&& EVP_CipherUpdate(ctx, out, &length, in, (int) OTP_VAULT_PLAIN) == 1;
+	
+	if (ok && !encrypt)
+		ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, OTP_VAULT_TAG, tag) == 1;
+	if (ok)
+		ok = EVP_CipherFinal_ex(ctx, out + length, &length) == 1;
+	if (ok && encrypt)
+		ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, OTP_VAULT_TAG, tag) == 1;
+	
+	EVP_CIPHER_CTX_free(ctx);
+	return ok;
+}
+
+/*
+	Returns the decrypted records of page, decrypting it on first
+	  access. Threads racing for a cold page both decrypt it, the
+	  first to publish wins.
+	
+	Returns
+			The records
+			OTP_VAULT_FAILED when the page doesn't authenticate
+		out of memory, 0 nothing is cached, a later access retries
+*/
+static void* otp_vault_page(OTPVault* vault, uint64_t page)
+{
+	otp_vault_state* state = (otp_vault_state*) vault->state;
+	void* plain = atomic_load_explicit(&state->pages[page], memory_order_acquire);
+	if (plain != NULL)
+		return plain;
+	
+	const uint8_t* block = vault->map.base + otp_vault_pages_offset(vault->count) + page * OTP_VAULT_PAGE_SIZE;
+	uint8_t tag[OTP_VAULT_TAG];
+	memcpy(tag, block + OTP_VAULT_NONCE, OTP_VAULT_TAG);
+	
+	plain = otp_locked_alloc(OTP_VAULT_PLAIN);
+	if (plain == NULL)
+		return NULL;
+	
+	int decrypted = otp_vault_crypt(vault->key, vault->map.base, page, block, tag, block + OTP_VAULT_NONCE + OTP_VAULT_TAG, (uint8_t*) plain, 0);
+	if (decrypted != 1)
+	{
+		otp_locked_free(plain, OTP_VAULT_PLAIN);
+		if (decrypted < 0)
+			return NULL;
+		plain = OTP_VAULT_FAILED;
+	}
+	
+	void* expected = NULL;
+	if (!atomic_compare_exchange_strong_explicit(&state->pages[page], &expected, plain, memory_order_acq_rel, memory_order_acquire))
+	{
+		if (plain != OTP_VAULT_FAILED)
+			otp_locked_free(plain, OTP_VAULT_PLAIN);
+		plain = expected;
+	}
+	
+	return plain;
+}
+
+/*
+	Maps the vault at path read-only, no page is decrypted yet.
+	
+	key is the OTP_VAULT_KEY_LENGTH byte key it was written with,
+	  copied into the vault
+	flags are OTP_MAP_POPULATE and OTP_MAP_HUGE hints
+	
+	Returns
+			A pointer to the passed vault
+		error, 0
+*/
+OTPVault* otp_vault_open(OTPVault* vault, const char* path, const uint8_t* key, int flags)
+{
+	if (vault == NULL || path == NULL || key == NULL)
+		return 0;
+	
+	if (!otp_map_open(&vault->map, path, 0, flags & ~OTP_MAP_WRITE))
+		return 0;
+	
+	otp_vault_header header;
+	if (vault->map.size < OTP_VAULT_HEADER)
+	{
+		otp_map_close(&vault->map);
+		return 0;
+	}
+	memcpy(&header, vault->map.base, sizeof(header));
+	
+	uint64_t max_count = vault->map.size / sizeof(uint64_t);
+	uint64_t pages = (header.count + OTP_VAULT_PAGE_RECORDS - 1) / OTP_VAULT_PAGE_RECORDS;
+	if (memcmp(header.magic, OTP_VAULT_MAGIC, 8) != 0 || header.version != OTP_VAULT_VERSION
+			|| header.endian != OTP_VAULT_ENDIAN || header.record_size != sizeof(OTPStoreRecord)
+			|| header.page_records != OTP_VAULT_PAGE_RECORDS || header.count > max_count
+			|| header.ids_offset != OTP_VAULT_HEADER || header.pages_offset != otp_vault_pages_offset(header.count)
+			|| header.pages_offset + pages * OTP_VAULT_PAGE_SIZE > vault->map.size)
+	{
+		otp_map_close(&vault->map);
+		return 0;
+	}
+	
+	otp_vault_state* state = (otp_vault_state*) calloc(1, sizeof(otp_vault_state));
+	if (state != NULL)
+		state->pages = (_Atomic(void*)*) calloc(pages > 0 ? pages : 1, sizeof(_Atomic(void*)));
+	if (state == NULL || state->pages == NULL)
+	{
+		free(state);
+		otp_map_close(&vault->map);
+		return 0;
+	}
+	atomic_init(&state->prewarming, 0);
+	atomic_init(&state->stopping, 0);
+	
+	vault->count = header.count;
+	vault->pages = pages;
+	vault->ids = (const uint64_t*) (vault->map.base + header.ids_offset);
+	memcpy(vault->key, key, OTP_VAULT_KEY_LENGTH);
+	vault->state = state;
+	
+	return vault;
+}
+
+/*
+	Stops prewarming, wipes every decrypted page and the key, and
+	  unmaps the vault. Every record found in it becomes invalid.
+	  No other call on the vault may run meanwhile.
+*/
+void otp_vault_close(OTPVault* vault)
+{
+	if (vault == NULL || vault->state == NULL)
+		return;
+	
+	otp_vault_state* state = (otp_vault_state*) vault->state;
+	if (atomic_load(&state->prewarming))
+	{
+		atomic_store(&state->stopping, 1);
+		pthread_join(state->prewarm, NULL);
+	}
+	
+	for (uint64_t i=0; i<vault->pages; i++)
+	{
+		void* plain = atomic_load(&state->pages[i]);
+		if (plain != NULL && plain != OTP_VAULT_FAILED)
+			otp_locked_free(plain, OTP_VAULT_PLAIN);
+	}
+	free((void*) state->pages);
+	free(state);
+	
+	volatile uint8_t* key = vault->key;
+	for (int i=0; i<OTP_VAULT_KEY_LENGTH; i++)
+		key[i] = 0;
+	
+	otp_map_close(&vault->map);
+	vault->state = NULL;
+	vault->count = 0;
+	vault->pages = 0;
+	vault->ids = NULL;
+}
+
+/*
+	Looks up the record of key_id, decrypting its page on first access.
+	
+	The record can be passed to otp_store_data() like a keystore's.
+	
+	out_status is optional, tells a missing key id apart from a
+	  page that failed authentication or couldn't be decrypted for
+	  lack of memory
+	
+	Returns
+			A pointer into the vault's decrypted pages
+		not found, not authenticated or out of memory, 0
+*/
+const OTPStoreRecord* otp_vault_find(OTPVault* vault, uint64_t key_id, OTPVaultStatus* out_status)
+{
+	OTPVaultStatus status = OTP_VAULT_MISSING;
+	const OTPStoreRecord* record = NULL;
+	
+	if (vault != NULL && vault->state != NULL)
+	{
+		uint64_t low = 0;
+		uint64_t high = vault->count;
+		while (low < high)
+		{
+			uint64_t middle = low + (high - low) / 2;
+			if (vault->ids[middle] < key_id)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		
+		if (low < vault->count && vault->ids[low] == key_id)
+		{
+			void* plain = otp_vault_page(vault, low / OTP_VAULT_PAGE_RECORDS);
+			if (plain == NULL)
+				status = OTP_VAULT_NO_MEMORY;
+			else if (plain == OTP_VAULT_FAILED)
+				status = OTP_VAULT_AUTH_FAILED;
+			else
+			{
+				record = (const OTPStoreRecord*) plain + low % OTP_VAULT_PAGE_RECORDS;
+				status = record->key_id == key_id ? OTP_VAULT_FOUND : OTP_VAULT_AUTH_FAILED;
+				if (status != OTP_VAULT_FOUND)
+					record = NULL;
+			}
+		}
+	}
+	
+	if (out_status != NULL)
+		*out_status = status;
+	
+	return record;
+}
+
+static void* otp_vault_prewarm_thread(void* arg)
+{
+	OTPVault* vault = (OTPVault*) arg;
+	otp_vault_state* state = (otp_vault_state*) vault->state;
+	
+	for (uint64_t i=0; i<vault->pages && !atomic_load(&state->stopping); i++)
+		otp_vault_page(vault, i);
+	
+	return NULL;
+}
+
+/*
+	Decrypts every page ahead of its first access.
+	
+	background runs it on a thread otp_vault_close() joins,
+	  lookups meanwhile decrypt the pages they need themselves.
+	  Only the first background call starts a thread, concurrent
+	  or later ones fail.
+	
+	Returns
+			1 success, pages that fail authentication don't count
+		error, 0
+*/
+COTPRESULT otp_vault_prewarm(OTPVault* vault, int background)
+{
+	if (vault == NULL || vault->state == NULL)
+		return OTP_ERROR;
+	
+	otp_vault_state* state = (otp_vault_state*) vault->state;
+	if (!background)
+	{
+		otp_vault_prewarm_thread(vault);
+		return OTP_OK;
+	}
+	
+	// Claimed before the thread starts so two callers can't both start one
+	if (atomic_exchange(&state->prewarming, 1))
+		return OTP_ERROR;
+	
+	if (pthread_create(&state->prewarm, NULL, otp_vault_prewarm_thread, vault) != 0)
+	{
+		atomic_store(&state->prewarming, 0);
+		return OTP_ERROR;
+	}
+	
+	return OTP_OK;
+}
+
+static int otp_vault_compare(const void* a, const void* b)
+{
+	uint64_t x = ((const OTPStoreRecord*) a)->key_id;
+	uint64_t y = ((const OTPStoreRecord*) b)->key_id;
+	return (x > y) - (x < y);
+}
+
+/*
+	Writes count records as a vault at path encrypted with key,
+	  replacing it. Every page gets a random nonce.
+	
+	records are sorted by key id in place, key ids must be unique
+	
+	The vault is written to path.tmp, readable by its owner only,
+	  and renamed over path once synced. A vault already at path is
+	  left as it was on error.
+	
+	Returns
+			1 success
+		error, 0
+*/
+COTPRESULT otp_vault_write(const char* path, const uint8_t* key, OTPStoreRecord* records, size_t count)
+{
+	if (path == NULL || key == NULL || (records == NULL && count > 0))
+		return OTP_ERROR;
+	
+	qsort(records, count, sizeof(OTPStoreRecord), otp_vault_compare);
+	for (size_t i=1; i<count; i++)
+	{
+		if (records[i].key_id == records[i - 1].key_id)
+			return OTP_ERROR;
+	}
+	
+	otp_vault_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, OTP_VAULT_MAGIC, 8);
+	header.version = OTP_VAULT_VERSION;
+	header.endian = OTP_VAULT_ENDIAN;
+	header.record_size = sizeof(OTPStoreRecord);
+	header.page_records = OTP_VAULT_PAGE_RECORDS;
+	header.count = count;
+	header.ids_offset = OTP_VAULT_HEADER;
+	header.pages_offset = otp_vault_pages_offset(count);
+	
+	char* temp = otp_file_temp_path(path);
+	if (temp == NULL)
+		return OTP_ERROR;
+	
+	remove(temp);
+	FILE* file = otp_file_create(temp, 1);
+	if (file == NULL)
+	{
+		free(temp);
+		return OTP_ERROR;
+	}
+	
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	for (size_t i=0; ok && i<count; i++)
+		ok = fwrite(&records[i].key_id, sizeof(uint64_t), 1, file) == 1;
+	
+	uint8_t* plain = (uint8_t*) otp_locked_alloc(OTP_VAULT_PLAIN);
+	uint8_t* block = (uint8_t*) calloc(1, OTP_VAULT_PAGE_SIZE);
+	ok = ok && plain != NULL && block != NULL;
+	
+	size_t padding = (size_t) (header.pages_offset - OTP_VAULT_HEADER - count * sizeof(uint64_t));
+	if (ok && padding > 0)
+		ok = fwrite(block, padding, 1, file) == 1;
+	
+	for (size_t first=0; ok && first<count; first+=OTP_VAULT_PAGE_RECORDS)
+	{
+		size_t records_in_page = count - first < OTP_VAULT_PAGE_RECORDS ? count - first : OTP_VAULT_PAGE_RECORDS;
+		memset(plain, 0, OTP_VAULT_PLAIN);
+		memcpy(plain, &records[first], records_in_page * sizeof(OTPStoreRecord));
+		memset(block, 0, OTP_VAULT_PAGE_SIZE);
+		
+		ok = RAND_bytes(block, OTP_VAULT_NONCE) == 1
+			&& otp_vault_crypt(key, (const uint8_t*) &header, first / OTP_VAULT_PAGE_RECORDS, block, block + OTP_VAULT_NONCE, plain, block + OTP_VAULT_NONCE + OTP_VAULT_TAG, 1) == 1
+			&& fwrite(block, OTP_VAULT_PAGE_SIZE, 1, file) == 1;
+	}
+	
+	otp_locked_free(plain, OTP_VAULT_PLAIN);
+	free(block);
+	
+	ok = ok && otp_file_sync(file);
+	ok = (fclose(file) == 0) && ok;
+	ok = ok && otp_file_replace(temp, path);
+	if (!ok)
+		remove(temp);
+	free(temp);
+	return ok ? OTP_OK : OTP_ERROR;
+}
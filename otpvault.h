@@ -0,0 +1,64 @@
+#pragma once
+
+#include "cotp.h"
+#include "otpmap.h"
+#include "otpstore.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+	Records per encrypted page, a page is one 4096 byte block
+	  of the file holding its nonce, tag and ciphertext.
+*/
+#define OTP_VAULT_PAGE_RECORDS 12
+
+/*
+	Size of the AES-256-GCM key of a vault.
+*/
+#define OTP_VAULT_KEY_LENGTH 32
+
+/*
+	What otp_vault_find() found.
+*/
+typedef enum OTPVaultStatus
+{
+	OTP_VAULT_FOUND,
+	OTP_VAULT_MISSING,     // No record for the key id
+	OTP_VAULT_AUTH_FAILED, // The record's page didn't authenticate
+	OTP_VAULT_NO_MEMORY    // The record's page couldn't be decrypted for lack of memory
+} OTPVaultStatus;
+
+/*
+	An encrypted keystore, the records of otpstore.h encrypted with
+	  AES-256-GCM per page of OTP_VAULT_PAGE_RECORDS records.
+	
+	Key ids stay in plain text so lookups don't decrypt anything. A
+	  page is decrypted on first access into locked memory, later
+	  accesses read that copy. Startup costs nothing but the mmap.
+	
+	Open with otp_vault_open(), write with otp_vault_write().
+*/
+typedef struct OTPVault
+{
+	OTPMap map;
+	uint64_t count;
+	uint64_t pages;
+	const uint64_t* ids;
+	uint8_t key[OTP_VAULT_KEY_LENGTH];
+	void* state;
+} OTPVault;
+
+/*
+	Vault functions
+*/
+OTPVault* otp_vault_open(OTPVault* vault, const char* path, const uint8_t* key, int flags);
+void otp_vault_close(OTPVault* vault);
+const OTPStoreRecord* otp_vault_find(OTPVault* vault, uint64_t key_id, OTPVaultStatus* out_status);
+COTPRESULT otp_vault_prewarm(OTPVault* vault, int background);
+COTPRESULT otp_vault_write(const char* path, const uint8_t* key, OTPStoreRecord* records, size_t count);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -6,12 +6,34 @@
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#if !defined(_WIN32)
+#	include <unistd.h>
+#	include <sys/wait.h>
+#	include <sys/stat.h>
+#endif
 
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
 
 #include "../cotp.h"
 #include "../otpuri.h"
+#include "../otphmac.h"
+#include "../otpbatch.h"
+#include "../otppool.h"
+#include "../otpreplay.h"
+#include "../otpcache.h"
+#include "../otpcounter.h"
+#include "../otpstore.h"
+#include "../otpvault.h"
+#include "../otpbase32.h"
+#include "../otprandom.h"
+#include "../otpenroll.h"
+#include "../otpimport.h"
 
 
 static const int32_t SHA1_BYTES   = 160 / 8;	// 20
@@ -73,6 +95,94 @@ int hmac_algo_sha512(const char* byte_secret, int key_length, const char* byte_s
 	return result == 0 ? 0 : len;
 }
 
+// Keys an EVP_MAC_CTX once, the inner and outer pads are hashed here
+// returns 0 for failure otherwise 1
+int hmac_prepared_sha1_init(const char* byte_secret, int key_length, OTPAlgoCtx* ctx)
+{
+	EVP_MAC* mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+	if (mac == NULL)
+		return 0;
+	
+	EVP_MAC_CTX* mctx = EVP_MAC_CTX_new(mac);
+	EVP_MAC_free(mac);
+	if (mctx == NULL)
+		return 0;
+	
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA1", 0),
+		OSSL_PARAM_construct_end()
+	};
+	
+	if (EVP_MAC_init(mctx, (const unsigned char*)byte_secret, key_length, params) != 1)
+	{
+		EVP_MAC_CTX_free(mctx);
+		return 0;
+	}
+	
+	ctx->ptr = mctx;
+	return 1;
+}
+
+// Copies the keyed context so the same key can be used concurrently
+// returns 0 for failure otherwise the length of the string
+int hmac_prepared_compute(const OTPAlgoCtx* ctx, const char* byte_string, char* out)
+{
+	EVP_MAC_CTX* mctx = EVP_MAC_CTX_dup((EVP_MAC_CTX*)ctx->ptr);
+	if (mctx == NULL)
+		return 0;
+	
+	size_t len = 0;
+	int ok = EVP_MAC_update(mctx, (const unsigned char*)byte_string, 8)
+		&& EVP_MAC_final(mctx, (unsigned char*)out, &len, 64);
+	
+	EVP_MAC_CTX_free(mctx);
+	
+	return ok ? (int)len : 0;
+}
+
+void hmac_prepared_free(OTPAlgoCtx* ctx)
+{
+	EVP_MAC_CTX_free((EVP_MAC_CTX*)ctx->ptr);
+	ctx->ptr = NULL;
+}
+
+static const OTPAlgo HMAC_PREPARED_SHA1 = {
+	hmac_prepared_sha1_init,
+	hmac_prepared_compute,
+	hmac_prepared_free
+};
+
+// Prepares like HMAC_PREPARED_SHA1 but fails every computation
+int hmac_failing_compute(const OTPAlgoCtx* ctx, const char* byte_string, char* out)
+{
+	return 0;
+}
+
+static const OTPAlgo HMAC_FAILING = {
+	hmac_prepared_sha1_init,
+	hmac_failing_compute,
+	hmac_prepared_free
+};
+
+// Counts HMAC operations to check how many timeblocks a verification hashed
+static int hmac_counted_calls = 0;
+int hmac_algo_counted(const char* byte_secret, int key_length, const char* byte_string, char* out)
+{
+	hmac_counted_calls++;
+	return otp_algo_sha1(byte_secret, key_length, byte_string, out);
+}
+
+// Inserts the same pairs as every other replay thread
+#define REPLAY_PAIRS 2000
+static OTPReplay* replay_shared;
+static void* replay_thread(void* arg)
+{
+	int* inserted = (int*) arg;
+	for (int i=0; i<REPLAY_PAIRS; i++)
+		*inserted += otp_replay_insert(replay_shared, (uint64_t) (i % 500), 1000 + (uint64_t) (i / 500));
+	return NULL;
+}
+
 static uint64_t get_current_time(void)
 {
 	uint64_t seconds;
@@ -86,6 +196,29 @@ static uint64_t get_current_time(void)
 	return seconds;
 }
 
+// Verifies every counter's code in order against a shared store
+#define COUNTER_CODES 200
+static OTPCounterStore* counter_shared;
+static OTPData* counter_data;
+static void* counter_thread(void* arg)
+{
+	int* accepted = (int*) arg;
+	for (uint64_t i=0; i<COUNTER_CODES; i++)
+	{
+		char ccode[6+1];
+		hotp_at(counter_data, i, ccode);
+		*accepted += hotp_verify_stored(counter_data, counter_shared, 7, ccode, 2);
+	}
+	return NULL;
+}
+
+// A clock the refresher test controls
+static uint64_t fixed_time = 0;
+static uint64_t get_fixed_time(void)
+{
+	return fixed_time;
+}
+
 
 
 int main(int argc, char** argv)
@@ -103,7 +236,7 @@ int main(int argc, char** argv)
 	
 	// Base32 secret to utilize with padding
 	const char BASE32_SECRET_PADDING[] = "ORSXG5BRGIZXIZLTOQ2DKNRXHA4XIZLTOQYQ====";
-
+	
 	bool success = true;
 	
 	OTPData odata1;
@@ -354,6 +487,1458 @@ int main(int argc, char** argv)
 	printf("HOTP Verification 2 pass=true: `%s`\n", hv2 == 0 ? "false" : "true");
 	success = success && (hv2 != 0);
 	
+	puts(""); // line break for readability
+	
+	
+	
+	////////////////////////////////////////////////////////////////
+	// Prepared Key Stuff                                         //
+	////////////////////////////////////////////////////////////////
+	
+	// Decode the secret once and reuse it for every generation
+	OTPData odata_prepared;
+	memset(&odata_prepared, 0, sizeof(OTPData));
+	OTPData* pdata = totp_new(
+		&odata_prepared,
+		BASE32_SECRET,
+		hmac_algo_sha1,
+		get_current_time,
+		DIGITS,
+		INTERVAL
+	);
+	
+	OTPKey pkey;
+	int prepare_err = otp_prepare(pdata, &pkey);
+	printf("otp_prepare() pass=1: `%d` (%u bytes)\n", prepare_err, pkey.length);
+	success = success && (prepare_err == 1) && (pkey.length == 10);
+	
+	// Prepared and unprepared generation must agree
+	int prepared_match = 1;
+	for (uint64_t t=0; t<100*INTERVAL; t+=INTERVAL)
+	{
+		char pcode1[DIGITS+1];
+		char pcode2[DIGITS+1];
+		memset(pcode1, 0, DIGITS+1);
+		memset(pcode2, 0, DIGITS+1);
+		prepared_match &= totp_at(tdata, t, 0, pcode1) && totp_at(pdata, t, 0, pcode2);
+		prepared_match &= strcmp(pcode1, pcode2) == 0;
+	}
+	printf("Prepared TOTP matches pass=1: `%d`\n", prepared_match);
+	success = success && (prepared_match == 1);
+	
+	int pv1 = totp_verify(pdata, "282760", 0, 4);
+	printf("Prepared TOTP Verification pass=true: `%s`\n", pv1 == 0 ? "false" : "true");
+	success = success && (pv1 != 0);
+	
+	OTPKey bad_key;
+	OTPKey* bad_key_res = otp_key_new(&bad_key, "JBSWY3DPEHPK3P");
+	printf("otp_key_new() bad length pass=false: `%s`\n", bad_key_res == NULL ? "false" : "true");
+	success = success && (bad_key_res == NULL);
+	
+	otp_key_wipe(&pkey);
+	
+	puts(""); // line break for readability
+	
+	
+	
+	////////////////////////////////////////////////////////////////
+	// Prepared HMAC Stuff                                        //
+	////////////////////////////////////////////////////////////////
+	
+	// The HMAC key schedule is computed once by otp_prepare
+	OTPData odata_sched;
+	memset(&odata_sched, 0, sizeof(OTPData));
+	OTPData* sdata = hotp_new(
+		&odata_sched,
+		BASE32_SECRET,
+		NULL,
+		DIGITS,
+		0
+	);
+	sdata->hmac = &HMAC_PREPARED_SHA1;
+	
+	// Without a prepared key the schedule is built per code
+	char scode1[DIGITS+1];
+	memset(scode1, 0, DIGITS+1);
+	int sched_err_1 = hotp_at(sdata, 1, scode1);
+	printf("hotp_at(1) unprepared hmac pass=996554: `%s` `%d`\n", scode1, sched_err_1);
+	success = success && (sched_err_1 == 1) && (strcmp(scode1, "996554") == 0);
+	
+	OTPKey skey;
+	int sched_prepare = otp_prepare(sdata, &skey);
+	printf("otp_prepare() with hmac pass=1: `%d` `%u`\n", sched_prepare, skey.scheduled);
+	success = success && (sched_prepare == 1) && (skey.scheduled != 0);
+	
+	char scode2[DIGITS+1];
+	memset(scode2, 0, DIGITS+1);
+	int sched_err_2 = hotp_at(sdata, 1, scode2);
+	printf("hotp_at(1) prepared hmac pass=996554: `%s` `%d`\n", scode2, sched_err_2);
+	success = success && (sched_err_2 == 1) && (strcmp(scode2, "996554") == 0);
+	
+	int sv1 = hotp_compare(sdata, "996554", 1);
+	printf("HOTP Verification prepared hmac pass=true: `%s`\n", sv1 == 0 ? "false" : "true");
+	success = success && (sv1 != 0);
+	
+	otp_unprepare(sdata, &skey);
+	printf("otp_unprepare() detaches pass=1: `%d`\n", sdata->key == NULL);
+	success = success && (sdata->key == NULL);
+	
+	puts(""); // line break for readability
+	
+	
+	
+	////////////////////////////////////////////////////////////////
+	// Built-in HMAC Stuff                                        //
+	////////////////////////////////////////////////////////////////
+	
+	// RFC 4226 Appendix D, secret "12345678901234567890"
+	const char RFC_SECRET_SHA1[] = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+	const char RFC_SECRET_SHA256[] = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZA====";
+	const char RFC_SECRET_SHA512[] = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNA=";
+	
+	static const char* RFC4226_CODES[10] = {
+		"755224", "287082", "359152", "969429", "338314",
+		"254676", "287922", "162583", "399871", "520489"
+	};
+	
+	OTPData odata_rfc4226;
+	memset(&odata_rfc4226, 0, sizeof(OTPData));
+	OTPData* rdata = hotp_new(&odata_rfc4226, RFC_SECRET_SHA1, NULL, 6, 0);
+	rdata->hmac = &OTP_HMAC_SHA1;
+	
+	OTPKey rkey;
+	int rfc4226_ok = otp_prepare(rdata, &rkey);
+	for (uint64_t i=0; i<10; i++)
+	{
+		char rcode[6+1];
+		memset(rcode, 0, 6+1);
+		rfc4226_ok &= hotp_at(rdata, i, rcode);
+		rfc4226_ok &= strcmp(rcode, RFC4226_CODES[i]) == 0;
+	}
+	printf("RFC 4226 HOTP vectors pass=1: `%d`\n", rfc4226_ok);
+	success = success && (rfc4226_ok == 1);
+	otp_unprepare(rdata, &rkey);
+	
+	// RFC 6238 Appendix B
+	static const uint64_t RFC6238_TIMES[6] = { 59, 1111111109, 1111111111, 1234567890, 2000000000, 20000000000 };
+	static const char* RFC6238_CODES[3][6] = {
+		{ "94287082", "07081804", "14050471", "89005924", "69279037", "65353130" },
+		{ "46119246", "68084774", "67062674", "91819424", "90698825", "77737706" },
+		{ "90693936", "25091201", "99943326", "93441116", "38618901", "47863826" }
+	};
+	const char* rfc6238_secrets[3] = { RFC_SECRET_SHA1, RFC_SECRET_SHA256, RFC_SECRET_SHA512 };
+	const OTPAlgo* rfc6238_algos[3] = { &OTP_HMAC_SHA1, &OTP_HMAC_SHA256, &OTP_HMAC_SHA512 };
+	COTP_ALGO rfc6238_oneshot[3] = { otp_algo_sha1, otp_algo_sha256, otp_algo_sha512 };
+	static const char* RFC6238_NAMES[3] = { "SHA1", "SHA256", "SHA512" };
+	
+	for (int a=0; a<3; a++)
+	{
+		OTPData odata_rfc6238;
+		memset(&odata_rfc6238, 0, sizeof(OTPData));
+		OTPData* vdata = totp_new(&odata_rfc6238, rfc6238_secrets[a], rfc6238_oneshot[a], get_current_time, 8, 30);
+		
+		// One-shot COTP_ALGO
+		int rfc6238_ok = 1;
+		for (int i=0; i<6; i++)
+		{
+			char vcode[8+1];
+			memset(vcode, 0, 8+1);
+			rfc6238_ok &= totp_at(vdata, RFC6238_TIMES[i], 0, vcode);
+			rfc6238_ok &= strcmp(vcode, RFC6238_CODES[a][i]) == 0;
+		}
+		
+		// Prepared OTPAlgo
+		OTPKey vkey;
+		vdata->hmac = rfc6238_algos[a];
+		rfc6238_ok &= otp_prepare(vdata, &vkey);
+		for (int i=0; i<6; i++)
+		{
+			rfc6238_ok &= totp_verify(vdata, RFC6238_CODES[a][i], RFC6238_TIMES[i], 0);
+		}
+		otp_unprepare(vdata, &vkey);
+		
+		printf("RFC 6238 TOTP %s vectors pass=1: `%d`\n", RFC6238_NAMES[a], rfc6238_ok);
+		success = success && (rfc6238_ok == 1);
+	}
+	
+	// Cross-check against OpenSSL for keys shorter and longer than a block
+	COTP_ALGO openssl_algos[3] = { hmac_algo_sha1, hmac_algo_sha256, hmac_algo_sha512 };
+	int hmac_match = 1;
+	for (int a=0; a<3; a++)
+	{
+		for (int key_length=0; key_length<=200; key_length+=7)
+		{
+			char hkey[200];
+			for (int i=0; i<key_length; i++)
+				hkey[i] = (char) (i * 31 + key_length);
+			
+			char hinput[8] = { 0, 0, 0, 0, 3, 5, 7, (char) key_length };
+			char hout1[64];
+			char hout2[64];
+			int hlen1 = openssl_algos[a](hkey, key_length, hinput, hout1);
+			int hlen2 = rfc6238_oneshot[a](hkey, key_length, hinput, hout2);
+			hmac_match &= hlen1 == hlen2 && memcmp(hout1, hout2, hlen1) == 0;
+		}
+	}
+	printf("Built-in HMAC matches OpenSSL pass=1: `%d`\n", hmac_match);
+	success = success && (hmac_match == 1);
+	
+	puts(""); // line break for readability
+	
+	
+	
+	////////////////////////////////////////////////////////////////
+	// Batch Stuff                                                //
+	////////////////////////////////////////////////////////////////
+	
+	// Batches of codes across many keys must match otp_generate for every SIMD level
+	#define BATCH_COUNT 37
+	const char* batch_secrets[4] = { BASE32_SECRET, BASE32_SECRET_PADDING, RFC_SECRET_SHA1, RFC_SECRET_SHA256 };
+	const OTPAlgo* batch_algos[3] = { &OTP_HMAC_SHA1, &OTP_HMAC_SHA256, &OTP_HMAC_SHA512 };
+	
+	static OTPKey batch_keys[BATCH_COUNT];
+	const OTPKey* batch_key_ptrs[BATCH_COUNT];
+	uint64_t batch_counters[BATCH_COUNT];
+	
+	for (int a=0; a<3; a++)
+	{
+		for (uint32_t batch_digits=6; batch_digits<=8; batch_digits+=2)
+		{
+			char expected[BATCH_COUNT][8+1];
+			for (int i=0; i<BATCH_COUNT; i++)
+			{
+				OTPData odata_batch;
+				memset(&odata_batch, 0, sizeof(OTPData));
+				OTPData* bdata = hotp_new(&odata_batch, batch_secrets[i % 4], NULL, batch_digits, 0);
+				bdata->hmac = batch_algos[a];
+				otp_prepare(bdata, &batch_keys[i]);
+				batch_key_ptrs[i] = &batch_keys[i];
+				batch_counters[i] = (uint64_t) i * 0x9E3779B97F4A7C15ULL;
+				
+				memset(expected[i], 0, 8+1);
+				hotp_at(bdata, batch_counters[i], expected[i]);
+			}
+			
+			for (OTPSimd level=OTP_SIMD_SCALAR; level<=OTP_SIMD_AVX512; level++)
+			{
+				OTPSimd in_effect = otp_simd_select(level);
+				
+				uint32_t batch_codes[BATCH_COUNT];
+				int batch_ok = otp_generate_batch(batch_algos[a], batch_key_ptrs, batch_counters, BATCH_COUNT, batch_digits, batch_codes);
+				for (int i=0; i<BATCH_COUNT; i++)
+				{
+					char bcode[8+1];
+					snprintf(bcode, sizeof(bcode), "%0*u", (int) batch_digits, batch_codes[i]);
+					batch_ok &= strcmp(bcode, expected[i]) == 0;
+				}
+				
+				printf("otp_generate_batch() %s digits=%u simd=%d/%d lanes=%zu pass=1: `%d`\n",
+					RFC6238_NAMES[a], batch_digits, (int) level, (int) in_effect, otp_simd_lanes(), batch_ok);
+				success = success && (batch_ok == 1);
+			}
+		}
+	}
+	otp_simd_select(OTP_SIMD_AUTO);
+	
+	const OTPKey* unprepared_keys[1] = { &pkey };
+	uint32_t unprepared_code;
+	int batch_unprepared = otp_generate_batch(&OTP_HMAC_SHA1, unprepared_keys, batch_counters, 1, 6, &unprepared_code);
+	printf("otp_generate_batch() unprepared key pass=0: `%d`\n", batch_unprepared);
+	success = success && (batch_unprepared == 0);
+	
+	puts(""); // line break for readability
+	
+	
+	
+	////////////////////////////////////////////////////////////////
+	// Window Verification Stuff                                  //
+	////////////////////////////////////////////////////////////////
+	
+	// Prepared keys verify the whole window in SIMD lanes, results must match the one-at-a-time path
+	const uint64_t window_time = 1111111109;
+	const int64_t window = 10;
+	for (int a=0; a<3; a++)
+	{
+		OTPData odata_slow;
+		memset(&odata_slow, 0, sizeof(OTPData));
+		OTPData* slow = totp_new(&odata_slow, rfc6238_secrets[a], rfc6238_oneshot[a], get_current_time, 8, 30);
+		
+		OTPData odata_fast;
+		memset(&odata_fast, 0, sizeof(OTPData));
+		OTPData* fast = totp_new(&odata_fast, rfc6238_secrets[a], NULL, get_current_time, 8, 30);
+		fast->hmac = rfc6238_algos[a];
+		OTPKey fast_key;
+		otp_prepare(fast, &fast_key);
+		
+		int window_ok = 1;
+		for (int64_t offset=-window-2; offset<=window+2; offset++)
+		{
+			char wcode[8+1];
+			memset(wcode, 0, 8+1);
+			totp_at(slow, window_time, offset, wcode);
+			
+			int expected_ok = offset >= -window && offset <= window;
+			int slow_res = totp_verify(slow, wcode, window_time, window);
+			int fast_res = totp_verify(fast, wcode, window_time, window);
+			window_ok &= slow_res == expected_ok && fast_res == expected_ok;
+		}
+		
+		// Windows wider than one chunk of lanes
+		char far_code[8+1];
+		memset(far_code, 0, 8+1);
+		totp_at(slow, window_time, -100, far_code);
+		window_ok &= totp_verify(fast, far_code, window_time, 100) == 1;
+		window_ok &= totp_verify(fast, far_code, window_time, 99) == 0;
+		
+		window_ok &= totp_verify(fast, "1234567", window_time, window) == 0;
+		window_ok &= totp_verify(fast, "12345a78", window_time, window) == 0;
+		
+		printf("totp_verify() window %s pass=1: `%d`\n", RFC6238_NAMES[a], window_ok);
+		success = success && (window_ok == 1);
+		
+		otp_unprepare(fast, &fast_key);
+	}
+	
+	puts(""); // line break for readability
+	
+	
+	
+	////////////////////////////////////////////////////////////////
+	// Drift Stuff                                                //
+	////////////////////////////////////////////////////////////////
+	
+	// totp_verify_offset reports which timeblock matched
+	char dcode[DIGITS+1];
+	memset(dcode, 0, DIGITS+1);
+	totp_at(tdata, window_time, -3, dcode);
+	int64_t drift_offset = 0;
+	int dv1 = totp_verify_offset(tdata, dcode, window_time, 4, &drift_offset);
+	printf("totp_verify_offset() pass=1 offset=-3: `%d` `%" PRId64 "`\n", dv1, drift_offset);
+	success = success && (dv1 == 1) && (drift_offset == -3);
+	
+	// A token running 3 timeblocks ahead, checked with a narrow window of 1 inside a window of 5
+	OTPData odata_drift;
+	memset(&odata_drift, 0, sizeof(OTPData));
+	OTPData* ddata = totp_new(&odata_drift, BASE32_SECRET, hmac_algo_counted, get_current_time, DIGITS, INTERVAL);
+	
+	OTPDrift drift;
+	totp_drift_new(&drift);
+	
+	int drift_ok = 1;
+	for (int i=0; i<3; i++)
+	{
+		uint64_t drift_time = window_time + (uint64_t) i * INTERVAL;
+		memset(dcode, 0, DIGITS+1);
+		totp_at(ddata, drift_time, 3, dcode);
+		
+		hmac_counted_calls = 0;
+		drift_ok &= totp_verify_drift(ddata, &drift, dcode, drift_time, 1, 5);
+		
+		// The first verification searches the full window, later ones only the narrow window
+		int expected_calls = i == 0 ? 11 : 3;
+		printf("totp_verify_drift() #%d pass=1 skew=3 hmacs=%d: `%d` `%" PRId64 "` `%d`\n", i, expected_calls, drift_ok, drift.skew, hmac_counted_calls);
+		drift_ok &= drift.skew == 3 && hmac_counted_calls == expected_calls;
+	}
+	drift_ok &= drift.matches == 3 && drift.last_timecode == (window_time + 2 * INTERVAL) / INTERVAL + 3;
+	
+	// Outside of the valid window fails and keeps the estimate
+	memset(dcode, 0, DIGITS+1);
+	totp_at(ddata, window_time, -9, dcode);
+	drift_ok &= totp_verify_drift(ddata, &drift, dcode, window_time, 1, 5) == 0;
+	drift_ok &= drift.skew == 3 && drift.matches == 3;
+	
+	// Windows past OTP_MAX_LOOK_AHEAD are refused instead of searched
+	drift_ok &= totp_verify_drift(ddata, &drift, dcode, window_time, INT64_MAX, 5) == 0;
+	drift_ok &= totp_verify_drift(ddata, &drift, dcode, window_time, 1, INT64_MAX) == 0;
+	drift_ok &= drift.skew == 3 && drift.matches == 3;
+	
+	printf("totp_verify_drift() pass=1: `%d`\n", drift_ok);
+	success = success && (drift_ok == 1);
+	
+	puts(""); // line break for readability
+	
+	
+	
+	////////////////////////////////////////////////////////////////
+	// Integer Code Stuff                                         //
+	////////////////////////////////////////////////////////////////
+	
+	// otp_format_code must match printf for every width
+	int format_ok = 1;
+	for (uint32_t fdigits=1; fdigits<=OTP_MAX_DIGITS; fdigits++)
+	{
+		uint64_t fpower = 1;
+		for (uint32_t i=0; i<fdigits; i++)
+			fpower *= 10;
+		
+		for (uint32_t f=0; f<1000; f++)
+		{
+			uint32_t fcode = (uint32_t) (((f * 2654435761u) & 0x7FFFFFFF) % fpower);
+			char fexpected[OTP_MAX_DIGITS+1];
+			char fout[OTP_MAX_DIGITS+1];
+			snprintf(fexpected, sizeof(fexpected), "%0*u", (int) fdigits, fcode);
+			format_ok &= otp_format_code(fcode, fdigits, fout);
+			format_ok &= strcmp(fout, fexpected) == 0;
+		}
+	}
+	format_ok &= otp_format_code(1, 0, tcode) == 0 && otp_format_code(1, OTP_MAX_DIGITS+1, tcode) == 0;
+	printf("otp_format_code() pass=1: `%d`\n", format_ok);
+	success = success && (format_ok == 1);
+	
+	// otp_generate_code returns the same code as an integer
+	uint32_t icode = 0;
+	int icode_err = otp_generate_code(hdata, 1, &icode);
+	printf("otp_generate_code(1) pass=996554: `%u` `%d`\n", icode, icode_err);
+	success = success && (icode_err == 1) && (icode == 996554);
+	
+	// 10 digits is the whole 31-bit truncated value, more is rejected
+	OTPData odata_digits;
+	memset(&odata_digits, 0, sizeof(OTPData));
+	OTPData* gdata = hotp_new(&odata_digits, BASE32_SECRET, hmac_algo_sha1, 10, 0);
+	char gcode[OTP_MAX_DIGITS+1];
+	memset(gcode, 0, OTP_MAX_DIGITS+1);
+	int digits_ok = hotp_at(gdata, 1, gcode) == 1 && strlen(gcode) == 10 && strcmp(gcode + 4, "996554") == 0;
+	gdata->digits = 11;
+	digits_ok &= hotp_at(gdata, 1, gcode) == 0 && otp_generate_code(gdata, 1, &icode) == 0;
+	gdata->digits = 0;
+	digits_ok &= hotp_at(gdata, 1, gcode) == 0 && totp_verify(gdata, "", 0, 1) == 0;
+	printf("Digits bounds pass=1: `%d`\n", digits_ok);
+	success = success && (digits_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Code Parsing Stuff                                         //
+	////////////////////////////////////////////////////////////////
+	
+	// Codes are parsed with an explicit length and no null-terminator
+	uint32_t pcode = 0;
+	int parse_ok = otp_parse_code("996554xyz", 6, 6, &pcode) == 1 && pcode == 996554;
+	parse_ok &= otp_parse_code("0000000000", 10, 10, &pcode) == 1 && pcode == 0;
+	parse_ok &= otp_parse_code("4294967295", 10, 10, &pcode) == 1 && pcode == 4294967295u;
+	parse_ok &= otp_parse_code("4294967296", 10, 10, &pcode) == 0;
+	parse_ok &= otp_parse_code("99655", 5, 6, &pcode) == 0;
+	parse_ok &= otp_parse_code("99655/", 6, 6, &pcode) == 0;
+	parse_ok &= otp_parse_code("99655:", 6, 6, &pcode) == 0;
+	parse_ok &= otp_parse_code("-99655", 6, 6, &pcode) == 0;
+	parse_ok &= otp_parse_code("", 0, 0, &pcode) == 0;
+	printf("otp_parse_code() pass=1: `%d`\n", parse_ok);
+	success = success && (parse_ok == 1);
+	
+	// Integer comparisons agree with the string ones
+	int code_cmp_ok = hotp_compare_code(hdata, 996554, 1) == 1 && hotp_compare_code(hdata, 996555, 1) == 0;
+	code_cmp_ok &= hotp_compare(hdata, "996554", 1) == 1 && hotp_compare(hdata, "99655", 1) == 0;
+	code_cmp_ok &= hotp_compare(hdata, "99655a", 1) == 0;
+	
+	OTPData odata_code;
+	memset(&odata_code, 0, sizeof(OTPData));
+	OTPData* cdata = totp_new(&odata_code, rfc6238_secrets[0], rfc6238_oneshot[0], get_current_time, 8, 30);
+	int64_t code_offset = 0;
+	code_cmp_ok &= totp_compare_code(cdata, 94287082, 0, 59) == 1 && totp_compare_code(cdata, 94287083, 0, 59) == 0;
+	code_cmp_ok &= totp_compare(cdata, "94287082", 0, 59) == 1;
+	code_cmp_ok &= totp_compare_code(cdata, 94287082, -1, 89) == 1;
+	code_cmp_ok &= totp_verify_code(cdata, 94287082, 119, 2, &code_offset) == 1 && code_offset == -2;
+	code_cmp_ok &= totp_verify_code(cdata, 94287082, 119, 1, NULL) == 0;
+	code_cmp_ok &= totp_verify_code(cdata, 94287082, 119, INT64_MAX, NULL) == 0;
+	code_cmp_ok &= totp_verify_code(cdata, 94287082, 119, (int64_t) OTP_MAX_LOOK_AHEAD + 1, NULL) == 0;
+	printf("*_compare_code() pass=1: `%d`\n", code_cmp_ok);
+	success = success && (code_cmp_ok == 1);
+	
+	// Batch parsing validates 16 bytes at a time away from the end of the buffer
+	const char* parse_buffer = "123456,000000,12a456,999999,12345/,654321";
+	uint32_t parse_codes[6];
+	uint8_t parse_valid[6];
+	const uint32_t parse_expected[6] = { 123456, 0, 0, 999999, 0, 654321 };
+	const uint8_t parse_expected_valid[6] = { 1, 1, 0, 1, 0, 1 };
+	int batch_parse_ok = otp_parse_codes(parse_buffer, 7, 6, 6, parse_codes, parse_valid) == 1;
+	for (int i=0; i<6; i++)
+		batch_parse_ok &= parse_codes[i] == parse_expected[i] && parse_valid[i] == parse_expected_valid[i];
+	batch_parse_ok &= otp_parse_codes(parse_buffer, 3, 2, 6, parse_codes, parse_valid) == 0;
+	printf("otp_parse_codes() pass=1: `%d`\n", batch_parse_ok);
+	success = success && (batch_parse_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Bulk Verification Stuff                                    //
+	////////////////////////////////////////////////////////////////
+	
+	// Mixed algorithms, digits and prepared state must agree with totp_verify_offset
+	#define BULK_COUNT 61
+	OTPData bulk_odata[4];
+	OTPKey bulk_keys[4];
+	OTPData* bulk_handles[4];
+	for (int a=0; a<4; a++)
+	{
+		memset(&bulk_odata[a], 0, sizeof(OTPData));
+		if (a < 3)
+		{
+			bulk_handles[a] = totp_new(&bulk_odata[a], rfc6238_secrets[a], NULL, get_current_time, 8, 30);
+			bulk_handles[a]->hmac = rfc6238_algos[a];
+			otp_prepare(bulk_handles[a], &bulk_keys[a]);
+		}
+		else
+		{
+			bulk_handles[a] = totp_new(&bulk_odata[a], BASE32_SECRET, hmac_algo_sha1, get_current_time, 6, 30);
+		}
+	}
+	
+	OTPData* bulk_datas[BULK_COUNT];
+	uint32_t bulk_codes[BULK_COUNT];
+	uint64_t bulk_times[BULK_COUNT];
+	int64_t bulk_windows[BULK_COUNT];
+	uint8_t bulk_results[BULK_COUNT];
+	int64_t bulk_offsets[BULK_COUNT];
+	for (int i=0; i<BULK_COUNT; i++)
+	{
+		OTPData* data = bulk_handles[i % 4];
+		bulk_datas[i] = data;
+		bulk_times[i] = window_time + (uint64_t) i * 977;
+		bulk_windows[i] = i % 7;
+		
+		// Codes from up to 9 timeblocks away, some out of their window
+		int64_t from = (i % 19) - 9;
+		otp_generate_code(data, totp_timecode(data, bulk_times[i]) + from, &bulk_codes[i]);
+	}
+	bulk_windows[5] = -1;
+	bulk_windows[6] = INT64_MAX;
+	
+	int bulk_ok = totp_verify_batch(bulk_datas, bulk_codes, bulk_times, bulk_windows, BULK_COUNT, bulk_results, bulk_offsets) == 1;
+	int bulk_matches = 0;
+	for (int i=0; i<BULK_COUNT; i++)
+	{
+		char bcode[OTP_MAX_DIGITS+1];
+		otp_format_code(bulk_codes[i], bulk_datas[i]->digits, bcode);
+		int64_t expected_offset = 0;
+		int expected = totp_verify_offset(bulk_datas[i], bcode, bulk_times[i], bulk_windows[i], &expected_offset);
+		bulk_ok &= bulk_results[i] == expected;
+		bulk_ok &= !expected || bulk_offsets[i] == expected_offset;
+		bulk_matches += bulk_results[i];
+	}
+	bulk_ok &= bulk_matches > 0 && bulk_matches < BULK_COUNT;
+	
+	// A failing group leaves no request at the pending marker
+	OTPData ofailing;
+	OTPKey failing_key;
+	OTPData* failing = totp_new(&ofailing, rfc6238_secrets[0], NULL, get_current_time, 8, 30);
+	failing->hmac = &HMAC_FAILING;
+	bulk_ok &= otp_prepare(failing, &failing_key) == 1;
+	OTPData* failing_datas[2] = { failing, bulk_handles[0] };
+	bulk_ok &= totp_verify_batch(failing_datas, bulk_codes, bulk_times, bulk_windows, 2, bulk_results, bulk_offsets) == 0;
+	bulk_ok &= bulk_results[0] == 0 && bulk_results[1] == 0;
+	otp_unprepare(failing, &failing_key);
+	printf("totp_verify_batch() pass=1: `%d`\n", bulk_ok);
+	success = success && (bulk_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Thread Pool Stuff                                          //
+	////////////////////////////////////////////////////////////////
+	
+	// Splitting across workers must not change any result
+	#define POOL_COUNT 5000
+	OTPPool opool;
+	static const int pool_cpus[1] = { -1 };
+	int pool_ok = otp_pool_new(&opool, 0, pool_cpus) == NULL;
+	OTPPool* pool = otp_pool_new(&opool, 4, NULL);
+	pool_ok &= pool != NULL && pool->threads == 4;
+	
+	static const OTPKey* pool_keys[POOL_COUNT];
+	static uint64_t pool_counters[POOL_COUNT];
+	static uint32_t pool_codes[POOL_COUNT];
+	static uint32_t pool_expected[POOL_COUNT];
+	
+	// bulk_keys[0] holds an HMAC-SHA1 schedule
+	for (int i=0; i<POOL_COUNT; i++)
+	{
+		pool_keys[i] = &bulk_keys[0];
+		pool_counters[i] = (uint64_t) i * 7919;
+	}
+	pool_ok &= otp_generate_batch(&OTP_HMAC_SHA1, pool_keys, pool_counters, POOL_COUNT, 8, pool_expected) == 1;
+	pool_ok &= otp_pool_generate_batch(pool, &OTP_HMAC_SHA1, pool_keys, pool_counters, POOL_COUNT, 8, pool_codes) == 1;
+	pool_ok &= memcmp(pool_codes, pool_expected, sizeof(pool_codes)) == 0;
+	
+	static OTPData* pool_datas[POOL_COUNT];
+	static uint32_t pool_submitted[POOL_COUNT];
+	static uint64_t pool_times[POOL_COUNT];
+	static int64_t pool_windows[POOL_COUNT];
+	static uint8_t pool_results[POOL_COUNT];
+	static uint8_t pool_results_expected[POOL_COUNT];
+	static int64_t pool_offsets[POOL_COUNT];
+	static int64_t pool_offsets_expected[POOL_COUNT];
+	for (int i=0; i<POOL_COUNT; i++)
+	{
+		pool_datas[i] = bulk_handles[i % 4];
+		pool_times[i] = window_time + (uint64_t) i * 31;
+		pool_windows[i] = i % 3;
+		otp_generate_code(pool_datas[i], totp_timecode(pool_datas[i], pool_times[i]) + (i % 7) - 3, &pool_submitted[i]);
+	}
+	pool_ok &= totp_verify_batch(pool_datas, pool_submitted, pool_times, pool_windows, POOL_COUNT, pool_results_expected, pool_offsets_expected) == 1;
+	pool_ok &= otp_pool_verify_batch(pool, pool_datas, pool_submitted, pool_times, pool_windows, POOL_COUNT, pool_results, pool_offsets) == 1;
+	for (int i=0; i<POOL_COUNT; i++)
+		pool_ok &= pool_results[i] == pool_results_expected[i] && (!pool_results[i] || pool_offsets[i] == pool_offsets_expected[i]);
+	
+	// Small batches run on the calling thread
+	pool_ok &= otp_pool_verify_batch(pool, pool_datas, pool_submitted, pool_times, pool_windows, 3, pool_results, NULL) == 1;
+	otp_pool_free(pool);
+	pool_ok &= opool.state == NULL;
+	
+	for (int a=0; a<3; a++)
+		otp_unprepare(bulk_handles[a], &bulk_keys[a]);
+	printf("otp_pool_*_batch() pass=1: `%d`\n", pool_ok);
+	success = success && (pool_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Replay Cache Stuff                                         //
+	////////////////////////////////////////////////////////////////
+	
+	// A pair is accepted once, other key ids and timesteps are separate
+	static uint64_t replay_memory[4 * 64 * OTP_REPLAY_BUCKET_SLOTS];
+	OTPReplay oreplay;
+	OTPReplay* replay = otp_replay_new(&oreplay, replay_memory, sizeof(replay_memory), 4, 64, 4);
+	int replay_ok = replay != NULL && otp_replay_size(4, 64) == sizeof(replay_memory);
+	replay_ok &= otp_replay_size(3, 64) == 0 && otp_replay_new(&oreplay, replay_memory, 8, 4, 64, 4) == NULL;
+	replay_ok &= otp_replay_insert(replay, 42, 100) == 1 && otp_replay_insert(replay, 42, 100) == 0;
+	replay_ok &= otp_replay_insert(replay, 43, 100) == 1 && otp_replay_insert(replay, 42, 101) == 1;
+	
+	// A full bucket refuses new pairs until its entries leave the horizon
+	static uint64_t replay_tiny_memory[OTP_REPLAY_BUCKET_SLOTS];
+	OTPReplay otiny;
+	OTPReplay* tiny = otp_replay_new(&otiny, replay_tiny_memory, sizeof(replay_tiny_memory), 1, 1, 2);
+	for (int i=0; i<OTP_REPLAY_BUCKET_SLOTS; i++)
+		replay_ok &= otp_replay_insert(tiny, (uint64_t) i, 500) == 1;
+	replay_ok &= otp_replay_insert(tiny, 99, 502) == 0;
+	replay_ok &= otp_replay_insert(tiny, 99, 503) == 1 && otp_replay_insert(tiny, 99, 503) == 0;
+	
+	// Tags wrap around every 2^24 timesteps
+	replay_ok &= otp_replay_insert(tiny, 99, (1 << 24) + 503) == 0;
+	printf("otp_replay_insert() pass=1: `%d`\n", replay_ok);
+	success = success && (replay_ok == 1);
+	
+	// Verifying marks the matched timestep, replays within the window fail
+	int once_ok = totp_verify_once(cdata, replay, 7, "94287082", 59, 1) == 1;
+	once_ok &= totp_verify_once(cdata, replay, 7, "94287082", 59, 1) == 0;
+	once_ok &= totp_verify_once(cdata, replay, 7, "94287082", 89, 1) == 0;
+	once_ok &= totp_verify_once(cdata, replay, 8, "94287082", 89, 1) == 1;
+	once_ok &= totp_verify_code_once(cdata, replay, 9, 94287083, 59, 1) == 0;
+	printf("totp_verify_once() pass=1: `%d`\n", once_ok);
+	success = success && (once_ok == 1);
+	
+	// Racing threads insert every pair exactly once
+	static uint64_t replay_race_memory[64 * 64 * OTP_REPLAY_BUCKET_SLOTS];
+	OTPReplay orace;
+	replay_shared = otp_replay_new(&orace, replay_race_memory, sizeof(replay_race_memory), 64, 64, 8);
+	pthread_t replay_threads[4];
+	int replay_inserted[4] = { 0 };
+	for (int i=0; i<4; i++)
+		pthread_create(&replay_threads[i], NULL, replay_thread, &replay_inserted[i]);
+	int replay_total = 0;
+	for (int i=0; i<4; i++)
+	{
+		pthread_join(replay_threads[i], NULL);
+		replay_total += replay_inserted[i];
+	}
+	printf("Replay race pass=%d: `%d`\n", REPLAY_PAIRS, replay_total);
+	success = success && (replay_total == REPLAY_PAIRS);
+	
+	////////////////////////////////////////////////////////////////
+	// Code Cache Stuff                                           //
+	////////////////////////////////////////////////////////////////
+	
+	// A cold cache computes its window once, later verifies within it hash nothing
+	OTPData odata_cached;
+	memset(&odata_cached, 0, sizeof(OTPData));
+	OTPData* cached_data = totp_new(&odata_cached, rfc6238_secrets[0], hmac_algo_counted, get_fixed_time, 8, 30);
+	OTPCodeCache code_cache;
+	int cache_ok = otp_code_cache_new(&code_cache, cached_data, 2) != NULL;
+	cache_ok &= otp_code_cache_new(&code_cache, cached_data, OTP_CODE_CACHE_MAX_WINDOW + 1) == NULL;
+	cache_ok &= otp_code_cache_new(&code_cache, cached_data, 2) != NULL;
+	
+	hmac_counted_calls = 0;
+	int64_t cached_offset = 0;
+	uint32_t cached_code = 0;
+	otp_generate_code(cached_data, totp_timecode(cached_data, window_time) - 2, &cached_code);
+	int cold_calls = hmac_counted_calls;
+	cache_ok &= totp_verify_cached(&code_cache, cached_code, window_time, &cached_offset) == 1 && cached_offset == -2;
+	cold_calls = hmac_counted_calls - cold_calls;
+	cache_ok &= cold_calls == 2 * 2 + 3;
+	
+	hmac_counted_calls = 0;
+	cache_ok &= totp_verify_cached(&code_cache, cached_code, window_time, NULL) == 1;
+	cache_ok &= totp_verify_cached(&code_cache, cached_code + 1, window_time, NULL) == 0;
+	cache_ok &= hmac_counted_calls == 0;
+	
+	// The next step is held already, sliding further computes the new edge steps only
+	cache_ok &= totp_verify_cached(&code_cache, cached_code, window_time + 30, NULL) == 0;
+	cache_ok &= hmac_counted_calls == 0;
+	cache_ok &= totp_verify_cached(&code_cache, cached_code, window_time + 60, NULL) == 0;
+	cache_ok &= hmac_counted_calls == 2;
+	
+	// Results agree with totp_verify_code across every offset
+	for (int64_t offset=-4; offset<=4; offset++)
+	{
+		uint32_t ocode;
+		otp_generate_code(cached_data, totp_timecode(cached_data, window_time) + offset, &ocode);
+		int64_t expected_offset = 0;
+		int expected = totp_verify_code(cached_data, ocode, window_time, 2, &expected_offset);
+		cache_ok &= totp_verify_cached(&code_cache, ocode, window_time, &cached_offset) == expected;
+		cache_ok &= !expected || cached_offset == expected_offset;
+	}
+	printf("totp_verify_cached() pass=1 cold hmacs=7: `%d` `%d`\n", cache_ok, cold_calls);
+	success = success && (cache_ok == 1);
+	
+	// The refresher computes the next step before the boundary
+	fixed_time = 1111111110 - 5;
+	otp_code_cache_new(&code_cache, cached_data, 2);
+	OTPRefresher orefresher;
+	OTPRefresher* refresher = otp_refresher_new(&orefresher, &code_cache, 1, get_fixed_time, 10);
+	int refresh_ok = refresher != NULL;
+	otp_refresher_free(refresher);
+	refresh_ok &= orefresher.state == NULL;
+	
+	uint32_t next_code = 0;
+	otp_generate_code(cached_data, totp_timecode(cached_data, 1111111110) + 2, &next_code);
+	hmac_counted_calls = 0;
+	refresh_ok &= totp_verify_cached(&code_cache, next_code, 1111111110, NULL) == 1;
+	refresh_ok &= totp_verify_cached(&code_cache, next_code, fixed_time, NULL) == 0;
+	refresh_ok &= hmac_counted_calls == 0;
+	printf("otp_refresher_new() pass=1: `%d`\n", refresh_ok);
+	success = success && (refresh_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Look-ahead Stuff                                           //
+	////////////////////////////////////////////////////////////////
+	
+	// Prepared and one-shot keys find the first matching counter, across chunk boundaries
+	OTPData odata_ahead;
+	memset(&odata_ahead, 0, sizeof(OTPData));
+	OTPData* adata = hotp_new(&odata_ahead, RFC_SECRET_SHA1, hmac_algo_sha1, 6, 0);
+	OTPData odata_ahead_fast;
+	memset(&odata_ahead_fast, 0, sizeof(OTPData));
+	OTPData* afast = hotp_new(&odata_ahead_fast, RFC_SECRET_SHA1, NULL, 6, 0);
+	afast->hmac = &OTP_HMAC_SHA1;
+	OTPKey akey;
+	otp_prepare(afast, &akey);
+	
+	int ahead_ok = 1;
+	OTPData* ahead_datas[2] = { adata, afast };
+	for (int d=0; d<2; d++)
+	{
+		OTPData* data = ahead_datas[d];
+		uint64_t matched = 0;
+		ahead_ok &= hotp_verify(data, "969429", 0, 5, &matched) == 1 && matched == 3;
+		ahead_ok &= hotp_verify(data, "969429", 0, 2, NULL) == 0;
+		ahead_ok &= hotp_verify(data, "96942", 0, 5, NULL) == 0;
+		
+		uint64_t far_counters[4] = { 62, 63, 64, 777 };
+		for (int i=0; i<4; i++)
+		{
+			uint32_t far_code;
+			uint32_t far_next;
+			otp_generate_code(data, far_counters[i], &far_code);
+			otp_generate_code(data, far_counters[i] + 1, &far_next);
+			
+			ahead_ok &= hotp_verify_code(data, far_code, 0, 1000, &matched) == 1 && hotp_compare_code(data, far_code, matched) == 1;
+			ahead_ok &= matched <= far_counters[i];
+			ahead_ok &= hotp_verify_code(data, far_code, far_counters[i], 0, &matched) == 1 && matched == far_counters[i];
+			
+			char far_key[6+1];
+			char far_next_key[6+1];
+			otp_format_code(far_code, 6, far_key);
+			otp_format_code(far_next, 6, far_next_key);
+			ahead_ok &= hotp_resync(data, far_key, far_next_key, 0, 1000, &matched) == 1 && matched == far_counters[i];
+			ahead_ok &= hotp_resync(data, far_key, far_next_key, 0, far_counters[i] - 1, NULL) == 0;
+		}
+		
+		ahead_ok &= hotp_resync(data, "338314", "254676", 0, 10, &matched) == 1 && matched == 4;
+		ahead_ok &= hotp_resync(data, "338314", "287922", 0, 10, NULL) == 0;
+	}
+	otp_unprepare(afast, &akey);
+	printf("hotp_verify() hotp_resync() pass=1: `%d`\n", ahead_ok);
+	success = success && (ahead_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Counter Store Stuff                                        //
+	////////////////////////////////////////////////////////////////
+	
+	// Counters only move forward and survive reopening
+	const char* counter_path = "test_counters.bin";
+	remove(counter_path);
+	OTPCounterStore counter_store;
+	int counter_ok = otp_counter_open(&counter_store, counter_path, 0, OTP_SYNC_EACH) == NULL;
+	OTPCounterStore* store = otp_counter_open(&counter_store, counter_path, 16, OTP_SYNC_EACH);
+	counter_ok &= store != NULL && store->slots == 16;
+	
+	uint64_t stored = 1;
+	counter_ok &= otp_counter_get(store, 3, &stored) == 1 && stored == 0;
+	counter_ok &= otp_counter_get(store, 16, &stored) == 0;
+	counter_ok &= hotp_verify_stored(adata, store, 3, "969429", 5) == 1;
+	counter_ok &= otp_counter_get(store, 3, &stored) == 1 && stored == 4;
+	counter_ok &= hotp_verify_stored(adata, store, 3, "969429", 5) == 0;
+	counter_ok &= hotp_verify_stored(adata, store, 3, "338314", 5) == 1;
+	counter_ok &= otp_counter_advance(store, 3, 2) == 0 && otp_counter_advance(store, 3, 5) == 1;
+	otp_counter_close(store);
+	
+	store = otp_counter_open(&counter_store, counter_path, 0, OTP_SYNC_NONE);
+	counter_ok &= store != NULL && store->slots == 16;
+	counter_ok &= otp_counter_get(store, 3, &stored) == 1 && stored == 6;
+	otp_counter_close(store);
+	
+	store = otp_counter_open(&counter_store, counter_path, 64, OTP_SYNC_ASYNC);
+	counter_ok &= store != NULL && store->slots == 64;
+	counter_ok &= otp_counter_get(store, 3, &stored) == 1 && stored == 6;
+	counter_ok &= otp_counter_get(store, 63, &stored) == 1 && stored == 0;
+	printf("otp_counter_*() pass=1: `%d`\n", counter_ok);
+	success = success && (counter_ok == 1);
+	
+	// Racing verifications accept every code exactly once
+	counter_shared = store;
+	counter_data = adata;
+	pthread_t counter_threads[4];
+	int counter_accepted[4] = { 0 };
+	for (int i=0; i<4; i++)
+		pthread_create(&counter_threads[i], NULL, counter_thread, &counter_accepted[i]);
+	int counter_total = 0;
+	for (int i=0; i<4; i++)
+	{
+		pthread_join(counter_threads[i], NULL);
+		counter_total += counter_accepted[i];
+	}
+	otp_counter_get(store, 7, &stored);
+	printf("Counter race pass=%d: `%d` `%" PRIu64 "`\n", COUNTER_CODES, counter_total, stored);
+	success = success && (counter_total == COUNTER_CODES) && (stored == COUNTER_CODES);
+	otp_counter_close(store);
+	
+	// A truncated file isn't grown back, that would reset its counters
+	uint8_t counter_head[64 + 8 * 8];
+	FILE* counter_file = fopen(counter_path, "rb");
+	int counter_bad = fread(counter_head, sizeof(counter_head), 1, counter_file) == 1;
+	fclose(counter_file);
+	counter_file = fopen(counter_path, "wb");
+	fwrite(counter_head, sizeof(counter_head), 1, counter_file);
+	fclose(counter_file);
+	counter_bad &= otp_counter_open(&counter_store, counter_path, 64, OTP_SYNC_NONE) == NULL;
+	counter_bad &= otp_counter_open(&counter_store, counter_path, 0, OTP_SYNC_NONE) == NULL;
+	
+	// Files that aren't counter stores are refused
+	counter_file = fopen(counter_path, "wb");
+	fputs("not a counter store, not a counter store, not a counter store!!", counter_file);
+	fclose(counter_file);
+	counter_bad &= otp_counter_open(&counter_store, counter_path, 16, OTP_SYNC_NONE) == NULL;
+	remove(counter_path);
+	printf("otp_counter_open() bad file pass=1: `%d`\n", counter_bad);
+	success = success && (counter_bad == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Keystore Stuff                                             //
+	////////////////////////////////////////////////////////////////
+	
+	// Records generate straight from the mapped file, like their base32 secrets do
+	const char* store_path = "test_keys.bin";
+	OTPStoreRecord store_records[4];
+	int store_ok = otp_store_record_new(&store_records[0], 900, rfc6238_secrets[0], OTP_STORE_SHA1, TOTP, 8, 30, 0) != NULL;
+	store_ok &= otp_store_record_new(&store_records[1], 5, rfc6238_secrets[1], OTP_STORE_SHA256, TOTP, 8, 30, 0) != NULL;
+	store_ok &= otp_store_record_new(&store_records[2], 77, rfc6238_secrets[2], OTP_STORE_SHA512, TOTP, 8, 30, 0) != NULL;
+	store_ok &= otp_store_record_new(&store_records[3], 12, RFC_SECRET_SHA1, OTP_STORE_SHA1, HOTP, 6, 0, 3) != NULL;
+	store_ok &= otp_store_record_new(&store_records[3], 12, RFC_SECRET_SHA1, OTP_STORE_SHA1, TOTP, 6, 0, 3) == NULL;
+	store_ok &= otp_store_record_new(&store_records[3], 12, RFC_SECRET_SHA1, OTP_STORE_SHA1, HOTP, 6, 0, 3) != NULL;
+	store_ok &= otp_store_write(store_path, store_records, 4) == 1;
+	
+	OTPStore okeystore;
+	OTPStore* keystore = otp_store_open(&okeystore, store_path, OTP_MAP_POPULATE);
+	store_ok &= keystore != NULL && keystore->count == 4;
+	store_ok &= otp_store_find(keystore, 6) == NULL && otp_store_find(keystore, 901) == NULL;
+	
+	const uint64_t STORE_IDS[3] = { 900, 5, 77 };
+	for (int a=0; a<3; a++)
+	{
+		const OTPStoreRecord* record = otp_store_find(keystore, STORE_IDS[a]);
+		OTPData ostore_data;
+		OTPData* sdata = otp_store_data(&ostore_data, record, get_current_time);
+		store_ok &= sdata != NULL && sdata->key == &record->key;
+		store_ok &= (const uint8_t*) record >= keystore->map.base && (const uint8_t*) (record + 1) <= keystore->map.base + keystore->map.size;
+		for (int i=0; i<6; i++)
+			store_ok &= totp_verify(sdata, RFC6238_CODES[a][i], RFC6238_TIMES[i], 0);
+	}
+	
+	OTPData ostore_hotp;
+	OTPData* shotp = otp_store_data(&ostore_hotp, otp_store_find(keystore, 12), NULL);
+	char store_code[6+1];
+	store_ok &= shotp != NULL && shotp->count == 3 && hotp_next(shotp, store_code) == 1 && strcmp(store_code, RFC4226_CODES[3]) == 0;
+	otp_store_close(keystore);
+	
+	// The keystore is renamed into place and readable by its owner only
+	FILE* store_file = fopen("test_keys.bin.tmp", "rb");
+	store_ok &= store_file == NULL;
+	if (store_file != NULL)
+		fclose(store_file);
+#if !defined(_WIN32)
+	struct stat store_stat;
+	store_ok &= stat(store_path, &store_stat) == 0 && (store_stat.st_mode & 0777) == 0600;
+#endif
+	
+	// Duplicate ids and files that aren't keystores are refused
+	store_records[1].key_id = 900;
+	store_ok &= otp_store_write(store_path, store_records, 4) == 0;
+	store_file = fopen(store_path, "wb");
+	fputs("COTPKEY1 but not really a keystore, the header is all wrong here!", store_file);
+	fclose(store_file);
+	store_ok &= otp_store_open(&okeystore, store_path, 0) == NULL;
+	remove(store_path);
+	store_ok &= otp_store_open(&okeystore, store_path, 0) == NULL;
+	printf("otp_store_*() pass=1: `%d`\n", store_ok);
+	success = success && (store_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Vault Stuff                                                //
+	////////////////////////////////////////////////////////////////
+	
+	// Pages decrypt on first access and authenticate one by one
+	#define VAULT_COUNT 30
+	const char* vault_path = "test_vault.bin";
+	uint8_t vault_key[OTP_VAULT_KEY_LENGTH];
+	for (int i=0; i<OTP_VAULT_KEY_LENGTH; i++)
+		vault_key[i] = (uint8_t) (i * 7 + 1);
+	
+	static OTPStoreRecord vault_records[VAULT_COUNT];
+	int vault_ok = 1;
+	for (int i=0; i<VAULT_COUNT; i++)
+		vault_ok &= otp_store_record_new(&vault_records[i], (uint64_t) (VAULT_COUNT - i) * 10, rfc6238_secrets[0], OTP_STORE_SHA1, TOTP, 8, 30, 0) != NULL;
+	vault_ok &= otp_vault_write(vault_path, vault_key, vault_records, VAULT_COUNT) == 1;
+	
+	// The vault is renamed into place and readable by its owner only
+	FILE* vault_file = fopen("test_vault.bin.tmp", "rb");
+	vault_ok &= vault_file == NULL;
+	if (vault_file != NULL)
+		fclose(vault_file);
+#if !defined(_WIN32)
+	struct stat vault_stat;
+	vault_ok &= stat(vault_path, &vault_stat) == 0 && (vault_stat.st_mode & 0777) == 0600;
+#endif
+	
+	OTPVault ovault;
+	OTPVault* vault = otp_vault_open(&ovault, vault_path, vault_key, 0);
+	vault_ok &= vault != NULL && vault->count == VAULT_COUNT && vault->pages == 3;
+	
+	OTPVaultStatus vault_status;
+	vault_ok &= otp_vault_find(vault, 15, &vault_status) == NULL && vault_status == OTP_VAULT_MISSING;
+	const OTPStoreRecord* vrecord = otp_vault_find(vault, 150, &vault_status);
+	vault_ok &= vrecord != NULL && vault_status == OTP_VAULT_FOUND && vrecord->key_id == 150;
+	
+	OTPData ovault_data;
+	OTPData* vdata_store = otp_store_data(&ovault_data, vrecord, get_current_time);
+	for (int i=0; i<6; i++)
+		vault_ok &= totp_verify(vdata_store, RFC6238_CODES[0][i], RFC6238_TIMES[i], 0);
+	vault_ok &= otp_vault_prewarm(vault, 1) == 1 && otp_vault_prewarm(vault, 1) == 0;
+	otp_vault_close(vault);
+	
+	// A wrong key fails every page
+	vault_key[0] ^= 1;
+	vault = otp_vault_open(&ovault, vault_path, vault_key, 0);
+	vault_ok &= vault != NULL && otp_vault_find(vault, 150, &vault_status) == NULL && vault_status == OTP_VAULT_AUTH_FAILED;
+	otp_vault_close(vault);
+	vault_key[0] ^= 1;
+	
+	// A flipped byte fails its own page only
+	vault_file = fopen(vault_path, "r+b");
+	fseek(vault_file, 4096 * 2 + 100, SEEK_SET);
+	int vault_byte = fgetc(vault_file);
+	fseek(vault_file, 4096 * 2 + 100, SEEK_SET);
+	fputc(vault_byte ^ 0x80, vault_file);
+	fclose(vault_file);
+	
+	vault = otp_vault_open(&ovault, vault_path, vault_key, OTP_MAP_POPULATE);
+	vault_ok &= vault != NULL && otp_vault_prewarm(vault, 0) == 1;
+	vault_ok &= otp_vault_find(vault, 10, &vault_status) != NULL && vault_status == OTP_VAULT_FOUND;
+	vault_ok &= otp_vault_find(vault, 150, &vault_status) == NULL && vault_status == OTP_VAULT_AUTH_FAILED;
+	vault_ok &= otp_vault_find(vault, 300, &vault_status) != NULL && vault_status == OTP_VAULT_FOUND;
+	otp_vault_close(vault);
+	remove(vault_path);
+	printf("otp_vault_*() pass=1: `%d`\n", vault_ok);
+	success = success && (vault_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Base32                                                     //
+	////////////////////////////////////////////////////////////////
+	
+	static const char* const B32_VECTORS[][3] = {
+		{ "", "", "" },
+		{ "MY======", "MY", "f" },
+		{ "MZXQ====", "mzxq", "fo" },
+		{ "MZXW6===", "MZXW6", "foo" },
+		{ "MZXW6YQ=", "mzXw6yQ", "foob" },
+		{ "MZXW6YTB", "MZXW6YTB", "fooba" },
+		{ "MZXW6YTBOI======", "MZXW6YTBOI", "foobar" },
+	};
+	
+	int b32_ok = 1;
+	uint8_t b32_out[64];
+	size_t b32_length;
+	for (size_t i=0; i<sizeof(B32_VECTORS)/sizeof(B32_VECTORS[0]); i++)
+	{
+		size_t expected = strlen(B32_VECTORS[i][2]);
+		for (int j=0; j<2; j++)
+		{
+			const char* in = B32_VECTORS[i][j];
+			b32_length = 99;
+			b32_ok &= otp_base32_decode(in, strlen(in), b32_out, sizeof(b32_out), &b32_length) == 1;
+			b32_ok &= b32_length == expected && memcmp(b32_out, B32_VECTORS[i][2], expected) == 0;
+			b32_ok &= otp_base32_decoded_length(in, strlen(in)) == expected;
+		}
+		
+		char b32_text[32];
+		const uint8_t* raw = (const uint8_t*) B32_VECTORS[i][2];
+		b32_ok &= otp_base32_encode(raw, expected, b32_text, sizeof(b32_text), 1, &b32_length) == 1;
+		b32_ok &= strcmp(b32_text, B32_VECTORS[i][0]) == 0 && b32_length == strlen(B32_VECTORS[i][0]);
+		b32_ok &= otp_base32_encode(raw, expected, b32_text, sizeof(b32_text), 0, &b32_length) == 1;
+		b32_ok &= b32_length == strlen(B32_VECTORS[i][1]) && strncmp(b32_text, B32_VECTORS[i][0], b32_length) == 0;
+	}
+	b32_ok &= otp_base32_encode((const uint8_t*) "foobar", 6, (char*) b32_out, 16, 1, NULL) == 0;
+	
+	// Invalid characters, inner padding, impossible lengths and short buffers
+	b32_ok &= otp_base32_decode("MZXW6YT1", 8, b32_out, sizeof(b32_out), NULL) == 0;
+	b32_ok &= otp_base32_decode("MZXW6YT!", 8, b32_out, sizeof(b32_out), NULL) == 0;
+	b32_ok &= otp_base32_decode("MZ=W6YTB", 8, b32_out, sizeof(b32_out), NULL) == 0;
+	b32_ok &= otp_base32_decode("MZXW6=", 6, b32_out, sizeof(b32_out), NULL) == 0;
+	b32_ok &= otp_base32_decode("MZX", 3, b32_out, sizeof(b32_out), NULL) == 0;
+	b32_ok &= otp_base32_decode("MZXW6YTBOI======", 16, b32_out, 5, NULL) == 0;
+	b32_ok &= otp_base32_decoded_length("M=======", 8) == 0;
+	
+	OTPKey b32_key;
+	b32_ok &= otp_key_new(&b32_key, "JBSWY3DPEHPK3PXP!") == NULL;
+	b32_ok &= otp_key_new(&b32_key, "MZXW6YTBOI") != NULL && b32_key.length == 6;
+	
+	// Every instruction set decodes long input like the scalar path
+	static char b32_long[1002];
+	static uint8_t b32_expected[1002 * 5 / 8];
+	static uint8_t b32_simd[1002 * 5 / 8];
+	for (size_t i=0; i<sizeof(b32_long); i++)
+	{
+		char c = OTP_DEFAULT_BASE32_CHARS[(i * 13 + i / 32) % 32];
+		b32_long[i] = (i % 3 == 0 && c >= 'A') ? c | 0x20 : c;
+	}
+	otp_simd_select(OTP_SIMD_SCALAR);
+	b32_ok &= otp_base32_decode(b32_long, sizeof(b32_long), b32_expected, sizeof(b32_expected), &b32_length) == 1 && b32_length == sizeof(b32_expected);
+	for (OTPSimd level=OTP_SIMD_SSE4; level<=OTP_SIMD_AVX512; level++)
+	{
+		otp_simd_select(level);
+		b32_ok &= otp_base32_decode(b32_long, sizeof(b32_long), b32_simd, sizeof(b32_simd), NULL) == 1;
+		b32_ok &= memcmp(b32_simd, b32_expected, sizeof(b32_expected)) == 0;
+		
+		// The encoder always writes upper case
+		static char b32_encoded[sizeof(b32_long) + 1];
+		b32_ok &= otp_base32_encode(b32_simd, sizeof(b32_simd), b32_encoded, sizeof(b32_encoded), 0, &b32_length) == 1;
+		b32_ok &= b32_length == sizeof(b32_long);
+		for (size_t i=0; i<sizeof(b32_long); i++)
+			b32_ok &= b32_encoded[i] == (b32_long[i] >= 'a' ? b32_long[i] - 32 : b32_long[i]);
+		
+		// One bad character anywhere fails the whole input
+		static const size_t B32_BAD_AT[] = { 3, 517, 1001 };
+		static const char B32_BAD[] = { '@', '8', '{' };
+		for (int j=0; j<3; j++)
+		{
+			char saved = b32_long[B32_BAD_AT[j]];
+			b32_long[B32_BAD_AT[j]] = B32_BAD[j];
+			b32_ok &= otp_base32_decode(b32_long, sizeof(b32_long), b32_simd, sizeof(b32_simd), NULL) == 0;
+			b32_long[B32_BAD_AT[j]] = saved;
+		}
+	}
+	otp_simd_select(OTP_SIMD_AUTO);
+	printf("otp_base32_*() pass=1: `%d`\n", b32_ok);
+	success = success && (b32_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Random Secrets                                             //
+	////////////////////////////////////////////////////////////////
+	
+	#define RANDOM_SECRETS 1000
+	static char random_secrets[RANDOM_SECRETS][27];
+	int random_ok = otp_random_base32_batch(26, RANDOM_SECRETS, random_secrets[0], sizeof(random_secrets[0])) == 1;
+	for (int i=0; i<RANDOM_SECRETS; i++)
+	{
+		OTPKey random_key;
+		random_ok &= strlen(random_secrets[i]) == 26;
+		random_ok &= otp_key_new(&random_key, random_secrets[i]) != NULL && random_key.length == 16;
+		random_ok &= i == 0 || strcmp(random_secrets[i], random_secrets[i - 1]) != 0;
+	}
+	
+	// Long secrets go through several steps of the encoder
+	static char random_long[1001];
+	random_ok &= otp_random_base32_batch(1000, 1, random_long, sizeof(random_long)) == 1;
+	random_ok &= strlen(random_long) == 1000 && otp_base32_decoded_length(random_long, 1000) == 625;
+	random_ok &= otp_random_base32_batch(16, 1, random_long, 16) == 0;
+	
+	uint8_t random_a[100] = { 0 };
+	uint8_t random_b[100] = { 0 };
+	random_ok &= otp_random_bytes(random_a, sizeof(random_a)) == 1;
+	otp_random_wipe();
+	random_ok &= otp_random_bytes(random_b, sizeof(random_b)) == 1;
+	random_ok &= memcmp(random_a, random_b, sizeof(random_a)) != 0;
+	
+#if !defined(_WIN32)
+	// A forked child doesn't repeat the bytes its parent has buffered
+	int random_pipe[2];
+	random_ok &= pipe(random_pipe) == 0;
+	pid_t random_child = fork();
+	if (random_child == 0)
+	{
+		otp_random_bytes(random_b, 32);
+		_exit(write(random_pipe[1], random_b, 32) == 32 ? 0 : 1);
+	}
+	random_ok &= random_child > 0 && otp_random_bytes(random_a, 32) == 1;
+	random_ok &= read(random_pipe[0], random_b, 32) == 32 && memcmp(random_a, random_b, 32) != 0;
+	random_ok &= waitpid(random_child, NULL, 0) == random_child;
+	close(random_pipe[0]);
+	close(random_pipe[1]);
+#endif
+	
+	char random_single[17] = { 0 };
+	random_ok &= otp_random_base32(16, random_single) == 1 && otp_base32_decoded_length(random_single, 16) == 10;
+	OTPKey random_key;
+	random_ok &= otp_key_new(&random_key, random_single) != NULL && random_key.length == 10;
+	printf("otp_random_*() pass=1: `%d`\n", random_ok);
+	success = success && (random_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Enrollment                                                 //
+	////////////////////////////////////////////////////////////////
+	
+	const char* enroll_users = "test_users.txt";
+	const char* enroll_keys = "test_enroll.bin";
+	const char* enroll_csv = "test_enroll.csv";
+	
+	// More users than one batch, with comments, blank lines and CRLF
+	#define ENROLL_USERS 5000
+	FILE* enroll_file = fopen(enroll_users, "wb");
+	fputs("# users\r\n\n", enroll_file);
+	for (int i=0; i<ENROLL_USERS; i++)
+		fprintf(enroll_file, i % 2 ? "Acme:user%d\r\n" : "user \"%d\"\n", i);
+	fclose(enroll_file);
+	
+	OTPEnrollConfig enroll_config;
+	otp_enroll_config_new(&enroll_config, "COTP");
+	enroll_config.first_id = 1000;
+	enroll_config.threads = 3;
+	uint64_t enrolled = 0;
+	int enroll_ok = otp_enroll(&enroll_config, enroll_users, enroll_keys, enroll_csv, &enrolled) == 1 && enrolled == ENROLL_USERS;
+	
+	OTPStore oenroll_store;
+	OTPStore* enroll_store = otp_store_open(&oenroll_store, enroll_keys, 0);
+	enroll_ok &= enroll_store != NULL && enroll_store->count == ENROLL_USERS;
+	
+	// Every export line matches its record, in the order of the users
+	enroll_file = fopen(enroll_csv, "rb");
+	char enroll_line[512];
+	enroll_ok &= fgets(enroll_line, sizeof(enroll_line), enroll_file) != NULL && strcmp(enroll_line, "key_id,issuer,name,secret,uri\n") == 0;
+	for (int i=0; i<ENROLL_USERS && enroll_ok; i++)
+	{
+		char expected[64];
+		uint64_t key_id;
+		int field;
+		enroll_ok &= fgets(enroll_line, sizeof(enroll_line), enroll_file) != NULL;
+		enroll_ok &= sscanf(enroll_line, "%" SCNu64 ",%n", &key_id, &field) == 1 && key_id == 1000 + (uint64_t) i;
+		
+		snprintf(expected, sizeof(expected), i % 2 ? "\"Acme\",\"user%d\"," : "\"COTP\",\"user \"\"%d\"\"\",", i);
+		enroll_ok &= strncmp(enroll_line + field, expected, strlen(expected)) == 0;
+		
+		char secret[33];
+		memcpy(secret, enroll_line + field + strlen(expected), 32);
+		secret[32] = '\0';
+		
+		OTPKey enroll_key;
+		const OTPStoreRecord* record = otp_store_find(enroll_store, key_id);
+		enroll_ok &= record != NULL && otp_key_new(&enroll_key, secret) != NULL;
+		enroll_ok &= record != NULL && record->key.length == 20 && memcmp(record->key.bytes, enroll_key.bytes, 20) == 0;
+		enroll_ok &= strstr(enroll_line, "?secret=") != NULL && strncmp(strstr(enroll_line, "?secret=") + 8, secret, 32) == 0;
+	}
+	enroll_ok &= fgets(enroll_line, sizeof(enroll_line), enroll_file) == NULL;
+	fclose(enroll_file);
+	otp_store_close(enroll_store);
+#if !defined(_WIN32)
+	struct stat enroll_stat;
+	enroll_ok &= stat(enroll_csv, &enroll_stat) == 0 && (enroll_stat.st_mode & 0777) == 0600;
+#endif
+	
+	// An unfinished keystore never replaces the one at its path
+	OTPStoreWriter enroll_writer;
+	enroll_ok &= otp_store_writer_open(&enroll_writer, enroll_keys, 1) != NULL;
+	otp_store_writer_abort(&enroll_writer);
+	enroll_store = otp_store_open(&oenroll_store, enroll_keys, 0);
+	enroll_ok &= enroll_store != NULL && enroll_store->count == ENROLL_USERS;
+	if (enroll_store != NULL)
+		otp_store_close(enroll_store);
+	enroll_file = fopen("test_enroll.bin.tmp", "rb");
+	enroll_ok &= enroll_file == NULL;
+	if (enroll_file != NULL)
+		fclose(enroll_file);
+	remove(enroll_keys);
+	remove(enroll_csv);
+	
+	// A line longer than a batch fails before creating a keystore or an export
+	enroll_file = fopen(enroll_users, "wb");
+	for (int i=0; i<(1 << 18); i++)
+		fputc('x', enroll_file);
+	fclose(enroll_file);
+	enroll_ok &= otp_enroll(&enroll_config, enroll_users, enroll_keys, enroll_csv, NULL) == 0;
+	enroll_ok &= otp_store_open(&oenroll_store, enroll_keys, 0) == NULL;
+	enroll_file = fopen(enroll_csv, "rb");
+	enroll_ok &= enroll_file == NULL;
+	if (enroll_file != NULL)
+		fclose(enroll_file);
+	
+	// Names without an issuer quote the configured one, however long it is
+	enroll_file = fopen(enroll_users, "wb");
+	fputs("bob\n", enroll_file);
+	fclose(enroll_file);
+	OTPEnrollConfig enroll_long;
+	otp_enroll_config_new(&enroll_long, "A \"Very\" Long Company Name Incorporated Worldwide Holdings");
+	enroll_ok &= otp_enroll(&enroll_long, enroll_users, enroll_keys, enroll_csv, NULL) == 1;
+	enroll_file = fopen(enroll_csv, "rb");
+	enroll_ok &= enroll_file != NULL && fgets(enroll_line, sizeof(enroll_line), enroll_file) != NULL;
+	enroll_ok &= enroll_file != NULL && fgets(enroll_line, sizeof(enroll_line), enroll_file) != NULL;
+	enroll_ok &= strncmp(enroll_line, "1,\"A \"\"Very\"\" Long Company Name Incorporated Worldwide Holdings\",\"bob\",", 71) == 0;
+	enroll_ok &= strstr(enroll_line, "&issuer=A%20%22Very%22%20Long") != NULL;
+	if (enroll_file != NULL)
+		fclose(enroll_file);
+	
+	remove(enroll_users);
+	remove(enroll_keys);
+	remove(enroll_csv);
+	printf("otp_enroll() pass=1: `%d`\n", enroll_ok);
+	success = success && (enroll_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// URI Building                                               //
+	////////////////////////////////////////////////////////////////
+	
+	OTPData ouri_data;
+	OTPData* uri_data = totp_new(&ouri_data, "JBSWY3DPEHPK3PXP", hmac_algo_sha1, get_current_time, 8, 60);
+	const char* URI_EXPECTED = "otpauth://totp/Acme%20Co:j%C3%A9r%C3%B4me%40example.com?secret=JBSWY3DPEHPK3PXP&issuer=Acme%20Co&algorithm=SHA1&digits=8&period=60";
+	
+	char uri[256];
+	size_t uri_length = otpuri_length(uri_data, "Acme Co", "j\xC3\xA9r\xC3\xB4me@example.com", "SHA1");
+	int uri_ok = uri_length == strlen(URI_EXPECTED);
+	uri_ok &= otpuri_strlen(uri_data, "Acme Co", "j\xC3\xA9r\xC3\xB4me@example.com", "SHA1") >= uri_length;
+	uri_ok &= otpuri_write(uri_data, "Acme Co", "j\xC3\xA9r\xC3\xB4me@example.com", "SHA1", uri, sizeof(uri)) == uri_length;
+	uri_ok &= strcmp(uri, URI_EXPECTED) == 0;
+	
+	// One byte short of the terminator writes nothing
+	memset(uri, 'x', sizeof(uri));
+	uri_ok &= otpuri_write(uri_data, "Acme Co", "j\xC3\xA9r\xC3\xB4me@example.com", "SHA1", uri, uri_length) == 0 && uri[0] == 'x';
+	uri_ok &= otpuri_write(uri_data, "Acme Co", "j\xC3\xA9r\xC3\xB4me@example.com", "SHA1", uri, uri_length + 1) == uri_length;
+	
+	// The counter may grow between sizing and building
+	OTPData ouri_hotp;
+	OTPData* uri_hotp = hotp_new(&ouri_hotp, "JBSWY3DPEHPK3PXP", hmac_algo_sha1, 6, 7);
+	size_t uri_max = otpuri_strlen(uri_hotp, "a&b", "c?d", "SHA1");
+	uri_hotp->count = UINT64_MAX;
+	uri_ok &= otpuri_length(uri_hotp, "a&b", "c?d", "SHA1") <= uri_max;
+	uri_ok &= otpuri_build_uri(uri_hotp, "a&b", "c?d", "SHA1", uri) == 1;
+	uri_ok &= strcmp(uri, "otpauth://hotp/a%26b:c%3Fd?secret=JBSWY3DPEHPK3PXP&issuer=a%26b&algorithm=SHA1&digits=6&counter=18446744073709551615") == 0;
+	
+	// Every byte value, between runs of safe bytes longer than a vector
+	static char uri_raw[1024];
+	static char uri_encoded[sizeof(uri_raw) * 3 + 1];
+	static char uri_expected[sizeof(uri_raw) * 3 + 1];
+	size_t uri_expected_length = 0;
+	for (size_t i=0; i<sizeof(uri_raw); i++)
+	{
+		unsigned char c = (unsigned char) (i < 512 && i % 2 ? i / 2 : 'a' + i % 26);
+		uri_raw[i] = (char) c;
+		if (c < 0x20 || c >= 0x7F || strchr("\"<>#%@{}|\\^~[]` ?&", c) != NULL)
+			uri_expected_length += sprintf(uri_expected + uri_expected_length, "%%%02X", c);
+		else
+			uri_expected[uri_expected_length++] = (char) c;
+	}
+	for (OTPSimd level=OTP_SIMD_SCALAR; level<=OTP_SIMD_AVX512; level++)
+	{
+		otp_simd_select(level);
+		uri_ok &= otpuri_encoded_length(uri_raw, sizeof(uri_raw)) == uri_expected_length;
+		uri_ok &= otpuri_encode_url(uri_raw, sizeof(uri_raw), uri_encoded) == 1;
+		uri_ok &= strcmp(uri_encoded, uri_expected) == 0;
+	}
+	otp_simd_select(OTP_SIMD_AUTO);
+	printf("otpuri_write() pass=1: `%d`\n", uri_ok);
+	success = success && (uri_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// URI Parsing                                                //
+	////////////////////////////////////////////////////////////////
+	
+	// What otpuri_write() builds parses back to the same data
+	OTPUri parsed_uri;
+	char uri_text[128];
+	int uri_parse_ok = otpuri_parse(&parsed_uri, URI_EXPECTED, strlen(URI_EXPECTED)) == 1;
+	uri_parse_ok &= parsed_uri.type == TOTP && parsed_uri.digits == 8 && parsed_uri.interval == 60 && parsed_uri.hmac == &OTP_HMAC_SHA1;
+	uri_parse_ok &= otpuri_decode(&parsed_uri.issuer, uri_text, sizeof(uri_text), NULL) == 1 && strcmp(uri_text, "Acme Co") == 0;
+	uri_parse_ok &= otpuri_decode(&parsed_uri.name, uri_text, sizeof(uri_text), NULL) == 1 && strcmp(uri_text, "j\xC3\xA9r\xC3\xB4me@example.com") == 0;
+	uri_parse_ok &= otpuri_decode(&parsed_uri.name, uri_text, 10, NULL) == 0;
+	uri_parse_ok &= parsed_uri.secret.length == 16 && strncmp(parsed_uri.secret.data, "JBSWY3DPEHPK3PXP", 16) == 0;
+	
+	// The parsed key generates like the RFC secret, without a copy of the input
+	char rfc_uri[256];
+	snprintf(rfc_uri, sizeof(rfc_uri), "otpauth://totp/ACME%%3A%%20alice?secret=%s&algorithm=sha512&digits=8&issuer=ACME&unknown=1&ignored", RFC_SECRET_SHA512);
+	OTPData oparsed_data;
+	OTPKey parsed_key;
+	uri_parse_ok &= otpuri_parse(&parsed_uri, rfc_uri, strlen(rfc_uri) - strlen("&ignored")) == 1;
+	uri_parse_ok &= parsed_uri.name.length == 5 && strncmp(parsed_uri.name.data, "alice", 5) == 0;
+	OTPData* parsed_data = otpuri_data(&oparsed_data, &parsed_uri, &parsed_key, get_current_time);
+	for (int i=0; parsed_data != NULL && i<6; i++)
+		uri_parse_ok &= totp_verify(parsed_data, RFC6238_CODES[2][i], RFC6238_TIMES[i], 0);
+	uri_parse_ok &= parsed_data != NULL && parsed_data->key == &parsed_key;
+	otp_key_wipe(&parsed_key);
+	
+	const char* HOTP_URI = "OTPAUTH://HOTP/bob?counter=18446744073709551615&secret=JBSW%59%33DPEHPK3PXP";
+	uri_parse_ok &= otpuri_parse(&parsed_uri, HOTP_URI, strlen(HOTP_URI)) == 1;
+	uri_parse_ok &= parsed_uri.type == HOTP && parsed_uri.counter == UINT64_MAX && parsed_uri.issuer.length == 0;
+	uri_parse_ok &= otpuri_data(&oparsed_data, &parsed_uri, &parsed_key, NULL) != NULL && parsed_key.length == 10;
+	otp_key_wipe(&parsed_key);
+	
+	static const char* const BAD_URIS[] = {
+		"otpauth://totp/bob?secret=JBSWY3DPEHPK3PXP&secret=JBSWY3DPEHPK3PXP",
+		"otpauth://totp/bob?secret=JBSWY3DPEHPK3PXP&digits=11",
+		"otpauth://totp/bob?secret=JBSWY3DPEHPK3PXP&period=0",
+		"otpauth://totp/bob?secret=JBSWY3DPEHPK3PXP&algorithm=MD5",
+		"otpauth://totp/bob?secret=JBSWY3DPEHPK3PXP&issuer=%4",
+		"otpauth://totp/a:bob?secret=JBSWY3DPEHPK3PXP&issuer=b",
+		"otpauth://totp/:bob?secret=JBSWY3DPEHPK3PXP",
+		"otpauth://totp/?secret=JBSWY3DPEHPK3PXP",
+		"otpauth://totp/bob?secret=JBSWY3DPE",
+		"otpauth://totp/bob?secret=",
+		"otpauth://totp/bob?issuer=a",
+		"otpauth://totp/bob?secret=JBSWY3DPEHPK3PXP#frag",
+		"otpauth://totp/bob?secret=JBSWY3DPEHPK3PXP&&",
+		"otpauth://hotp/bob?secret=JBSWY3DPEHPK3PXP",
+		"otpauth://hotp/bob?secret=JBSWY3DPEHPK3PXP&counter=18446744073709551616",
+		"otpauth://hotp/bob?secret=JBSWY3DPEHPK3PXP&counter=-1",
+		"otpauth://otp/bob?secret=JBSWY3DPEHPK3PXP",
+		"otpuri://totp/bob?secret=JBSWY3DPEHPK3PXP",
+		"otpauth://totp/b\tob?secret=JBSWY3DPEHPK3PXP",
+	};
+	for (size_t i=0; i<sizeof(BAD_URIS)/sizeof(BAD_URIS[0]); i++)
+		uri_parse_ok &= otpuri_parse(&parsed_uri, BAD_URIS[i], strlen(BAD_URIS[i])) == 0;
+	
+	// Syntax is fine, the secret isn't base32
+	const char* BAD_SECRET = "otpauth://totp/bob?secret=JBSWY3DPEHPK3PX1";
+	uri_parse_ok &= otpuri_parse(&parsed_uri, BAD_SECRET, strlen(BAD_SECRET)) == 1;
+	uri_parse_ok &= otpuri_data(&oparsed_data, &parsed_uri, &parsed_key, NULL) == NULL;
+	printf("otpuri_parse() pass=1: `%d`\n", uri_parse_ok);
+	success = success && (uri_parse_ok == 1);
+	
+	////////////////////////////////////////////////////////////////
+	// Import                                                     //
+	////////////////////////////////////////////////////////////////
+	
+	const char* import_input = "test_import.txt";
+	const char* import_keys = "test_import.bin";
+	const char* import_report = "test_import_report.txt";
+	const char* import_index = "test_import_index.csv";
+	
+	// A migration export of three keys, the second with an unknown algorithm
+	const char* IMPORT_MIGRATION = "otpauth-migration://offline?data="
+		"Ch8KCkhlbGxvId6tvu8SBWFsaWNlGgRBY21lIAIoAjACChUKCkhlbGxvId6tvu8SA2JvYiAJMAIK"
+		"GwoKSGVsbG8h3q2%2B7xIFY2Fyb2wgASgBMAE4BRABGAEgACgA";
+	
+	// More than one chunk of lines, with comments, blank lines, CRLF and bad lines
+	#define IMPORT_USERS 25000
+	FILE* import_file = fopen(import_input, "wb");
+	fputs("# exported\n", import_file);
+	fputs("otpauth://totp/Acme:dave?secret=JBSWY3DPEHPK3PXP&issuer=Acme&algorithm=SHA512&digits=8&period=60\r\n", import_file);
+	fputs("\r\n", import_file);
+	fputs("otpauth://hotp/%22erin%22?secret=JBSWY3DP%45HPK3PXP&counter=42\n", import_file);
+	fputs("otpauth://totp/bad?secret=JBSWY3DPEHPK3PX1\n", import_file);
+	fprintf(import_file, "%s\n", IMPORT_MIGRATION);
+	fputs("not a uri\n", import_file);
+	fputs("otpauth-migration://offline?data=%%%%\n", import_file);
+	for (int i=0; i<IMPORT_USERS; i++)
+		fprintf(import_file, "otpauth://totp/user%d?secret=JBSWY3DPEHPK3PXP\n", i);
+	fputs("otpauth://totp/last", import_file);
+	fclose(import_file);
+	
+	OTPImportResult import_result;
+	int import_ok = otp_import(import_input, import_keys, import_report, import_index, 100, 3, &import_result) == 1;
+	import_ok &= import_result.imported == IMPORT_USERS + 4 && import_result.failed == 5 && import_result.lines == IMPORT_USERS + 7;
+	
+	OTPStore oimport_store;
+	OTPStore* import_store = otp_store_open(&oimport_store, import_keys, 0);
+	import_ok &= import_store != NULL && import_store->count == IMPORT_USERS + 4;
+	
+	// Keys keep the order of the input, migration entries in place of their line
+	const uint8_t IMPORT_SECRET[10] = { 'H', 'e', 'l', 'l', 'o', '!', 0xDE, 0xAD, 0xBE, 0xEF };
+	const struct { uint8_t algo; uint8_t type; uint8_t digits; uint32_t interval; uint64_t counter; } IMPORT_EXPECTED[5] = {
+		{ OTP_STORE_SHA512, TOTP, 8, 60, 0 },
+		{ OTP_STORE_SHA1, HOTP, 6, 0, 42 },
+		{ OTP_STORE_SHA256, TOTP, 8, 30, 0 },
+		{ OTP_STORE_SHA1, HOTP, 6, 0, 5 },
+		{ OTP_STORE_SHA1, TOTP, 6, 30, 0 },
+	};
+	for (uint64_t i=0; i<IMPORT_USERS + 4 && import_store != NULL; i++)
+	{
+		const OTPStoreRecord* record = otp_store_find(import_store, 100 + i);
+		int expected = i < 4 ? (int) i : 4;
+		import_ok &= record != NULL && record->key.length == 10 && memcmp(record->key.bytes, IMPORT_SECRET, 10) == 0;
+		import_ok &= record != NULL && record->algo == IMPORT_EXPECTED[expected].algo && record->type == IMPORT_EXPECTED[expected].type;
+		import_ok &= record != NULL && record->digits == IMPORT_EXPECTED[expected].digits && record->interval == IMPORT_EXPECTED[expected].interval;
+		import_ok &= record != NULL && record->counter == IMPORT_EXPECTED[expected].counter;
+	}
+	if (import_store != NULL)
+		otp_store_close(import_store);
+	
+	char import_text[256] = { 0 };
+	import_file = fopen(import_report, "rb");
+	import_ok &= import_file != NULL && fread(import_text, 1, sizeof(import_text) - 1, import_file) > 0;
+	if (import_file != NULL)
+		fclose(import_file);
+	char import_expected[256];
+	snprintf(import_expected, sizeof(import_expected),
+		"line 5: invalid secret\n"
+		"line 6 entry 1: unsupported algorithm\n"
+		"line 7: invalid uri\n"
+		"line 8: invalid migration data\n"
+		"line %d: invalid uri\n", IMPORT_USERS + 9);
+	import_ok &= strcmp(import_text, import_expected) == 0;
+	
+	// The index names every key by its id, labels decoded and quoted
+	import_file = fopen(import_index, "rb");
+	import_ok &= import_file != NULL;
+	const char* IMPORT_INDEX[6] = {
+		"key_id,issuer,name\n",
+		"100,\"Acme\",\"dave\"\n",
+		"101,\"\",\"\"\"erin\"\"\"\n",
+		"102,\"Acme\",\"alice\"\n",
+		"103,\"\",\"carol\"\n",
+		"104,\"\",\"user0\"\n",
+	};
+	for (int i=0; i<6 && import_file != NULL; i++)
+		import_ok &= fgets(import_text, sizeof(import_text), import_file) != NULL && strcmp(import_text, IMPORT_INDEX[i]) == 0;
+	uint64_t import_lines = 6;
+	while (import_file != NULL && fgets(import_text, sizeof(import_text), import_file) != NULL)
+		import_lines++;
+	import_ok &= import_lines == IMPORT_USERS + 5;
+	if (import_file != NULL)
+		fclose(import_file);
+	
+	// An empty input gives an empty keystore
+	import_file = fopen(import_input, "wb");
+	fclose(import_file);
+	import_ok &= otp_import(import_input, import_keys, NULL, import_index, 1, 0, &import_result) == 1;
+	import_ok &= import_result.lines == 0 && import_result.imported == 0 && import_result.failed == 0;
+	import_store = otp_store_open(&oimport_store, import_keys, 0);
+	import_ok &= import_store != NULL && import_store->count == 0;
+	if (import_store != NULL)
+		otp_store_close(import_store);
+	import_file = fopen(import_index, "rb");
+	import_ok &= import_file != NULL && fgets(import_text, sizeof(import_text), import_file) != NULL && strcmp(import_text, "key_id,issuer,name\n") == 0;
+	import_ok &= import_file != NULL && fgets(import_text, sizeof(import_text), import_file) == NULL;
+	if (import_file != NULL)
+		fclose(import_file);
+	
+	// A missing input fails without leaving a keystore behind
+	remove(import_input);
+	remove(import_keys);
+	import_ok &= otp_import(import_input, import_keys, NULL, NULL, 1, 0, NULL) == 0;
+	import_ok &= otp_store_open(&oimport_store, import_keys, 0) == NULL;
+	
+	remove(import_report);
+	remove(import_index);
+	printf("otp_import() pass=1: `%d`\n", import_ok);
+	success = success && (import_ok == 1);
+	
 	return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
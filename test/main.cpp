@@ -17,6 +17,39 @@ using namespace std;
 using namespace COTP;
 
 
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <atomic>
+
+// Fire and forget coroutine for the Async tests
+struct Detached
+{
+	struct promise_type
+	{
+		Detached get_return_object() { return {}; }
+		suspend_never initial_suspend() noexcept { return {}; }
+		suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { terminate(); }
+	};
+};
+
+static Detached async_verify(Async::Executor& executor, OTPData* data, const char* key, uint64_t for_time, atomic<int>* out_verified, atomic<int>* out_done)
+{
+	Async::VerifyResult verified = co_await executor.verify(data, key, for_time, 4);
+	if (verified.result == OTP_OK && verified.offset == 0)
+		(*out_verified)++;
+	(*out_done)++;
+}
+
+static Detached async_generate(Async::Executor& executor, const OTPAlgo* hmac, const OTPKey* key, uint64_t counter, uint32_t expected, atomic<int>* out_done)
+{
+	Async::GenerateResult generated = co_await executor.generate(hmac, key, counter, 6);
+	if (generated.result == OTP_OK && generated.code == expected)
+		(*out_done)++;
+}
+#endif
+
+
 static const int32_t SHA1_BYTES   = 160 / 8;	// 20
 static const int32_t SHA256_BYTES = 256 / 8;	// 32
 static const int32_t SHA512_BYTES = 512 / 8;	// 64
@@ -361,6 +394,107 @@ int main(int argc, char** argv)
 	cout << "HOTP Verification 2 pass=true: `" << (hv2 == 0 ? "false" : "true") << "`" << endl;
 	success = success && (hv2 != 0);
 	
+	// Look-ahead finds counter 1 from counter 0
+	uint64_t hmatched = 0;
+	int hv3 = hdata.verify("996554", 0, 10, &hmatched);
+	cout << "HOTP Look-ahead pass=1: `" << hv3 << "` `" << hmatched << "`" << endl;
+	success = success && (hv3 == 1) && (hmatched == 1);
+	
+#if __cplusplus >= 201703L
+	////////////////////////////////////////////////////////////////
+	// Fixed Stuff                                                //
+	////////////////////////////////////////////////////////////////
+	
+	cout << endl; // line break for readability
+	
+	// Same secrets as above, specialized at compile time
+	Fixed::TOTP<Fixed::Sha1, 6, 30> ftotp(BASE32_SECRET_PADDING);
+	auto fcode = ftotp.at(0);
+	cout << "Fixed::TOTP at(0) pass=570783: `" << fcode.data() << "`" << endl;
+	success = success && ftotp.valid() && strcmp(fcode.data(), "570783") == 0;
+	
+	int64_t foffset = 0;
+	int fv1 = ftotp.verify("570783", 2 * 30, 4, &foffset);
+	cout << "Fixed::TOTP verify pass=1: `" << fv1 << "` `" << foffset << "`" << endl;
+	success = success && (fv1 == 1) && (foffset == -2) && ftotp.verify("570784", 0, 4) == 0;
+	
+	Fixed::HOTP<Fixed::Sha1, 6> fhotp(BASE32_SECRET);
+	auto fhcode = fhotp.at(1);
+	uint64_t fmatched = 0;
+	int fv2 = fhotp.verify("996554", 0, 10, &fmatched);
+	cout << "Fixed::HOTP at(1) pass=996554: `" << fhcode.data() << "` `" << fv2 << "`" << endl;
+	success = success && strcmp(fhcode.data(), "996554") == 0 && (fv2 == 1) && (fmatched == 1);
+	success = success && fhotp.compare("996554", 1) == 1 && fhotp.compare("996555", 1) == 0;
+	
+	// Windows past OTP_MAX_LOOK_AHEAD are refused instead of searched
+	bool fbound = fhotp.verify("996554", 0, UINT64_MAX) == 0 && ftotp.verify("570783", 2 * 30, INT64_MAX) == 0;
+	cout << "Fixed look-ahead bound pass=1: `" << fbound << "`" << endl;
+	success = success && fbound;
+	
+	// RFC 6238 test vectors at T = 59
+	const uint8_t RFC_KEY[] = "1234567890123456789012345678901234567890123456789012345678901234";
+	Fixed::TOTP<Fixed::Sha1, 8, 30> frfc1(RFC_KEY, 20);
+	Fixed::TOTP<Fixed::Sha256, 8, 30> frfc256(RFC_KEY, 32);
+	Fixed::TOTP<Fixed::Sha512, 8, 30> frfc512(RFC_KEY, 64);
+	bool frfc = strcmp(frfc1.at(59).data(), "94287082") == 0
+		&& strcmp(frfc256.at(59).data(), "46119246") == 0
+		&& strcmp(frfc512.at(59).data(), "90693936") == 0;
+	cout << "Fixed::TOTP RFC 6238 pass=1: `" << frfc << "`" << endl;
+	success = success && frfc;
+	
+	// Moving hands the key over, the moved-from generator is empty
+	Fixed::HOTP<Fixed::Sha1, 6> fmoved(std::move(fhotp));
+	bool fmove = fmoved.valid() && !fhotp.valid() && fmoved.generate_code(1) == 996554 && fhotp.generate_code(1) == 0;
+	fhotp = std::move(fmoved);
+	fmove = fmove && fhotp.valid() && !fmoved.valid();
+	fmove = fmove && !Fixed::HOTP<Fixed::Sha1, 6>("JBSWY3D!").valid();
+	cout << "Fixed move pass=1: `" << fmove << "`" << endl;
+	success = success && fmove;
+#endif
+	
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+	////////////////////////////////////////////////////////////////
+	// Async Stuff                                                //
+	////////////////////////////////////////////////////////////////
+	
+	cout << endl; // line break for readability
+	
+	OTPData oasync;
+	OTPData* async_data = totp_new(&oasync, BASE32_SECRET_PADDING, nullptr, get_current_time, DIGITS, INTERVAL);
+	async_data->hmac = &OTP_HMAC_SHA1;
+	OTPKey async_key;
+	bool async_ok = otp_prepare(async_data, &async_key) == OTP_OK;
+	OTPKey async_unscheduled;
+	async_ok = async_ok && otp_key_new(&async_unscheduled, BASE32_SECRET_PADDING) != nullptr;
+	
+	// Concurrent awaiters are coalesced into batches, the executor drains them before stopping
+	const int ASYNC_COUNT = 1000;
+	atomic<int> async_verified{0};
+	atomic<int> async_done{0};
+	atomic<int> async_generated{0};
+	for (uint32_t threads=1; threads<=2; threads++)
+	{
+		Async::Executor executor(threads);
+		for (int i=0; i<ASYNC_COUNT; i++)
+		{
+			async_verify(executor, async_data, i % 2 ? "570783" : "570784", 0, &async_verified, &async_done);
+			async_generate(executor, &OTP_HMAC_SHA1, &async_key, 0, 570783, &async_generated);
+			
+			// Fails on its own instead of failing the batch it would join
+			if (i == ASYNC_COUNT / 2)
+				async_generate(executor, &OTP_HMAC_SHA1, &async_unscheduled, 0, 570783, &async_generated);
+		}
+		
+		// A malformed code completes without suspending
+		int async_before = async_done;
+		async_verify(executor, async_data, "57078", 0, &async_verified, &async_done);
+		async_ok = async_ok && async_done > async_before;
+	}
+	async_ok = async_ok && async_done == 2 * (ASYNC_COUNT + 1) && async_verified == ASYNC_COUNT && async_generated == 2 * ASYNC_COUNT;
+	cout << "Async::Executor pass=1: `" << async_ok << "` `" << async_verified << "`" << endl;
+	success = success && async_ok;
+#endif
+	
 	return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
@@ -0,0 +1,74 @@
+/*
+	Imports otpauth URIs into a keystore.
+	
+	Usage
+		otpimport [-s first_id] [-t threads] [-r report.txt]
+			[-i index.csv] input.txt output.keys
+	
+	Every line of input.txt is an otpauth:// URI or an
+	  otpauth-migration:// export holding several keys. Lines that
+	  can't be imported are listed in the report with the reason,
+	  the index lists the key id, issuer and name of every key.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "../otpimport.h"
+
+
+int main(int argc, char** argv)
+{
+	uint64_t first_id = 1;
+	uint32_t threads = 0;
+	const char* report = NULL;
+	const char* index = NULL;
+	
+	const char* paths[2] = { NULL, NULL };
+	int path_count = 0;
+	int usage = 0;
+	
+	for (int i=1; i<argc && !usage; i++)
+	{
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+		
+		if (arg[0] == '-' && arg[1] != '\0' && arg[2] == '\0' && value != NULL)
+		{
+			i++;
+			switch (arg[1])
+			{
+				case 's': first_id = strtoull(value, NULL, 10); break;
+				case 't': threads = (uint32_t) strtoul(value, NULL, 10); break;
+				case 'r': report = value; break;
+				case 'i': index = value; break;
+				default: usage = 1; break;
+			}
+		}
+		else if (path_count < 2)
+			paths[path_count++] = arg;
+		else
+			usage = 1;
+	}
+	
+	if (usage || path_count != 2)
+	{
+		fprintf(stderr, "usage: otpimport [-s first_id] [-t threads] [-r report.txt] [-i index.csv] input.txt output.keys\n");
+		return EXIT_FAILURE;
+	}
+	
+	clock_t started = clock();
+	OTPImportResult result;
+	if (otp_import(paths[0], paths[1], report, index, first_id, threads, &result) != OTP_OK)
+	{
+		fprintf(stderr, "otpimport: import from `%s` failed\n", paths[0]);
+		return EXIT_FAILURE;
+	}
+	
+	printf("otpimport: %" PRIu64 " keys imported from %" PRIu64 " lines, %" PRIu64 " skipped, in %.2fs of CPU time\n",
+		result.imported, result.lines, result.failed, (double) (clock() - started) / CLOCKS_PER_SEC);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+/*
+	Converts base32 secrets and otpauth:// URIs into a keystore.
+	
+	Usage
+		otpstore [-a sha1|sha256|sha512] [-d digits] [-p period] output.keys [input.txt]
+	
+	Every input line is a key id followed by a base32 secret or an
+	  otpauth:// URI. Plain secrets are TOTP and take the -a, -d and -p
+	  defaults, URIs carry their own. Reads stdin without input.txt.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "../otpstore.h"
+#include "../otpuri.h"
+#include "../otphmac.h"
+
+
+typedef struct otpstore_defaults
+{
+	OTPStoreAlgo algo;
+	uint32_t digits;
+	uint32_t interval;
+} otpstore_defaults;
+
+static int otpstore_parse_algo(const char* name, size_t length, OTPStoreAlgo* out_algo)
+{
+	static const char* NAMES[3] = { "SHA1", "SHA256", "SHA512" };
+	for (int i=0; i<3; i++)
+	{
+		size_t name_length = strlen(NAMES[i]);
+		if (length != name_length)
+			continue;
+		
+		int equal = 1;
+		for (size_t j=0; j<length; j++)
+			equal &= (name[j] & ~0x20) == NAMES[i][j] || name[j] == NAMES[i][j];
+		if (equal)
+		{
+			*out_algo = (OTPStoreAlgo) (OTP_STORE_SHA1 + i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	Fills record from an otpauth://TYPE/LABEL?PARAMETERS uri.
+*/
+static int otpstore_parse_uri(const char* uri, uint64_t key_id, OTPStoreRecord* record)
+{
+	OTPUri parsed;
+	char secret[OTP_KEY_MAX_LENGTH * 8 / 5 + 8 + 1];
+	if (!otpuri_parse(&parsed, uri, strlen(uri)) || !otpuri_decode(&parsed.secret, secret, sizeof(secret), NULL))
+		return 0;
+	
+	OTPStoreAlgo algo = OTP_STORE_SHA1;
+	if (parsed.hmac == &OTP_HMAC_SHA256)
+		algo = OTP_STORE_SHA256;
+	else if (parsed.hmac == &OTP_HMAC_SHA512)
+		algo = OTP_STORE_SHA512;
+	
+	return otp_store_record_new(record, key_id, secret, algo, parsed.type, parsed.digits, parsed.interval, parsed.counter) != NULL;
+}
+
+int main(int argc, char** argv)
+{
+	otpstore_defaults defaults = { OTP_STORE_SHA1, 6, 30 };
+	const char* output = NULL;
+	const char* input = NULL;
+	int usage = argc < 2;
+	
+	for (int i=1; i<argc; i++)
+	{
+		if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (!otpstore_parse_algo(argv[i], strlen(argv[i]), &defaults.algo))
+			{
+				fprintf(stderr, "otpstore: unknown algorithm `%s`\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			defaults.digits = (uint32_t) strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			defaults.interval = (uint32_t) strtoul(argv[++i], NULL, 10);
+		else if (output == NULL)
+			output = argv[i];
+		else if (input == NULL)
+			input = argv[i];
+		else
+			usage = 1;
+	}
+	
+	if (usage || output == NULL)
+	{
+		fprintf(stderr, "usage: otpstore [-a sha1|sha256|sha512] [-d digits] [-p period] output.keys [input.txt]\n");
+		return EXIT_FAILURE;
+	}
+	
+	FILE* in = input != NULL ? fopen(input, "r") : stdin;
+	if (in == NULL)
+	{
+		fprintf(stderr, "otpstore: can't open `%s`\n", input);
+		return EXIT_FAILURE;
+	}
+	
+	size_t count = 0;
+	size_t capacity = 1024;
+	OTPStoreRecord* records = (OTPStoreRecord*) malloc(capacity * sizeof(OTPStoreRecord));
+	
+	char line[4096];
+	size_t line_number = 0;
+	int ok = records != NULL;
+	while (ok && fgets(line, sizeof(line), in) != NULL)
+	{
+		line_number++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		
+		char* source;
+		uint64_t key_id = strtoull(line, &source, 10);
+		source += strspn(source, " \t");
+		if (source == line || *source == '\0')
+		{
+			fprintf(stderr, "otpstore: line %zu: expected `key_id secret|uri`\n", line_number);
+			ok = 0;
+			break;
+		}
+		
+		if (count == capacity)
+		{
+			capacity *= 2;
+			OTPStoreRecord* grown = (OTPStoreRecord*) realloc(records, capacity * sizeof(OTPStoreRecord));
+			if (grown == NULL)
+			{
+				ok = 0;
+				break;
+			}
+			records = grown;
+		}
+		
+		int parsed;
+		if (strncmp(source, "otpauth://", 10) == 0)
+			parsed = otpstore_parse_uri(source, key_id, &records[count]);
+		else
+			parsed = otp_store_record_new(&records[count], key_id, source, defaults.algo, TOTP, defaults.digits, defaults.interval, 0) != NULL;
+		
+		if (!parsed)
+		{
+			fprintf(stderr, "otpstore: line %zu: invalid secret or uri\n", line_number);
+			ok = 0;
+			break;
+		}
+		count++;
+	}
+	
+	if (in != stdin)
+		fclose(in);
+	
+	if (ok && otp_store_write(output, records, count) != OTP_OK)
+	{
+		fprintf(stderr, "otpstore: can't write `%s`, or duplicate key ids\n", output);
+		ok = 0;
+	}
+	
+	if (records != NULL)
+	{
+		memset(records, 0, capacity * sizeof(OTPStoreRecord));
+		free(records);
+	}
+	
+	if (ok)
+		printf("otpstore: wrote %zu keys to `%s`\n", count, output);
+	
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}